@@ -4,10 +4,9 @@
 #include <Open3D/Geometry/LineSet.h>
 #include <Open3D/Visualization/Visualizer/RenderOption.h>
 #include <Open3D/Visualization/Visualizer/Visualizer.h>
-#include <coxgraph_msgs/ClientSubmap.h>
-#include <coxgraph_msgs/ClientSubmapSrv.h>
+#include <coxgraph_msgs/ClientSubmapChunk.h>
 #include <coxgraph_msgs/PoseHistorySrv.h>
-#include <coxgraph_msgs/SubmapsSrv.h>
+#include <coxgraph_msgs/SubmapChunkSrv.h>
 #include <coxgraph_msgs/TimeLine.h>
 #include <message_filters/subscriber.h>
 #include <message_filters/sync_policies/approximate_time.h>
@@ -24,6 +23,7 @@
 #include <string>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include "coxgraph/client/map_server.h"
 #include "coxgraph/common.h"
@@ -35,7 +35,8 @@ class CoxgraphClient : public voxgraph::VoxgraphMapper {
   CoxgraphClient(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private)
       : VoxgraphMapper(nh, nh_private),
         recover_mode_(true),
-        vis_combined_o3d_mesh_(false) {
+        vis_combined_o3d_mesh_(false),
+        submap_chunk_blocks_(64) {
     int client_id;
     nh_private.param<int>("client_id", client_id, -1);
     client_id_ = static_cast<CliId>(client_id);
@@ -43,6 +44,9 @@ class CoxgraphClient : public voxgraph::VoxgraphMapper {
     nh_private.param("recover_mode", recover_mode_, recover_mode_);
     nh_private.param("vis_combined_o3d_mesh", vis_combined_o3d_mesh_,
                      vis_combined_o3d_mesh_);
+    nh_private.param("submap_chunk_blocks", submap_chunk_blocks_,
+                     submap_chunk_blocks_);
+    CHECK_GT(submap_chunk_blocks_, 0);
     if (vis_combined_o3d_mesh_) {
       o3d_vis_ = new open3d::visualization::Visualizer();
       o3d_vis_->CreateVisualizerWindow("client_" + std::to_string(client_id_));
@@ -78,13 +82,9 @@ class CoxgraphClient : public voxgraph::VoxgraphMapper {
   void advertiseClientTopics();
   void advertiseClientServices();
 
-  bool getClientSubmapCallback(
-      coxgraph_msgs::ClientSubmapSrv::Request& request,     // NOLINT
-      coxgraph_msgs::ClientSubmapSrv::Response& response);  // NOLINT
-
-  bool getAllClientSubmapsCallback(
-      coxgraph_msgs::SubmapsSrv::Request& request,     // NOLINT
-      coxgraph_msgs::SubmapsSrv::Response& response);  // NOLINT
+  bool getSubmapChunkCallback(
+      coxgraph_msgs::SubmapChunkSrv::Request& request,     // NOLINT
+      coxgraph_msgs::SubmapChunkSrv::Response& response);  // NOLINT
 
   bool getPoseHistory(
       coxgraph_msgs::PoseHistorySrv::Request& request,      // NOLINT
@@ -117,14 +117,40 @@ class CoxgraphClient : public voxgraph::VoxgraphMapper {
   ros::Publisher time_line_pub_;
   ros::Publisher map_pose_pub_;
   ros::Publisher submap_mesh_pub_;
-  ros::ServiceServer get_client_submap_srv_;
-  ros::ServiceServer get_all_client_submaps_srv_;
+  ros::ServiceServer get_submap_chunk_srv_;
   ros::ServiceServer get_pose_history_srv_;
 
   SmIdTfMap ser_sm_id_pose_map_;
 
   std::timed_mutex submap_proc_mutex_;
 
+  // The submap transfer the server is currently pulling, chunk by chunk
+  struct SubmapStream {
+    uint32_t transfer_id = 0;
+    uint32_t next_seq = 0;
+    std::vector<CliSm::ConstPtr> submaps;
+    // One submap requested by time, which counts as sent once the transfer
+    // ends, instead of all submaps not sent yet
+    bool mode_by_time = false;
+    // Only the header and transform are sent, the submap was sent before
+    bool header_only = false;
+    Transformation T_submap_t;
+    size_t submap_index = 0;
+    bool submap_begun = false;
+    voxblox::BlockIndexList block_indices;
+    size_t next_block = 0;
+    // Versions of the submaps the server caches
+    std::map<CliSmId, uint64_t> cached_versions;
+  };
+  SubmapStream submap_stream_;
+  // Content hash of every submap, valid as long as its end time is unchanged
+  std::map<CliSmId, std::pair<ros::Time, uint64_t>> submap_versions_;
+  uint64_t getSubmapVersion(const CliSm& submap);
+  int submap_chunk_blocks_;
+  // Both are called with submap_proc_mutex_ held
+  bool openSubmapStream(const coxgraph_msgs::SubmapChunkSrv::Request& request);
+  void fillNextSubmapChunk(coxgraph_msgs::ClientSubmapChunk* chunk);
+
   MapServer::Ptr map_server_;
 
   bool recover_mode_;
@@ -1,6 +1,7 @@
 #ifndef COXGRAPH_CLIENT_MAP_SERVER_H_
 #define COXGRAPH_CLIENT_MAP_SERVER_H_
 
+#include <coxgraph_msgs/MeshResyncRequest.h>
 #include <nav_msgs/Odometry.h>
 #include <ros/ros.h>
 #include <voxblox_msgs/Layer.h>
@@ -10,12 +11,15 @@
 #include <voxgraph/frontend/submap_collection/voxgraph_submap_collection.h>
 #include <voxgraph/tools/visualization/submap_visuals.h>
 
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <tuple>
 
 #include "coxgraph/common.h"
+#include "coxgraph/utils/mesh_pack_codec.h"
 #include "coxgraph/utils/msg_converter.h"
 
 namespace coxgraph {
@@ -29,12 +33,25 @@ class MapServer {
           publish_on_update(true),
           publish_traversable(false),
           traversability_radius(1.0),
-          publish_mesh_with_trajectory(true) {}
+          publish_mesh_with_trajectory(true),
+          pack_submap_mesh(false),
+          mesh_pack_lossy_colors(false),
+          publish_mesh_deltas(true),
+          mesh_full_resend_every_n(10) {}
     float publish_combined_maps_every_n_sec;
     bool publish_on_update;
     bool publish_traversable;
     float traversability_radius;
     bool publish_mesh_with_trajectory;
+    // Publish the mesh with trajectory in the compact packed format instead
+    bool pack_submap_mesh;
+    bool mesh_pack_lossy_colors;
+    // Only send the mesh blocks of a submap that changed since it was last
+    // published, with a full mesh every mesh_full_resend_every_n publishes.
+    // Changed blocks are found from the kMesh updated flags of the submap
+    // TSDF blocks, which the map server clears.
+    bool publish_mesh_deltas;
+    int mesh_full_resend_every_n;
 
     friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
       s << std::endl
@@ -54,6 +71,20 @@ class MapServer {
         << static_cast<std::string>(v.publish_mesh_with_trajectory ? "enabled"
                                                                    : "disabled")
         << std::endl
+        << "  Pack submap mesh: "
+        << static_cast<std::string>(v.pack_submap_mesh ? "enabled"
+                                                       : "disabled")
+        << std::endl
+        << "  Mesh pack lossy colors: "
+        << static_cast<std::string>(v.mesh_pack_lossy_colors ? "enabled"
+                                                             : "disabled")
+        << std::endl
+        << "  Publish mesh deltas: "
+        << static_cast<std::string>(v.publish_mesh_deltas ? "enabled"
+                                                          : "disabled")
+        << std::endl
+        << "  Full mesh resend every: " << v.mesh_full_resend_every_n
+        << std::endl
         << "-------------------------------------------" << std::endl;
       return (s);
     }
@@ -85,6 +116,10 @@ class MapServer {
         client_id_(client_id),
         frame_names_(frame_names),
         submap_collection_ptr_(submap_collection_ptr) {
+    utils::MeshPackCodec::Config mesh_pack_config;
+    mesh_pack_config.lossy_colors = config_.mesh_pack_lossy_colors;
+    mesh_pack_codec_ = utils::MeshPackCodec(mesh_pack_config);
+
     tsdf_map_.reset(new voxblox::TsdfMap(
         static_cast<voxblox::TsdfMap::Config>(map_config)));
     esdf_map_.reset(new voxblox::EsdfMap(
@@ -145,6 +180,33 @@ class MapServer {
   }
 
   ros::Publisher submap_mesh_pub_;
+  utils::MeshPackCodec mesh_pack_codec_;
+
+  // What was last published of a submap mesh. Block hashes are only kept if
+  // deltas are published.
+  typedef std::tuple<int64_t, int64_t, int64_t> MeshBlockKey;
+  struct PublishedSubmapMesh {
+    std::map<MeshBlockKey, uint64_t> block_hashes;
+    uint64_t trajectory_hash = 0;
+    int num_deltas = 0;
+    uint32_t seq = 0;
+  };
+  std::map<CliSmId, PublishedSubmapMesh> published_submap_meshes_;
+  // The visuals of the last publish, owned by the mapper, to republish a
+  // submap mesh on a resync request
+  const voxgraph::SubmapVisuals* submap_vis_ = nullptr;
+  std::mutex submap_mesh_mutex_;
+  void publishSubmapMeshLocked(CliSmId csid,
+                               const voxgraph::SubmapVisuals& submap_vis);
+  void getUpdatedMeshBlocks(const CliSm::Ptr& submap_ptr,
+                            std::set<MeshBlockKey>* updated_mesh_blocks);
+  void removeUnchangedMeshBlocks(
+      const std::set<MeshBlockKey>& updated_mesh_blocks, bool send_delta,
+      PublishedSubmapMesh* published, voxblox_msgs::Mesh* mesh_msg);
+
+  ros::Subscriber mesh_resync_sub_;
+  void meshResyncCallback(
+      const coxgraph_msgs::MeshResyncRequest& mesh_resync_msg);
 
   ros::Subscriber kf_pose_sub_;
   std::set<ros::Time> kf_timestamp_set_;
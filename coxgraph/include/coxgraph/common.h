@@ -18,7 +18,7 @@
 
 namespace coxgraph {
 
-typedef int8_t CliId;
+typedef int16_t CliId;
 
 using CliSm = voxgraph::VoxgraphSubmap;
 using SerSmId = voxgraph::SubmapID;
@@ -83,7 +83,8 @@ struct TimeLine {
   }
 };
 
-typedef std::function<void()> TimeLineUpdateCallback;
+typedef std::function<void(const CliId&, const TimeLine&)>
+    TimeLineUpdateCallback;
 
 typedef std::vector<geometry_msgs::PoseStamped> PoseStampedVector;
 
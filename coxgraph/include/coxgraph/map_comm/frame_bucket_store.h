@@ -0,0 +1,113 @@
+#ifndef COXGRAPH_MAP_COMM_FRAME_BUCKET_STORE_H_
+#define COXGRAPH_MAP_COMM_FRAME_BUCKET_STORE_H_
+
+#include <glog/logging.h>
+#include <voxblox/core/common.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace voxblox {
+
+/**
+ * @brief Points and colors grouped by frame id, stored in one flat arena.
+ *
+ * Buckets are filled counting-sort style: first every bucket size is
+ * announced with addCount(), then allocate() lays the buckets out back to
+ * back and append() fills them without any reallocation. clear() keeps the
+ * arena capacity, so repeated recover calls stop allocating once the
+ * largest mesh pack has been seen.
+ */
+class FrameBucketStore {
+ public:
+  typedef uint32_t FrameId;
+
+  FrameBucketStore() : allocated_(false) {}
+  ~FrameBucketStore() = default;
+
+  // Start a new fill for frame ids in [0, num_frames)
+  void reset(size_t num_frames) {
+    clear();
+    counts_.assign(num_frames, 0u);
+    offsets_.assign(num_frames + 1, 0u);
+    cursors_.assign(num_frames, 0u);
+  }
+
+  void clear() {
+    counts_.clear();
+    offsets_.clear();
+    cursors_.clear();
+    points_.clear();
+    colors_.clear();
+    allocated_ = false;
+  }
+
+  inline size_t numFrames() const { return counts_.size(); }
+  inline bool hasFrame(FrameId frame_id) const {
+    return frame_id < counts_.size();
+  }
+
+  // First pass
+  inline void addCount(FrameId frame_id, size_t num_points) {
+    DCHECK(!allocated_);
+    DCHECK(hasFrame(frame_id));
+    counts_[frame_id] += num_points;
+  }
+
+  void allocate() {
+    CHECK(!allocated_);
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      offsets_[i + 1] = offsets_[i] + counts_[i];
+      cursors_[i] = offsets_[i];
+    }
+    points_.resize(offsets_.back());
+    colors_.resize(offsets_.back());
+    allocated_ = true;
+  }
+
+  // Second pass, the total appended to a bucket must match its count
+  inline void append(FrameId frame_id, const Point* points,
+                     const Color* colors, size_t num_points) {
+    DCHECK(allocated_);
+    DCHECK(hasFrame(frame_id));
+    size_t& cursor = cursors_[frame_id];
+    DCHECK_LE(cursor + num_points, offsets_[frame_id + 1]);
+    std::copy(points, points + num_points, points_.begin() + cursor);
+    std::copy(colors, colors + num_points, colors_.begin() + cursor);
+    cursor += num_points;
+  }
+
+  inline size_t size(FrameId frame_id) const {
+    return hasFrame(frame_id) && allocated_
+               ? offsets_[frame_id + 1] - offsets_[frame_id]
+               : 0u;
+  }
+  inline const Point* points(FrameId frame_id) const {
+    return points_.data() + offsets_[frame_id];
+  }
+  inline const Color* colors(FrameId frame_id) const {
+    return colors_.data() + offsets_[frame_id];
+  }
+
+  inline size_t getMemorySize() const {
+    return points_.capacity() * sizeof(Point) +
+           colors_.capacity() * sizeof(Color) +
+           (counts_.capacity() + offsets_.capacity() + cursors_.capacity()) *
+               sizeof(size_t);
+  }
+
+ private:
+  bool allocated_;
+
+  std::vector<size_t> counts_;
+  std::vector<size_t> offsets_;
+  std::vector<size_t> cursors_;
+
+  Pointcloud points_;
+  Colors colors_;
+};
+
+}  // namespace voxblox
+
+#endif  // COXGRAPH_MAP_COMM_FRAME_BUCKET_STORE_H_
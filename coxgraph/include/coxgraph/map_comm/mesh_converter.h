@@ -11,23 +11,40 @@
 #include <voxblox_msgs/Mesh.h>
 #include <voxblox_ros/tsdf_server.h>
 
+#include <algorithm>
 #include <limits>
-#include <map>
 #include <memory>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include "coxgraph/map_comm/frame_bucket_store.h"
+#include "coxgraph/map_comm/mesh_tsdf_integrator.h"
+#include "coxgraph/map_comm/triangle_sampler.h"
+
 namespace voxblox {
 typedef std::shared_ptr<Pointcloud> PointcloudPtr;
 typedef std::shared_ptr<Colors> ColorsPtr;
 class MeshConverter {
  public:
   struct Config {
-    float voxel_size = 0.20;
+    // Spacing of the points sampled on the mesh triangles. If not positive,
+    // it is derived from the TSDF voxel size and samples_per_voxel instead,
+    // which is the default. A fixed spacing far below the voxel size only
+    // multiplies the points integrated into each voxel.
+    float voxel_size = 0.0;
+    float tsdf_voxel_size = 0.20;
+    float samples_per_voxel = 2.0;
+    bool sample_interior = false;
+    int num_threads = std::thread::hardware_concurrency();
     friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
       s << std::endl
         << "Mesh Converter using Config:" << std::endl
         << "  voxel_size: " << v.voxel_size << std::endl
+        << "  tsdf_voxel_size: " << v.tsdf_voxel_size << std::endl
+        << "  samples_per_voxel: " << v.samples_per_voxel << std::endl
+        << "  sample_interior: " << v.sample_interior << std::endl
+        << "  num_threads: " << v.num_threads << std::endl
         << "-------------------------------------------" << std::endl;
       return (s);
     }
@@ -37,14 +54,35 @@ class MeshConverter {
     Config config;
     nh_private.param<float>("interpolate_voxel_size", config.voxel_size,
                             config.voxel_size);
+    nh_private.param<float>("tsdf_voxel_size", config.tsdf_voxel_size,
+                            config.tsdf_voxel_size);
+    nh_private.param<float>("interpolate_samples_per_voxel",
+                            config.samples_per_voxel, config.samples_per_voxel);
+    nh_private.param<bool>("interpolate_interior", config.sample_interior,
+                           config.sample_interior);
+    nh_private.param<int>("mesh_decoder_threads", config.num_threads,
+                          config.num_threads);
     return config;
   }
 
+  static TriangleSampler::Config getSamplerConfig(const Config& config) {
+    TriangleSampler::Config sampler_config;
+    sampler_config.spacing =
+        config.voxel_size > 0.0f
+            ? config.voxel_size
+            : config.tsdf_voxel_size / config.samples_per_voxel;
+    sampler_config.sample_interior = config.sample_interior;
+    return sampler_config;
+  }
+
   typedef std::shared_ptr<MeshConverter> Ptr;
   typedef kindr::minimal::PositionTemplate<FloatingPoint> Position;
 
   explicit MeshConverter(const ros::NodeHandle nh_private)
-      : config_(getConfigFromRosParam(nh_private)) {
+      : MeshConverter(getConfigFromRosParam(nh_private)) {}
+
+  explicit MeshConverter(const Config& config)
+      : config_(config), triangle_sampler_(getSamplerConfig(config_)) {
     LOG(INFO) << config_;
     T_odom_submap_.setIdentity();
   }
@@ -77,93 +115,80 @@ class MeshConverter {
     recovered_pointcloud->clear();
     if (mesh_.mesh_blocks.empty()) return false;
     timing::Timer recovered_poincloud_timer("recover_pointcloud");
-    Pointcloud triangle;
-    voxblox::Colors colors;
 
     LOG(INFO) << "receive mesh blocks: " << mesh_.mesh_blocks.size();
-    int n = 0, n_colors = 0;
-    size_t vertex_index = 0u;
-    for (auto const& mesh_block : mesh_.mesh_blocks) {
+
+    std::vector<DecodedMeshBlock> decoded_blocks;
+    decodeMeshBlocks(&decoded_blocks);
+
+    timing::Timer merge_timer("recover_pointcloud/merge_blocks");
+    size_t total_vertices = 0u;
+    for (const DecodedMeshBlock& decoded_block : decoded_blocks) {
+      total_vertices += decoded_block.x.size();
+    }
+    recovered_pointcloud->reserve(total_vertices);
+
+    int n = 0;
+    for (size_t block_i = 0; block_i < mesh_.mesh_blocks.size(); ++block_i) {
+      auto const& mesh_block = mesh_.mesh_blocks[block_i];
       if (mesh_block.history.empty()) continue;
-      CHECK_EQ(mesh_block.x.size() / 3, mesh_block.history.size());
-      const BlockIndex index(mesh_block.index[0], mesh_block.index[1],
-                             mesh_block.index[2]);
-
-      // translate vertex data from message to voxblox mesh
-      for (size_t i = 0; i < mesh_block.x.size(); ++i) {
-        // Each vertex is given as its distance from the blocks origin in units
-        // of (2*block_size), see mesh_vis.h for the slightly convoluted
-        // justification of the 2.
-        constexpr float point_conv_factor =
-            2.0f / std::numeric_limits<uint16_t>::max();
-        const float mesh_x =
-            (static_cast<float>(mesh_block.x[i]) * point_conv_factor +
-             static_cast<float>(index[0])) *
-            mesh_.block_edge_length;
-        const float mesh_y =
-            (static_cast<float>(mesh_block.y[i]) * point_conv_factor +
-             static_cast<float>(index[1])) *
-            mesh_.block_edge_length;
-        const float mesh_z =
-            (static_cast<float>(mesh_block.z[i]) * point_conv_factor +
-             static_cast<float>(index[2])) *
-            mesh_.block_edge_length;
-
-        auto history = mesh_block.history[i / 3];
-        // CHECK_EQ(history.history.size() % 2, 0);
-
-        triangle.emplace_back(mesh_x, mesh_y, mesh_z);
-        colors.emplace_back(mesh_block.r[i], mesh_block.g[i], mesh_block.b[i]);
+      const DecodedMeshBlock& decoded_block = decoded_blocks[block_i];
+
+      for (size_t i = 0; i < decoded_block.x.size(); ++i) {
         pcl::PointXYZRGB recovered_point;
-        recovered_point.x = mesh_x;
-        recovered_point.y = mesh_y;
-        recovered_point.z = mesh_z;
+        recovered_point.x = decoded_block.x[i];
+        recovered_point.y = decoded_block.y[i];
+        recovered_point.z = decoded_block.z[i];
         recovered_point.r = mesh_block.r[i];
         recovered_point.g = mesh_block.g[i];
         recovered_point.b = mesh_block.b[i];
         recovered_pointcloud->push_back(recovered_point);
-        if (triangle.size() == 3) {
-          if (mesh_block.r[i] * mesh_block.g[i] * mesh_block.b[i] > 0 &&
-              mesh_block.r[i - 1] * mesh_block.g[i - 1] * mesh_block.b[i - 1] >
-                  0 &&
-              mesh_block.r[i - 2] * mesh_block.g[i - 2] * mesh_block.b[i - 2] >
-                  0) {
-            n_colors++;
-          }
-          Pointcloud interp_pts;
-          Colors interp_colors;
-          interpolateTriangle(triangle, colors, &interp_pts, &interp_colors);
-
-          voxblox_msgs::ObsHistory recovered_history;
-          for (size_t i = 0; i < history.history.size(); i += 2) {
-            for (size_t j = history.history[i]; j <= history.history[i + 1];
-                 j++)
-              recovered_history.history.emplace_back(j);
-          }
-
-          for (size_t hi = 0; hi < recovered_history.history.size(); hi++) {
-            auto stamp = recovered_history.history[hi];
-            if (!pointcloud_.count(stamp))
-              pointcloud_.emplace(
-                  stamp, std::make_pair(new Pointcloud(), new Colors()));
-            pointcloud_[stamp].first->insert(pointcloud_[stamp].first->end(),
-                                             triangle.begin(), triangle.end());
-            pointcloud_[stamp].first->insert(pointcloud_[stamp].first->end(),
-                                             interp_pts.begin(),
-                                             interp_pts.end());
-            pointcloud_[stamp].second->insert(pointcloud_[stamp].second->end(),
-                                              colors.begin(), colors.end());
-            pointcloud_[stamp].second->insert(pointcloud_[stamp].second->end(),
-                                              interp_colors.begin(),
-                                              interp_colors.end());
-          }
-          triangle.clear();
-          colors.clear();
-        }
       }
       n++;
     }
 
+    // Bucket the triangles by the frames that observed them, counting first
+    // so that the flat store is filled without reallocating
+    frame_buckets_.reset(getNumFrames());
+    const size_t num_dropped_observations = forEachObservation(
+        frame_buckets_.numFrames(),
+        [this, &decoded_blocks](FrameBucketStore::FrameId frame_id,
+                                size_t block_i, size_t tri_i) {
+          const DecodedMeshBlock& decoded_block = decoded_blocks[block_i];
+          frame_buckets_.addCount(frame_id,
+                                  3u + decoded_block.interp_offsets[tri_i + 1] -
+                                      decoded_block.interp_offsets[tri_i]);
+        });
+    frame_buckets_.allocate();
+
+    Pointcloud triangle(3);
+    Colors colors(3);
+    forEachObservation(
+        frame_buckets_.numFrames(),
+        [this, &decoded_blocks, &triangle, &colors](
+            FrameBucketStore::FrameId frame_id, size_t block_i, size_t tri_i) {
+          auto const& mesh_block = mesh_.mesh_blocks[block_i];
+          const DecodedMeshBlock& decoded_block = decoded_blocks[block_i];
+          for (size_t v = 0; v < 3; ++v) {
+            const size_t i = 3 * tri_i + v;
+            triangle[v] = Point(decoded_block.x[i], decoded_block.y[i],
+                                decoded_block.z[i]);
+            colors[v] =
+                Color(mesh_block.r[i], mesh_block.g[i], mesh_block.b[i]);
+          }
+          const size_t interp_begin = decoded_block.interp_offsets[tri_i];
+          const size_t interp_end = decoded_block.interp_offsets[tri_i + 1];
+          frame_buckets_.append(frame_id, triangle.data(), colors.data(), 3u);
+          frame_buckets_.append(
+              frame_id, decoded_block.interp_pts.data() + interp_begin,
+              decoded_block.interp_colors.data() + interp_begin,
+              interp_end - interp_begin);
+        });
+    LOG_IF(WARNING, num_dropped_observations > 0)
+        << "dropped " << num_dropped_observations
+        << " triangle observations outside of the trajectory";
+    merge_timer.Stop();
+
     LOG(INFO) << "processed " << n;
 
     recovered_poincloud_timer.Stop();
@@ -171,13 +196,67 @@ class MeshConverter {
     return true;
   }
 
-  void clear() {
-    // Clear point clouds
-    for (auto const& pointcloud : pointcloud_) {
-      pointcloud.second.first->clear();
-      pointcloud.second.second->clear();
+  /**
+   * @brief Collect the observed triangles of the mesh for direct TSDF
+   * recovery, in the frame the trajectory poses are given in. Each triangle
+   * is paired with the camera position of the first keyframe that observed
+   * it and the number of keyframes that did, triangles never observed from a
+   * trajectory pose are skipped.
+   */
+  bool convertToTriangles(MeshTsdfIntegrator::Triangles* triangles) const {
+    CHECK_NOTNULL(triangles);
+    triangles->clear();
+    if (mesh_.mesh_blocks.empty() || T_G_C_.empty()) return false;
+    timing::Timer convert_timer("recover_triangles");
+
+    std::vector<DecodedMeshBlock> decoded_blocks;
+    decodeMeshBlocks(&decoded_blocks);
+
+    // Frames without a trajectory pose are never integrated by the raycast
+    // recovery either, so they don't count as observations here
+    std::vector<int> pose_index_of_frame(getNumFrames(), -1);
+    for (size_t i = 0; i < T_G_C_.size(); ++i) {
+      int& pose_index = pose_index_of_frame[getFrameId(T_G_C_[i].first)];
+      if (pose_index < 0) pose_index = i;
     }
-    pointcloud_.clear();
+
+    // Observations come in mesh order, so consecutive calls for the same
+    // triangle extend the last entry
+    size_t last_block_i = std::numeric_limits<size_t>::max(), last_tri_i = 0u;
+    forEachObservation(
+        pose_index_of_frame.size(),
+        [&](FrameBucketStore::FrameId frame_id, size_t block_i, size_t tri_i) {
+          const int pose_index = pose_index_of_frame[frame_id];
+          if (pose_index < 0) return;
+          if (block_i == last_block_i && tri_i == last_tri_i) {
+            triangles->num_observations.back()++;
+            return;
+          }
+          last_block_i = block_i;
+          last_tri_i = tri_i;
+
+          auto const& mesh_block = mesh_.mesh_blocks[block_i];
+          const DecodedMeshBlock& decoded_block = decoded_blocks[block_i];
+          for (size_t v = 0; v < 3; ++v) {
+            const size_t i = 3 * tri_i + v;
+            triangles->vertices.emplace_back(
+                T_odom_submap_ * Point(decoded_block.x[i], decoded_block.y[i],
+                                       decoded_block.z[i]));
+            triangles->colors.emplace_back(mesh_block.r[i], mesh_block.g[i],
+                                           mesh_block.b[i]);
+          }
+          triangles->viewpoints.emplace_back(
+              T_G_C_[pose_index].second.getPosition());
+          triangles->num_observations.push_back(1u);
+        });
+
+    convert_timer.Stop();
+    return !triangles->num_observations.empty();
+  }
+
+  void clear() {
+    // Reset the frame buckets, their arena is kept for the next mesh
+    frame_buckets_.clear();
     T_G_C_.clear();
     mesh_.mesh_blocks.clear();
     T_odom_submap_.setIdentity();
@@ -191,87 +270,184 @@ class MeshConverter {
     timing::Timer next_pointcloud_timer("next_pointcloud");
     CHECK(pointcloud);
     *T_G_C = T_G_C_[*i].second;
-    auto id =
-        T_G_C_[*i].first == T_G_C_.begin()->first
-            ? 0
-            : std::round((T_G_C_[*i].first - T_G_C_.begin()->first).toSec() /
-                         0.05);
-    if (!pointcloud_.count(id))
-      pointcloud_.emplace(id, std::make_pair(new Pointcloud(), new Colors()));
+    const FrameBucketStore::FrameId id = getFrameId(T_G_C_[*i].first);
     // Point cloud is actually T_Submap_P; to get T_C_P, need to get T_Submap_C;
     auto T_Submap_C = T_odom_submap_.inverse() * (*T_G_C);
-    transformPointcloud(T_Submap_C.inverse(), *(pointcloud_[id].first),
-                        pointcloud->get());
-    *colors = pointcloud_[id].second;
+    const Transformation T_C_Submap = T_Submap_C.inverse();
+    const size_t num_points = frame_buckets_.size(id);
+    (*pointcloud)->resize(num_points);
+    (*colors)->resize(num_points);
+    if (num_points > 0u) {
+      const Point* points_Submap = frame_buckets_.points(id);
+      for (size_t pt_i = 0; pt_i < num_points; ++pt_i) {
+        (**pointcloud)[pt_i] = T_C_Submap * points_Submap[pt_i];
+      }
+      std::copy(frame_buckets_.colors(id),
+                frame_buckets_.colors(id) + num_points, (*colors)->begin());
+    }
     (*i)++;
     next_pointcloud_timer.Stop();
     return true;
   }
 
-  void interpolateTriangle(const Pointcloud& triangle, const Colors& colors,
-                           Pointcloud* interp_pc, Colors* interp_colors) {
-    CHECK_EQ(triangle.size(), colors.size());
-    timing::Timer interpolate_timer("interpolate_triangle");
-    // TODO(mikexyl): a really stupid interpolation, but should do the work
-    Pointcloud interp_pts_e01, interp_pts_e02, interp_pts_e12;
-    Colors interp_colors_e01, interp_colors_e02, interp_colors_e12;
-    Point p0 = triangle[0], p1 = triangle[1], p2 = triangle[2];
-
-    Point t_p0_p1 = p1 - p0;
-    Point t_p0_p2 = p2 - p0;
-    Point t_p1_p2 = p2 - p1;
-
-    for (float dist = config_.voxel_size; dist < t_p0_p1.norm();
-         dist += config_.voxel_size) {
-      interp_pts_e01.emplace_back(p0 + t_p0_p1 / t_p0_p1.norm() * dist);
-      interp_colors_e01.emplace_back(
-          Color::blendTwoColors(colors[0], (1 - dist / t_p0_p1.norm()),
-                                colors[1], dist / t_p0_p1.norm()));
+ private:
+  // Vertices of a mesh block dequantized into SoA buffers, plus the
+  // interpolated points of all its triangles. interp_offsets[t] and
+  // interp_offsets[t + 1] delimit the interpolated points of triangle t.
+  struct DecodedMeshBlock {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+    Pointcloud interp_pts;
+    Colors interp_colors;
+    std::vector<size_t> interp_offsets;
+  };
+
+  // Each vertex is given as its distance from the blocks origin in units of
+  // (2*block_size), see mesh_vis.h for the slightly convoluted justification
+  // of the 2.
+  static void dequantizeCoordinates(const std::vector<uint16_t>& quantized,
+                                    const float block_index,
+                                    const float block_edge_length,
+                                    float* coordinates) {
+    constexpr float point_conv_factor =
+        2.0f / std::numeric_limits<uint16_t>::max();
+    const uint16_t* quantized_data = quantized.data();
+    const size_t num_coordinates = quantized.size();
+#pragma omp simd
+    for (size_t i = 0; i < num_coordinates; ++i) {
+      coordinates[i] =
+          (static_cast<float>(quantized_data[i]) * point_conv_factor +
+           block_index) *
+          block_edge_length;
+    }
+  }
+
+  // Frames are indexed by their offset from the first trajectory pose, in
+  // units of the keyframe interval used by the mesh history. Stamps before
+  // the first pose are clamped to frame 0, a negative offset can't be cast to
+  // an unsigned frame id.
+  inline FrameBucketStore::FrameId getFrameId(const ros::Time& stamp) const {
+    CHECK(!T_G_C_.empty());
+    if (stamp <= T_G_C_.begin()->first) return 0u;
+    return static_cast<FrameBucketStore::FrameId>(std::round(
+        (stamp - T_G_C_.begin()->first).toSec() / kFrameIntervalSec));
+  }
+
+  // Only frames up to the last trajectory pose can ever be requested by
+  // getNextPointcloud, so the bucket count is sized from the trajectory
+  inline size_t getNumFrames() const {
+    if (T_G_C_.empty()) return 0u;
+    FrameBucketStore::FrameId max_frame_id = 0u;
+    for (auto const& stamp_pose : T_G_C_) {
+      max_frame_id = std::max(max_frame_id, getFrameId(stamp_pose.first));
     }
-    for (float dist = config_.voxel_size; dist < t_p0_p2.norm();
-         dist += config_.voxel_size) {
-      interp_pts_e02.emplace_back(p0 + t_p0_p2 / t_p0_p2.norm() * dist);
-      interp_colors_e02.emplace_back(
-          Color::blendTwoColors(colors[0], (1 - dist / t_p0_p2.norm()),
-                                colors[1], dist / t_p0_p2.norm()));
+    return max_frame_id + 1u;
+  }
+
+  // Calls observation_fn(frame_id, block_index, triangle_index) for every
+  // frame in the mesh history of every triangle, in mesh order. Returns the
+  // number of observations dropped for lying at or beyond num_frames.
+  template <typename ObservationFunction>
+  size_t forEachObservation(const size_t num_frames,
+                            const ObservationFunction& observation_fn) const {
+    size_t num_dropped = 0u;
+    for (size_t block_i = 0; block_i < mesh_.mesh_blocks.size(); ++block_i) {
+      auto const& mesh_block = mesh_.mesh_blocks[block_i];
+      for (size_t tri_i = 0; tri_i < mesh_block.history.size(); ++tri_i) {
+        auto const& history = mesh_block.history[tri_i].history;
+        for (size_t i = 0; i + 1 < history.size(); i += 2) {
+          const size_t first = history[i];
+          const size_t last = history[i + 1];
+          for (size_t j = first; j <= last; j++) {
+            if (j >= num_frames) {
+              num_dropped += last - j + 1;
+              break;
+            }
+            observation_fn(static_cast<FrameBucketStore::FrameId>(j),
+                           block_i, tri_i);
+          }
+        }
+      }
     }
-    for (float dist = config_.voxel_size; dist < t_p1_p2.norm();
-         dist += config_.voxel_size) {
-      interp_pts_e12.emplace_back(p1 + t_p1_p2 / t_p1_p2.norm() * dist);
-      interp_colors_e12.emplace_back(
-          Color::blendTwoColors(colors[1], (1 - dist / t_p1_p2.norm()),
-                                colors[2], dist / t_p1_p2.norm()));
+    return num_dropped;
+  }
+
+  // Decode all blocks in parallel, each into its own buffer, so that callers
+  // can walk the result in the original block order. Block sizes vary a lot,
+  // hence the dynamic schedule.
+  void decodeMeshBlocks(std::vector<DecodedMeshBlock>* decoded_blocks) const {
+    CHECK_NOTNULL(decoded_blocks);
+    timing::Timer decode_timer("recover_pointcloud/decode_blocks");
+    decoded_blocks->clear();
+    decoded_blocks->resize(mesh_.mesh_blocks.size());
+    const int num_blocks = decoded_blocks->size();
+    const int num_threads =
+        std::max(1, std::min(config_.num_threads, num_blocks));
+#pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int block_i = 0; block_i < num_blocks; ++block_i) {
+      decodeMeshBlock(mesh_.mesh_blocks[block_i], &(*decoded_blocks)[block_i]);
     }
+    decode_timer.Stop();
+  }
 
-    interp_pts_e01.emplace_back((p0 + p1 + p2) / 3);
-    interp_colors_e01.emplace_back(Color::blendTwoColors(
-        colors[2], 1 / 3.0,
-        Color::blendTwoColors(colors[0], 0.5, colors[1], 0.5), 2 / 3.0));
-
-    interp_pts_e01.insert(interp_pts_e01.end(), interp_pts_e02.begin(),
-                          interp_pts_e02.end());
-    interp_pts_e01.insert(interp_pts_e01.end(), interp_pts_e12.begin(),
-                          interp_pts_e12.end());
-
-    *interp_pc = interp_pts_e01;
-    interp_colors->insert(interp_colors->end(), interp_colors_e01.begin(),
-                          interp_colors_e01.end());
-    interp_colors->insert(interp_colors->end(), interp_colors_e02.begin(),
-                          interp_colors_e02.end());
-    interp_colors->insert(interp_colors->end(), interp_colors_e12.begin(),
-                          interp_colors_e12.end());
-
-    interpolate_timer.Stop();
+  void decodeMeshBlock(const voxblox_msgs::MeshBlock& mesh_block,
+                       DecodedMeshBlock* decoded_block) const {
+    CHECK_NOTNULL(decoded_block);
+    if (mesh_block.history.empty()) return;
+    // Blocks are decoded independently, so a triangle can't continue into the
+    // next block. Voxblox only ever sends whole triangles per block, and the
+    // history holds one entry per triangle.
+    const size_t num_vertices = mesh_block.x.size();
+    CHECK_EQ(num_vertices % 3, 0u);
+    CHECK_EQ(num_vertices / 3, mesh_block.history.size());
+    CHECK_EQ(mesh_block.y.size(), num_vertices);
+    CHECK_EQ(mesh_block.z.size(), num_vertices);
+    CHECK_EQ(mesh_block.r.size(), num_vertices);
+    CHECK_EQ(mesh_block.g.size(), num_vertices);
+    CHECK_EQ(mesh_block.b.size(), num_vertices);
+
+    decoded_block->x.resize(num_vertices);
+    decoded_block->y.resize(num_vertices);
+    decoded_block->z.resize(num_vertices);
+    dequantizeCoordinates(mesh_block.x, static_cast<float>(mesh_block.index[0]),
+                          mesh_.block_edge_length, decoded_block->x.data());
+    dequantizeCoordinates(mesh_block.y, static_cast<float>(mesh_block.index[1]),
+                          mesh_.block_edge_length, decoded_block->y.data());
+    dequantizeCoordinates(mesh_block.z, static_cast<float>(mesh_block.index[2]),
+                          mesh_.block_edge_length, decoded_block->z.data());
+
+    // Sample all triangles of the block in one batch, straight into the
+    // block's buffers
+    const TriangleSampler::TriangleBatch batch{
+        decoded_block->x.data(), decoded_block->y.data(),
+        decoded_block->z.data(), mesh_block.r.data(),
+        mesh_block.g.data(),     mesh_block.b.data(),
+        num_vertices / 3};
+    decoded_block->interp_offsets.resize(batch.num_triangles + 1);
+    triangle_sampler_.countSamples(batch,
+                                   decoded_block->interp_offsets.data() + 1);
+    decoded_block->interp_offsets[0] = 0u;
+    for (size_t tri_i = 1; tri_i <= batch.num_triangles; ++tri_i) {
+      decoded_block->interp_offsets[tri_i] +=
+          decoded_block->interp_offsets[tri_i - 1];
+    }
+    decoded_block->interp_pts.resize(decoded_block->interp_offsets.back());
+    decoded_block->interp_colors.resize(decoded_block->interp_offsets.back());
+    triangle_sampler_.sample(batch, decoded_block->interp_pts.data(),
+                             decoded_block->interp_colors.data());
   }
 
- private:
   Config config_;
+  TriangleSampler triangle_sampler_;
 
   voxblox_msgs::Mesh mesh_;
   AlignedVector<std::pair<ros::Time, Transformation>> T_G_C_;
   Transformation T_odom_submap_;
 
-  std::map<uint8_t, std::pair<PointcloudPtr, ColorsPtr>> pointcloud_;
+  FrameBucketStore frame_buckets_;
+
+  constexpr static double kFrameIntervalSec = 0.05;
 };
 }  // namespace voxblox
 
@@ -0,0 +1,407 @@
+#ifndef COXGRAPH_MAP_COMM_MESH_TSDF_INTEGRATOR_H_
+#define COXGRAPH_MAP_COMM_MESH_TSDF_INTEGRATOR_H_
+
+#include <Eigen/Geometry>
+#include <glog/logging.h>
+#include <voxblox/core/block_hash.h>
+#include <voxblox/core/common.h>
+#include <voxblox/core/layer.h>
+#include <voxblox/core/voxel.h>
+#include <voxblox/utils/timing.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace voxblox {
+
+/**
+ * @brief Computes a TSDF layer directly from a triangle mesh.
+ *
+ * Instead of raycasting the mesh from every keyframe it was observed in, every
+ * voxel inside the truncation band of a triangle gets the signed distance to
+ * its closest triangle. Every triangle normal is oriented towards a camera
+ * that observed the triangle. The sign comes from the angle-weighted
+ * pseudo-normal of the closest feature, the face, edge or vertex, so voxels
+ * closest to an edge or a vertex get the sign of all triangles sharing it and
+ * not of an arbitrary one of them (Baerentzen and Aanaes, Signed Distance
+ * Computation Using the Angle Weighted Pseudonormal). The weight comes from
+ * the number of keyframes that observed the closest triangle, mimicking what
+ * a constant-weight raycast integration of the same keyframes would
+ * accumulate. Triangles are first binned into the blocks their truncation
+ * band touches, then the blocks are processed in parallel.
+ */
+class MeshTsdfIntegrator {
+ public:
+  struct Config {
+    FloatingPoint truncation_distance = 0.3;
+    FloatingPoint max_weight = 10000.0;
+    int num_threads = std::thread::hardware_concurrency();
+  };
+
+  // Triangle t consists of vertices and colors 3t, 3t + 1 and 3t + 2, was
+  // seen from viewpoints[t] and observed in num_observations[t] keyframes
+  struct Triangles {
+    Pointcloud vertices;
+    Colors colors;
+    Pointcloud viewpoints;
+    std::vector<uint32_t> num_observations;
+
+    inline size_t size() const { return viewpoints.size(); }
+    inline void clear() {
+      vertices.clear();
+      colors.clear();
+      viewpoints.clear();
+      num_observations.clear();
+    }
+  };
+
+  explicit MeshTsdfIntegrator(const Config& config) : config_(config) {
+    CHECK_GT(config_.truncation_distance, 0.0);
+  }
+  ~MeshTsdfIntegrator() = default;
+
+  const Config& getConfig() const { return config_; }
+
+  void integrateTriangles(const Triangles& triangles,
+                          Layer<TsdfVoxel>* layer) const {
+    CHECK_NOTNULL(layer);
+    CHECK_EQ(triangles.vertices.size(), 3 * triangles.size());
+    CHECK_EQ(triangles.colors.size(), triangles.vertices.size());
+    CHECK_EQ(triangles.num_observations.size(), triangles.size());
+
+    timing::Timer normals_timer("mesh_tsdf/pseudo_normals");
+    PseudoNormals pseudo_normals;
+    computePseudoNormals(triangles, &pseudo_normals);
+    normals_timer.Stop();
+
+    timing::Timer bin_timer("mesh_tsdf/bin_triangles");
+    std::vector<std::pair<Block<TsdfVoxel>::Ptr, std::vector<size_t>>> blocks;
+    binTriangles(triangles, layer, &blocks);
+    bin_timer.Stop();
+
+    timing::Timer integrate_timer("mesh_tsdf/integrate_blocks");
+    const size_t num_threads = std::max<size_t>(
+        1, std::min<size_t>(config_.num_threads, blocks.size()));
+    std::atomic<size_t> next_block_index(0);
+    auto integrate_worker = [this, &triangles, &pseudo_normals, &blocks,
+                             &next_block_index]() {
+      size_t block_index;
+      while ((block_index = next_block_index++) < blocks.size()) {
+        integrateBlock(triangles, pseudo_normals, blocks[block_index].second,
+                       blocks[block_index].first.get());
+      }
+    };
+    if (num_threads == 1) {
+      integrate_worker();
+    } else {
+      std::vector<std::thread> integrate_threads;
+      for (size_t i = 0; i < num_threads; ++i) {
+        integrate_threads.emplace_back(integrate_worker);
+      }
+      for (std::thread& thread : integrate_threads) {
+        thread.join();
+      }
+    }
+    integrate_timer.Stop();
+  }
+
+ private:
+  // Oriented pseudo-normals of triangle t: the face normal, the normals of its
+  // edges 3t + k from vertex k to vertex (k + 1) % 3 and of its vertices 3t + k
+  struct PseudoNormals {
+    Pointcloud faces;
+    Pointcloud edges;
+    Pointcloud vertices;
+  };
+
+  // The mesh is a triangle soup, triangles share edges and vertices if their
+  // vertex positions agree up to kWeldResolution
+  void computePseudoNormals(const Triangles& triangles,
+                            PseudoNormals* pseudo_normals) const {
+    const size_t num_triangles = triangles.size();
+    pseudo_normals->faces.resize(num_triangles);
+    pseudo_normals->edges.resize(3 * num_triangles);
+    pseudo_normals->vertices.resize(3 * num_triangles);
+
+    std::vector<uint32_t> vertex_id_of_corner(3 * num_triangles);
+    const size_t num_vertices =
+        weldVertices(triangles.vertices, &vertex_id_of_corner);
+
+    Pointcloud vertex_normals(num_vertices, Point::Zero());
+    std::unordered_map<uint64_t, Point> edge_normals;
+    auto edge_key = [&vertex_id_of_corner](size_t t, int k) {
+      const uint64_t v0 = vertex_id_of_corner[3 * t + k];
+      const uint64_t v1 = vertex_id_of_corner[3 * t + (k + 1) % 3];
+      return std::min(v0, v1) << 32 | std::max(v0, v1);
+    };
+    for (size_t t = 0; t < num_triangles; ++t) {
+      const Point* corners = &triangles.vertices[3 * t];
+      Point normal = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+      const FloatingPoint norm = normal.norm();
+      // Degenerate triangles have no orientation to contribute
+      if (norm <= std::numeric_limits<FloatingPoint>::epsilon()) {
+        pseudo_normals->faces[t] = Point::Zero();
+        continue;
+      }
+      normal /= norm;
+      if (normal.dot(triangles.viewpoints[t] - corners[0]) < 0.0) {
+        normal = -normal;
+      }
+      pseudo_normals->faces[t] = normal;
+
+      for (int k = 0; k < 3; ++k) {
+        // Eigen leaves new points uninitialized, operator[] can't be used
+        edge_normals.emplace(edge_key(t, k), Point::Zero()).first->second +=
+            normal;
+        const Point e0 = corners[(k + 1) % 3] - corners[k];
+        const Point e1 = corners[(k + 2) % 3] - corners[k];
+        const FloatingPoint cos_angle =
+            e0.dot(e1) / std::max<FloatingPoint>(e0.norm() * e1.norm(),
+                                                 kEpsilon);
+        vertex_normals[vertex_id_of_corner[3 * t + k]] +=
+            std::acos(std::max<FloatingPoint>(
+                -1.0, std::min<FloatingPoint>(1.0, cos_angle))) *
+            normal;
+      }
+    }
+
+    for (size_t t = 0; t < num_triangles; ++t) {
+      for (int k = 0; k < 3; ++k) {
+        // Edges only shared by degenerate triangles have no normal
+        auto edge_it = edge_normals.find(edge_key(t, k));
+        pseudo_normals->edges[3 * t + k] =
+            edge_it != edge_normals.end() ? edge_it->second : Point::Zero();
+        pseudo_normals->vertices[3 * t + k] =
+            vertex_normals[vertex_id_of_corner[3 * t + k]];
+      }
+    }
+  }
+
+  // Gives every corner the id of the first vertex within kWeldResolution of
+  // it, returns the number of ids. Vertices are hashed into cells of that
+  // size, a vertex close to a cell boundary can match one in the cell next to
+  // it, so all 27 cells around it are searched.
+  static size_t weldVertices(const Pointcloud& corners,
+                             std::vector<uint32_t>* vertex_id_of_corner) {
+    constexpr FloatingPoint kWeldResolutionSquared =
+        kWeldResolution * kWeldResolution;
+    LongIndexHashMapType<std::vector<uint32_t>>::type cells;
+    Pointcloud vertices;
+    for (size_t i = 0; i < corners.size(); ++i) {
+      const Point& corner = corners[i];
+      const GlobalIndex cell_index =
+          getGridIndexFromPoint<GlobalIndex>(corner, 1.0 / kWeldResolution);
+      uint32_t vertex_id = vertices.size();
+      GlobalIndex offset;
+      for (offset.x() = -1; offset.x() <= 1; ++offset.x()) {
+        for (offset.y() = -1; offset.y() <= 1; ++offset.y()) {
+          for (offset.z() = -1; offset.z() <= 1; ++offset.z()) {
+            auto cell_it = cells.find(cell_index + offset);
+            if (cell_it == cells.end()) continue;
+            for (const uint32_t id : cell_it->second) {
+              if (id < vertex_id && (vertices[id] - corner).squaredNorm() <=
+                                        kWeldResolutionSquared) {
+                vertex_id = id;
+              }
+            }
+          }
+        }
+      }
+      if (vertex_id == vertices.size()) {
+        vertices.emplace_back(corner);
+        cells[cell_index].push_back(vertex_id);
+      }
+      (*vertex_id_of_corner)[i] = vertex_id;
+    }
+    return vertices.size();
+  }
+
+  // Pseudo-normal of the feature of triangle t the barycentric weights of a
+  // closest point lie on
+  static inline const Point& getPseudoNormal(
+      const PseudoNormals& pseudo_normals, size_t t, const Point& weights) {
+    int num_zero = 0, zero_k = 0, nonzero_k = 0;
+    for (int k = 0; k < 3; ++k) {
+      if (weights[k] <= 0.0) {
+        num_zero++;
+        zero_k = k;
+      } else {
+        nonzero_k = k;
+      }
+    }
+    switch (num_zero) {
+      case 0:
+        return pseudo_normals.faces[t];
+      case 1:
+        // The edge from vertex zero_k + 1 to zero_k + 2
+        return pseudo_normals.edges[3 * t + (zero_k + 1) % 3];
+      default:
+        return pseudo_normals.vertices[3 * t + nonzero_k];
+    }
+  }
+
+  // Allocates every block overlapped by the truncation band of a triangle and
+  // lists the triangles each of them has to consider
+  void binTriangles(
+      const Triangles& triangles, Layer<TsdfVoxel>* layer,
+      std::vector<std::pair<Block<TsdfVoxel>::Ptr, std::vector<size_t>>>*
+          blocks) const {
+    const FloatingPoint block_size_inv = layer->block_size_inv();
+    AnyIndexHashMapType<size_t>::type block_slots;
+    for (size_t t = 0; t < triangles.size(); ++t) {
+      const Point& a = triangles.vertices[3 * t];
+      const Point& b = triangles.vertices[3 * t + 1];
+      const Point& c = triangles.vertices[3 * t + 2];
+      const Point band(config_.truncation_distance,
+                       config_.truncation_distance,
+                       config_.truncation_distance);
+      const BlockIndex min_index = getGridIndexFromPoint<BlockIndex>(
+          a.cwiseMin(b).cwiseMin(c) - band, block_size_inv);
+      const BlockIndex max_index = getGridIndexFromPoint<BlockIndex>(
+          a.cwiseMax(b).cwiseMax(c) + band, block_size_inv);
+
+      BlockIndex block_index;
+      for (block_index.x() = min_index.x(); block_index.x() <= max_index.x();
+           ++block_index.x()) {
+        for (block_index.y() = min_index.y(); block_index.y() <= max_index.y();
+             ++block_index.y()) {
+          for (block_index.z() = min_index.z();
+               block_index.z() <= max_index.z(); ++block_index.z()) {
+            auto slot_it = block_slots.find(block_index);
+            if (slot_it == block_slots.end()) {
+              slot_it = block_slots.emplace(block_index, blocks->size()).first;
+              blocks->emplace_back(layer->allocateBlockPtrByIndex(block_index),
+                                   std::vector<size_t>());
+            }
+            (*blocks)[slot_it->second].second.push_back(t);
+          }
+        }
+      }
+    }
+  }
+
+  void integrateBlock(const Triangles& triangles,
+                      const PseudoNormals& pseudo_normals,
+                      const std::vector<size_t>& triangle_indices,
+                      Block<TsdfVoxel>* block) const {
+    const FloatingPoint truncation = config_.truncation_distance;
+    bool has_data = false;
+    for (size_t linear_index = 0; linear_index < block->num_voxels();
+         ++linear_index) {
+      const Point voxel_center =
+          block->computeCoordinatesFromLinearIndex(linear_index);
+
+      FloatingPoint min_distance = std::numeric_limits<FloatingPoint>::max();
+      size_t closest_triangle = 0u;
+      Point closest_point = Point::Zero(), closest_weights = Point::Zero();
+      for (const size_t t : triangle_indices) {
+        Point point, weights;
+        const FloatingPoint distance = closestPointOnTriangle(
+            voxel_center, triangles.vertices[3 * t],
+            triangles.vertices[3 * t + 1], triangles.vertices[3 * t + 2],
+            &point, &weights);
+        if (distance < min_distance) {
+          min_distance = distance;
+          closest_triangle = t;
+          closest_point = point;
+          closest_weights = weights;
+        }
+      }
+      if (min_distance > truncation) continue;
+
+      const size_t t = closest_triangle;
+      const Point& normal =
+          getPseudoNormal(pseudo_normals, t, closest_weights);
+      const FloatingPoint sign =
+          normal.dot(voxel_center - closest_point) < 0.0 ? -1.0 : 1.0;
+
+      TsdfVoxel& voxel = block->getVoxelByLinearIndex(linear_index);
+      voxel.distance = sign * min_distance;
+      voxel.weight = std::min<FloatingPoint>(triangles.num_observations[t],
+                                             config_.max_weight);
+      voxel.color = blendColor(triangles.colors[3 * t],
+                               triangles.colors[3 * t + 1],
+                               triangles.colors[3 * t + 2], closest_weights);
+      has_data = true;
+    }
+    if (has_data) {
+      block->set_has_data(true);
+      block->setUpdatedAll();
+    }
+  }
+
+  // Closest point on triangle abc to p, see Ericson, Real-Time Collision
+  // Detection, 5.1.5. Also returns its barycentric weights and the distance.
+  static FloatingPoint closestPointOnTriangle(const Point& p, const Point& a,
+                                              const Point& b, const Point& c,
+                                              Point* closest_point,
+                                              Point* weights) {
+    const Point ab = b - a;
+    const Point ac = c - a;
+    const Point ap = p - a;
+    const FloatingPoint d1 = ab.dot(ap);
+    const FloatingPoint d2 = ac.dot(ap);
+    if (d1 <= 0.0 && d2 <= 0.0) {
+      *weights = Point(1.0, 0.0, 0.0);
+    } else {
+      const Point bp = p - b;
+      const FloatingPoint d3 = ab.dot(bp);
+      const FloatingPoint d4 = ac.dot(bp);
+      const Point cp = p - c;
+      const FloatingPoint d5 = ab.dot(cp);
+      const FloatingPoint d6 = ac.dot(cp);
+      const FloatingPoint vc = d1 * d4 - d3 * d2;
+      const FloatingPoint vb = d5 * d2 - d1 * d6;
+      const FloatingPoint va = d3 * d6 - d5 * d4;
+      if (d3 >= 0.0 && d4 <= d3) {
+        *weights = Point(0.0, 1.0, 0.0);
+      } else if (d6 >= 0.0 && d5 <= d6) {
+        *weights = Point(0.0, 0.0, 1.0);
+      } else if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0) {
+        const FloatingPoint v = d1 / (d1 - d3);
+        *weights = Point(1.0 - v, v, 0.0);
+      } else if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0) {
+        const FloatingPoint w = d2 / (d2 - d6);
+        *weights = Point(1.0 - w, 0.0, w);
+      } else if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0) {
+        const FloatingPoint w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        *weights = Point(0.0, 1.0 - w, w);
+      } else {
+        const FloatingPoint denom = 1.0 / (va + vb + vc);
+        const FloatingPoint v = vb * denom;
+        const FloatingPoint w = vc * denom;
+        *weights = Point(1.0 - v - w, v, w);
+      }
+    }
+    *closest_point = weights->x() * a + weights->y() * b + weights->z() * c;
+    return (p - *closest_point).norm();
+  }
+
+  static inline Color blendColor(const Color& c0, const Color& c1,
+                                 const Color& c2, const Point& weights) {
+    Color color;
+    color.r = static_cast<uint8_t>(std::round(
+        weights.x() * c0.r + weights.y() * c1.r + weights.z() * c2.r));
+    color.g = static_cast<uint8_t>(std::round(
+        weights.x() * c0.g + weights.y() * c1.g + weights.z() * c2.g));
+    color.b = static_cast<uint8_t>(std::round(
+        weights.x() * c0.b + weights.y() * c1.b + weights.z() * c2.b));
+    color.a = static_cast<uint8_t>(std::round(
+        weights.x() * c0.a + weights.y() * c1.a + weights.z() * c2.a));
+    return color;
+  }
+
+  Config config_;
+
+  constexpr static FloatingPoint kWeldResolution = 1e-4;
+};
+
+}  // namespace voxblox
+
+#endif  // COXGRAPH_MAP_COMM_MESH_TSDF_INTEGRATOR_H_
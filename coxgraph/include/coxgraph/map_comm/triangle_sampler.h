@@ -0,0 +1,191 @@
+#ifndef COXGRAPH_MAP_COMM_TRIANGLE_SAMPLER_H_
+#define COXGRAPH_MAP_COMM_TRIANGLE_SAMPLER_H_
+
+#include <glog/logging.h>
+#include <voxblox/core/common.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace voxblox {
+
+/**
+ * @brief Samples points on mesh triangles at a fixed spacing.
+ *
+ * Each triangle gets samples along its three edges, one at its centroid and,
+ * optionally, a barycentric grid over its interior. Triangles are processed
+ * in batches given as SoA vertex arrays, the caller first queries the sample
+ * counts to size its buffers, then sample() writes all samples back to back
+ * without allocating.
+ */
+class TriangleSampler {
+ public:
+  struct Config {
+    float spacing = 0.2;
+    bool sample_interior = false;
+  };
+
+  // Triangle t consists of the vertex entries 3t, 3t + 1 and 3t + 2
+  struct TriangleBatch {
+    const float* x;
+    const float* y;
+    const float* z;
+    const uint8_t* r;
+    const uint8_t* g;
+    const uint8_t* b;
+    size_t num_triangles;
+  };
+
+  explicit TriangleSampler(const Config& config) : config_(config) {
+    CHECK_GT(config_.spacing, 0.0f);
+  }
+  ~TriangleSampler() = default;
+
+  const Config& getConfig() const { return config_; }
+
+  // Writes the number of samples of triangle t to num_samples[t]
+  void countSamples(const TriangleBatch& batch, size_t* num_samples) const {
+    CHECK_NOTNULL(num_samples);
+    const float inv_spacing = 1.0f / config_.spacing;
+#pragma omp simd
+    for (size_t t = 0; t < batch.num_triangles; ++t) {
+      const size_t i0 = 3 * t, i1 = 3 * t + 1, i2 = 3 * t + 2;
+      // Samples on the three edges plus the centroid
+      num_samples[t] = numSegments(batch, i0, i1, inv_spacing) +
+                       numSegments(batch, i0, i2, inv_spacing) +
+                       numSegments(batch, i1, i2, inv_spacing) - 2;
+    }
+    if (config_.sample_interior) {
+      for (size_t t = 0; t < batch.num_triangles; ++t) {
+        const size_t i0 = 3 * t, i1 = 3 * t + 1, i2 = 3 * t + 2;
+        num_samples[t] +=
+            numInteriorSamples(numSegments(batch, i0, i1, inv_spacing),
+                               numSegments(batch, i0, i2, inv_spacing));
+      }
+    }
+  }
+
+  // Writes the samples of all triangles in batch order, triangle t starting
+  // at the sum of the counts of the triangles before it
+  void sample(const TriangleBatch& batch, Point* points, Color* colors) const {
+    CHECK_NOTNULL(points);
+    CHECK_NOTNULL(colors);
+    const float inv_spacing = 1.0f / config_.spacing;
+    size_t out_i = 0u;
+    for (size_t t = 0; t < batch.num_triangles; ++t) {
+      const size_t i0 = 3 * t, i1 = 3 * t + 1, i2 = 3 * t + 2;
+      const int n01 = numSegments(batch, i0, i1, inv_spacing);
+      const int n02 = numSegments(batch, i0, i2, inv_spacing);
+      const int n12 = numSegments(batch, i1, i2, inv_spacing);
+
+      out_i += sampleEdge(batch, i0, i1, n01, points + out_i, colors + out_i);
+
+      // Centroid
+      points[out_i] = (vertex(batch, i0) + vertex(batch, i1) +
+                       vertex(batch, i2)) /
+                      3.0f;
+      colors[out_i] = blend(batch, i0, i1, i2, 1.0f / 3.0f, 1.0f / 3.0f);
+      ++out_i;
+
+      out_i += sampleEdge(batch, i0, i2, n02, points + out_i, colors + out_i);
+      out_i += sampleEdge(batch, i1, i2, n12, points + out_i, colors + out_i);
+
+      if (config_.sample_interior) {
+        out_i += sampleInterior(batch, i0, i1, i2, n01, n02, points + out_i,
+                                colors + out_i);
+      }
+    }
+  }
+
+ private:
+  static inline Point vertex(const TriangleBatch& batch, size_t i) {
+    return Point(batch.x[i], batch.y[i], batch.z[i]);
+  }
+
+  static inline float edgeLength(const TriangleBatch& batch, size_t i,
+                                 size_t j) {
+    const float dx = batch.x[j] - batch.x[i];
+    const float dy = batch.y[j] - batch.y[i];
+    const float dz = batch.z[j] - batch.z[i];
+    return std::sqrt(dx * dx + dy * dy + dz * dz);
+  }
+
+  // Number of spacing-sized segments the edge is cut into, the edge gets one
+  // sample less than that, excluding both end points
+  static inline int numSegments(const TriangleBatch& batch, size_t i, size_t j,
+                                float inv_spacing) {
+    return std::max(
+        1, static_cast<int>(std::ceil(edgeLength(batch, i, j) * inv_spacing)));
+  }
+
+  // Number of grid nodes (u, v) with u, v >= 1 and u / n_u + v / n_v < 1
+  static inline size_t numInteriorSamples(int n_u, int n_v) {
+    size_t count = 0u;
+    for (int u = 1; u < n_u; ++u) {
+      count += numInteriorRowSamples(n_u, n_v, u);
+    }
+    return count;
+  }
+  static inline int numInteriorRowSamples(int n_u, int n_v, int u) {
+    return (n_v * (n_u - u) + n_u - 1) / n_u - 1;
+  }
+
+  static inline Color blend(const TriangleBatch& batch, size_t i0, size_t i1,
+                            size_t i2, float w1, float w2) {
+    const float w0 = 1.0f - w1 - w2;
+    Color color;
+    color.r = static_cast<uint8_t>(
+        std::round(w0 * batch.r[i0] + w1 * batch.r[i1] + w2 * batch.r[i2]));
+    color.g = static_cast<uint8_t>(
+        std::round(w0 * batch.g[i0] + w1 * batch.g[i1] + w2 * batch.g[i2]));
+    color.b = static_cast<uint8_t>(
+        std::round(w0 * batch.b[i0] + w1 * batch.b[i1] + w2 * batch.b[i2]));
+    // Mesh colors carry no alpha and are opaque, as blendTwoColors of them was
+    color.a = 255u;
+    return color;
+  }
+
+  size_t sampleEdge(const TriangleBatch& batch, size_t i, size_t j,
+                    int num_segments, Point* points, Color* colors) const {
+    const float length = edgeLength(batch, i, j);
+    if (length <= 0.0f) return 0u;
+    const Point start = vertex(batch, i);
+    const Point direction = vertex(batch, j) - start;
+    const float step = config_.spacing / length;
+    const size_t num_samples = num_segments - 1;
+    for (size_t k = 0; k < num_samples; ++k) {
+      const float t = static_cast<float>(k + 1) * step;
+      points[k] = start + t * direction;
+      colors[k] = blend(batch, i, j, j, t, 0.0f);
+    }
+    return num_samples;
+  }
+
+  size_t sampleInterior(const TriangleBatch& batch, size_t i0, size_t i1,
+                        size_t i2, int n_u, int n_v, Point* points,
+                        Color* colors) const {
+    const Point p0 = vertex(batch, i0);
+    const Point e01 = vertex(batch, i1) - p0;
+    const Point e02 = vertex(batch, i2) - p0;
+    const float du = 1.0f / static_cast<float>(n_u);
+    const float dv = 1.0f / static_cast<float>(n_v);
+    size_t k = 0u;
+    for (int u = 1; u < n_u; ++u) {
+      const float w1 = static_cast<float>(u) * du;
+      const int num_row_samples = numInteriorRowSamples(n_u, n_v, u);
+      for (int v = 1; v <= num_row_samples; ++v, ++k) {
+        const float w2 = static_cast<float>(v) * dv;
+        points[k] = p0 + w1 * e01 + w2 * e02;
+        colors[k] = blend(batch, i0, i1, i2, w1, w2);
+      }
+    }
+    return k;
+  }
+
+  Config config_;
+};
+
+}  // namespace voxblox
+
+#endif  // COXGRAPH_MAP_COMM_TRIANGLE_SAMPLER_H_
@@ -2,25 +2,58 @@
 #define COXGRAPH_MAP_COMM_TSDF_RECOVER_H_
 
 #include <cblox_msgs/MapPoseUpdates.h>
+#include <minkindr_conversions/kindr_msg.h>
 #include <pcl_ros/point_cloud.h>
 #include <ros/ros.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <voxblox/core/tsdf_map.h>
 #include <voxblox/integrator/tsdf_integrator.h>
+#include <voxblox/interpolator/interpolator.h>
+#include <voxblox/utils/timing.h>
 #include <voxblox_msgs/LayerWithTrajectory.h>
+#include <voxblox_ros/conversions.h>
 #include <voxblox_ros/ros_params.h>
 #include <voxblox_ros/transformer.h>
-#include <voxblox_ros/tsdf_server.h>
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "coxgraph/map_comm/mesh_converter.h"
+#include "coxgraph/map_comm/mesh_tsdf_integrator.h"
 namespace voxblox {
-class TsdfRecover : public TsdfServer {
+// Recovers TSDF layers from the meshes of a client on a pool of workers. The
+// workers own all maps, so no TsdfServer map is kept besides them.
+class TsdfRecover {
  public:
   struct Config {
-    Config() : use_tf_submap_pose(false) {}
+    Config()
+        : use_tf_submap_pose(false),
+          recovery_mode("raycast"),
+          num_workers(2),
+          max_queued_meshes(10),
+          log_surface_error(false) {}
     bool use_tf_submap_pose;
+    // "raycast" integrates the mesh as a point cloud from every keyframe,
+    // "direct" computes the TSDF from the mesh triangles
+    std::string recovery_mode;
+    // Number of meshes recovered concurrently, each worker owns its own TSDF
+    // layer and integrators
+    int num_workers;
+    // Meshes waiting for a worker, the oldest is dropped beyond this
+    int max_queued_meshes;
+    // Debugging only, measures the recovered distance at the vertices of the
+    // observed triangles of every mesh, the same ones in both modes
+    bool log_surface_error;
+
+    inline bool directRecovery() const { return recovery_mode == "direct"; }
 
     friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
       s << std::endl
@@ -29,6 +62,13 @@ class TsdfRecover : public TsdfServer {
         << static_cast<std::string>(v.use_tf_submap_pose ? "enabled"
                                                          : "disabled")
         << std::endl
+        << "  Recovery Mode: " << v.recovery_mode << std::endl
+        << "  Recover Workers: " << v.num_workers << std::endl
+        << "  Max Queued Meshes: " << v.max_queued_meshes << std::endl
+        << "  Log Surface Error: "
+        << static_cast<std::string>(v.log_surface_error ? "enabled"
+                                                        : "disabled")
+        << std::endl
         << "-------------------------------------------" << std::endl;
       return (s);
     }
@@ -38,41 +78,208 @@ class TsdfRecover : public TsdfServer {
     Config config;
     nh_private.param<bool>("use_tf_submap_pose", config.use_tf_submap_pose,
                            config.use_tf_submap_pose);
+    nh_private.param<std::string>("recovery_mode", config.recovery_mode,
+                                  config.recovery_mode);
+    CHECK(config.recovery_mode == "raycast" || config.recovery_mode == "direct")
+        << "Unknown recovery_mode " << config.recovery_mode;
+    nh_private.param<int>("recover_workers", config.num_workers,
+                          config.num_workers);
+    CHECK_GT(config.num_workers, 0);
+    nh_private.param<int>("max_queued_meshes", config.max_queued_meshes,
+                          config.max_queued_meshes);
+    CHECK_GT(config.max_queued_meshes, 0);
+    nh_private.param<bool>("log_surface_error", config.log_surface_error,
+                           config.log_surface_error);
     return config;
   }
 
   TsdfRecover(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private)
       : nh_(nh),
         nh_private_(nh_private),
-        config_(getConfigFromRosParam(nh_private)),
-        TsdfServer(nh, nh_private, getTsdfMapConfigFromRosParam(nh_private),
-                   getTsdfIntegratorConfigFromRosParam(nh_private),
-                   getMeshIntegratorConfigFromRosParam(nh_private)) {
-    mesh_converter_.reset(new MeshConverter(nh_private_));
+        verbose_(true),
+        config_(getConfigFromRosParam(nh_private)) {
+    nh_private_.param("verbose", verbose_, verbose_);
+    LOG(INFO) << config_;
+
+    initWorkers(getTsdfMapConfigFromRosParam(nh_private),
+                getTsdfIntegratorConfigFromRosParam(nh_private));
 
     subscribeToTopics();
     advertiseTopics();
   }
 
-  ~TsdfRecover() = default;
+  ~TsdfRecover() {
+    {
+      std::lock_guard<std::mutex> job_queue_lock(job_queue_mutex_);
+      shutdown_ = true;
+    }
+    job_queue_cv_.notify_all();
+    for (auto& worker : workers_) {
+      if (worker->thread.joinable()) worker->thread.join();
+    }
+    LOG_IF(WARNING, !job_queue_.empty())
+        << "Discarded " << job_queue_.size()
+        << " queued meshes on shutdown, oldest is mesh "
+        << job_queue_.front().seq;
+  }
+
+ private:
+  // Everything needed to recover one mesh, so that several meshes can be
+  // recovered at once without sharing any map state
+  struct RecoverWorker {
+    TsdfMap::Ptr tsdf_map;
+    TsdfIntegratorBase::Ptr tsdf_integrator;
+    MeshConverter::Ptr mesh_converter;
+    std::unique_ptr<MeshTsdfIntegrator> mesh_tsdf_integrator;
+    MeshTsdfIntegrator::Triangles triangles;
+    std::thread thread;
+  };
+
+  struct RecoverJob {
+    uint64_t seq;
+    voxblox_msgs::Mesh::ConstPtr mesh_msg;
+  };
+
+  struct RecoverResult {
+    // False for dropped meshes, which are only skipped in the publish order
+    bool recovered = true;
+    voxblox_msgs::LayerWithTrajectory layer_msg;
+    sensor_msgs::PointCloud2 recovered_pointcloud_msg;
+  };
+
+  void initWorkers(const TsdfMap::Config& map_config,
+                   TsdfIntegratorBase::Config integrator_config) {
+    std::string method("merged");
+    nh_private_.param<std::string>("method", method, method);
+
+    // The workers run at once, so they share the integrator thread budget
+    integrator_config.integrator_threads = std::max<size_t>(
+        1u, integrator_config.integrator_threads / config_.num_workers);
+
+    MeshTsdfIntegrator::Config mesh_tsdf_config;
+    mesh_tsdf_config.truncation_distance =
+        integrator_config.default_truncation_distance;
+    mesh_tsdf_config.max_weight = integrator_config.max_weight;
+    mesh_tsdf_config.num_threads = integrator_config.integrator_threads;
+
+    for (int i = 0; i < config_.num_workers; ++i) {
+      std::unique_ptr<RecoverWorker> worker(new RecoverWorker());
+      worker->tsdf_map.reset(new TsdfMap(map_config));
+      worker->tsdf_integrator = TsdfIntegratorFactory::create(
+          method, integrator_config, worker->tsdf_map->getTsdfLayerPtr());
+      worker->mesh_converter.reset(new MeshConverter(nh_private_));
+      worker->mesh_tsdf_integrator.reset(
+          new MeshTsdfIntegrator(mesh_tsdf_config));
+      workers_.emplace_back(std::move(worker));
+    }
+    for (auto& worker : workers_) {
+      worker->thread =
+          std::thread(&TsdfRecover::workerLoop, this, worker.get());
+    }
+  }
+
+  void workerLoop(RecoverWorker* worker) {
+    while (true) {
+      RecoverJob job;
+      {
+        std::unique_lock<std::mutex> job_queue_lock(job_queue_mutex_);
+        job_queue_cv_.wait(job_queue_lock,
+                           [this] { return shutdown_ || !job_queue_.empty(); });
+        if (shutdown_) return;
+        job = job_queue_.front();
+        job_queue_.pop_front();
+      }
 
-  bool processMesh(const voxblox_msgs::Mesh& mesh_msg,
+      RecoverResult result;
+      pcl::PointCloud<pcl::PointXYZRGB> recovered_pointcloud;
+      processMesh(worker, *job.mesh_msg, &result.layer_msg,
+                  &recovered_pointcloud);
+      pcl::toROSMsg<pcl::PointXYZRGB>(recovered_pointcloud,
+                                      result.recovered_pointcloud_msg);
+      result.recovered_pointcloud_msg.header.stamp = job.mesh_msg->header.stamp;
+      result.layer_msg.header.stamp = job.mesh_msg->header.stamp;
+      publishInOrder(job.seq, std::move(result));
+    }
+  }
+
+  bool processMesh(RecoverWorker* worker, const voxblox_msgs::Mesh& mesh_msg,
                    voxblox_msgs::LayerWithTrajectory* layer_msg,
                    pcl::PointCloud<pcl::PointXYZRGB>* recovered_pointcloud) {
-    tsdf_map_->getTsdfLayerPtr()->removeAllBlocks();
+    worker->tsdf_map->getTsdfLayerPtr()->removeAllBlocks();
     timing::Timer mesh_process_timer("mesh_process");
-    mesh_converter_->setMesh(mesh_msg);
-    mesh_converter_->convertToPointCloud(recovered_pointcloud);
+    worker->mesh_converter->setMesh(mesh_msg);
+    if (config_.directRecovery()) {
+      recoverDirect(worker, recovered_pointcloud);
+    } else {
+      recoverByRaycasting(worker, recovered_pointcloud);
+    }
+    if (config_.log_surface_error) {
+      MeshTsdfIntegrator::Triangles& triangles = worker->triangles;
+      worker->mesh_converter->convertToTriangles(&triangles);
+      logSurfaceError(worker->tsdf_map->getTsdfLayer(), triangles.vertices);
+      triangles.clear();
+    }
+
+    worker->mesh_converter->clear();
+
+    mesh_process_timer.Stop();
+
+    if (verbose_) {
+      ROS_INFO_STREAM("Timings: " << std::endl << timing::Timing::Print());
+      ROS_INFO_STREAM("Layer memory: "
+                      << worker->tsdf_map->getTsdfLayer().getMemorySize());
+    }
+
+    serializeLayerAsMsg(worker->tsdf_map->getTsdfLayer(), false,
+                        &layer_msg->layer);
+    layer_msg->trajectory = mesh_msg.trajectory;
+
+    return true;
+  }
+
+  // The mesh vertices lie on the surface, so the recovered distance there is
+  // the surface error of the recovery
+  void logSurfaceError(const Layer<TsdfVoxel>& tsdf_layer,
+                       const Pointcloud& mesh_vertices) const {
+    Interpolator<TsdfVoxel> interpolator(&tsdf_layer);
+    double sum_error = 0.0;
+    FloatingPoint max_error = 0.0;
+    size_t num_observed = 0u;
+    for (const Point& vertex : mesh_vertices) {
+      FloatingPoint distance;
+      if (!interpolator.getDistance(vertex, &distance, true)) {
+        continue;
+      }
+      sum_error += std::abs(distance);
+      max_error = std::max(max_error, std::abs(distance));
+      num_observed++;
+    }
+    ROS_INFO_STREAM("Surface error of " << config_.recovery_mode
+                    << " recovery: mean "
+                    << (num_observed > 0 ? sum_error / num_observed : 0.0)
+                    << " m, max " << max_error << " m, " << num_observed
+                    << " of " << mesh_vertices.size()
+                    << " mesh vertices observed");
+  }
+
+  // Integrate the mesh as a point cloud seen from every keyframe of its
+  // trajectory
+  void recoverByRaycasting(
+      RecoverWorker* worker,
+      pcl::PointCloud<pcl::PointXYZRGB>* recovered_pointcloud) {
+    worker->mesh_converter->convertToPointCloud(recovered_pointcloud);
 
     Transformation T_G_C;
     PointcloudPtr points_C(new Pointcloud());
     int i = 0;
     ColorsPtr colors(new Colors());
-    while (mesh_converter_->getNextPointcloud(&i, &T_G_C, &points_C, &colors)) {
+    while (worker->mesh_converter->getNextPointcloud(&i, &T_G_C, &points_C,
+                                                     &colors)) {
       if (points_C->empty()) continue;
 
       timing::Timer integrator("integrate");
-      tsdf_integrator_->integratePointCloud(T_G_C, *points_C, *colors, false);
+      worker->tsdf_integrator->integratePointCloud(T_G_C, *points_C, *colors,
+                                                   false);
       integrator.Stop();
 
       //    if (frame_pointcloud_pub_.getNumSubscribers() > 0) {
@@ -84,21 +291,36 @@ class TsdfRecover : public TsdfServer {
       //      frame_pointcloud_pub_.publish(pointcloud_msg);
       //    }
     }
+  }
 
-    mesh_converter_->clear();
-
-    mesh_process_timer.Stop();
-
-    LOG(INFO) << "layer memory: " << tsdf_map_->getTsdfLayer().getMemorySize();
-    ROS_INFO_STREAM("Timings: " << std::endl << timing::Timing::Print());
+  // Compute the TSDF straight from the mesh triangles, skipping the
+  // per-keyframe raycasting
+  void recoverDirect(RecoverWorker* worker,
+                     pcl::PointCloud<pcl::PointXYZRGB>* recovered_pointcloud) {
+    CHECK_NOTNULL(recovered_pointcloud);
+    recovered_pointcloud->clear();
+    MeshTsdfIntegrator::Triangles& triangles = worker->triangles;
+    worker->mesh_converter->convertToTriangles(&triangles);
 
-    serializeLayerAsMsg(tsdf_map_->getTsdfLayer(), false, &layer_msg->layer);
-    layer_msg->trajectory = mesh_msg.trajectory;
+    timing::Timer integrator("integrate");
+    worker->mesh_tsdf_integrator->integrateTriangles(
+        triangles, worker->tsdf_map->getTsdfLayerPtr());
+    integrator.Stop();
 
-    return true;
+    recovered_pointcloud->reserve(triangles.vertices.size());
+    for (size_t i = 0; i < triangles.vertices.size(); ++i) {
+      pcl::PointXYZRGB recovered_point;
+      recovered_point.x = triangles.vertices[i].x();
+      recovered_point.y = triangles.vertices[i].y();
+      recovered_point.z = triangles.vertices[i].z();
+      recovered_point.r = triangles.colors[i].r;
+      recovered_point.g = triangles.colors[i].g;
+      recovered_point.b = triangles.colors[i].b;
+      recovered_pointcloud->push_back(recovered_point);
+    }
+    triangles.clear();
   }
 
- private:
   void subscribeToTopics() {
     mesh_sub_ = nh_private_.subscribe("mesh_with_history", 10,
                                       &TsdfRecover::meshCallback, this);
@@ -108,44 +330,88 @@ class TsdfRecover : public TsdfServer {
     else
       LOG(FATAL) << "Don't turn on use_tf_submap_pose, bug unfix";
   }
+  // publishInOrder() releases up to one result per worker at once, and every
+  // queued mesh can follow right behind. The outgoing queues hold all of
+  // them, so a burst never overwrites a result before it's sent.
   void advertiseTopics() {
+    const int publish_queue_size =
+        config_.num_workers + config_.max_queued_meshes;
+    tsdf_map_pub_ = nh_private_.advertise<voxblox_msgs::LayerWithTrajectory>(
+        "tsdf_map_out", publish_queue_size, false);
     recovered_pointcloud_pub_ = nh_private_.advertise<sensor_msgs::PointCloud2>(
-        "mesh_pointcloud", 1, true);
+        "mesh_pointcloud", publish_queue_size, true);
     frame_pointcloud_pub_ =
         nh_private_.advertise<pcl::PointCloud<pcl::PointXYZ>>(
             "in_fov_pointcloud", 1, true);
   }
 
-  void meshCallback(const voxblox_msgs::Mesh& mesh_msg) {
-    pcl::PointCloud<pcl::PointXYZRGB> recovered_pointcloud;
-    voxblox_msgs::LayerWithTrajectory layer_msg;
-    processMesh(mesh_msg, &layer_msg, &recovered_pointcloud);
-    sensor_msgs::PointCloud2 recovered_pointcloud_msg;
-    pcl::toROSMsg<pcl::PointXYZRGB>(recovered_pointcloud,
-                                 recovered_pointcloud_msg);
-    recovered_pointcloud_msg.header.stamp = mesh_msg.header.stamp;
-    layer_msg.header.stamp = mesh_msg.header.stamp;
-    tsdf_map_pub_.publish(layer_msg);
-    recovered_pointcloud_pub_.publish(recovered_pointcloud_msg);
+  // Only queues the mesh, so a burst of meshes never blocks the subscriber.
+  // If the workers fall behind, the oldest waiting mesh is dropped.
+  void meshCallback(const voxblox_msgs::Mesh::ConstPtr& mesh_msg) {
+    std::vector<uint64_t> dropped_seqs;
+    {
+      std::lock_guard<std::mutex> job_queue_lock(job_queue_mutex_);
+      job_queue_.push_back(RecoverJob{next_job_seq_++, mesh_msg});
+      while (job_queue_.size() >
+             static_cast<size_t>(config_.max_queued_meshes)) {
+        dropped_seqs.emplace_back(job_queue_.front().seq);
+        job_queue_.pop_front();
+      }
+      LOG_IF(INFO, verbose_) << "Queued mesh " << job_queue_.back().seq
+                             << ", " << job_queue_.size() << " waiting";
+    }
+    job_queue_cv_.notify_one();
 
-    if (verbose_) {
-      ROS_INFO_STREAM("Timings: " << std::endl << timing::Timing::Print());
-      ROS_INFO_STREAM(
-          "Layer memory: " << tsdf_map_->getTsdfLayer().getMemorySize());
+    for (uint64_t seq : dropped_seqs) {
+      LOG(WARNING) << "Recover workers fell behind, dropped mesh " << seq;
+      RecoverResult result;
+      result.recovered = false;
+      publishInOrder(seq, std::move(result));
+    }
+  }
+
+  // Publishes results in the order their meshes arrived, holding back the
+  // ones that finished before an earlier mesh
+  void publishInOrder(uint64_t seq, RecoverResult&& result) {
+    std::lock_guard<std::mutex> publish_lock(publish_mutex_);
+    finished_results_.emplace(seq, std::move(result));
+    auto result_it = finished_results_.begin();
+    while (result_it != finished_results_.end() &&
+           result_it->first == next_publish_seq_) {
+      if (result_it->second.recovered) {
+        tsdf_map_pub_.publish(result_it->second.layer_msg);
+        recovered_pointcloud_pub_.publish(
+            result_it->second.recovered_pointcloud_msg);
+      }
+      result_it = finished_results_.erase(result_it);
+      next_publish_seq_++;
     }
   }
 
   ros::NodeHandle nh_;
   ros::NodeHandle nh_private_;
 
+  bool verbose_;
+
   Config config_;
 
   ros::Subscriber mesh_sub_;
+  ros::Publisher tsdf_map_pub_;
   ros::Publisher recovered_pointcloud_pub_;
   ros::Publisher frame_pointcloud_pub_;
   ros::Publisher submap_pub_;
 
-  MeshConverter::Ptr mesh_converter_;
+  std::vector<std::unique_ptr<RecoverWorker>> workers_;
+
+  std::deque<RecoverJob> job_queue_;
+  std::mutex job_queue_mutex_;
+  std::condition_variable job_queue_cv_;
+  uint64_t next_job_seq_ = 0u;
+  bool shutdown_ = false;
+
+  std::map<uint64_t, RecoverResult> finished_results_;
+  std::mutex publish_mutex_;
+  uint64_t next_publish_seq_ = 0u;
 
   tf::TransformListener tf_listener_;
 
@@ -0,0 +1,252 @@
+#ifndef COXGRAPH_SERVER_BACKEND_DENSE_TSDF_GRID_H_
+#define COXGRAPH_SERVER_BACKEND_DENSE_TSDF_GRID_H_
+
+#include <voxblox/core/layer.h>
+#include <voxblox/core/voxel.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <memory>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Dense copy of the narrow band of a finished submap's TSDF, for the
+ * registration cost functions. Looking up a point costs an index computation
+ * and 8 reads from one flat array, instead of a block hash lookup and a voxel
+ * lookup per corner. Only voxels observed with at least min_weight and closer
+ * than band to the surface are kept, the others are NaN, so a point is only
+ * valid where all 8 voxels around it are in the band.
+ *
+ * The grid spans the bounding box of the band, so it costs 4 bytes per voxel
+ * of that box, against 12 bytes per allocated voxel of the TSDF layer.
+ */
+class DenseTsdfGrid {
+ public:
+  typedef std::shared_ptr<const DenseTsdfGrid> ConstPtr;
+  typedef voxblox::Layer<voxblox::TsdfVoxel> TsdfLayer;
+
+  DenseTsdfGrid(const TsdfLayer& tsdf_layer, float band, float min_weight)
+      : voxel_size_(tsdf_layer.voxel_size()),
+        voxel_size_inv_(1.0f / tsdf_layer.voxel_size()),
+        num_band_voxels_(0),
+        distances_(nullptr, &std::free) {
+    voxblox::BlockIndexList block_indices;
+    tsdf_layer.getAllAllocatedBlocks(&block_indices);
+
+    // Bounds of the band in global voxel indices
+    voxblox::GlobalIndex min_index, max_index;
+    typedef std::numeric_limits<voxblox::LongIndexElement> Limits;
+    min_index.setConstant(Limits::max());
+    max_index.setConstant(Limits::lowest());
+    forEachBandVoxel(tsdf_layer, block_indices, band, min_weight,
+                     [&](const voxblox::GlobalIndex& global_index, float) {
+                       min_index = min_index.cwiseMin(global_index);
+                       max_index = max_index.cwiseMax(global_index);
+                     });
+    if ((min_index.array() > max_index.array()).any()) {
+      dims_.setZero();
+      origin_index_.setZero();
+      return;
+    }
+    origin_index_ = min_index;
+    dims_ = (max_index - min_index).cast<int>() + Eigen::Vector3i::Ones();
+
+    // Starts on a cache line, padded to whole cache lines
+    const size_t num_voxels = static_cast<size_t>(dims_.prod());
+    const size_t num_bytes =
+        (num_voxels * sizeof(float) + kAlignment - 1) / kAlignment * kAlignment;
+    void* data = nullptr;
+    CHECK_EQ(posix_memalign(&data, kAlignment, num_bytes), 0)
+        << "Failed to allocate " << num_bytes << " bytes for a dense grid";
+    distances_.reset(static_cast<float*>(data));
+    std::fill(distances_.get(), distances_.get() + num_voxels,
+              std::numeric_limits<float>::quiet_NaN());
+    num_bytes_ = num_bytes;
+
+    forEachBandVoxel(tsdf_layer, block_indices, band, min_weight,
+                     [&](const voxblox::GlobalIndex& global_index,
+                         float distance) {
+                       const Eigen::Vector3i index =
+                           (global_index - origin_index_).cast<int>();
+                       distances_.get()[linearIndex(index)] = distance;
+                       num_band_voxels_++;
+                     });
+  }
+
+  // Trilinearly interpolated distance at a point in submap frame, and its
+  // gradient. False if any of the 8 voxels around the point isn't in the band.
+  inline bool getDistanceAndGradient(const Eigen::Vector3f& point,
+                                     float* distance,
+                                     Eigen::Vector3f* gradient) const {
+    // Voxel centers are at (index + 0.5) * voxel_size
+    const Eigen::Vector3f grid_point =
+        point * voxel_size_inv_ -
+        origin_index_.cast<float>() - Eigen::Vector3f::Constant(0.5f);
+    const Eigen::Vector3f floor_point = grid_point.array().floor();
+    const Eigen::Vector3i index = floor_point.cast<int>();
+    if ((index.array() < 0).any() ||
+        (index.array() + 1 >= dims_.array()).any()) {
+      return false;
+    }
+    const Eigen::Vector3f t = grid_point - floor_point;
+
+    // Corner c is at index + (c & 1, c >> 1 & 1, c >> 2 & 1)
+    const size_t base = linearIndex(index);
+    const size_t stride_y = dims_.x();
+    const size_t stride_z = stride_y * dims_.y();
+    const float* data = distances_.get();
+    const float d[8] = {data[base],
+                        data[base + 1],
+                        data[base + stride_y],
+                        data[base + stride_y + 1],
+                        data[base + stride_z],
+                        data[base + stride_z + 1],
+                        data[base + stride_z + stride_y],
+                        data[base + stride_z + stride_y + 1]};
+    for (float corner_distance : d) {
+      if (std::isnan(corner_distance)) return false;
+    }
+
+    // Interpolate along x, then y, then z
+    const float d_00 = d[0] + t.x() * (d[1] - d[0]);
+    const float d_10 = d[2] + t.x() * (d[3] - d[2]);
+    const float d_01 = d[4] + t.x() * (d[5] - d[4]);
+    const float d_11 = d[6] + t.x() * (d[7] - d[6]);
+    const float d_0 = d_00 + t.y() * (d_10 - d_00);
+    const float d_1 = d_01 + t.y() * (d_11 - d_01);
+    *distance = d_0 + t.z() * (d_1 - d_0);
+
+    if (gradient != nullptr) {
+      const float dx_00 = d[1] - d[0];
+      const float dx_10 = d[3] - d[2];
+      const float dx_01 = d[5] - d[4];
+      const float dx_11 = d[7] - d[6];
+      const float dx_0 = dx_00 + t.y() * (dx_10 - dx_00);
+      const float dx_1 = dx_01 + t.y() * (dx_11 - dx_01);
+      gradient->x() = (dx_0 + t.z() * (dx_1 - dx_0)) * voxel_size_inv_;
+      gradient->y() =
+          ((d_10 - d_00) + t.z() * ((d_11 - d_01) - (d_10 - d_00))) *
+          voxel_size_inv_;
+      gradient->z() = (d_1 - d_0) * voxel_size_inv_;
+    }
+    return true;
+  }
+
+  // Box covered by the grid, in submap frame
+  inline void getBounds(Eigen::Vector3f* min, Eigen::Vector3f* max) const {
+    CHECK_NOTNULL(min);
+    CHECK_NOTNULL(max);
+    *min = origin_index_.cast<float>() * voxel_size_;
+    *max = (origin_index_.cast<float>() + dims_.cast<float>()) * voxel_size_;
+  }
+
+  inline float getVoxelSize() const { return voxel_size_; }
+  inline const Eigen::Vector3i& getDims() const { return dims_; }
+  inline size_t getNumBandVoxels() const { return num_band_voxels_; }
+  inline bool empty() const { return num_band_voxels_ == 0; }
+  // Bytes of the grid
+  inline size_t getMemorySize() const { return num_bytes_; }
+
+ private:
+  static constexpr size_t kAlignment = 64;
+
+  // Calls visit(global_index, distance) for the voxels in the band
+  template <typename Visitor>
+  static void forEachBandVoxel(const TsdfLayer& tsdf_layer,
+                               const voxblox::BlockIndexList& block_indices,
+                               float band, float min_weight, Visitor visit) {
+    const int voxels_per_side = tsdf_layer.voxels_per_side();
+    for (const voxblox::BlockIndex& block_index : block_indices) {
+      const voxblox::Block<voxblox::TsdfVoxel>& block =
+          tsdf_layer.getBlockByIndex(block_index);
+      for (size_t i = 0; i < block.num_voxels(); ++i) {
+        const voxblox::TsdfVoxel& voxel = block.getVoxelByLinearIndex(i);
+        if (voxel.weight <= 0.0f || voxel.weight < min_weight ||
+            std::abs(voxel.distance) > band) {
+          continue;
+        }
+        visit(voxblox::getGlobalVoxelIndexFromBlockAndVoxelIndex(
+                  block_index, block.computeVoxelIndexFromLinearIndex(i),
+                  voxels_per_side),
+              voxel.distance);
+      }
+    }
+  }
+
+  // x varies fastest
+  inline size_t linearIndex(const Eigen::Vector3i& index) const {
+    return index.x() +
+           static_cast<size_t>(dims_.x()) *
+               (index.y() + static_cast<size_t>(dims_.y()) * index.z());
+  }
+
+  const float voxel_size_;
+  const float voxel_size_inv_;
+  // Global voxel index of the first grid voxel
+  voxblox::GlobalIndex origin_index_;
+  Eigen::Vector3i dims_;
+  size_t num_band_voxels_;
+  size_t num_bytes_ = 0;
+  std::unique_ptr<float, decltype(&std::free)> distances_;
+};
+
+/**
+ * @brief Dense grids of the submaps in registration constraints. A grid is
+ * built the first time a constraint needs it, and freed once no cost function
+ * holds it any more. Only used by the thread optimizing the pose graph.
+ */
+class DenseTsdfGridCache {
+ public:
+  DenseTsdfGridCache(float band, float min_weight)
+      : band_(band), min_weight_(min_weight) {}
+
+  DenseTsdfGrid::ConstPtr get(const CliSm& submap) {
+    // Forget the grids that were freed meanwhile
+    for (auto grid_it = grids_.begin(); grid_it != grids_.end();) {
+      if (grid_it->second.expired()) {
+        grid_it = grids_.erase(grid_it);
+      } else {
+        ++grid_it;
+      }
+    }
+
+    DenseTsdfGrid::ConstPtr grid = grids_[submap.getID()].lock();
+    if (grid == nullptr) {
+      grid = std::make_shared<const DenseTsdfGrid>(
+          submap.getTsdfMapPtr()->getTsdfLayer(), band_, min_weight_);
+      grids_[submap.getID()] = grid;
+    }
+    return grid;
+  }
+
+  // Number of grids alive and their total size in bytes
+  void getStats(size_t* num_grids, size_t* num_bytes) const {
+    CHECK_NOTNULL(num_grids);
+    CHECK_NOTNULL(num_bytes);
+    *num_grids = 0;
+    *num_bytes = 0;
+    for (auto const& grid_kv : grids_) {
+      const DenseTsdfGrid::ConstPtr grid = grid_kv.second.lock();
+      if (grid == nullptr) continue;
+      (*num_grids)++;
+      *num_bytes += grid->getMemorySize();
+    }
+  }
+
+ private:
+  const float band_;
+  const float min_weight_;
+  std::map<SerSmId, std::weak_ptr<const DenseTsdfGrid>> grids_;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_BACKEND_DENSE_TSDF_GRID_H_
@@ -30,6 +30,10 @@ class NodeCollection {
     client_frame_node_map_.emplace(config.client_id, client_node_ptr);
   }
 
+  void removeClientNode(const CliId& cid) {
+    client_frame_node_map_.erase(cid);
+  }
+
   ClientFrameNode::Ptr getClientNodePtrById(const CliId& cid) const {
     auto it = client_frame_node_map_.find(cid);
     if (it != client_frame_node_map_.end()) {
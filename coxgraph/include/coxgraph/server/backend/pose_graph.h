@@ -1,9 +1,15 @@
 #ifndef COXGRAPH_SERVER_BACKEND_POSE_GRAPH_H_
 #define COXGRAPH_SERVER_BACKEND_POSE_GRAPH_H_
 
+#include <ceres/types.h>
+#include <ros/ros.h>
+
+#include <algorithm>
 #include <list>
 #include <map>
 #include <memory>
+#include <string>
+#include <thread>
 
 #include "coxgraph/common.h"
 #include "coxgraph/server/backend/client_frame_node.h"
@@ -14,21 +20,130 @@ namespace coxgraph {
 namespace server {
 class PoseGraph {
  public:
+  struct Config {
+    Config()
+        : linear_solver("auto"),
+          dense_max_parameter_blocks(64),
+          num_threads(0),
+          max_solver_time_in_seconds(4.0),
+          parameter_tolerance(3e-3),
+          max_num_iterations(50) {}
+    // Name of a ceres::LinearSolverType, or "auto" to use DENSE_SCHUR for
+    // problems with up to dense_max_parameter_blocks and SPARSE_SCHUR above
+    std::string linear_solver;
+    int32_t dense_max_parameter_blocks;
+    // Threads evaluating the residuals and factorizing, 0 uses one thread for
+    // dense problems with few residuals and all cores otherwise
+    int32_t num_threads;
+    double max_solver_time_in_seconds;
+    double parameter_tolerance;
+    int32_t max_num_iterations;
+
+    friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
+      s << std::endl
+        << "Pose Graph using Config:" << std::endl
+        << "  Linear Solver: " << v.linear_solver << std::endl
+        << "  Dense Max Parameter Blocks: " << v.dense_max_parameter_blocks
+        << std::endl
+        << "  Num Threads: "
+        << (v.num_threads > 0 ? std::to_string(v.num_threads) : "auto")
+        << std::endl
+        << "  Max Solver Time: " << v.max_solver_time_in_seconds << " s"
+        << std::endl
+        << "  Parameter Tolerance: " << v.parameter_tolerance << std::endl
+        << "  Max Num Iterations: " << v.max_num_iterations << std::endl
+        << "-------------------------------------------" << std::endl;
+      return (s);
+    }
+  };
+
+  static Config getConfigFromRosParam(const ros::NodeHandle& nh_private) {
+    Config config;
+    nh_private.param<std::string>("linear_solver", config.linear_solver,
+                                  config.linear_solver);
+    nh_private.param<int>("dense_max_parameter_blocks",
+                          config.dense_max_parameter_blocks,
+                          config.dense_max_parameter_blocks);
+    nh_private.param<int>("num_threads", config.num_threads,
+                          config.num_threads);
+    nh_private.param<double>("max_solver_time_in_seconds",
+                             config.max_solver_time_in_seconds,
+                             config.max_solver_time_in_seconds);
+    nh_private.param<double>("parameter_tolerance", config.parameter_tolerance,
+                             config.parameter_tolerance);
+    nh_private.param<int>("max_num_iterations", config.max_num_iterations,
+                          config.max_num_iterations);
+    ceres::LinearSolverType linear_solver_type;
+    CHECK(config.linear_solver == "auto" ||
+          ceres::StringToLinearSolverType(config.linear_solver,
+                                          &linear_solver_type))
+        << "Unknown linear solver " << config.linear_solver;
+    return config;
+  }
+
+  // Solver options for a problem of the given size
+  static ceres::Solver::Options getSolverOptions(const Config& config,
+                                                 int num_parameter_blocks,
+                                                 int num_residuals) {
+    ceres::Solver::Options ceres_options;
+    ceres_options.parameter_tolerance = config.parameter_tolerance;
+    ceres_options.max_num_iterations = config.max_num_iterations;
+    ceres_options.max_solver_time_in_seconds =
+        config.max_solver_time_in_seconds;
+    // Small graphs, like the client frame graph, are much faster to solve
+    // with the dense solvers
+    const bool dense =
+        num_parameter_blocks <= config.dense_max_parameter_blocks;
+    if (config.linear_solver == "auto") {
+      ceres_options.linear_solver_type =
+          dense ? ceres::LinearSolverType::DENSE_SCHUR
+                : ceres::LinearSolverType::SPARSE_SCHUR;
+    } else {
+      CHECK(ceres::StringToLinearSolverType(config.linear_solver,
+                                            &ceres_options.linear_solver_type));
+    }
+    // Registration residuals make evaluation worth spreading over threads,
+    // however few the submaps
+    const int kMaxSingleThreadResiduals = 1000;
+    if (config.num_threads > 0) {
+      ceres_options.num_threads = config.num_threads;
+    } else if (dense && num_residuals <= kMaxSingleThreadResiduals) {
+      ceres_options.num_threads = 1;
+    } else {
+      ceres_options.num_threads =
+          std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    return ceres_options;
+  }
+
   typedef std::shared_ptr<const PoseGraph> ConstPtr;
   typedef std::list<ceres::Solver::Summary> SolverSummaryList;
   typedef std::map<const CliId, const Transformation> PoseMap;
 
   PoseGraph() = default;
+  explicit PoseGraph(const Config& config) : config_(config) {}
   ~PoseGraph() = default;
 
   void addClientNode(const ClientFrameNode::Config& config) {
     node_collection_.addClientNode(config);
   }
+  // Constraints referring to the client have to be reset before the next
+  // optimization
+  void removeClientNode(const CliId& cid) {
+    node_collection_.removeClientNode(cid);
+  }
   bool hasClientNode(const CliId& cid) {
     auto ptr = node_collection_.getClientNodePtrById(cid);
     return ptr != nullptr;
   }
 
+  // Sets the pose the next optimization starts from
+  void setClientNodePose(const CliId& cid, const Transformation& pose) {
+    auto ptr = node_collection_.getClientNodePtrById(cid);
+    CHECK(ptr != nullptr);
+    ptr->setPose(pose);
+  }
+
   void addClientRelativePoseConstraint(
       const RelativePoseConstraint::Config& config) {
     constraint_collection_.addClientRelativePoseConstraint(config);
@@ -54,15 +169,10 @@ class PoseGraph {
     initialize();
 
     // Run the solver
-    ceres::Solver::Options ceres_options;
-    // TODO(victorr): Set these from parameters
     // TODO(victorr): Look into manual parameter block ordering
-    ceres_options.parameter_tolerance = 3e-3;
-    //  ceres_options.max_num_iterations = 4;
-    ceres_options.max_solver_time_in_seconds = 4;
-    ceres_options.num_threads = 4;
-    ceres_options.linear_solver_type = ceres::LinearSolverType::SPARSE_SCHUR;
-    // NOTE: For small problems DENSE_SCHUR is much faster
+    const ceres::Solver::Options ceres_options =
+        getSolverOptions(config_, problem_ptr_->NumParameterBlocks(),
+                         problem_ptr_->NumResiduals());
 
     ceres::Solver::Summary summary;
     ceres::Solve(ceres_options, problem_ptr_.get(), &summary);
@@ -72,6 +182,12 @@ class PoseGraph {
     solver_summaries_.emplace_back(summary);
   }
 
+  // Summary of the latest solve, call only after optimize()
+  const ceres::Solver::Summary& getLastSolverSummary() const {
+    CHECK(!solver_summaries_.empty());
+    return solver_summaries_.back();
+  }
+
   PoseMap getClientMapTf() {
     PoseMap client_map_tf;
     for (const auto& client_node_kv : node_collection_.getClientNodes()) {
@@ -82,6 +198,8 @@ class PoseGraph {
   }
 
  private:
+  const Config config_;
+
   NodeCollection node_collection_;
   ConstraintCollection constraint_collection_;
 
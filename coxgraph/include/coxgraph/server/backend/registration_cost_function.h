@@ -0,0 +1,196 @@
+#ifndef COXGRAPH_SERVER_BACKEND_REGISTRATION_COST_FUNCTION_H_
+#define COXGRAPH_SERVER_BACKEND_REGISTRATION_COST_FUNCTION_H_
+
+#include <ceres/ceres.h>
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "coxgraph/server/backend/dense_tsdf_grid.h"
+
+namespace coxgraph {
+namespace server {
+
+// Point near the surface of the reading submap, in its submap frame, with
+// the TSDF distance it has there
+struct RegistrationSample {
+  Eigen::Vector3f position;
+  float distance;
+};
+typedef std::vector<RegistrationSample> RegistrationSamples;
+
+/**
+ * @brief Registration of a reading submap to a reference submap. Each sample
+ * of the reading submap is moved into the reference submap, and its residual
+ * is the distance the dense grid of the reference submap has there minus the
+ * distance it has in the reading submap. Samples outside the band of the
+ * reference submap have zero residual and Jacobian.
+ *
+ * The parameter blocks are the 4 DoF poses [x, y, z, yaw] of the reading and
+ * the reference submap, in that order, as voxgraph nodes store them.
+ */
+class RegistrationCostFunction : public ceres::CostFunction {
+ public:
+  RegistrationCostFunction(
+      const std::shared_ptr<const RegistrationSamples>& reading_samples,
+      const DenseTsdfGrid::ConstPtr& reference_grid, double sqrt_weight)
+      : reading_samples_(reading_samples),
+        reference_grid_(reference_grid),
+        sqrt_weight_(sqrt_weight) {
+    CHECK_NOTNULL(reading_samples_.get());
+    CHECK_NOTNULL(reference_grid_.get());
+    CHECK(!reading_samples_->empty());
+    set_num_residuals(reading_samples_->size());
+    mutable_parameter_block_sizes()->push_back(kPoseSize);
+    mutable_parameter_block_sizes()->push_back(kPoseSize);
+  }
+
+  bool Evaluate(double const* const* parameters, double* residuals,
+                double** jacobians) const override {
+    const double* T_W_A = parameters[0];
+    const double* T_W_B = parameters[1];
+    const double cos_a = std::cos(T_W_A[3]), sin_a = std::sin(T_W_A[3]);
+    const double cos_b = std::cos(T_W_B[3]), sin_b = std::sin(T_W_B[3]);
+    double* jacobian_a =
+        jacobians != nullptr ? jacobians[0] : static_cast<double*>(nullptr);
+    double* jacobian_b =
+        jacobians != nullptr ? jacobians[1] : static_cast<double*>(nullptr);
+
+    for (size_t i = 0; i < reading_samples_->size(); ++i) {
+      const RegistrationSample& sample = (*reading_samples_)[i];
+      const double x = sample.position.x(), y = sample.position.y();
+
+      // p_B = R_B^T * (R_A * p_A + t_A - t_B), rotations about z only
+      const double q_x = cos_a * x - sin_a * y + T_W_A[0] - T_W_B[0];
+      const double q_y = sin_a * x + cos_a * y + T_W_A[1] - T_W_B[1];
+      const double q_z = sample.position.z() + T_W_A[2] - T_W_B[2];
+      const Eigen::Vector3f p_B(cos_b * q_x + sin_b * q_y,
+                                -sin_b * q_x + cos_b * q_y, q_z);
+
+      float distance;
+      Eigen::Vector3f gradient;
+      if (!reference_grid_->getDistanceAndGradient(
+              p_B, &distance, jacobians != nullptr ? &gradient : nullptr)) {
+        residuals[i] = 0.0;
+        if (jacobian_a != nullptr) {
+          std::fill(jacobian_a + i * kPoseSize,
+                    jacobian_a + (i + 1) * kPoseSize, 0.0);
+        }
+        if (jacobian_b != nullptr) {
+          std::fill(jacobian_b + i * kPoseSize,
+                    jacobian_b + (i + 1) * kPoseSize, 0.0);
+        }
+        continue;
+      }
+      residuals[i] = sqrt_weight_ * (distance - sample.distance);
+      if (jacobians == nullptr) continue;
+
+      // Gradient w.r.t. the point in the frame both submaps are posed in,
+      // g_W = R_B * g_B
+      const double g_x =
+          sqrt_weight_ * (cos_b * gradient.x() - sin_b * gradient.y());
+      const double g_y =
+          sqrt_weight_ * (sin_b * gradient.x() + cos_b * gradient.y());
+      const double g_z = sqrt_weight_ * gradient.z();
+      if (jacobian_a != nullptr) {
+        double* row = jacobian_a + i * kPoseSize;
+        row[0] = g_x;
+        row[1] = g_y;
+        row[2] = g_z;
+        // d(R_A * p_A) / d yaw_A
+        row[3] =
+            g_x * (-sin_a * x - cos_a * y) + g_y * (cos_a * x - sin_a * y);
+      }
+      if (jacobian_b != nullptr) {
+        double* row = jacobian_b + i * kPoseSize;
+        row[0] = -g_x;
+        row[1] = -g_y;
+        row[2] = -g_z;
+        // d(R_B^T * q) / d yaw_B, with the gradient in frame B
+        row[3] = sqrt_weight_ *
+                 (gradient.x() * (-sin_b * q_x + cos_b * q_y) +
+                  gradient.y() * (-cos_b * q_x - sin_b * q_y));
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief Samples of the reading submap that land within margin of the box
+   * of the reference grid at the relative pose T_B_A, the others can't have
+   * a residual as long as the relative pose moves them by less than margin.
+   * Returns the distance from the reading submap origin to the farthest kept
+   * sample, which bounds how far a rotation moves them.
+   */
+  static float cropSamples(const RegistrationSamples& samples,
+                           const Transformation& T_B_A,
+                           const DenseTsdfGrid& reference_grid, float margin,
+                           RegistrationSamples* cropped_samples) {
+    CHECK_NOTNULL(cropped_samples);
+    cropped_samples->clear();
+    Eigen::Vector3f min, max;
+    reference_grid.getBounds(&min, &max);
+    min.array() -= margin;
+    max.array() += margin;
+    float radius = 0.0f;
+    for (const RegistrationSample& sample : samples) {
+      const Eigen::Vector3f p_B = T_B_A * sample.position;
+      if ((p_B.array() < min.array()).any() ||
+          (p_B.array() > max.array()).any()) {
+        continue;
+      }
+      cropped_samples->push_back(sample);
+      radius = std::max(radius, sample.position.norm());
+    }
+    return radius;
+  }
+
+  /**
+   * @brief Samples of a submap for registration: the centers of the voxels
+   * observed with at least min_weight and at most max_distance from the
+   * surface, every 1 / sampling_ratio th of them. Positions are packed in
+   * one array, so a cost function evaluation streams through them.
+   */
+  static void getSamples(const DenseTsdfGrid::TsdfLayer& tsdf_layer,
+                         float max_distance, float min_weight,
+                         float sampling_ratio, RegistrationSamples* samples) {
+    CHECK_NOTNULL(samples);
+    CHECK_GT(sampling_ratio, 0.0f);
+    samples->clear();
+    voxblox::BlockIndexList block_indices;
+    tsdf_layer.getAllAllocatedBlocks(&block_indices);
+    // Deterministic, so that a submap always gets the same samples
+    float sampling_accumulator = 0.0f;
+    for (const voxblox::BlockIndex& block_index : block_indices) {
+      const voxblox::Block<voxblox::TsdfVoxel>& block =
+          tsdf_layer.getBlockByIndex(block_index);
+      for (size_t i = 0; i < block.num_voxels(); ++i) {
+        const voxblox::TsdfVoxel& voxel = block.getVoxelByLinearIndex(i);
+        if (voxel.weight <= 0.0f || voxel.weight < min_weight ||
+            std::abs(voxel.distance) > max_distance) {
+          continue;
+        }
+        sampling_accumulator += sampling_ratio;
+        if (sampling_accumulator < 1.0f) continue;
+        sampling_accumulator -= 1.0f;
+        samples->push_back(
+            {block.computeCoordinatesFromLinearIndex(i), voxel.distance});
+      }
+    }
+  }
+
+ private:
+  // Not a static member, push_back() would need its definition
+  enum : int { kPoseSize = 4 };
+
+  const std::shared_ptr<const RegistrationSamples> reading_samples_;
+  const DenseTsdfGrid::ConstPtr reference_grid_;
+  const double sqrt_weight_;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_BACKEND_REGISTRATION_COST_FUNCTION_H_
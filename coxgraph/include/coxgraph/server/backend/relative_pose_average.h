@@ -0,0 +1,112 @@
+#ifndef COXGRAPH_SERVER_BACKEND_RELATIVE_POSE_AVERAGE_H_
+#define COXGRAPH_SERVER_BACKEND_RELATIVE_POSE_AVERAGE_H_
+
+#include <Eigen/Geometry>
+
+#include <cmath>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Weighted average of relative pose measurements in 4DoF (x, y, z and
+ * yaw), as used by the pose graph constraints. Translations are averaged
+ * arithmetically and yaws as the circular mean, which is the closed-form
+ * least squares solution for one pair of frames.
+ *
+ * Only running sums are kept, so adding a measurement is O(1) and the
+ * average is available at any time.
+ */
+class RelativePoseAverage {
+ public:
+  RelativePoseAverage()
+      : weight_(0.0),
+        num_pairs_(0),
+        weighted_translation_(Eigen::Vector3d::Zero()),
+        weighted_cos_(0.0),
+        weighted_sin_(0.0) {}
+
+  void add(const Transformation& T, double weight = 1.0) {
+    const double yaw = getYaw(T);
+    weight_ += weight;
+    num_pairs_++;
+    weighted_translation_ += weight * T.getPosition().cast<double>();
+    weighted_cos_ += weight * std::cos(yaw);
+    weighted_sin_ += weight * std::sin(yaw);
+  }
+
+  /**
+   * @brief Adds the products T_A_X[i] * T_X_B[j] of all i, j with unit
+   * weight, in O(|T_A_X| + |T_X_B|) instead of O(|T_A_X| * |T_X_B|).
+   *
+   * The translations of the products are bilinear in the inputs, so their sum
+   * factorizes exactly. The yaw of a product is the sum of the yaws for
+   * gravity aligned frames, so the sums of its cosine and sine factorize too.
+   */
+  void addProducts(const TransformationVector& T_A_X,
+                   const TransformationVector& T_X_B) {
+    if (T_A_X.empty() || T_X_B.empty()) return;
+    Eigen::Vector3d sum_t_A_X = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d sum_R_A_X = Eigen::Matrix3d::Zero();
+    double sum_cos_A_X = 0.0, sum_sin_A_X = 0.0;
+    for (auto const& T : T_A_X) {
+      const double yaw = getYaw(T);
+      sum_t_A_X += T.getPosition().cast<double>();
+      sum_R_A_X += T.getRotationMatrix().cast<double>();
+      sum_cos_A_X += std::cos(yaw);
+      sum_sin_A_X += std::sin(yaw);
+    }
+    Eigen::Vector3d sum_t_X_B = Eigen::Vector3d::Zero();
+    double sum_cos_X_B = 0.0, sum_sin_X_B = 0.0;
+    for (auto const& T : T_X_B) {
+      const double yaw = getYaw(T);
+      sum_t_X_B += T.getPosition().cast<double>();
+      sum_cos_X_B += std::cos(yaw);
+      sum_sin_X_B += std::sin(yaw);
+    }
+
+    weight_ += static_cast<double>(T_A_X.size()) * T_X_B.size();
+    num_pairs_++;
+    weighted_translation_ +=
+        static_cast<double>(T_X_B.size()) * sum_t_A_X + sum_R_A_X * sum_t_X_B;
+    weighted_cos_ += sum_cos_A_X * sum_cos_X_B - sum_sin_A_X * sum_sin_X_B;
+    weighted_sin_ += sum_sin_A_X * sum_cos_X_B + sum_cos_A_X * sum_sin_X_B;
+  }
+
+  bool empty() const { return weight_ <= 0.0; }
+
+  double getWeight() const { return weight_; }
+
+  // Number of add() and addProducts() calls, the products of one call stem
+  // from the same pair of submaps and aren't independent measurements
+  int getNumPairs() const { return num_pairs_; }
+
+  Transformation getAverage() const {
+    CHECK(!empty());
+    const double yaw = std::atan2(weighted_sin_, weighted_cos_);
+    const Eigen::Quaterniond q_yaw(
+        Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()));
+    return Transformation(
+        Transformation::Rotation(q_yaw.cast<voxblox::FloatingPoint>()),
+        (weighted_translation_ / weight_).cast<voxblox::FloatingPoint>());
+  }
+
+ private:
+  static inline double getYaw(const Transformation& T) {
+    const Eigen::Matrix3d R = T.getRotationMatrix().cast<double>();
+    return std::atan2(R(1, 0), R(0, 0));
+  }
+
+  double weight_;
+  int num_pairs_;
+  Eigen::Vector3d weighted_translation_;
+  double weighted_cos_;
+  double weighted_sin_;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_BACKEND_RELATIVE_POSE_AVERAGE_H_
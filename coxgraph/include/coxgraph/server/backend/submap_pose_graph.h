@@ -0,0 +1,266 @@
+#ifndef COXGRAPH_SERVER_BACKEND_SUBMAP_POSE_GRAPH_H_
+#define COXGRAPH_SERVER_BACKEND_SUBMAP_POSE_GRAPH_H_
+
+#include <ceres/ceres.h>
+#include <voxgraph/backend/local_parameterization/angle_local_parameterization.h>
+#include <voxgraph/backend/node/submap_node.h>
+
+#include <array>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "coxgraph/common.h"
+#include "coxgraph/server/backend/pose_graph.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Pose graph of the server's submaps that keeps its Ceres problem
+ * alive across optimizations. Nodes and constraints go into the problem when
+ * they are added, and a constraint that changes or goes away only replaces or
+ * removes its own residual block, so a solve starts from the previous
+ * solution without rebuilding the problem.
+ *
+ * Constraints are keyed by their type and submap pair, a pair has at most one
+ * constraint of each type. The graph owns the cost functions, copies of the
+ * graph share them.
+ */
+class SubmapPoseGraph {
+ public:
+  typedef std::pair<SerSmId, SerSmId> SerSmIdPair;
+  typedef std::map<SerSmId, Transformation> PoseMap;
+  typedef std::list<ceres::Solver::Summary> SolverSummaryList;
+
+  enum class ConstraintType { LoopClosure = 0, SubmapRelPose, Registration };
+
+  explicit SubmapPoseGraph(const PoseGraph::Config& config)
+      : config_(config),
+        local_parameterization_(
+            std::make_shared<ceres::ProductParameterization>(
+                new ceres::IdentityParameterization(3),
+                voxgraph::AngleLocalParameterization::Create())),
+        registration_enabled_(true),
+        node_id_counter_(0) {
+    resetProblem();
+  }
+
+  // Deep copy with a problem of its own, e.g. for a pose graph on an overlay
+  // of the submap collection. Cost functions are shared, they never change.
+  SubmapPoseGraph(const SubmapPoseGraph& rhs)
+      : config_(rhs.config_),
+        local_parameterization_(rhs.local_parameterization_),
+        constraints_(rhs.constraints_),
+        registration_enabled_(rhs.registration_enabled_),
+        node_id_counter_(rhs.node_id_counter_) {
+    resetProblem();
+    for (auto const& node_kv : rhs.nodes_) {
+      voxgraph::SubmapNode::Config node_config = node_kv.second.config;
+      node_config.T_I_node_initial = node_kv.second.node_ptr->getPose();
+      addNodeToProblem(node_kv.second.node_id, node_config);
+    }
+    for (size_t type_i = 0; type_i < constraints_.size(); ++type_i) {
+      if (!isInProblem(static_cast<ConstraintType>(type_i))) continue;
+      for (auto& constraint_kv : constraints_[type_i]) {
+        addResidualBlock(constraint_kv.first, &constraint_kv.second);
+      }
+    }
+  }
+
+  SubmapPoseGraph& operator=(const SubmapPoseGraph&) = delete;
+  ~SubmapPoseGraph() = default;
+
+  void addSubmapNode(const voxgraph::SubmapNode::Config& config) {
+    CHECK(!hasSubmapNode(config.submap_id))
+        << "Submap " << config.submap_id << " already has a node";
+    addNodeToProblem(node_id_counter_++, config);
+  }
+
+  bool hasSubmapNode(const SerSmId& submap_id) const {
+    return nodes_.count(submap_id) > 0;
+  }
+
+  // Adds the constraint, or replaces the one of the same type between the
+  // submaps. Takes ownership of the cost function, whose parameter blocks are
+  // the poses of the first and the second submap.
+  void setConstraint(ConstraintType type, const SerSmIdPair& submap_pair,
+                     ceres::CostFunction* cost_function) {
+    CHECK_NOTNULL(cost_function);
+    CHECK(hasSubmapNode(submap_pair.first) && hasSubmapNode(submap_pair.second))
+        << "Constraint between submaps " << submap_pair.first << " and "
+        << submap_pair.second << " without nodes";
+    removeConstraint(type, submap_pair);
+    Constraint& constraint = getConstraints(type)[submap_pair];
+    constraint.cost_function.reset(cost_function);
+    if (isInProblem(type)) addResidualBlock(submap_pair, &constraint);
+  }
+
+  // Returns false if there was no such constraint
+  bool removeConstraint(ConstraintType type, const SerSmIdPair& submap_pair) {
+    ConstraintMap& constraints = getConstraints(type);
+    auto constraint_it = constraints.find(submap_pair);
+    if (constraint_it == constraints.end()) return false;
+    if (constraint_it->second.residual_block_id != nullptr) {
+      problem_ptr_->RemoveResidualBlock(
+          constraint_it->second.residual_block_id);
+    }
+    constraints.erase(constraint_it);
+    return true;
+  }
+
+  bool hasConstraint(ConstraintType type,
+                     const SerSmIdPair& submap_pair) const {
+    return getConstraints(type).count(submap_pair) > 0;
+  }
+
+  size_t getNumConstraints(ConstraintType type) const {
+    return getConstraints(type).size();
+  }
+
+  // Submap pairs of the constraints of a type, in ascending order
+  std::vector<SerSmIdPair> getConstraintPairs(ConstraintType type) const {
+    std::vector<SerSmIdPair> submap_pairs;
+    submap_pairs.reserve(getConstraints(type).size());
+    for (auto const& constraint_kv : getConstraints(type)) {
+      submap_pairs.emplace_back(constraint_kv.first);
+    }
+    return submap_pairs;
+  }
+
+  // Takes the registration residuals out of the problem, or puts them back.
+  // They keep their cost functions meanwhile, with their samples and grids.
+  void setRegistrationEnabled(bool enabled) {
+    if (enabled == registration_enabled_) return;
+    registration_enabled_ = enabled;
+    for (auto& constraint_kv : getConstraints(ConstraintType::Registration)) {
+      if (enabled) {
+        addResidualBlock(constraint_kv.first, &constraint_kv.second);
+      } else {
+        problem_ptr_->RemoveResidualBlock(
+            constraint_kv.second.residual_block_id);
+        constraint_kv.second.residual_block_id = nullptr;
+      }
+    }
+  }
+
+  void optimize() {
+    // Ceres evaluates the residual blocks, one per constraint, on
+    // config_.num_threads threads
+    const ceres::Solver::Options ceres_options = PoseGraph::getSolverOptions(
+        config_, problem_ptr_->NumParameterBlocks(),
+        problem_ptr_->NumResiduals());
+    ceres::Solver::Summary summary;
+    ceres::Solve(ceres_options, problem_ptr_.get(), &summary);
+
+    std::cout << summary.BriefReport() << std::endl;
+    solver_summaries_.emplace_back(summary);
+  }
+
+  // Summary of the latest solve, call only after optimize()
+  const ceres::Solver::Summary& getLastSolverSummary() const {
+    CHECK(!solver_summaries_.empty());
+    return solver_summaries_.back();
+  }
+
+  PoseMap getSubmapPoses() const {
+    PoseMap submap_poses;
+    for (auto const& node_kv : nodes_) {
+      submap_poses.emplace(node_kv.first, node_kv.second.node_ptr->getPose());
+    }
+    return submap_poses;
+  }
+
+  // Residuals of all constraints of a type at the current poses, empty if
+  // the type has none or isn't in the problem
+  std::vector<double> evaluateResiduals(ConstraintType type) {
+    std::vector<double> residuals;
+    if (!isInProblem(type) || getConstraints(type).empty()) return residuals;
+    ceres::Problem::EvaluateOptions evaluate_options;
+    for (auto const& constraint_kv : getConstraints(type)) {
+      evaluate_options.residual_blocks.emplace_back(
+          constraint_kv.second.residual_block_id);
+    }
+    problem_ptr_->Evaluate(evaluate_options, nullptr, &residuals, nullptr,
+                           nullptr);
+    return residuals;
+  }
+
+ private:
+  struct Node {
+    voxgraph::Node::NodeId node_id;
+    voxgraph::SubmapNode::Config config;
+    std::shared_ptr<voxgraph::SubmapNode> node_ptr;
+  };
+
+  struct Constraint {
+    std::shared_ptr<ceres::CostFunction> cost_function;
+    // nullptr while the constraint isn't in the problem
+    ceres::ResidualBlockId residual_block_id = nullptr;
+  };
+  typedef std::map<SerSmIdPair, Constraint> ConstraintMap;
+
+  static constexpr ceres::LossFunction* kNoRobustLossFunction = nullptr;
+
+  void resetProblem() {
+    ceres::Problem::Options problem_options;
+    problem_options.cost_function_ownership =
+        ceres::Ownership::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.local_parameterization_ownership =
+        ceres::Ownership::DO_NOT_TAKE_OWNERSHIP;
+    // Removing a residual block would otherwise scan the whole problem
+    problem_options.enable_fast_removal = true;
+    problem_ptr_.reset(new ceres::Problem(problem_options));
+  }
+
+  void addNodeToProblem(voxgraph::Node::NodeId node_id,
+                        const voxgraph::SubmapNode::Config& config) {
+    Node& node = nodes_[config.submap_id];
+    node.node_id = node_id;
+    node.config = config;
+    node.node_ptr = std::make_shared<voxgraph::SubmapNode>(node_id, config);
+    node.node_ptr->addToProblem(problem_ptr_.get(),
+                                local_parameterization_.get());
+  }
+
+  void addResidualBlock(const SerSmIdPair& submap_pair,
+                        Constraint* constraint) {
+    constraint->residual_block_id = problem_ptr_->AddResidualBlock(
+        constraint->cost_function.get(), kNoRobustLossFunction,
+        nodes_.at(submap_pair.first).node_ptr->getPosePtr()
+            ->optimizationVectorData(),
+        nodes_.at(submap_pair.second).node_ptr->getPosePtr()
+            ->optimizationVectorData());
+  }
+
+  bool isInProblem(ConstraintType type) const {
+    return type != ConstraintType::Registration || registration_enabled_;
+  }
+
+  ConstraintMap& getConstraints(ConstraintType type) {
+    return constraints_[static_cast<size_t>(type)];
+  }
+  const ConstraintMap& getConstraints(ConstraintType type) const {
+    return constraints_[static_cast<size_t>(type)];
+  }
+
+  const PoseGraph::Config config_;
+  std::shared_ptr<ceres::LocalParameterization> local_parameterization_;
+
+  std::map<SerSmId, Node> nodes_;
+  // Indexed by ConstraintType
+  std::array<ConstraintMap, 3> constraints_;
+  bool registration_enabled_;
+  voxgraph::Node::NodeId node_id_counter_;
+
+  std::unique_ptr<ceres::Problem> problem_ptr_;
+  SolverSummaryList solver_summaries_;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_BACKEND_SUBMAP_POSE_GRAPH_H_
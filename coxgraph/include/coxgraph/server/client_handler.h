@@ -1,25 +1,34 @@
 #ifndef COXGRAPH_SERVER_CLIENT_HANDLER_H_
 #define COXGRAPH_SERVER_CLIENT_HANDLER_H_
 
-#include <coxgraph_msgs/ClientSubmap.h>
-#include <coxgraph_msgs/ClientSubmapSrv.h>
+#include <coxgraph_msgs/ClientSubmapChunk.h>
 #include <coxgraph_msgs/MapPoseUpdates.h>
 #include <coxgraph_msgs/MapTransform.h>
 #include <coxgraph_msgs/MeshWithTrajectory.h>
+#include <coxgraph_msgs/PackedMeshWithTrajectory.h>
+#include <coxgraph_msgs/SubmapChunkSrv.h>
 #include <coxgraph_msgs/TimeLine.h>
 #include <ros/ros.h>
 #include <voxgraph_msgs/LoopClosure.h>
 #include <Eigen/Dense>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "coxgraph/common.h"
+#include "coxgraph/server/submap_cache.h"
 #include "coxgraph/server/submap_collection.h"
 #include "coxgraph/server/visualizer/mesh_collection.h"
 #include "coxgraph/utils/eval_data_publisher.h"
+#include "coxgraph/utils/mesh_pack_codec.h"
 #include "coxgraph/utils/msg_converter.h"
 
 namespace coxgraph {
@@ -63,16 +72,18 @@ class ClientHandler {
                 const CliSmConfig& submap_config,
                 const SubmapCollection::Ptr& submap_collection_ptr,
                 MeshCollection::Ptr mesh_collection_ptr,
+                SubmapCache::Ptr submap_cache_ptr,
                 TimeLineUpdateCallback time_line_callback)
       : ClientHandler(nh, nh_private, client_id, map_frame_prefix,
                       submap_config, getConfigFromRosParam(nh_private),
                       submap_collection_ptr, mesh_collection_ptr,
-                      time_line_callback) {}
+                      submap_cache_ptr, time_line_callback) {}
   ClientHandler(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private,
                 const CliId& client_id, std::string map_frame_prefix,
                 const CliSmConfig& submap_config, const Config& config,
                 const SubmapCollection::Ptr& submap_collection_ptr,
                 MeshCollection::Ptr mesh_collection_ptr,
+                SubmapCache::Ptr submap_cache_ptr,
                 TimeLineUpdateCallback time_line_callback)
       : client_id_(client_id),
         nh_(nh),
@@ -88,12 +99,22 @@ class ClientHandler {
         time_line_update_callback_(time_line_callback),
         eval_data_pub_(nh, nh_private),
         submap_collection_ptr_(submap_collection_ptr),
-        mesh_collection_ptr_(mesh_collection_ptr) {
+        mesh_collection_ptr_(mesh_collection_ptr),
+        submap_cache_ptr_(submap_cache_ptr) {
+    CHECK(submap_cache_ptr_ != nullptr);
     subscribeToTopics();
     advertiseTopics();
     subscribeToServices();
+    io_thread_ = std::thread(&ClientHandler::ioLoop, this);
+  }
+  virtual ~ClientHandler() {
+    {
+      std::lock_guard<std::mutex> io_lock(io_mutex_);
+      io_shutdown_ = true;
+    }
+    io_cv_.notify_all();
+    io_thread_.join();
   }
-  virtual ~ClientHandler() = default;
 
   inline const Config& getConfig() const { return config_; }
 
@@ -108,12 +129,58 @@ class ClientHandler {
                                const SerSmId& ser_sid, CliSmId* cli_sid,
                                CliSm::Ptr* submap, Transformation* T_Sm_C_t);
 
-  bool requestAllSubmaps(std::vector<CliSmPack>* submap_packs,
+  struct SubmapRequest {
+    ReqState state = ReqState::FAILED;
+    CliSmId cli_sid;
+    CliSm::Ptr submap;
+    Transformation T_Sm_C_t;
+  };
+  // Same as requestSubmapByTime, but the transfer and deserialization run on
+  // the I/O thread of this client. Timestamps ahead of the client time line
+  // resolve immediately to FUTURE.
+  std::future<SubmapRequest> requestSubmapByTimeAsync(
+      const ros::Time& timestamp, const SerSmId& ser_sid);
+
+  // Called for every submap of a transfer as soon as its last chunk arrived
+  typedef std::function<void(const CliSmPack&)> SubmapPackCallback;
+  // Hands the submaps over one by one, so a transfer never holds more than
+  // the submap being received
+  bool requestAllSubmaps(const SubmapPackCallback& submap_pack_callback,
                          SerSmId* start_ser_sm_id);
 
   bool requestPoseHistory(const std::string& file_path,
                           PoseStampedVector* pose_history);
 
+  // What this client costs the server, in traffic, time and memory
+  struct ResourceUsage {
+    uint64_t submap_bytes_received = 0;
+    uint64_t mesh_bytes_received = 0;
+    uint32_t submaps_received = 0;
+    double transfer_time = 0.0;
+    uint32_t submaps_in_collection = 0;
+    uint64_t collection_memory_bytes = 0;
+    // Map fusions with this client solved in the pose graph, and the sum of
+    // their latencies from acceptance to solve
+    uint32_t map_fusions_solved = 0;
+    double fusion_latency = 0.0;
+  };
+  ResourceUsage getResourceUsage() {
+    std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+    return resource_usage_;
+  }
+  // Accounts a submap of this client added to the server collection
+  void addCollectionSubmap(const CliSm& submap) {
+    std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+    resource_usage_.submaps_in_collection++;
+    resource_usage_.collection_memory_bytes +=
+        submap.getTsdfMap().getTsdfLayer().getMemorySize();
+  }
+  void addFusionLatency(double latency) {
+    std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+    resource_usage_.map_fusions_solved++;
+    resource_usage_.fusion_latency += latency;
+  }
+
   inline bool hasTime(const ros::Time time) { return time_line_.hasTime(time); }
   inline bool isTimeLineUpdated() const { return time_line_updated_; }
   inline void resetTimeLineUpdated() { time_line_updated_ = false; }
@@ -147,6 +214,30 @@ class ClientHandler {
   void advertiseTopics();
   void subscribeToServices();
 
+  // Pulls a submap transfer from the client chunk by chunk, building up the
+  // submaps as their chunks arrive. Submaps in skip_cli_sm_ids are received
+  // but neither built nor handed over.
+  bool pullSubmapStream(uint8_t mode, const ros::Time& timestamp,
+                        SerSmId* ser_sm_id,
+                        const SubmapPackCallback& submap_pack_callback,
+                        Transformation* T_Sm_C_t);
+  bool pullSubmapStream(uint8_t mode, const ros::Time& timestamp,
+                        bool use_cache,
+                        const std::set<CliSmId>& skip_cli_sm_ids,
+                        SerSmId* ser_sm_id,
+                        const SubmapPackCallback& submap_pack_callback,
+                        Transformation* T_Sm_C_t, bool* cache_missed);
+  bool callSubmapChunkService(coxgraph_msgs::SubmapChunkSrv* chunk_srv);
+
+  // Requests to the client run one after the other on the I/O thread
+  void ioLoop();
+  void postIoTask(std::function<void()> task);
+  std::thread io_thread_;
+  std::deque<std::function<void()>> io_tasks_;
+  std::mutex io_mutex_;
+  std::condition_variable io_cv_;
+  bool io_shutdown_ = false;
+
   const CliId client_id_;
   const std::string client_node_name_;
   const std::string log_prefix_;
@@ -166,8 +257,8 @@ class ClientHandler {
   ros::Publisher sm_pose_tf_pub_;
   ros::Subscriber time_line_sub_;
   ros::Subscriber sm_pose_updates_sub_;
-  ros::ServiceClient pub_client_submap_client_;
-  ros::ServiceClient get_all_submaps_client_;
+  ros::ServiceClient get_submap_chunk_client_;
+  uint32_t next_transfer_id_ = 0;
   ros::ServiceClient get_pose_history_client_;
 
   Transformer transformer_;
@@ -176,21 +267,44 @@ class ClientHandler {
 
   std::mutex submap_request_mutex_;
 
+  ResourceUsage resource_usage_;
+  std::mutex resource_usage_mutex_;
+
   TimeLineUpdateCallback time_line_update_callback_;
 
   utils::EvalDataPublisher eval_data_pub_;
 
   MeshCollection::Ptr mesh_collection_ptr_;
+  SubmapCache::Ptr submap_cache_ptr_;
   ros::Subscriber submap_mesh_sub_;
+  ros::Subscriber packed_submap_mesh_sub_;
+  void packedSubmapMeshCallback(
+      const coxgraph_msgs::PackedMeshWithTrajectory& packed_mesh_msg);
   void submapMeshCallback(
       const coxgraph_msgs::MeshWithTrajectory& mesh_with_traj) {
+    const uint32_t mesh_size =
+        ros::serialization::serializationLength(mesh_with_traj);
+    eval_data_pub_.publishBandwidth(
+        client_node_name_ + "/submap_mesh_with_traj", mesh_size,
+        ros::Time::now(), ros::Time::now());
+    {
+      std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+      resource_usage_.mesh_bytes_received += mesh_size;
+    }
+    addSubmapMesh(mesh_with_traj);
+  }
+  void addSubmapMesh(const coxgraph_msgs::MeshWithTrajectory& mesh_with_traj) {
     CIdCSIdPair csid_pair =
         utils::resolveSubmapFrame(mesh_with_traj.mesh.header.frame_id);
     CHECK_EQ(csid_pair.first, client_id_);
     LOG(INFO) << log_prefix_ << " Received mesh of submap " << csid_pair.second;
-    mesh_collection_ptr_->addSubmapMesh(client_id_, csid_pair.second,
-                                        mesh_with_traj);
+    if (mesh_collection_ptr_->addSubmapMesh(client_id_, csid_pair.second,
+                                            mesh_with_traj)) {
+      requestMeshResync(csid_pair.second);
+    }
   }
+  void requestMeshResync(CliSmId csid);
+  ros::Publisher mesh_resync_pub_;
 
   constexpr static int8_t kSubQueueSize = 10;
 };
@@ -1,50 +1,103 @@
 #ifndef COXGRAPH_SERVER_CLIENT_TF_OPTIMIZER_H_
 #define COXGRAPH_SERVER_CLIENT_TF_OPTIMIZER_H_
 
+#include <coxgraph_msgs/SolverSummary.h>
 #include <ros/ros.h>
 
 #include <map>
+#include <set>
+#include <utility>
 
 #include "coxgraph/common.h"
 #include "coxgraph/server/backend/client_frame_node.h"
 #include "coxgraph/server/backend/pose_graph.h"
+#include "coxgraph/server/backend/relative_pose_average.h"
 #include "coxgraph/utils/ros_params.h"
 
 namespace coxgraph {
 namespace server {
 
+/**
+ * @brief Estimates the client map frames in the global frame from relative
+ * pose measurements between client maps.
+ *
+ * Measurements are reduced to one running average per client pair. The
+ * client frames are then chained in closed form along a maximum weight
+ * spanning tree rooted at the fixed client 0. Optionally, the closed-form
+ * result seeds a Ceres refinement with one constraint per client pair, which
+ * also distributes the error around loops of three or more clients.
+ */
 class ClientTfOptimizer {
  public:
   using PoseMap = PoseGraph::PoseMap;
 
   ClientTfOptimizer(const ros::NodeHandle& nh_private, bool verbose)
-      : verbose_(verbose) {
+      : verbose_(verbose),
+        ceres_refinement_(false),
+        pose_graph_(PoseGraph::getConfigFromRosParam(
+            ros::NodeHandle(nh_private, "client_tf_solver"))) {
     utils::setInformationMatrixFromRosParams(
         ros::NodeHandle(nh_private,
                         "client_map_relative_pose/information_matrix"),
         &cli_rp_info_matrix_);
+    nh_private.param<bool>("client_tf_solver/ceres_refinement",
+                           ceres_refinement_, ceres_refinement_);
+    ros::NodeHandle nh_pub(nh_private);
+    solver_summary_pub_ = nh_pub.advertise<coxgraph_msgs::SolverSummary>(
+        "client_tf_solver_summary", 10);
   }
 
   void addClient(const CliId& cid, const Transformation& pose);
 
-  void addClientRelativePoseMeasurement(const CliId& first_cid,
-                                        const CliId& second_cid,
-                                        const Transformation& T_C1_C2);
+  // Also drops the measurements of the client
+  void removeClient(const CliId& cid);
+
+  bool hasClient(const CliId& cid) const { return client_poses_.count(cid); }
+
+  // Adds the measurements T_C1_X[i] * T_X_C2[j] for all i, j, in linear time.
+  // Measurements involving clients that weren't added are ignored.
+  void addClientRelativePoseMeasurements(const CliId& first_cid,
+                                         const CliId& second_cid,
+                                         const TransformationVector& T_C1_X,
+                                         const TransformationVector& T_X_C2);
 
   void resetClientRelativePoseConstraints() {
-    pose_graph_.resetClientRelativePoseConstraint();
+    relative_pose_averages_.clear();
   }
 
-  void optimize() { pose_graph_.optimize(); }
+  // Solves in closed form and, if enabled, refines with Ceres. Publishes a
+  // solver summary for each of the two solves.
+  void optimize();
 
-  PoseMap getClientMapTfs() { return pose_graph_.getClientMapTf(); }
+  // Poses of the clients connected to client 0 in the last optimization
+  PoseMap getClientMapTfs() const {
+    PoseMap client_map_tfs;
+    for (const CliId& cid : fused_clients_) {
+      client_map_tfs.emplace(cid, client_poses_.at(cid));
+    }
+    return client_map_tfs;
+  }
 
  private:
+  typedef std::pair<CliId, CliId> CliIdPair;
+
+  void refineWithCeres();
+  void publishClosedFormSummary(double solve_time);
+  void publishSolverSummary();
+
   bool verbose_;
+  bool ceres_refinement_;
 
   PoseGraph pose_graph_;
 
   InformationMatrix cli_rp_info_matrix_;
+
+  // Keyed by (origin, destination) with origin < destination
+  std::map<CliIdPair, RelativePoseAverage> relative_pose_averages_;
+  std::map<CliId, Transformation> client_poses_;
+  std::set<CliId> fused_clients_;
+
+  ros::Publisher solver_summary_pub_;
 };
 
 }  // namespace server
@@ -1,10 +1,13 @@
 #ifndef COXGRAPH_SERVER_COXGRAPH_SERVER_H_
 #define COXGRAPH_SERVER_COXGRAPH_SERVER_H_
 
+#include <coxgraph_msgs/ClientResourceUsage.h>
 #include <coxgraph_msgs/ControlTrigger.h>
+#include <coxgraph_msgs/DeregisterClient.h>
 #include <coxgraph_msgs/FilePath.h>
 #include <coxgraph_msgs/MapFusion.h>
 #include <coxgraph_msgs/NeedToFuseSrv.h>
+#include <coxgraph_msgs/RegisterClient.h>
 #include <ros/ros.h>
 #include <voxblox_ros/ros_params.h>
 #include <voxgraph/frontend/pose_graph_interface/pose_graph_interface.h>
@@ -15,11 +18,12 @@
 #include <voxgraph/tools/visualization/submap_visuals.h>
 #include <voxgraph_msgs/LoopClosure.h>
 
-#include <deque>
+#include <atomic>
 #include <future>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -28,17 +32,33 @@
 #include "coxgraph/server/client_handler.h"
 #include "coxgraph/server/distribution/distribution_controller.h"
 #include "coxgraph/server/global_tf_controller.h"
+#include "coxgraph/server/map_fusion_scheduler.h"
 #include "coxgraph/server/pose_graph_interface.h"
+#include "coxgraph/server/submap_cache.h"
 #include "coxgraph/server/submap_collection.h"
 #include "coxgraph/server/visualizer/server_visualizer.h"
+#include "coxgraph/utils/work_queue.h"
 
 namespace coxgraph {
 
 class CoxgraphServer {
  public:
+  // What happens to the submaps of a client that left. Frozen submaps stay in
+  // the pose graph and keep their constraints, evicted ones are dropped from
+  // everything but the pose graph, see evictClient().
+  enum class ClientLeavePolicy { FREEZE, EVICT };
+
   struct Config {
+    // Clients registered at startup, more can register at run time
     int32_t client_number = 0;
+    // Client ids go from 0 to max_client_number - 1, registrations beyond
+    // are rejected. Every client adds an I/O thread, topics and per client
+    // state, and the scaling test covers up to 32.
+    int32_t max_client_number = 32;
+    ClientLeavePolicy client_leave_policy = ClientLeavePolicy::FREEZE;
     int32_t map_fusion_queue_size = 10;
+    int32_t map_fusion_pipeline_queue_size = 4;
+    ros::Duration optimization_interval = ros::Duration(1);
     ros::Duration refuse_interval = ros::Duration(2);
     int32_t fixed_map_client_id = 0;
     std::string map_frame_prefix = "map";
@@ -54,7 +74,16 @@ class CoxgraphServer {
       s << std::endl
         << "Coxgraph Server using Config:" << std::endl
         << "  Client Number: " << v.client_number << std::endl
+        << "  Max Client Number: " << v.max_client_number << std::endl
+        << "  Client Leave Policy: "
+        << (v.client_leave_policy == ClientLeavePolicy::FREEZE ? "freeze"
+                                                               : "evict")
+        << std::endl
         << "  Map Fusion Queue Size: " << v.map_fusion_queue_size << std::endl
+        << "  Map Fusion Pipeline Queue Size: "
+        << v.map_fusion_pipeline_queue_size << std::endl
+        << "  Optimization Interval: " << v.optimization_interval << " s"
+        << std::endl
         << "  Client Map Refusion Interval: " << v.refuse_interval << " s"
         << std::endl
         << "  Map Fixed for Client Id: " << v.fixed_map_client_id << std::endl
@@ -85,6 +114,9 @@ class CoxgraphServer {
 
   static Config getConfigFromRosParam(const ros::NodeHandle& nh_private);
 
+  static bool parseClientLeavePolicy(const std::string& policy_str,
+                                     ClientLeavePolicy* policy);
+
   CoxgraphServer(const ros::NodeHandle& nh, const ros::NodeHandle& nh_private)
       : CoxgraphServer(
             nh, nh_private, getConfigFromRosParam(nh_private),
@@ -99,12 +131,17 @@ class CoxgraphServer {
         verbose_(false),
         config_(config),
         submap_config_(submap_config),
-        submap_collection_ptr_(std::make_shared<SubmapCollection>(
-            submap_config_, config.client_number)),
+        submap_collection_ptr_(
+            std::make_shared<SubmapCollection>(submap_config_)),
         pose_graph_interface_(nh_private, submap_collection_ptr_, mesh_config,
                               config.output_map_frame, false),
+        clients_(std::make_shared<const ClientMap>()),
+        next_ser_sm_id_(0),
+        num_fusions_in_fetch_(0),
         server_vis_(
             new ServerVisualizer(nh, nh_private, submap_config, mesh_config)),
+        submap_cache_ptr_(std::make_shared<SubmapCache>(
+            SubmapCache::getConfigFromRosParam(nh_private))),
         global_mesh_initialized_(false),
         global_mesh_need_update_(0) {
     nh_private_.param<bool>("verbose", verbose_, verbose_);
@@ -114,18 +151,30 @@ class CoxgraphServer {
     distrib_ctl_ptr_.reset(
         new DistributionController(nh_, nh_private_, submap_collection_ptr_));
 
-    tf_controller_.reset(new GlobalTfController(
-        nh_, nh_private_, config_.client_number, config_.map_frame_prefix,
-        distrib_ctl_ptr_, verbose_));
+    tf_controller_.reset(new GlobalTfController(nh_, nh_private_,
+                                                config_.map_frame_prefix,
+                                                distrib_ctl_ptr_, verbose_));
+    map_fusion_scheduler_.reset(new MapFusionScheduler(
+        MapFusionScheduler::getConfigFromRosParam(nh_private_)));
+    fuse_queue_.reset(new utils::WorkQueue<SubmapPairFusion>(
+        config_.map_fusion_pipeline_queue_size,
+        config_.map_fusion_pipeline_queue_size,
+        std::bind(&CoxgraphServer::fuseSubmapPairs, this,
+                  std::placeholders::_1)));
+    fetch_queue_.reset(new utils::WorkQueue<MapFusionJob>(
+        config_.map_fusion_pipeline_queue_size, 1,
+        std::bind(&CoxgraphServer::collectSubmapPairs, this,
+                  std::placeholders::_1)));
     pose_graph_interface_.setVerbosity(verbose_);
     pose_graph_interface_.setMeasurementConfigFromRosParams(nh_private_);
 
     subscribeTopics();
     advertiseTopics();
     advertiseServices();
-    initClientHandlers(nh_, nh_private_);
+    initClientHandlers();
 
-    LOG(INFO) << client_handlers_[0]->getConfig();
+    LOG(INFO) << getClientHandler(config_.fixed_map_client_id)->getConfig();
+    LOG(INFO) << submap_cache_ptr_->getConfig();
 
     CHECK_EQ(config_.fixed_map_client_id, 0)
         << "Fixed map client id has to be set 0 now, since pose graph "
@@ -134,9 +183,16 @@ class CoxgraphServer {
     if (config_.publish_global_mesh_on_update)
       generate_global_mesh_timer_ = nh_private_.createTimer(
           ros::Duration(1), &CoxgraphServer::generateGlobalMeshEvent, this);
+
+    client_resource_usage_timer_ = nh_private_.createTimer(
+        ros::Duration(1), &CoxgraphServer::publishClientResourceUsage, this);
   }
 
-  ~CoxgraphServer() = default;
+  // The fuse stage reads the fetch stage, so both drain before either goes
+  ~CoxgraphServer() {
+    fetch_queue_->waitUntilIdle();
+    fuse_queue_->waitUntilIdle();
+  }
 
   void subscribeTopics();
   void advertiseTopics();
@@ -156,7 +212,13 @@ class CoxgraphServer {
       coxgraph_msgs::NeedToFuseSrv::Request& request,     // NOLINT
       coxgraph_msgs::NeedToFuseSrv::Response& response);  // NOLINT
 
-  void futureMFProcCallback(const ros::TimerEvent& event);
+  bool registerClientCallback(
+      coxgraph_msgs::RegisterClient::Request& request,     // NOLINT
+      coxgraph_msgs::RegisterClient::Response& response);  // NOLINT
+
+  bool deregisterClientCallback(
+      coxgraph_msgs::DeregisterClient::Request& request,     // NOLINT
+      coxgraph_msgs::DeregisterClient::Response& response);  // NOLINT
 
  private:
   using ClientHandler = server::ClientHandler;
@@ -168,18 +230,85 @@ class CoxgraphServer {
   using PoseMap = PoseGraphInterface::PoseMap;
   using ServerVisualizer = server::ServerVisualizer;
   using DistributionController = server::DistributionController;
+  using MapFusionScheduler = server::MapFusionScheduler;
+
+  void initClientHandlers();
+
+  // Every client that ever registered. A client that left keeps its entry,
+  // without a handler, so its id is not given out again.
+  enum class ClientState { ACTIVE, FROZEN, EVICTED };
+  struct Client {
+    ClientState state;
+    ClientHandler::Ptr handler;
+  };
+  typedef std::map<CliId, Client> ClientMap;
 
-  void initClientHandlers(const ros::NodeHandle& nh,
-                          const ros::NodeHandle& nh_private);
+  // Lock-free, readers take one map and do all their lookups on it
+  inline std::shared_ptr<const ClientMap> getClients() const {
+    return std::atomic_load(&clients_);
+  }
+  // nullptr if the client is not registered or left
+  ClientHandler::Ptr getClientHandler(const CliId& cid) const;
+
+  // Creates the handler of a new client, or of a frozen one coming back with
+  // the same submap ids, e.g. after its link dropped. A negative id takes the
+  // next id never used before.
+  bool registerClient(CliId* cid, std::string* message);
+  // Fusion with the other clients goes on meanwhile, deferred fusions with
+  // the client are dropped and the ones in flight only fused if it's frozen
+  bool deregisterClient(const CliId& cid, ClientLeavePolicy policy,
+                        std::string* message);
+  // Drops what the server keeps of a client apart from its submaps in the
+  // pose graph, which voxgraph can't remove
+  void evictClient(const CliId& cid);
 
   void loopClosureCallback(const CliId& client_id,
                            const voxgraph_msgs::LoopClosure& loop_closure_msg);
-  bool mapFusionCallback(const coxgraph_msgs::MapFusion& map_fusion_msg,
-                         bool future = false);
-  void addToMFFuture(const coxgraph_msgs::MapFusion& map_fusion_msg);
-  void processMFFuture();
-  void timeLineUpdateCallback() {
-    processMFFuture();
+  // Map fusions run as a pipeline. The client handlers fetch and decode both
+  // submaps on their I/O threads, fetch_queue_ collects the decoded submap
+  // pairs in order, and fuse_queue_ inserts all pairs collected meanwhile
+  // into the collection and pose graph at once, followed by one optimization.
+  struct MapFusionJob {
+    coxgraph_msgs::MapFusion map_fusion_msg;
+    // When the map fusion was accepted, for its latency
+    ros::WallTime start_time;
+    // Reserved for the requested submaps, given back if they aren't added
+    SerSmId ser_sm_id_a;
+    SerSmId ser_sm_id_b;
+    std::future<ClientHandler::SubmapRequest> request_a;
+    std::future<ClientHandler::SubmapRequest> request_b;
+    // Times the fusion was fetched again right away after a FUTURE request
+    int num_retries = 0;
+  };
+  struct SubmapPairFusion {
+    coxgraph_msgs::MapFusion map_fusion_msg;
+    ros::WallTime start_time;
+    SerSmId ser_sm_id_a;
+    SerSmId ser_sm_id_b;
+    ClientHandler::SubmapRequest request_a;
+    ClientHandler::SubmapRequest request_b;
+  };
+
+  void mapFusionCallback(const coxgraph_msgs::MapFusion& map_fusion_msg);
+  // Reserves the submap ids and requests both submaps, returns false if not
+  // both clients are registered
+  bool startMapFusionJob(const coxgraph_msgs::MapFusion& map_fusion_msg,
+                         MapFusionJob* job);
+  void collectSubmapPairs(std::vector<MapFusionJob>* jobs);
+  void fuseSubmapPairs(std::vector<SubmapPairFusion>* fusions);
+  // Submaps in flight get their ids before they are added to the collection.
+  // Ids of submaps that were never added are released and reserved again, so
+  // failed, deferred and header only requests leave no gaps.
+  SerSmId reserveSerSmId();
+  void releaseSerSmId(const SerSmId& ser_sm_id);
+  // Returns false if the fusion wasn't deferred as the time lines known to
+  // the scheduler cover it, it's then up to the caller to run it
+  bool deferMapFusion(const coxgraph_msgs::MapFusion& map_fusion_msg);
+  // Runs the deferred map fusions the time line of a client made ready
+  void wakeMapFusions(const CliId& cid, const TimeLine& time_line);
+  void publishMapFusionQueueStats();
+  void timeLineUpdateCallback(const CliId& cid, const TimeLine& time_line) {
+    wakeMapFusions(cid, time_line);
     global_mesh_need_update_++;
   }
   bool needRefuse(const CliId& cid_a, const ros::Time& time_a,
@@ -187,13 +316,7 @@ class CoxgraphServer {
   bool updateNeedRefuse(const CliId& cid_a, const ros::Time& time_a,
                         const CliId& cid_b, const ros::Time& time_b);
 
-  // TODO(mikexyl): make a pack struct for these vars
-  bool fuseMap(const CliId& cid_a, const ros::Time& time_a,
-               const CliSmId& cli_sm_id_a, const CliSm::Ptr& submap_a,
-               const Transformation& T_submap_t_a, const CliId& cid_b,
-               const ros::Time& time_b, const CliSmId& cli_sm_id_b,
-               const CliSm::Ptr& submap_b, const Transformation& T_submap_t_b,
-               const Transformation& T_t1_t2);
+  bool fuseMap(const SubmapPairFusion& fusion);
 
   void updateSubmapRPConstraints();
 
@@ -204,17 +327,26 @@ class CoxgraphServer {
 
   void updateCliMapRelativePose();
 
-  inline bool isTimeFused(const CliId& cid, const ros::Time& time) {
-    return fused_time_line_[cid].hasTime(time);
+  // Map fusion state of a client, guarded by refuse_mutex_
+  struct FusionState {
+    bool force_fuse = true;
+    TimeLine fused_time_line;
+  };
+
+  inline bool isTimeFused(const FusionState& fusion_state,
+                          const ros::Time& time) {
+    return fusion_state.fused_time_line.hasTime(time);
   }
-  inline bool isTimeNeedRefuse(const CliId& cid, const ros::Time& time) {
+  inline bool isTimeNeedRefuse(const FusionState& fusion_state,
+                               const ros::Time& time) {
     if (config_.refuse_interval == ros::Duration(0))
-      return !isTimeFused(cid, time);
-    if (isTimeFused(cid, time)) return false;
-    if (time < fused_time_line_[cid].start) {
+      return !isTimeFused(fusion_state, time);
+    if (isTimeFused(fusion_state, time)) return false;
+    const TimeLine& fused_time_line = fusion_state.fused_time_line;
+    if (time < fused_time_line.start) {
       return false;
-    } else if (time > fused_time_line_[cid].end) {
-      return (time - fused_time_line_[cid].end) > config_.refuse_interval;
+    } else if (time > fused_time_line.end) {
+      return (time - fused_time_line.end) > config_.refuse_interval;
     }
     return false;
   }
@@ -224,6 +356,8 @@ class CoxgraphServer {
     std::lock_guard<std::mutex> submap_add_lock(submap_add_mutex_);
     submap_collection_ptr_->addSubmap(submap, cid, cli_sm_id);
     pose_graph_interface_.addSubmap(submap->getID());
+    const ClientHandler::Ptr client_handler = getClientHandler(cid);
+    if (client_handler != nullptr) client_handler->addCollectionSubmap(*submap);
     return submap->getID();
   }
 
@@ -243,27 +377,45 @@ class CoxgraphServer {
   PoseGraphInterface pose_graph_interface_;
   std::mutex submap_add_mutex_;
 
-  std::vector<ClientHandler::Ptr> client_handlers_;
+  // Only accessed through std::atomic_load and std::atomic_store, written
+  // under client_registration_mutex_
+  std::shared_ptr<const ClientMap> clients_;
+  std::mutex client_registration_mutex_;
 
   // Map fusion msg process related
-  std::deque<std::pair<coxgraph_msgs::MapFusion, int>> map_fusion_msgs_future_;
-  std::vector<bool> force_fuse_;
-  std::vector<TimeLine> fused_time_line_;
+  std::map<CliId, FusionState> fusion_states_;
   std::map<SerSmId, SerSmId> fused_ser_sm_id_pair;
   std::mutex map_fuse_mutex_;
-  std::mutex future_mf_queue_mutex_;
-  ros::Timer future_msg_proc_timer_;
-
-  // Asynchronous handle for the pose graph optimization thread
-  std::future<OptState> optimization_async_handle_;
+  std::mutex refuse_mutex_;
+  MapFusionScheduler::Ptr map_fusion_scheduler_;
+  ros::Publisher map_fusion_queue_stats_pub_;
+  SerSmId next_ser_sm_id_;
+  std::set<SerSmId> released_ser_sm_ids_;
+  std::mutex ser_sm_id_mutex_;
+  // Fusions added to the pose graph since its last optimization, only used
+  // by the fuse stage
+  struct UnsolvedFusion {
+    CliId cid_a;
+    CliId cid_b;
+    ros::WallTime start_time;
+  };
+  std::vector<UnsolvedFusion> unsolved_fusions_;
+  ros::WallTime unsolved_since_;
+  // Fusions pushed to fetch_queue_ and not handed to fuse_queue_ yet
+  std::atomic<size_t> num_fusions_in_fetch_;
 
   GlobalTfController::Ptr tf_controller_;
 
   // Visualization
   ServerVisualizer::Ptr server_vis_;
+
+  SubmapCache::Ptr submap_cache_ptr_;
+
   ros::ServiceServer get_final_global_mesh_srv_;
   ros::ServiceServer get_pose_history_srv_;
   ros::ServiceServer need_to_fuse_srv_;
+  ros::ServiceServer register_client_srv_;
+  ros::ServiceServer deregister_client_srv_;
   std::timed_mutex final_mesh_gen_mutex_;
 
   DistributionController::Ptr distrib_ctl_ptr_;
@@ -272,9 +424,22 @@ class CoxgraphServer {
   ros::Timer generate_global_mesh_timer_;
   int global_mesh_need_update_;
   bool global_mesh_initialized_;
+
+  ros::Publisher client_resource_usage_pub_;
+  ros::Timer client_resource_usage_timer_;
+  void publishClientResourceUsage(const ros::TimerEvent& /*event*/);
+
+  // Declared last, so the workers stop before anything they use goes away
+  std::unique_ptr<utils::WorkQueue<SubmapPairFusion>> fuse_queue_;
+  std::unique_ptr<utils::WorkQueue<MapFusionJob>> fetch_queue_;
   void generateGlobalMeshEvent(const ros::TimerEvent& /*event*/) {
+    int num_active_clients = 0;
+    for (auto const& client_kv : *getClients()) {
+      if (client_kv.second.state == ClientState::ACTIVE) num_active_clients++;
+    }
     if (config_.publish_global_mesh_on_update && global_mesh_initialized_ &&
-        global_mesh_need_update_ / config_.client_number == 4) {
+        num_active_clients > 0 &&
+        global_mesh_need_update_ / num_active_clients == 4) {
       coxgraph_msgs::FilePath file_path_srv;
       file_path_srv.request.file_path = "/home/lxl/Workspace/coxgraph/output/final_mesh/";
       getFinalGlobalMeshCallback(file_path_srv.request, file_path_srv.response);
@@ -282,10 +447,12 @@ class CoxgraphServer {
     }
   }
 
-  constexpr static uint8_t kMaxClientNum = 3;
   constexpr static uint8_t kPoseUpdateWaitMs = 100;
-  constexpr static float kFutureMFProcInterval = 1.0;
-  constexpr static int kMaxFutureUncatchedN = 4;
+  // Blocking on a full map fusion pipeline longer than this is logged
+  constexpr static double kPushWaitLogS = 0.01;
+  // A fetch only comes back FUTURE while a time line update is half applied,
+  // a fusion still failing after this many refetches is dropped
+  constexpr static int kMaxMapFusionRetries = 3;
 };
 
 }  // namespace coxgraph
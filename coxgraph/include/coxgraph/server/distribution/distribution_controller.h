@@ -4,10 +4,13 @@
 #include <coxgraph_msgs/ControlTrigger.h>
 #include <coxgraph_msgs/StateQuery.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "coxgraph/common.h"
+#include "coxgraph/server/submap_aabb_tree.h"
 #include "coxgraph/server/submap_collection.h"
 #include "coxgraph/utils/msg_converter.h"
 
@@ -37,9 +40,11 @@ class DistributionController {
       : nh_(nh),
         nh_private_(nh_private),
         submap_collection_ptr_(submap_collection_ptr) {
-    nh_private_.param<bool>("in_control", in_control_, true);
+    bool in_control;
+    nh_private_.param<bool>("in_control", in_control, true);
+    in_control_ = in_control;
     LOG(INFO) << "Server in control: "
-              << static_cast<std::string>(in_control_ ? "true" : "false");
+              << static_cast<std::string>(in_control ? "true" : "false");
 
     advertiseTopics();
   }
@@ -62,7 +67,8 @@ class DistributionController {
 
   // Control trigger service
   ros::ServiceServer control_trigger_srv_;
-  bool in_control_;
+  // Read by the tf timer thread
+  std::atomic<bool> in_control_;
   bool ControlTriggerCallback(
       coxgraph_msgs::ControlTrigger::Request& request,      // NOLINT
       coxgraph_msgs::ControlTrigger::Response& response) {  // NOLINT
@@ -78,10 +84,25 @@ class DistributionController {
   bool StateQueryCallback(
       coxgraph_msgs::StateQuery::Request& request,      // NOLINT
       coxgraph_msgs::StateQuery::Response& response) {  // NOLINT
-    response.n_submaps = submap_collection_ptr_->getSubmapPtrs().size();
-    for (auto const& submap_ptr : submap_collection_ptr_->getSubmapPtrs()) {
-      response.bb.emplace_back(
-          utils::msgFromBb(submap_ptr->getOdomFrameSurfaceAabb()));
+    // Boxes come from the index of the snapshot instead of recomputing the
+    // box of every submap. They are at the client poses of the submaps, the
+    // optimized poses are never applied to the live collection.
+    const SubmapCollection::Snapshot::ConstPtr snapshot =
+        submap_collection_ptr_->getSnapshot();
+    const SubmapAabbTree& aabb_tree = snapshot->getAabbTree();
+    std::vector<SerSmId> ser_sm_ids;
+    if (request.query_region) {
+      aabb_tree.query(utils::bbFromMsg(request.region), &ser_sm_ids);
+    } else {
+      ser_sm_ids = aabb_tree.getIds();
+    }
+
+    response.n_submaps = aabb_tree.size();
+    for (auto const& ser_sm_id : ser_sm_ids) {
+      BoundingBox aabb;
+      CHECK(aabb_tree.getAabb(ser_sm_id, &aabb));
+      response.submap_ids.emplace_back(ser_sm_id);
+      response.bb.emplace_back(utils::msgFromBb(aabb));
     }
     return true;
   }
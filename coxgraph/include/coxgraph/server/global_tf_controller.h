@@ -1,11 +1,18 @@
 #ifndef COXGRAPH_SERVER_GLOBAL_TF_CONTROLLER_H_
 #define COXGRAPH_SERVER_GLOBAL_TF_CONTROLLER_H_
 
+#include <coxgraph_msgs/Histogram.h>
+#include <ros/callback_queue.h>
 #include <tf/transform_broadcaster.h>
 
+#include <boost/optional.hpp>
+
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -39,33 +46,48 @@ class GlobalTfController {
   using PoseMap = ClientTfOptimizer::PoseMap;
 
   GlobalTfController(const ros::NodeHandle& nh,
-                     const ros::NodeHandle& nh_private, int8_t client_number,
+                     const ros::NodeHandle& nh_private,
                      std::string map_fram_prefix,
                      DistributionController::Ptr distrib_ctl_ptr, bool verbose)
-      : GlobalTfController(nh, nh_private, client_number, map_fram_prefix,
-                           distrib_ctl_ptr, getConfigFromRosParam(nh_private),
-                           verbose) {}
+      : GlobalTfController(nh, nh_private, map_fram_prefix, distrib_ctl_ptr,
+                           getConfigFromRosParam(nh_private), verbose) {}
 
   GlobalTfController(const ros::NodeHandle& nh,
-                     const ros::NodeHandle& nh_private, int8_t client_number,
+                     const ros::NodeHandle& nh_private,
                      std::string map_frame_prefix,
                      DistributionController::Ptr distrib_ctl_ptr,
                      const Config& config, bool verbose)
       : verbose_(verbose),
         nh_(nh),
         nh_private_(nh_private),
-        client_number_(client_number),
         map_frame_prefix_(map_frame_prefix),
         distrib_ctl_ptr_(distrib_ctl_ptr),
         config_(config),
         global_mission_frame_(map_frame_prefix + "_g"),
+        tf_pub_spinner_(1, &tf_pub_queue_),
         client_tf_optimizer_(nh_private, verbose),
-        pose_updated_(false) {
+        jitter_counts_(kJitterNumBins + 1, 0),
+        max_jitter_(0.0),
+        num_tf_pubs_(0),
+        solve_requested_(false),
+        solve_shutdown_(false) {
     LOG(INFO) << config;
     initCliMapPose();
+    jitter_pub_ =
+        nh_private_.advertise<coxgraph_msgs::Histogram>("tf_jitter", 10);
+    solve_thread_ = std::thread(&GlobalTfController::solveLoop, this);
+    tf_pub_spinner_.start();
   }
 
-  ~GlobalTfController() = default;
+  ~GlobalTfController() {
+    tf_pub_spinner_.stop();
+    {
+      std::lock_guard<std::mutex> solve_lock(solve_mutex_);
+      solve_shutdown_ = true;
+    }
+    solve_cv_.notify_all();
+    if (solve_thread_.joinable()) solve_thread_.join();
+  }
 
   const std::string& getGlobalMissionFrame() const {
     return global_mission_frame_;
@@ -73,8 +95,23 @@ class GlobalTfController {
 
   void publishTfGloCli();
 
-  void addCliMapRelativePose(const CliId& first_cid, const CliId& second_cid,
-                             const Transformation& T_C1_C2);
+  // Starts estimating and publishing the map frame of a client, does nothing
+  // if the client was added before. Client 0 is the fixed one.
+  void addClient(const CliId& cid);
+
+  // Stops estimating and publishing the map frame of a client
+  void removeClient(const CliId& cid);
+
+  // Adds the relative poses T_C1_G[i] * T_G_C2[j] for all i, j
+  void addCliMapRelativePoses(const CliId& first_cid, const CliId& second_cid,
+                              const TransformationVector& T_C1_G,
+                              const TransformationVector& T_G_C2);
+
+  // Has the worker thread solve for the client map poses from the relative
+  // poses added since the last reset, requests made while a solve is running
+  // are merged into one. Doesn't block, call after releasing
+  // getPoseUpdateMutex().
+  void requestCliMapPoseUpdate();
 
   void resetCliMapRelativePoses() {
     client_tf_optimizer_.resetClientRelativePoseConstraints();
@@ -84,15 +121,33 @@ class GlobalTfController {
 
   bool inControl() const { return distrib_ctl_ptr_->inControl(); }
 
-  const tf::StampedTransform& getTGCliOpt(const CliId& cid) const {
-    return T_G_CLI_opt_[cid];
+  // Empty for clients that are not or no longer known, e.g. evicted ones
+  boost::optional<tf::StampedTransform> getTGCliOpt(const CliId& cid) const {
+    const std::shared_ptr<const TfSet> tf_set = std::atomic_load(&tf_set_);
+    auto T_G_CLI_it = tf_set->T_G_CLI_opt.find(cid);
+    if (T_G_CLI_it == tf_set->T_G_CLI_opt.end()) return boost::none;
+    return T_G_CLI_it->second;
   }
 
-  bool ifClientFused(CliId cid) const { return cli_tf_fused_[cid]; }
+  bool ifClientFused(CliId cid) const {
+    const std::shared_ptr<const TfSet> tf_set = std::atomic_load(&tf_set_);
+    auto fused_it = tf_set->cli_tf_fused.find(cid);
+    return fused_it != tf_set->cli_tf_fused.end() && fused_it->second;
+  }
 
  private:
+  // Transforms of all clients as of one solve. The worker thread, and adding
+  // or removing clients, fill a new set under pose_update_mutex and swap it
+  // in, the tf timer only ever reads the latest one.
+  struct TfSet {
+    std::map<CliId, bool> cli_tf_fused;
+    std::map<CliId, tf::StampedTransform> T_G_CLI_opt;
+  };
+
   void initCliMapPose();
   void pubCliTfCallback(const ros::TimerEvent& event);
+  void recordTfJitter(const ros::TimerEvent& event);
+  void solveLoop();
   void updateCliMapPose();
   void computeOptCliMapPose();
 
@@ -104,22 +159,40 @@ class GlobalTfController {
   Config config_;
   std::string map_frame_prefix_;
 
-  const int8_t client_number_;
   const std::string global_mission_frame_;
-  std::vector<std::string> cli_mission_frames_;
 
+  // The tf timer runs on its own queue and thread, so it keeps its rate
+  // while callbacks on the global queue block, e.g. on a full map fusion
+  // pipeline
+  ros::CallbackQueue tf_pub_queue_;
+  ros::AsyncSpinner tf_pub_spinner_;
   ros::Timer tf_pub_timer_;
   tf::TransformBroadcaster tf_boardcaster_;
-  std::vector<bool> cli_tf_fused_;
-  std::vector<tf::StampedTransform> T_G_CLI_opt_;
+  // Only accessed through std::atomic_load and std::atomic_store
+  std::shared_ptr<const TfSet> tf_set_;
 
   ClientTfOptimizer client_tf_optimizer_;
-  bool pose_updated_;
   std::mutex pose_update_mutex;
 
+  // Deviation of the tf timer period from 1 / kTfPubFreq, only touched by
+  // the tf timer
+  ros::Publisher jitter_pub_;
+  std::vector<uint64_t> jitter_counts_;
+  double max_jitter_;
+  uint64_t num_tf_pubs_;
+
+  std::thread solve_thread_;
+  std::mutex solve_mutex_;
+  std::condition_variable solve_cv_;
+  bool solve_requested_;
+  bool solve_shutdown_;
+
   DistributionController::Ptr distrib_ctl_ptr_;
 
   constexpr static float kTfPubFreq = 100;
+  // Jitter histogram bins in seconds, the last bin collects everything above
+  constexpr static double kJitterBinWidth = 0.0005;
+  constexpr static int kJitterNumBins = 40;
 };
 
 }  // namespace server
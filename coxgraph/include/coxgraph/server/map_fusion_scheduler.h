@@ -0,0 +1,140 @@
+#ifndef COXGRAPH_SERVER_MAP_FUSION_SCHEDULER_H_
+#define COXGRAPH_SERVER_MAP_FUSION_SCHEDULER_H_
+
+#include <coxgraph_msgs/MapFusion.h>
+#include <coxgraph_msgs/MapFusionQueueStats.h>
+#include <ros/ros.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Map fusions whose timestamps are not covered by the time lines of
+ * both clients yet. Every deferred fusion is indexed by the client and
+ * timestamp it still waits for, so a time line update only touches the
+ * fusions it makes ready, instead of polling the whole queue.
+ *
+ * The scheduler keeps the last time line of every client, so a fusion is
+ * checked against the same time lines under one lock when it's deferred and
+ * when it's woken. A fusion covered by them already is never queued, it
+ * can't miss the update that made it ready.
+ *
+ * Fusions that become ready together are returned in a deterministic
+ * priority order. Requests for the same pair of client timestamps are kept
+ * once, and when the queue is full the lowest priority fusion is evicted.
+ */
+class MapFusionScheduler {
+ public:
+  enum class Priority { NEWEST_FIRST, OLDEST_FIRST };
+  enum class DeferState { DEFERRED, DUPLICATE, READY };
+
+  struct Config {
+    Config() : max_queue_size(10), priority(Priority::NEWEST_FIRST) {}
+    int32_t max_queue_size;
+    Priority priority;
+
+    friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
+      s << std::endl
+        << "Map Fusion Scheduler using Config:" << std::endl
+        << "  Max Queue Size: " << v.max_queue_size << std::endl
+        << "  Priority: "
+        << (v.priority == Priority::NEWEST_FIRST ? "newest_first"
+                                                 : "oldest_first")
+        << std::endl
+        << "-------------------------------------------" << std::endl;
+      return (s);
+    }
+  };
+
+  typedef std::shared_ptr<MapFusionScheduler> Ptr;
+
+  explicit MapFusionScheduler(const Config& config);
+  ~MapFusionScheduler() = default;
+
+  static Config getConfigFromRosParam(const ros::NodeHandle& nh_private);
+
+  // Queues the fusion unless the same one is queued already, or the known
+  // time lines of both clients cover it. The caller runs it if it's READY.
+  DeferState defer(const coxgraph_msgs::MapFusion& map_fusion_msg);
+
+  // Takes the new time line of a client and returns the deferred fusions it
+  // made ready, highest priority first. The time line is kept for defer().
+  void updateTimeLine(const CliId& cid, const TimeLine& time_line,
+                      std::vector<coxgraph_msgs::MapFusion>* ready);
+
+  // Drops all deferred fusions with a client and its time line, e.g. once it
+  // left, returns their number
+  size_t removeClient(const CliId& cid);
+
+  size_t size();
+
+  void getStats(coxgraph_msgs::MapFusionQueueStats* stats);
+
+ private:
+  // Client a, timestamp a, client b, timestamp b
+  typedef std::tuple<CliId, ros::Time, CliId, ros::Time> FusionKey;
+  typedef std::multimap<ros::Time, uint64_t> WaitIndex;
+
+  struct Entry {
+    coxgraph_msgs::MapFusion map_fusion_msg;
+    FusionKey key;
+    ros::WallTime deferred_time;
+    // Timestamps still waiting in the indices of client a and b, end() of
+    // that index once covered
+    WaitIndex::iterator wait_it_a;
+    WaitIndex::iterator wait_it_b;
+  };
+
+  static inline FusionKey getKey(const coxgraph_msgs::MapFusion& msg) {
+    return std::make_tuple(static_cast<CliId>(msg.from_client_id),
+                           msg.from_timestamp,
+                           static_cast<CliId>(msg.to_client_id),
+                           msg.to_timestamp);
+  }
+
+  bool isCovered(const CliId& cid, const ros::Time& time);
+
+  // Whether entry with sequence number seq_a goes before seq_b
+  bool hasPriority(uint64_t seq_a, uint64_t seq_b) const;
+
+  WaitIndex::iterator addWait(const CliId& cid, const ros::Time& time,
+                              uint64_t seq);
+  void erase(uint64_t seq);
+  void recordWaitTime(double wait_time);
+
+  const Config config_;
+
+  // Deferred fusions by sequence number, i.e. by arrival
+  std::map<uint64_t, Entry> entries_;
+  std::map<FusionKey, uint64_t> seqs_by_key_;
+  // Uncovered timestamps of every client, each mapped to its fusion
+  std::map<CliId, WaitIndex> wait_indices_;
+  std::map<CliId, TimeLine> time_lines_;
+  uint64_t next_seq_;
+
+  uint64_t num_deferred_;
+  uint64_t num_duplicates_;
+  uint64_t num_evicted_;
+  uint64_t num_dispatched_;
+  std::vector<uint64_t> wait_time_counts_;
+  double max_wait_time_;
+
+  std::mutex scheduler_mutex_;
+
+  constexpr static double kWaitTimeBinWidth = 0.5;
+  constexpr static int kWaitTimeNumBins = 20;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_MAP_FUSION_SCHEDULER_H_
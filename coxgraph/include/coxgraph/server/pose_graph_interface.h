@@ -6,10 +6,18 @@
 #include <voxgraph/frontend/pose_graph_interface/pose_graph_interface.h>
 #include <voxgraph/frontend/submap_collection/voxgraph_submap_collection.h>
 
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "coxgraph/common.h"
+#include "coxgraph/server/backend/dense_tsdf_grid.h"
+#include "coxgraph/server/backend/registration_cost_function.h"
+#include "coxgraph/server/backend/submap_pose_graph.h"
+#include "coxgraph/server/submap_aabb_tree.h"
 #include "coxgraph/server/submap_collection.h"
 #include "coxgraph/utils/ros_params.h"
 
@@ -20,10 +28,58 @@ class PoseGraphInterface : public voxgraph::PoseGraphInterface {
  public:
   typedef std::shared_ptr<PoseGraphInterface> Ptr;
 
+  struct Config {
+    Config()
+        : registration_sampling_ratio(0.3),
+          registration_grid_band(0.3),
+          registration_min_voxel_weight(1e-6),
+          registration_weight(1.0),
+          registration_crop_margin(0.5),
+          rp_translation_tolerance(1e-3),
+          rp_rotation_tolerance(1e-3) {}
+    // Share of the voxels near the surface of a submap that are registered
+    float registration_sampling_ratio;
+    // Distance to the surface up to which the dense grids of the reference
+    // submaps keep the TSDF, samples are taken up to half of it
+    float registration_grid_band;
+    float registration_min_voxel_weight;
+    double registration_weight;
+    // Each registration constraint only evaluates the samples within this
+    // distance of the reference grid box, it crops them again once the
+    // relative pose moved one of them farther
+    float registration_crop_margin;
+    // A submap relative pose constraint is only replaced if its measurement
+    // moved by more than this, in meters and radians
+    float rp_translation_tolerance;
+    float rp_rotation_tolerance;
+
+    friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
+      s << std::endl
+        << "Pose Graph Interface using Config:" << std::endl
+        << "  Registration Sampling Ratio: " << v.registration_sampling_ratio
+        << std::endl
+        << "  Registration Grid Band: " << v.registration_grid_band << " m"
+        << std::endl
+        << "  Registration Min Voxel Weight: "
+        << v.registration_min_voxel_weight << std::endl
+        << "  Registration Weight: " << v.registration_weight << std::endl
+        << "  Registration Crop Margin: " << v.registration_crop_margin
+        << " m" << std::endl
+        << "  RP Translation Tolerance: " << v.rp_translation_tolerance
+        << " m" << std::endl
+        << "  RP Rotation Tolerance: " << v.rp_rotation_tolerance << " rad"
+        << std::endl
+        << "-------------------------------------------" << std::endl;
+      return (s);
+    }
+  };
+
+  static Config getConfigFromRosParam(const ros::NodeHandle& nh_private);
+
   using VoxgraphSubmapCollection = voxgraph::VoxgraphSubmapCollection;
-  using RelativePoseConstraint = voxgraph::RelativePoseConstraint;
-  using RegistrationConstraint = voxgraph::RegistrationConstraint;
-  using PoseMap = voxgraph::PoseGraph::PoseMap;
+  using ConstraintType = SubmapPoseGraph::ConstraintType;
+  using PoseMap = SubmapPoseGraph::PoseMap;
+  using SerSmIdPair = SubmapPoseGraph::SerSmIdPair;
 
   PoseGraphInterface(ros::NodeHandle nh_private,
                      const SubmapCollection::Ptr& submap_collection_ptr,
@@ -35,11 +91,19 @@ class PoseGraphInterface : public voxgraph::PoseGraphInterface {
             nh_private,
             static_cast<VoxgraphSubmapCollection::Ptr>(submap_collection_ptr),
             mesh_config, visualizations_mission_frame, verbose),
+        config_(getConfigFromRosParam(nh_private)),
+        robocentric_(robocentric),
         cox_submap_collection_ptr_(submap_collection_ptr),
-        robocentric_(robocentric) {
+        submap_pose_graph_(PoseGraph::getConfigFromRosParam(
+            ros::NodeHandle(nh_private, "submap_pose_graph"))),
+        grid_cache_(config_.registration_grid_band,
+                    config_.registration_min_voxel_weight),
+        has_new_loop_closures_(false),
+        has_constant_node_(false) {
     utils::setInformationMatrixFromRosParams(
         ros::NodeHandle(nh_private, "submap_relative_pose/information_matrix"),
         &sm_rp_info_matrix_);
+    LOG(INFO) << config_;
 
     if (pose_graph_topic.size()) {
       pose_graph_pub_.shutdown();
@@ -48,10 +112,11 @@ class PoseGraphInterface : public voxgraph::PoseGraphInterface {
     }
   }
 
-  // Copy constructor
+  // Copy constructor, the copy gets a Ceres problem of its own
   PoseGraphInterface(const PoseGraphInterface& rhs) = default;
 
-  // Copy constructor with a new submap collection ptr
+  // Copy constructor with a new submap collection ptr, e.g. an overlay of the
+  // collection the copied pose graph was built on
   PoseGraphInterface(const PoseGraphInterface& rhs,
                      SubmapCollection::Ptr submap_collection_ptr)
       : PoseGraphInterface(rhs) {
@@ -65,35 +130,118 @@ class PoseGraphInterface : public voxgraph::PoseGraphInterface {
 
   void addSubmap(SerSmId submap_id);
 
+  // Adds the loop closure to the voxgraph pose graph, which checks the
+  // candidates, and to the submap pose graph that is solved. False if the
+  // voxgraph pose graph rejected it.
+  bool addLoopClosure(const SerSmId& first_submap_id,
+                      const SerSmId& second_submap_id,
+                      const Transformation& T_S1_S2);
+
+  // Solves the submap pose graph, whose Ceres problem lives across calls.
+  // Registration constraints are updated if enabled, after a solve without
+  // them if loop closures arrived since the last call, since these can move
+  // submaps far enough to change which ones overlap. Logs the latency
+  // against the number of submaps.
   void optimize(bool enable_registration);
 
+  // Adds the submap relative pose constraints of new submaps, and replaces or
+  // removes only the ones whose measurement changed
   void updateSubmapRPConstraints();
 
+  // Keeps one registration constraint per pair of submaps whose surface
+  // bounding boxes overlap at their pose graph poses, plus the forced ones.
+  // Only the constraints of pairs that start or stop overlapping, or whose
+  // samples have to be cropped again, are added or removed. Unlike the
+  // voxgraph version, the pairs come from a bounding box tree instead of
+  // testing all pairs.
+  void updateRegistrationConstraints();
+
+  // Unlike the voxgraph version, this goes through the submap collection
+  // snapshot, so optimizing on an overlay never moves the shared submaps.
+  // Only the snapshot of this collection, with its bounding box tree, gets
+  // the optimized poses, the live collection stays at the client poses.
+  void updateSubmapCollectionPoses();
+
   void resetSubmapRelativePoseConstrains() {
-    pose_graph_.resetSubmapRelativePoseConstraints();
+    for (auto const& constraint_kv : submap_rp_constraints_) {
+      submap_pose_graph_.removeConstraint(ConstraintType::SubmapRelPose,
+                                          constraint_kv.first);
+    }
+    submap_rp_constraints_.clear();
   }
 
   void addSubmapRelativePoseConstraint(const SerSmId& first_submap_id,
                                        const SerSmId& second_submap_id,
                                        const Transformation& T_S1_S2);
 
+  // Kept until the pose graph is destroyed, whether the submaps overlap or
+  // not
   void addForceRegistrationConstraint(const SerSmId& first_submap_id,
                                       const SerSmId& second_submap_id);
 
-  PoseMap getPoseMap() { return pose_graph_.getSubmapPoses(); }
+  PoseMap getPoseMap() const { return submap_pose_graph_.getSubmapPoses(); }
 
   void printResiduals(ConstraintType constraint_type) {
-    for (double residual : evaluateResiduals(constraint_type)) {
+    for (double residual :
+         submap_pose_graph_.evaluateResiduals(constraint_type)) {
       std::cout << residual << " ";
     }
     std::cout << std::endl;
   }
 
  private:
+  // Relative pose of a registration pair its samples were cropped at, and
+  // the distance of the farthest kept sample from the reading submap origin
+  struct RegistrationCrop {
+    Transformation T_B_A;
+    float radius;
+  };
+
+  // Adds or replaces the registration constraint of the pair, with the
+  // samples cropped at the given poses. Returns false and drops the
+  // constraint if no sample is close to the reference grid.
+  bool addRegistrationConstraint(const SerSmIdPair& submap_pair,
+                                 const PoseMap& submap_poses);
+
+  std::shared_ptr<const RegistrationSamples> getRegistrationSamples(
+      const CliSm& submap);
+
+  static InformationMatrix getSqrtInformation(
+      const InformationMatrix& information_matrix);
+
+  // Edges of the submap pose graph between the submap positions
+  void publishPoseGraph();
+
+  const Config config_;
   bool robocentric_;
 
   SubmapCollection::Ptr cox_submap_collection_ptr_;
   InformationMatrix sm_rp_info_matrix_;
+
+  // Solved instead of the voxgraph pose graph, which only keeps the nodes and
+  // loop closures for the voxgraph candidate checks
+  SubmapPoseGraph submap_pose_graph_;
+
+  // Measurements of the submap relative pose constraints in the pose graph,
+  // to tell which ones changed
+  std::map<SerSmIdPair, Transformation> submap_rp_constraints_;
+
+  // Surface bounding boxes of the submaps at their pose graph poses, kept
+  // across optimizations so that only submaps which moved out of their
+  // enlarged boxes are reinserted
+  SubmapAabbTree registration_aabb_tree_;
+  std::set<SerSmIdPair> forced_registration_pairs_;
+  std::map<SerSmIdPair, RegistrationCrop> registration_crops_;
+  // Registration samples of each submap, and dense grids of the reference
+  // submaps, shared by all constraints of a submap
+  std::map<SerSmId, std::shared_ptr<const RegistrationSamples>>
+      registration_samples_;
+  DenseTsdfGridCache grid_cache_;
+
+  // Whether loop closures were added since the last optimization
+  bool has_new_loop_closures_;
+  // Whether a node already fixes the gauge, copies on an overlay keep it
+  bool has_constant_node_;
 };
 
 }  // namespace server
@@ -0,0 +1,126 @@
+#ifndef COXGRAPH_SERVER_SUBMAP_AABB_TREE_H_
+#define COXGRAPH_SERVER_SUBMAP_AABB_TREE_H_
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Dynamic bounding volume hierarchy over the surface bounding boxes of
+ * submaps, to find overlapping submaps without testing all pairs.
+ *
+ * Every leaf keeps the exact box of its submap and a box enlarged by a
+ * margin. Moving a submap only restructures the tree once its box leaves the
+ * enlarged one, so the small corrections of pose updates and optimizations
+ * cost O(1). Leaves are inserted next to the node whose box grows least, and
+ * AVL rotations keep the tree balanced, so a query costs O(log n + k).
+ */
+class SubmapAabbTree {
+ public:
+  typedef std::pair<SerSmId, SerSmId> SerSmIdPair;
+
+  explicit SubmapAabbTree(float margin = 0.5f) : margin_(margin) {}
+  ~SubmapAabbTree() = default;
+
+  // Inserts the submap or moves it to its new box. Submaps with an empty box,
+  // e.g. without surface, are removed.
+  void update(const SerSmId& ser_sm_id, const BoundingBox& aabb);
+
+  void remove(const SerSmId& ser_sm_id);
+
+  inline size_t size() const { return leaves_.size(); }
+  inline bool exists(const SerSmId& ser_sm_id) const {
+    return leaves_.count(ser_sm_id);
+  }
+
+  // Ids of all submaps in the tree, in ascending order
+  std::vector<SerSmId> getIds() const;
+
+  // Exact box of a submap in the tree
+  bool getAabb(const SerSmId& ser_sm_id, BoundingBox* aabb) const;
+
+  // Submaps whose exact box overlaps the given one, in ascending order
+  void query(const BoundingBox& aabb, std::vector<SerSmId>* ser_sm_ids) const;
+
+  // All pairs of submaps with overlapping exact boxes, smaller id first and
+  // in ascending order
+  void getOverlappingPairs(std::vector<SerSmIdPair>* pairs) const;
+
+  static inline bool isEmpty(const BoundingBox& aabb) {
+    return !(aabb.min.array() <= aabb.max.array()).all();
+  }
+
+  static inline bool overlaps(const BoundingBox& a, const BoundingBox& b) {
+    return (a.min.array() <= b.max.array()).all() &&
+           (b.min.array() <= a.max.array()).all();
+  }
+
+ private:
+  struct Node {
+    // Enlarged box for leaves, union of the children otherwise
+    BoundingBox fat_aabb;
+    // Exact box of the submap, only set for leaves
+    BoundingBox aabb;
+    SerSmId ser_sm_id;
+    int parent;
+    int left;
+    int right;
+    // 0 for leaves
+    int height;
+
+    inline bool isLeaf() const { return left == kNullNode; }
+  };
+
+  int allocateNode();
+  void freeNode(int node);
+
+  void insertLeaf(int leaf);
+  void removeLeaf(int leaf);
+  // Rotates node up if its subtrees are unbalanced, returns the node now at
+  // its position
+  int balance(int node);
+  // Recomputes height and box of all ancestors of node, balancing them
+  void refitAncestors(int node);
+
+  // Traverses the nodes whose enlarged box overlaps aabb and collects the
+  // leaves whose exact box overlaps it
+  void queryLeaves(const BoundingBox& aabb, std::vector<int>* leaves) const;
+
+  static inline BoundingBox merge(const BoundingBox& a, const BoundingBox& b) {
+    BoundingBox merged;
+    merged.min = a.min.cwiseMin(b.min);
+    merged.max = a.max.cwiseMax(b.max);
+    return merged;
+  }
+
+  static inline float surfaceArea(const BoundingBox& aabb) {
+    const voxblox::Point extent = aabb.max - aabb.min;
+    return 2.0f * (extent.x() * extent.y() + extent.y() * extent.z() +
+                   extent.z() * extent.x());
+  }
+
+  static inline bool contains(const BoundingBox& outer,
+                              const BoundingBox& inner) {
+    return (outer.min.array() <= inner.min.array()).all() &&
+           (inner.max.array() <= outer.max.array()).all();
+  }
+
+  const float margin_;
+
+  std::vector<Node> nodes_;
+  std::vector<int> free_nodes_;
+  int root_ = kNullNode;
+  std::unordered_map<SerSmId, int> leaves_;
+
+  constexpr static int kNullNode = -1;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_SUBMAP_AABB_TREE_H_
@@ -0,0 +1,109 @@
+#ifndef COXGRAPH_SERVER_SUBMAP_CACHE_H_
+#define COXGRAPH_SERVER_SUBMAP_CACHE_H_
+
+#include <coxgraph_msgs/ClientSubmapChunk.h>
+#include <ros/ros.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace server {
+
+/**
+ * @brief Client submaps the server received before, keyed by client id,
+ * client submap id and the content hash (version) of the submap TSDF, so
+ * transfers can skip submaps whose version did not change.
+ *
+ * A submap is kept as one chunk carrying all its TSDF blocks and its mesh
+ * pointcloud. The least recently used submaps are evicted once the cache
+ * exceeds its memory budget, or spilled to disk if a spill directory is set.
+ * A spill file only lives as long as its entry is spilled, the files of the
+ * cache are removed on construction and destruction.
+ */
+class SubmapCache {
+ public:
+  struct Config {
+    Config() : max_memory_mb(512), spill_directory("") {}
+    int32_t max_memory_mb;
+    std::string spill_directory;
+
+    friend inline std::ostream& operator<<(std::ostream& s, const Config& v) {
+      s << std::endl
+        << "Submap Cache using Config:" << std::endl
+        << "  Max Memory: " << v.max_memory_mb << " MB" << std::endl
+        << "  Spill Directory: "
+        << (v.spill_directory.empty() ? "disabled" : v.spill_directory)
+        << std::endl
+        << "-------------------------------------------" << std::endl;
+      return (s);
+    }
+  };
+
+  typedef std::shared_ptr<SubmapCache> Ptr;
+
+  explicit SubmapCache(const Config& config);
+  ~SubmapCache();
+
+  static Config getConfigFromRosParam(const ros::NodeHandle& nh_private);
+
+  inline const Config& getConfig() const { return config_; }
+
+  inline bool enabled() const { return config_.max_memory_mb > 0; }
+
+  // Ids and versions of all submaps of a client in the cache
+  void getVersions(const CliId& cid, std::vector<CliSmId>* cli_sm_ids,
+                   std::vector<uint64_t>* versions);
+
+  // Takes a submap as one chunk with all its blocks, replaces older versions
+  void put(const CliId& cid,
+           const coxgraph_msgs::ClientSubmapChunk::ConstPtr& submap_msg);
+
+  // Drops all submaps of a client, also the ones spilled to disk
+  void removeClient(const CliId& cid);
+
+  // Returns nullptr if the submap is not cached in this version
+  coxgraph_msgs::ClientSubmapChunk::ConstPtr get(const CliId& cid,
+                                                 const CliSmId& cli_sm_id,
+                                                 uint64_t version);
+
+ private:
+  struct Entry {
+    uint64_t version;
+    size_t size;
+    // nullptr while spilled to disk
+    coxgraph_msgs::ClientSubmapChunk::ConstPtr submap_msg;
+    std::list<CIdCSIdPair>::iterator lru_it;
+  };
+
+  // Spills or drops least recently used entries until within budget
+  void evict();
+  std::string spillPath(const CIdCSIdPair& key) const;
+  bool spill(const CIdCSIdPair& key, const Entry& entry) const;
+  void removeSpillFile(const CIdCSIdPair& key) const;
+  // Removes every spill file in the spill directory, also ones left behind
+  // by an earlier run
+  void removeSpillFiles() const;
+  coxgraph_msgs::ClientSubmapChunk::ConstPtr load(
+      const CIdCSIdPair& key) const;
+
+  const Config config_;
+  const size_t max_memory_size_;
+
+  std::map<CIdCSIdPair, Entry> entries_;
+  // Entries held in memory, most recently used first
+  std::list<CIdCSIdPair> lru_;
+  size_t memory_size_;
+  std::mutex cache_mutex_;
+};
+
+}  // namespace server
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_SERVER_SUBMAP_CACHE_H_
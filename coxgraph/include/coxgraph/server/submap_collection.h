@@ -4,6 +4,7 @@
 #include <voxgraph/frontend/submap_collection/voxgraph_submap_collection.h>
 
 #include <boost/filesystem/path.hpp>
+#include <algorithm>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -12,97 +13,261 @@
 #include <vector>
 
 #include "coxgraph/common.h"
+#include "coxgraph/server/submap_aabb_tree.h"
+#include "coxgraph/utils/persistent_id_map.h"
 
 namespace coxgraph {
 namespace server {
 
+/**
+ * @brief Submaps of all clients, and the mapping between client and server
+ * submap ids.
+ *
+ * The submaps, the id maps and the submap poses are published as immutable
+ * snapshots. Writers (adding submaps and updating poses) are serialized, copy
+ * the current snapshot, modify the copy and swap it in atomically. Readers,
+ * like the optimizer and the visualizer, take one snapshot with getSnapshot()
+ * and get a consistent view without locking, no matter how many updates
+ * arrive in the meantime.
+ *
+ * Snapshots hand out submaps as const, and their poses are never set after
+ * they were added: the current pose of a submap is only kept in the
+ * snapshots. The per submap entries are stored in chunks shared between
+ * snapshots, so publishing a change only copies the chunks it touches.
+ *
+ * The voxgraph base collection still gets every submap, for the voxgraph pose
+ * graph. It's only accessed by the thread adding submaps, which is the one
+ * optimizing the pose graph, everyone else reads snapshots.
+ */
 class SubmapCollection : public voxgraph::VoxgraphSubmapCollection {
  public:
   typedef std::shared_ptr<SubmapCollection> Ptr;
+  typedef std::unordered_map<SerSmId, Transformation> SmPoseMap;
+
+  class Snapshot {
+   public:
+    typedef std::shared_ptr<const Snapshot> ConstPtr;
+
+    // Ids of all clients with submaps in the collection, in ascending order
+    inline std::vector<CliId> getCliIds() const {
+      std::vector<CliId> cids;
+      cids.reserve(cli_sm_ser_sm_id_maps_.size());
+      for (auto const& cli_sm_ser_sm_ids_kv : cli_sm_ser_sm_id_maps_) {
+        cids.emplace_back(cli_sm_ser_sm_ids_kv.first);
+      }
+      return cids;
+    }
+
+    // By ascending client submap id
+    inline bool getSerSmIdsByCliId(const CliId& cid,
+                                   std::vector<SerSmId>* ser_sids) const {
+      CHECK(ser_sids != nullptr);
+      ser_sids->clear();
+      auto ser_sm_ids_it = cli_sm_ser_sm_id_maps_.find(cid);
+      if (ser_sm_ids_it == cli_sm_ser_sm_id_maps_.end()) return false;
+      ser_sids->reserve(ser_sm_ids_it->second.size());
+      ser_sm_ids_it->second.forEach(
+          [ser_sids](int /*cli_sm_id*/, const SerSmId& ser_sm_id) {
+            ser_sids->emplace_back(ser_sm_id);
+          });
+      return true;
+    }
+
+    inline bool getSerSmIdByCliSmId(const CliId& cid, const CliSmId& cli_sm_id,
+                                    SerSmId* ser_sm_id) const {
+      CHECK(ser_sm_id != nullptr);
+      auto cli_sm_ser_sm_id_map_it = cli_sm_ser_sm_id_maps_.find(cid);
+      if (cli_sm_ser_sm_id_map_it == cli_sm_ser_sm_id_maps_.end()) {
+        return false;
+      }
+      const SerSmId* ser_sm_id_ptr =
+          cli_sm_ser_sm_id_map_it->second.find(cli_sm_id);
+      if (ser_sm_id_ptr == nullptr) return false;
+      *ser_sm_id = *ser_sm_id_ptr;
+      return true;
+    }
+
+    // In ascending order
+    inline bool getCliSmIdsByCliId(const CliId& cid,
+                                   std::vector<CliSmId>* cli_sids) const {
+      CHECK(cli_sids != nullptr);
+      cli_sids->clear();
+      auto ser_sm_ids_it = cli_sm_ser_sm_id_maps_.find(cid);
+      if (ser_sm_ids_it == cli_sm_ser_sm_id_maps_.end()) return false;
+      cli_sids->reserve(ser_sm_ids_it->second.size());
+      ser_sm_ids_it->second.forEach(
+          [cli_sids](int cli_sm_id, const SerSmId& /*ser_sm_id*/) {
+            cli_sids->emplace_back(cli_sm_id);
+          });
+      return !cli_sids->empty();
+    }
+
+    inline CIdCSIdPair getCliIdPairBySsid(const SerSmId& ssid) const {
+      const Entry& entry = entries_.at(ssid);
+      return CIdCSIdPair(entry.cid, entry.cli_sm_id);
+    }
+
+    inline bool exists(const SerSmId& ssid) const {
+      return entries_.contains(ssid);
+    }
+
+    inline size_t size() const { return entries_.size(); }
+
+    inline CliSm::ConstPtr getSubmapConstPtr(const SerSmId& ssid) const {
+      return entries_.at(ssid).submap_ptr;
+    }
+
+    // By ascending server submap id
+    inline std::vector<CliSm::ConstPtr> getSubmapConstPtrs() const {
+      std::vector<CliSm::ConstPtr> submap_ptrs;
+      submap_ptrs.reserve(entries_.size());
+      entries_.forEach([&submap_ptrs](int /*ssid*/, const Entry& entry) {
+        submap_ptrs.emplace_back(entry.submap_ptr);
+      });
+      return submap_ptrs;
+    }
+
+    // Submap pose as sent by its client
+    inline Transformation getOriPose(const SerSmId& ssid) const {
+      return entries_.at(ssid).ori_pose;
+    }
+
+    // Current pose of the submap in its client map frame
+    inline Transformation getPose(const SerSmId& ssid) const {
+      return entries_.at(ssid).pose;
+    }
+
+    // Surface bounding box of the submap at its pose in this snapshot
+    inline BoundingBox getAabb(const SerSmId& ssid) const {
+      return entries_.at(ssid).aabb;
+    }
+
+    // Index of the surface bounding boxes of the submaps at their poses in
+    // this snapshot, built on first use
+    const SubmapAabbTree& getAabbTree() const;
+
+    // Number of publishes before this snapshot
+    inline uint64_t getVersion() const { return version_; }
+
+   private:
+    friend class SubmapCollection;
+
+    struct Entry {
+      CliId cid = -1;
+      CliSmId cli_sm_id = -1;
+      Transformation ori_pose;
+      Transformation pose;
+      BoundingBox aabb;
+      CliSm::ConstPtr submap_ptr;
+    };
+
+    Snapshot() : version_(0) {}
+    // The copy starts without bounding box index
+    Snapshot(const Snapshot& rhs)
+        : version_(rhs.version_),
+          entries_(rhs.entries_),
+          cli_sm_ser_sm_id_maps_(rhs.cli_sm_ser_sm_id_maps_) {}
+
+    uint64_t version_;
+    // By server submap id
+    utils::PersistentIdMap<Entry> entries_;
+    // Server submap ids by client and client submap id
+    std::map<CliId, utils::PersistentIdMap<SerSmId>> cli_sm_ser_sm_id_maps_;
+
+    mutable std::mutex aabb_tree_mutex_;
+    mutable std::unique_ptr<SubmapAabbTree> aabb_tree_;
+  };
 
   SubmapCollection(const voxgraph::VoxgraphSubmap::Config& submap_config,
-                   int8_t client_number, bool verbose = false)
+                   bool verbose = false)
       : voxgraph::VoxgraphSubmapCollection(submap_config, verbose),
-        client_number_(client_number) {}
+        cox_submap_config_(submap_config),
+        snapshot_(new Snapshot()) {}
 
-  // Copy constructor without copy mutex
+  // Copy constructor without copy mutex, the copy starts from the current
+  // snapshot and publishes its own versions from there. Submaps are shared.
   SubmapCollection(const SubmapCollection& rhs)
-      : voxgraph::VoxgraphSubmapCollection(
-            static_cast<voxgraph::VoxgraphSubmapCollection>(rhs)),
-        client_number_(rhs.client_number_),
-        sm_cli_id_map_(rhs.sm_cli_id_map_),
-        cli_ser_sm_id_map_(rhs.cli_ser_sm_id_map_),
-        sm_id_ori_pose_map_(rhs.sm_id_ori_pose_map_) {}
+      : voxgraph::VoxgraphSubmapCollection(rhs),
+        cox_submap_config_(rhs.cox_submap_config_),
+        snapshot_(rhs.getSnapshot()) {}
 
   ~SubmapCollection() = default;
 
-  const int8_t& getClientNumber() const { return client_number_; }
+  // Readers should take one snapshot and do all their lookups on it
+  inline Snapshot::ConstPtr getSnapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+  /**
+   * @brief Copy-on-write overlay of this collection. The overlay shares all
+   * current submaps and the current snapshot, so creating it costs one
+   * pointer per submap. Submaps added to the overlay and poses set on it
+   * are only visible in the overlay.
+   */
+  Ptr createOverlay();
 
   Transformation addSubmap(const CliSm::Ptr& submap_ptr, const CliId& cid,
                            const CliSmId& cli_sm_id);
 
+  // Adds all submaps and publishes them in one snapshot
+  void addSubmaps(const std::vector<CliSmPack>& submap_packs);
+
+  // Sets the poses of existing submaps and publishes them in one snapshot,
+  // also as their original client poses if update_ori_poses is set
+  void updateSubmapPoses(const SmPoseMap& submap_poses, bool update_ori_poses);
+
+  // Shallow copies of all submaps at their snapshot poses, for consumers that
+  // read poses off the submaps, like the voxgraph mesher. The copies share
+  // the maps of the submaps, but setting their poses doesn't touch submaps
+  // used elsewhere.
+  voxgraph::VoxgraphSubmapCollection::Ptr createPosedCopy() const;
+
+  inline std::vector<CliId> getCliIds() const {
+    return getSnapshot()->getCliIds();
+  }
+
+  // Surface bounding box of a submap moved from the pose it was added with to
+  // T_O_S. Bounds the moved voxgraph box, so it's conservative unless T_O_S
+  // is that pose
+  static BoundingBox getMovedSurfaceAabb(const CliSm& submap,
+                                         const Transformation& T_O_S);
+
   inline bool getSerSmIdsByCliId(const CliId& cid,
-                                 std::vector<SerSmId>* ser_sids) {
-    if (cli_ser_sm_id_map_.count(cid)) {
-      *ser_sids = cli_ser_sm_id_map_[cid];
-      return true;
-    } else {
-      return false;
-    }
+                                 std::vector<SerSmId>* ser_sids) const {
+    return getSnapshot()->getSerSmIdsByCliId(cid, ser_sids);
   }
 
   inline bool getSerSmIdByCliSmId(const CliId& cid, const CliSmId& cli_sm_id,
-                                  SerSmId* ser_sm_id) {
-    CHECK(ser_sm_id != nullptr);
-    for (auto ser_sm_id_v : cli_ser_sm_id_map_[cid]) {
-      if (sm_cli_id_map_[ser_sm_id_v].second == cli_sm_id) {
-        *ser_sm_id = ser_sm_id_v;
-        return true;
-      }
-    }
-    return false;
+                                  SerSmId* ser_sm_id) const {
+    return getSnapshot()->getSerSmIdByCliSmId(cid, cli_sm_id, ser_sm_id);
   }
 
   inline bool getCliSmIdsByCliId(const CliId& cid,
-                                 std::vector<CliSmId>* cli_sids) {
-    CHECK(cli_sids != nullptr);
-    cli_sids->clear();
-    for (auto ser_sm_id_v : cli_ser_sm_id_map_[cid]) {
-      cli_sids->emplace_back(sm_cli_id_map_[ser_sm_id_v].second);
-    }
-    return !cli_sids->empty();
+                                 std::vector<CliSmId>* cli_sids) const {
+    return getSnapshot()->getCliSmIdsByCliId(cid, cli_sids);
   }
 
-  inline void updateOriPose(const SerSmId& ser_sm_id,
-                            const Transformation& pose) {
-    CHECK(exists(ser_sm_id));
-    sm_id_ori_pose_map_[ser_sm_id] = pose;
-  }
-  inline Transformation getOriPose(const SerSmId& ser_sm_id) {
-    CHECK(sm_id_ori_pose_map_.count(ser_sm_id));
-    return sm_id_ori_pose_map_[ser_sm_id];
-  }
-
-  inline std::timed_mutex* getPosesUpdateMutex() {
-    return &submap_poses_update_mutex;
+  inline Transformation getOriPose(const SerSmId& ser_sm_id) const {
+    return getSnapshot()->getOriPose(ser_sm_id);
   }
 
-  CIdCSIdPair getCliIdPairBySsid(SerSmId ssid) {
-    CHECK(sm_cli_id_map_.count(ssid));
-    return sm_cli_id_map_[ssid];
+  CIdCSIdPair getCliIdPairBySsid(SerSmId ssid) const {
+    return getSnapshot()->getCliIdPairBySsid(ssid);
   }
 
   VoxgraphSubmapCollection::PoseStampedVector getPoseHistory(CliId cid) {
     using PoseCountPair = std::pair<Transformation, int>;
     std::map<ros::Time, PoseCountPair> averaged_trajectory;
+    const Snapshot::ConstPtr snapshot = getSnapshot();
     // Iterate over all submaps and poses
-    for (const auto& submap_ptr : getSubmapConstPtrs()) {
-      if (getCliIdPairBySsid(submap_ptr->getID()).first != cid) continue;
+    for (const auto& submap_ptr : snapshot->getSubmapConstPtrs()) {
+      if (snapshot->getCliIdPairBySsid(submap_ptr->getID()).first != cid)
+        continue;
       for (const std::pair<const ros::Time, Transformation>& time_pose_pair :
            submap_ptr->getPoseHistory()) {
         // Transform the pose from submap frame into odom frame
         const Transformation T_O_B_i =
-            submap_ptr->getPose() * time_pose_pair.second;
+            snapshot->getPose(submap_ptr->getID()) * time_pose_pair.second;
         const ros::Time& timestamp_i = time_pose_pair.first;
 
         // Insert, or average if there was a previous pose with the same stamp
@@ -144,7 +309,7 @@ class SubmapCollection : public voxgraph::VoxgraphSubmapCollection {
   }
 
   void savePoseHistoryToFile(std::string file_path) {
-    for (CliId cid = 0; cid < client_number_; cid++) {
+    for (const CliId& cid : getCliIds()) {
       auto pose_history = getPoseHistory(cid);
       LOG(INFO) << cid << " " << pose_history.size();
 
@@ -167,20 +332,27 @@ class SubmapCollection : public voxgraph::VoxgraphSubmapCollection {
   }
 
  private:
-  typedef std::pair<CliId, CliId> CliIdPair;
-  typedef std::unordered_map<SerSmId, CIdCSIdPair> SmCliIdMap;
-  typedef std::unordered_map<CliId, std::vector<SerSmId>> CliSerSmIdMap;
-
   Transformation mergeToCliMap(const CliSm::Ptr& submap_ptr);
 
-  const int8_t client_number_;
+  void addSubmapToSnapshot(const CliSm::Ptr& submap_ptr, const CliId& cid,
+                           const CliSmId& cli_sm_id, Snapshot* snapshot);
 
-  SmCliIdMap sm_cli_id_map_;
-  CliSerSmIdMap cli_ser_sm_id_map_;
+  // Copies the current snapshot for a writer, to be published with
+  // publishSnapshot() while still holding snapshot_write_mutex_
+  inline std::shared_ptr<Snapshot> copySnapshot() const {
+    return std::shared_ptr<Snapshot>(new Snapshot(*getSnapshot()));
+  }
+  inline void publishSnapshot(const std::shared_ptr<Snapshot>& snapshot) {
+    snapshot->version_++;
+    std::atomic_store(&snapshot_,
+                      std::static_pointer_cast<const Snapshot>(snapshot));
+  }
 
-  std::unordered_map<SerSmId, Transformation> sm_id_ori_pose_map_;
+  const voxgraph::VoxgraphSubmap::Config cox_submap_config_;
 
-  std::timed_mutex submap_poses_update_mutex;
+  // Only accessed through std::atomic_load and std::atomic_store
+  Snapshot::ConstPtr snapshot_;
+  std::mutex snapshot_write_mutex_;
 };
 
 }  // namespace server
@@ -3,37 +3,259 @@
 
 #include <coxgraph/common.h>
 #include <coxgraph_msgs/MeshWithTrajectory.h>
+#include <coxgraph_msgs/PackedMeshWithTrajectory.h>
+#include <nav_msgs/Path.h>
+#include <std_msgs/Header.h>
+#include <voxblox_msgs/MultiMesh.h>
 
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
 #include <utility>
+#include <vector>
+
+#include "coxgraph/utils/mesh_pack_codec.h"
 
 namespace coxgraph {
 namespace server {
 
+/**
+ * @brief Submap meshes received from the clients. Mesh updates are applied
+ * block by block, and the blocks touched since the last call to
+ * takePendingDeltas() are remembered, so that visualization only has to
+ * republish what changed. New subscribers get the full meshes once from
+ * getFullMeshes().
+ */
 class MeshCollection {
  public:
   typedef std::shared_ptr<MeshCollection> Ptr;
 
-  using CSIdMeshMap = std::map<CIdCSIdPair, coxgraph_msgs::MeshWithTrajectory>;
-  using CSIdMeshMapPtr = std::shared_ptr<CSIdMeshMap>;
-
-  MeshCollection() : csid_mesh_map_ptr_(new CSIdMeshMap()) {}
+  MeshCollection() = default;
   ~MeshCollection() = default;
 
-  void addSubmapMesh(CliId cid, CliSmId csid,
-                     coxgraph_msgs::MeshWithTrajectory mesh_with_traj) {
-    if (!csid_mesh_map_ptr_->count(std::make_pair(cid, csid)))
-      csid_mesh_map_ptr_->emplace(std::make_pair(cid, csid), mesh_with_traj);
-    else
-      (*csid_mesh_map_ptr_)[std::make_pair(cid, csid)] = mesh_with_traj;
+  // Returns true if the mesh of the submap fell out of sync with its client,
+  // which then has to publish it in full. Reported once until the full mesh
+  // arrives.
+  bool addSubmapMesh(CliId cid, CliSmId csid,
+                     const coxgraph_msgs::MeshWithTrajectory& mesh_with_traj) {
+    std::lock_guard<std::mutex> mesh_lock(mesh_mutex_);
+    const voxblox_msgs::MultiMesh& multi_mesh = mesh_with_traj.mesh;
+    bool request_resync;
+    SubmapMesh* submap_mesh = startUpdate(
+        cid, csid, multi_mesh.header, multi_mesh.name_space,
+        multi_mesh.mesh.header, multi_mesh.mesh.block_edge_length,
+        mesh_with_traj.trajectory, mesh_with_traj.action, mesh_with_traj.seq,
+        &request_resync);
+    for (auto const& mesh_block : multi_mesh.mesh.mesh_blocks) {
+      applyBlock(mesh_block, submap_mesh);
+    }
+    return request_resync;
+  }
+
+  // Decodes every block of a packed mesh straight into its stored slot,
+  // without an intermediate MeshWithTrajectory. A malformed payload leaves
+  // the blocks decoded up to the error applied and the mesh out of sync.
+  bool addPackedSubmapMesh(
+      CliId cid, CliSmId csid,
+      const coxgraph_msgs::PackedMeshWithTrajectory& packed_mesh) {
+    std::lock_guard<std::mutex> mesh_lock(mesh_mutex_);
+    bool request_resync;
+    SubmapMesh* submap_mesh = startUpdate(
+        cid, csid, packed_mesh.header, packed_mesh.name_space,
+        packed_mesh.mesh_header, packed_mesh.block_edge_length,
+        packed_mesh.trajectory, packed_mesh.action, packed_mesh.seq,
+        &request_resync);
+    if (!utils::MeshPackCodec::forEachBlock(
+            packed_mesh,
+            [submap_mesh](const utils::MeshPackCodec::BlockView& block_view) {
+              applyBlock(block_view, submap_mesh);
+            })) {
+      request_resync = loseSync(submap_mesh);
+    }
+    return request_resync;
+  }
+
+  // Deletes all blocks of the submap meshes of a client, the deletions are
+  // still passed on by the next takePendingDeltas()
+  void removeClientMeshes(CliId cid) {
+    std::lock_guard<std::mutex> mesh_lock(mesh_mutex_);
+    for (auto& csid_mesh_kv : submap_meshes_) {
+      if (csid_mesh_kv.first.first != cid) continue;
+      SubmapMesh& submap_mesh = csid_mesh_kv.second;
+      for (auto const& block_slot : submap_mesh.block_slots) {
+        submap_mesh.pending_blocks.insert(block_slot.first);
+      }
+      submap_mesh.block_slots.clear();
+      submap_mesh.mesh_with_traj.mesh.mesh.mesh_blocks.clear();
+      submap_mesh.mesh_with_traj.mesh.mesh.mesh_blocks.shrink_to_fit();
+      submap_mesh.mesh_with_traj.trajectory.poses.clear();
+    }
   }
 
-  CSIdMeshMapPtr getSubmapMeshesPtr() { return csid_mesh_map_ptr_; }
+  // Current meshes of all submaps, for subscribers that missed the deltas
+  void getFullMeshes(std::vector<voxblox_msgs::MultiMesh>* meshes) {
+    CHECK_NOTNULL(meshes);
+    meshes->clear();
+    std::lock_guard<std::mutex> mesh_lock(mesh_mutex_);
+    for (auto const& csid_mesh_kv : submap_meshes_) {
+      const voxblox_msgs::MultiMesh& stored_mesh =
+          csid_mesh_kv.second.mesh_with_traj.mesh;
+      if (stored_mesh.mesh.mesh_blocks.empty()) continue;
+      meshes->push_back(stored_mesh);
+    }
+  }
+
+  // Collects the changed and deleted blocks of every submap mesh since the
+  // last call, deleted blocks are sent as empty blocks
+  void takePendingDeltas(std::vector<voxblox_msgs::MultiMesh>* deltas) {
+    CHECK_NOTNULL(deltas);
+    deltas->clear();
+    std::lock_guard<std::mutex> mesh_lock(mesh_mutex_);
+    for (auto& csid_mesh_kv : submap_meshes_) {
+      SubmapMesh& submap_mesh = csid_mesh_kv.second;
+      if (submap_mesh.pending_blocks.empty()) continue;
+      const voxblox_msgs::MultiMesh& stored_mesh =
+          submap_mesh.mesh_with_traj.mesh;
+      deltas->emplace_back();
+      voxblox_msgs::MultiMesh& delta = deltas->back();
+      delta.header = stored_mesh.header;
+      delta.name_space = stored_mesh.name_space;
+      delta.mesh.header = stored_mesh.mesh.header;
+      delta.mesh.block_edge_length = stored_mesh.mesh.block_edge_length;
+      delta.mesh.mesh_blocks.reserve(submap_mesh.pending_blocks.size());
+      for (const BlockKey& block_key : submap_mesh.pending_blocks) {
+        auto slot_it = submap_mesh.block_slots.find(block_key);
+        if (slot_it != submap_mesh.block_slots.end()) {
+          delta.mesh.mesh_blocks.push_back(
+              stored_mesh.mesh.mesh_blocks[slot_it->second]);
+        } else {
+          delta.mesh.mesh_blocks.emplace_back();
+          setBlockIndex(block_key, &delta.mesh.mesh_blocks.back());
+        }
+      }
+      submap_mesh.pending_blocks.clear();
+    }
+  }
 
  private:
-  CSIdMeshMapPtr csid_mesh_map_ptr_;
+  typedef std::tuple<int64_t, int64_t, int64_t> BlockKey;
+
+  struct SubmapMesh {
+    coxgraph_msgs::MeshWithTrajectory mesh_with_traj;
+    // Position of every block in mesh_with_traj.mesh.mesh.mesh_blocks
+    std::map<BlockKey, size_t> block_slots;
+    std::set<BlockKey> pending_blocks;
+    // Sequence number of the last mesh received. Out of sync until a full
+    // mesh arrives, a resync is only requested once in the meantime.
+    uint32_t seq = 0;
+    bool in_sync = false;
+    bool resync_requested = false;
+  };
+
+  static inline BlockKey getBlockKey(const voxblox_msgs::MeshBlock& block) {
+    return std::make_tuple(block.index[0], block.index[1], block.index[2]);
+  }
+  static inline void setBlockIndex(const BlockKey& block_key,
+                                   voxblox_msgs::MeshBlock* block) {
+    block->index[0] = std::get<0>(block_key);
+    block->index[1] = std::get<1>(block_key);
+    block->index[2] = std::get<2>(block_key);
+  }
+
+  // Updates the headers and trajectory of a submap mesh, a reset marks all
+  // its blocks for deletion downstream. An update that doesn't follow the
+  // last mesh received puts the mesh out of sync. Called with mesh_mutex_
+  // held.
+  SubmapMesh* startUpdate(CliId cid, CliSmId csid,
+                          const std_msgs::Header& header,
+                          const std::string& name_space,
+                          const std_msgs::Header& mesh_header,
+                          float block_edge_length,
+                          const nav_msgs::Path& trajectory, uint8_t action,
+                          uint32_t seq, bool* request_resync) {
+    CHECK_NOTNULL(request_resync);
+    SubmapMesh& submap_mesh = submap_meshes_[std::make_pair(cid, csid)];
+    *request_resync = false;
+    if (action == coxgraph_msgs::MeshWithTrajectory::ACTION_RESET) {
+      submap_mesh.in_sync = true;
+      submap_mesh.resync_requested = false;
+    } else if (!submap_mesh.in_sync || seq != submap_mesh.seq + 1) {
+      *request_resync = loseSync(&submap_mesh);
+    }
+    submap_mesh.seq = seq;
+    voxblox_msgs::MultiMesh& stored_mesh = submap_mesh.mesh_with_traj.mesh;
+    stored_mesh.header = header;
+    stored_mesh.name_space = name_space;
+    stored_mesh.mesh.header = mesh_header;
+    stored_mesh.mesh.block_edge_length = block_edge_length;
+    submap_mesh.mesh_with_traj.trajectory = trajectory;
+
+    if (action == coxgraph_msgs::MeshWithTrajectory::ACTION_RESET) {
+      // Blocks missing from the new mesh have to be deleted downstream too
+      for (auto const& block_slot : submap_mesh.block_slots) {
+        submap_mesh.pending_blocks.insert(block_slot.first);
+      }
+      stored_mesh.mesh.mesh_blocks.clear();
+      submap_mesh.block_slots.clear();
+    }
+    return &submap_mesh;
+  }
+
+  // Returns true if a resync has yet to be requested
+  static bool loseSync(SubmapMesh* submap_mesh) {
+    submap_mesh->in_sync = false;
+    if (submap_mesh->resync_requested) return false;
+    submap_mesh->resync_requested = true;
+    return true;
+  }
+
+  // Replaces, adds or, if the block is empty, deletes a single block.
+  // Returns the slot of the block, or nullptr if it was deleted.
+  static voxblox_msgs::MeshBlock* applyBlock(const BlockKey& block_key,
+                                             bool empty,
+                                             SubmapMesh* submap_mesh) {
+    auto& mesh_blocks = submap_mesh->mesh_with_traj.mesh.mesh.mesh_blocks;
+    submap_mesh->pending_blocks.insert(block_key);
+    auto slot_it = submap_mesh->block_slots.find(block_key);
+
+    if (empty) {
+      if (slot_it == submap_mesh->block_slots.end()) return nullptr;
+      // Move the last block into the freed slot
+      const size_t slot = slot_it->second;
+      submap_mesh->block_slots.erase(slot_it);
+      if (slot + 1 != mesh_blocks.size()) {
+        mesh_blocks[slot] = std::move(mesh_blocks.back());
+        submap_mesh->block_slots[getBlockKey(mesh_blocks[slot])] = slot;
+      }
+      mesh_blocks.pop_back();
+      return nullptr;
+    } else if (slot_it == submap_mesh->block_slots.end()) {
+      submap_mesh->block_slots.emplace(block_key, mesh_blocks.size());
+      mesh_blocks.emplace_back();
+      return &mesh_blocks.back();
+    }
+    return &mesh_blocks[slot_it->second];
+  }
+  static void applyBlock(const voxblox_msgs::MeshBlock& mesh_block,
+                         SubmapMesh* submap_mesh) {
+    voxblox_msgs::MeshBlock* stored_block = applyBlock(
+        getBlockKey(mesh_block), mesh_block.x.empty(), submap_mesh);
+    if (stored_block != nullptr) *stored_block = mesh_block;
+  }
+  static void applyBlock(const utils::MeshPackCodec::BlockView& block_view,
+                         SubmapMesh* submap_mesh) {
+    voxblox_msgs::MeshBlock* stored_block = applyBlock(
+        std::make_tuple(block_view.index[0], block_view.index[1],
+                        block_view.index[2]),
+        block_view.num_corners == 0u, submap_mesh);
+    if (stored_block != nullptr) block_view.expand(stored_block);
+  }
+
+  std::map<CIdCSIdPair, SubmapMesh> submap_meshes_;
+  std::mutex mesh_mutex_;
 };
 
 }  // namespace server
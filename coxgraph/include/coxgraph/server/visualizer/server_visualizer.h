@@ -20,6 +20,7 @@
 #include "coxgraph/server/pose_graph_interface.h"
 #include "coxgraph/server/submap_collection.h"
 #include "coxgraph/server/visualizer/mesh_collection.h"
+#include "coxgraph/utils/client_color.h"
 
 namespace coxgraph {
 namespace server {
@@ -114,9 +115,6 @@ class ServerVisualizer {
       o3d_vis_update_timer_ = nh_private_.createTimer(
           ros::Duration(0.01), &ServerVisualizer::o3dVisUpdateEvent, this);
     }
-    client_colors_.emplace_back(1.0, 0, 0);
-    client_colors_.emplace_back(0, 1.0, 0);
-    client_colors_.emplace_back(0, 0, 1.0);
   }
 
   ~ServerVisualizer() = default;
@@ -134,8 +132,12 @@ class ServerVisualizer {
   void advertiseTopics() {
     combined_mesh_pub_ =
         nh_private_.advertise<voxblox_msgs::Mesh>("combined_mesh", 10, true);
+    // Not latched, a latched delta is useless without the ones before it.
+    // Every new subscriber gets the full meshes instead.
     separated_mesh_pub_ = nh_private_.advertise<voxblox_msgs::MultiMesh>(
-        "separated_mesh", 10, true);
+        "separated_mesh", 10,
+        boost::bind(&ServerVisualizer::separatedMeshConnectCallback, this,
+                    _1));
     if (config_.publish_submap_meshes_every_n_sec > 0)
       submap_mesh_pub_timer_ = nh_private_.createTimer(
           ros::Duration(config_.publish_submap_meshes_every_n_sec),
@@ -150,31 +152,36 @@ class ServerVisualizer {
   }
 
   /**
-   * @brief Get the Final Global Mesh object, other submaps will be added to
-   * submap_collection and pose graph to optimize, then removed, so
-   * submap_collection and pose graph will not be changed.
+   * @brief Optimize the overlay pose graph for the final global mesh, and
+   * store the optimized poses in the overlay collection. The overlay graph
+   * shares its nodes with the live one, so map fusion must be paused until
+   * this returns.
    *
-   * @param submap_collection_ptr
-   * @param pose_graph_interface
-   * @param other_submaps
+   * @param global_pg_interface copy of the live pose graph interface on the
+   * overlay, with the pulled submaps already added
    */
-  void getFinalGlobalMesh(const SubmapCollection::Ptr& submap_collection_ptr,
-                          const PoseGraphInterface& pose_graph_interface,
-                          const std::vector<CliSmPack>& other_submaps,
-                          const std::string& mission_frame,
-                          const ros::Publisher& publisher,
-                          const std::string& file_path,
-                          bool save_to_file = false);
-
-  void getFinalGlobalMesh(const SubmapCollection::Ptr& submap_collection_ptr,
-                          const PoseGraphInterface& pose_graph_interface,
-                          const std::vector<CliSmPack>& other_submaps,
-                          const std::string& mission_frame,
-                          const std::string& file_path,
-                          bool save_to_file = false) {
-    getFinalGlobalMesh(submap_collection_ptr, pose_graph_interface,
-                       other_submaps, mission_frame, combined_mesh_pub_,
-                       file_path, save_to_file);
+  void optimizeFinalGlobalGraph(PoseGraphInterface* global_pg_interface);
+
+  /**
+   * @brief Get the Final Global Mesh object from the overlay of
+   * submap_collection, at the poses optimizeFinalGlobalGraph() stored in it,
+   * so the live submap_collection will not be changed.
+   *
+   * @param global_submap_collection_ptr overlay from
+   * SubmapCollection::createOverlay(), with the submaps pulled from the
+   * clients already added
+   */
+  void getFinalGlobalMesh(
+      const SubmapCollection::Ptr& global_submap_collection_ptr,
+      const std::string& mission_frame, const ros::Publisher& publisher,
+      const std::string& file_path, bool save_to_file = false);
+
+  void getFinalGlobalMesh(
+      const SubmapCollection::Ptr& global_submap_collection_ptr,
+      const std::string& mission_frame, const std::string& file_path,
+      bool save_to_file = false) {
+    getFinalGlobalMesh(global_submap_collection_ptr, mission_frame,
+                       combined_mesh_pub_, file_path, save_to_file);
   }
 
  private:
@@ -194,17 +201,29 @@ class ServerVisualizer {
   void publishSubmapMeshesCallback(const ros::TimerEvent& event) {
     publishSubmapMeshes();
   }
+  void separatedMeshConnectCallback(
+      const ros::SingleSubscriberPublisher& subscriber) {
+    std::vector<voxblox_msgs::MultiMesh> full_meshes;
+    mesh_collection_ptr_->getFullMeshes(&full_meshes);
+    for (auto& full_mesh : full_meshes) {
+      full_mesh.header.stamp = ros::Time::now();
+      full_mesh.mesh.header.stamp = ros::Time::now();
+      subscriber.publish(full_mesh);
+    }
+  }
+  // Only publishes the blocks that changed since the last call
   void publishSubmapMeshes() {
-    for (auto& kv : *mesh_collection_ptr_->getSubmapMeshesPtr()) {
-      kv.second.mesh.header.stamp = ros::Time::now();
-      kv.second.mesh.mesh.header.stamp = ros::Time::now();
-      separated_mesh_pub_.publish(kv.second.mesh);
+    std::vector<voxblox_msgs::MultiMesh> mesh_deltas;
+    mesh_collection_ptr_->takePendingDeltas(&mesh_deltas);
+    for (auto& mesh_delta : mesh_deltas) {
+      mesh_delta.header.stamp = ros::Time::now();
+      mesh_delta.mesh.header.stamp = ros::Time::now();
+      separated_mesh_pub_.publish(mesh_delta);
     }
   }
 
   open3d::visualization::Visualizer* o3d_vis_;
   ros::Timer o3d_vis_update_timer_;
-  std::vector<Eigen::Vector3d> client_colors_;
   void o3dVisUpdateEvent(const ros::TimerEvent& /*event*/) {
     o3d_vis_->PollEvents();
     o3d_vis_->UpdateRender();
@@ -0,0 +1,42 @@
+#ifndef COXGRAPH_UTILS_CLIENT_COLOR_H_
+#define COXGRAPH_UTILS_CLIENT_COLOR_H_
+
+#include <Eigen/Core>
+
+#include <cmath>
+#include <cstdlib>
+
+#include "coxgraph/common.h"
+
+namespace coxgraph {
+namespace utils {
+
+constexpr double kGoldenRatioConjugate = 0.618033988749895;
+
+// Red, green and blue for the first clients, the hues of further clients are
+// spread by the golden ratio so any number of them stays apart
+inline Eigen::Vector3d getClientColor(const CliId& cid) {
+  const int index = std::abs(static_cast<int>(cid));
+  if (index < 3) return Eigen::Vector3d::Unit(index);
+  const double hue = std::fmod(index * kGoldenRatioConjugate, 1.0) * 6.0;
+  const double x = 1.0 - std::fabs(std::fmod(hue, 2.0) - 1.0);
+  switch (static_cast<int>(hue)) {
+    case 0:
+      return Eigen::Vector3d(1.0, x, 0.0);
+    case 1:
+      return Eigen::Vector3d(x, 1.0, 0.0);
+    case 2:
+      return Eigen::Vector3d(0.0, 1.0, x);
+    case 3:
+      return Eigen::Vector3d(0.0, x, 1.0);
+    case 4:
+      return Eigen::Vector3d(x, 0.0, 1.0);
+    default:
+      return Eigen::Vector3d(1.0, 0.0, x);
+  }
+}
+
+}  // namespace utils
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_UTILS_CLIENT_COLOR_H_
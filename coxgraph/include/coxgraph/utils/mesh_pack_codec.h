@@ -0,0 +1,524 @@
+#ifndef COXGRAPH_UTILS_MESH_PACK_CODEC_H_
+#define COXGRAPH_UTILS_MESH_PACK_CODEC_H_
+
+#include <coxgraph_msgs/MeshWithTrajectory.h>
+#include <coxgraph_msgs/PackedMeshWithTrajectory.h>
+#include <glog/logging.h>
+#include <voxblox_msgs/MeshBlock.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "coxgraph/utils/rans_coder.h"
+
+namespace coxgraph {
+namespace utils {
+
+/**
+ * @brief Packs the mesh blocks of a MeshWithTrajectory into a byte payload.
+ *
+ * Per block, the triangle soup is turned into indexed vertices, a vertex
+ * shared by adjacent triangles is stored once and referenced by its distance
+ * to the next new vertex. Quantized positions are delta coded against the
+ * previous vertex, colors go into a palette if the block has at most 256 of
+ * them and are stored raw (or as lossy RGB565) otherwise. Observation
+ * histories are delta coded as well, all integers are zigzag varints. The
+ * whole payload is then entropy coded with rANS, unless that doesn't make it
+ * smaller. Without lossy colors, unpacking restores the mesh blocks exactly.
+ */
+class MeshPackCodec {
+ public:
+  struct Config {
+    bool entropy_coding = true;
+    bool lossy_colors = false;
+  };
+
+  MeshPackCodec() : MeshPackCodec(Config()) {}
+  explicit MeshPackCodec(const Config& config) : config_(config) {}
+  ~MeshPackCodec() = default;
+
+  void pack(const coxgraph_msgs::MeshWithTrajectory& mesh_with_traj,
+            coxgraph_msgs::PackedMeshWithTrajectory* packed) const {
+    CHECK_NOTNULL(packed);
+    const voxblox_msgs::MultiMesh& multi_mesh = mesh_with_traj.mesh;
+    packed->header = multi_mesh.header;
+    packed->name_space = multi_mesh.name_space;
+    packed->mesh_header = multi_mesh.mesh.header;
+    packed->block_edge_length = multi_mesh.mesh.block_edge_length;
+    packed->trajectory = mesh_with_traj.trajectory;
+    packed->action = mesh_with_traj.action;
+    packed->seq = mesh_with_traj.seq;
+
+    std::vector<uint8_t> payload;
+    payload.push_back(kFormatVersion);
+    writeUnsigned(multi_mesh.mesh.mesh_blocks.size(), &payload);
+    const int64_t kOrigin[3] = {0, 0, 0};
+    const int64_t* previous_index = kOrigin;
+    for (auto const& mesh_block : multi_mesh.mesh.mesh_blocks) {
+      packBlock(mesh_block, previous_index, &payload);
+      previous_index = mesh_block.index.data();
+    }
+
+    packed->raw_size = payload.size();
+    packed->codec = coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RAW;
+    if (config_.entropy_coding) {
+      RansCoder::encode(payload.data(), payload.size(), &packed->data);
+      if (packed->data.size() < payload.size()) {
+        packed->codec = coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RANS;
+        return;
+      }
+    }
+    packed->data.swap(payload);
+  }
+
+  /**
+   * @brief A decoded mesh block, as indexed vertices. Corner i of the
+   * triangle soup is unique vertex corner_vertices[i], the observation
+   * history of triangle t is frames[history_offsets[t]] up to
+   * frames[history_offsets[t + 1]]. The arrays point into scratch buffers of
+   * the decoder and are only valid inside the block callback.
+   */
+  struct BlockView {
+    int64_t index[3];
+    size_t num_corners;
+    const uint32_t* corner_vertices;
+    size_t num_unique;
+    const uint16_t* x;
+    const uint16_t* y;
+    const uint16_t* z;
+    // Null if the block has no colors
+    const uint8_t* r;
+    const uint8_t* g;
+    const uint8_t* b;
+    size_t num_histories;
+    const uint32_t* history_offsets;
+    const uint32_t* frames;
+
+    // Expands the view into a triangle soup block, reusing the capacity of
+    // the arrays already in it
+    void expand(voxblox_msgs::MeshBlock* mesh_block) const {
+      CHECK_NOTNULL(mesh_block);
+      for (int i = 0; i < 3; ++i) mesh_block->index[i] = index[i];
+      mesh_block->x.resize(num_corners);
+      mesh_block->y.resize(num_corners);
+      mesh_block->z.resize(num_corners);
+      for (size_t i = 0; i < num_corners; ++i) {
+        mesh_block->x[i] = x[corner_vertices[i]];
+        mesh_block->y[i] = y[corner_vertices[i]];
+        mesh_block->z[i] = z[corner_vertices[i]];
+      }
+      const size_t num_colors = r != nullptr ? num_corners : 0u;
+      mesh_block->r.resize(num_colors);
+      mesh_block->g.resize(num_colors);
+      mesh_block->b.resize(num_colors);
+      for (size_t i = 0; i < num_colors; ++i) {
+        mesh_block->r[i] = r[corner_vertices[i]];
+        mesh_block->g[i] = g[corner_vertices[i]];
+        mesh_block->b[i] = b[corner_vertices[i]];
+      }
+      mesh_block->history.resize(num_histories);
+      for (size_t t = 0; t < num_histories; ++t) {
+        mesh_block->history[t].history.assign(
+            frames + history_offsets[t], frames + history_offsets[t + 1]);
+      }
+    }
+  };
+
+  // Decodes straight from the message buffer and calls
+  // block_fn(const BlockView&) for every block in order, only an entropy
+  // coded payload is expanded into a scratch buffer first. The scratch
+  // buffers are shared by all blocks, nothing is allocated per block once
+  // they have grown. Returns false if the payload is malformed, the blocks
+  // before the malformed one have then already been passed to block_fn.
+  template <typename BlockFunction>
+  static bool forEachBlock(
+      const coxgraph_msgs::PackedMeshWithTrajectory& packed,
+      const BlockFunction& block_fn) {
+    const uint8_t* payload = packed.data.data();
+    const uint8_t* end = payload + packed.data.size();
+    std::vector<uint8_t> decoded;
+    if (packed.codec == coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RANS) {
+      decoded.resize(packed.raw_size);
+      if (!RansCoder::decode(packed.data.data(), packed.data.size(),
+                             packed.raw_size, decoded.data())) {
+        return false;
+      }
+      payload = decoded.data();
+      end = payload + decoded.size();
+    } else if (packed.codec !=
+               coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RAW) {
+      return false;
+    }
+
+    if (payload == end || *payload++ != kFormatVersion) return false;
+    uint64_t num_blocks;
+    if (!readUnsigned(&payload, end, &num_blocks) ||
+        num_blocks > static_cast<uint64_t>(end - payload)) {
+      return false;
+    }
+    BlockBuffers buffers;
+    BlockView block_view;
+    const int64_t kOrigin[3] = {0, 0, 0};
+    const int64_t* previous_index = kOrigin;
+    int64_t block_index[3];
+    for (uint64_t block_i = 0; block_i < num_blocks; ++block_i) {
+      if (!unpackBlock(&payload, end, previous_index, &buffers, &block_view)) {
+        return false;
+      }
+      block_fn(block_view);
+      std::copy(block_view.index, block_view.index + 3, block_index);
+      previous_index = block_index;
+    }
+    return payload == end;
+  }
+
+  // Decodes into the triangle soup blocks of a MeshWithTrajectory. Returns
+  // false if the payload is malformed.
+  static bool unpack(const coxgraph_msgs::PackedMeshWithTrajectory& packed,
+                     coxgraph_msgs::MeshWithTrajectory* mesh_with_traj) {
+    CHECK_NOTNULL(mesh_with_traj);
+    voxblox_msgs::MultiMesh& multi_mesh = mesh_with_traj->mesh;
+    multi_mesh.header = packed.header;
+    multi_mesh.name_space = packed.name_space;
+    multi_mesh.mesh.header = packed.mesh_header;
+    multi_mesh.mesh.block_edge_length = packed.block_edge_length;
+    multi_mesh.mesh.mesh_blocks.clear();
+    mesh_with_traj->trajectory = packed.trajectory;
+    mesh_with_traj->action = packed.action;
+    mesh_with_traj->seq = packed.seq;
+
+    auto& mesh_blocks = multi_mesh.mesh.mesh_blocks;
+    return forEachBlock(packed, [&mesh_blocks](const BlockView& block_view) {
+      mesh_blocks.emplace_back();
+      block_view.expand(&mesh_blocks.back());
+    });
+  }
+
+ private:
+  enum ColorMode : uint8_t { kNoColor = 0, kPalette, kRaw, kRgb565 };
+  enum : uint8_t { kFormatVersion = 1 };
+  static constexpr size_t kMaxPaletteSize = 256;
+
+  // Backing storage of a BlockView
+  struct BlockBuffers {
+    std::vector<uint32_t> corner_vertices;
+    std::vector<uint16_t> x, y, z;
+    std::vector<uint8_t> r, g, b;
+    std::vector<uint32_t> history_offsets;
+    std::vector<uint32_t> frames;
+  };
+
+  void packBlock(const voxblox_msgs::MeshBlock& mesh_block,
+                 const int64_t* previous_index,
+                 std::vector<uint8_t>* payload) const {
+    for (int i = 0; i < 3; ++i) {
+      writeSigned(mesh_block.index[i] - previous_index[i], payload);
+    }
+    const size_t num_vertices = mesh_block.x.size();
+    CHECK_EQ(mesh_block.y.size(), num_vertices);
+    CHECK_EQ(mesh_block.z.size(), num_vertices);
+    // Colors are either missing or given for every vertex
+    const bool has_colors = !mesh_block.r.empty() || !mesh_block.g.empty() ||
+                            !mesh_block.b.empty();
+    if (has_colors) {
+      CHECK_EQ(mesh_block.r.size(), num_vertices);
+      CHECK_EQ(mesh_block.g.size(), num_vertices);
+      CHECK_EQ(mesh_block.b.size(), num_vertices);
+    }
+    writeUnsigned(num_vertices, payload);
+
+    // Vertices of the triangle soup that share position and color with an
+    // earlier one become references to it
+    std::vector<uint32_t> unique_vertices;
+    std::vector<uint64_t> corner_codes(num_vertices);
+    std::unordered_map<uint64_t, uint32_t> vertex_ids;
+    for (size_t i = 0; i < num_vertices; ++i) {
+      const uint64_t position_key =
+          static_cast<uint64_t>(mesh_block.x[i]) |
+          static_cast<uint64_t>(mesh_block.y[i]) << 16 |
+          static_cast<uint64_t>(mesh_block.z[i]) << 32;
+      auto vertex_it = vertex_ids.find(position_key);
+      if (vertex_it != vertex_ids.end() &&
+          (!has_colors ||
+           sameColor(mesh_block, unique_vertices[vertex_it->second], i))) {
+        corner_codes[i] = unique_vertices.size() - vertex_it->second;
+        continue;
+      }
+      vertex_ids[position_key] = unique_vertices.size();
+      unique_vertices.push_back(i);
+      corner_codes[i] = 0;
+    }
+    writeUnsigned(unique_vertices.size(), payload);
+    for (const uint64_t corner_code : corner_codes) {
+      writeUnsigned(corner_code, payload);
+    }
+
+    int64_t previous_position[3] = {0, 0, 0};
+    for (const uint32_t i : unique_vertices) {
+      const int64_t position[3] = {mesh_block.x[i], mesh_block.y[i],
+                                   mesh_block.z[i]};
+      for (int d = 0; d < 3; ++d) {
+        writeSigned(position[d] - previous_position[d], payload);
+        previous_position[d] = position[d];
+      }
+    }
+
+    packColors(mesh_block, has_colors, unique_vertices, payload);
+
+    writeUnsigned(mesh_block.history.size(), payload);
+    for (auto const& observation : mesh_block.history) {
+      writeUnsigned(observation.history.size(), payload);
+      int64_t previous_frame = 0;
+      for (auto const frame : observation.history) {
+        writeSigned(static_cast<int64_t>(frame) - previous_frame, payload);
+        previous_frame = static_cast<int64_t>(frame);
+      }
+    }
+  }
+
+  void packColors(const voxblox_msgs::MeshBlock& mesh_block, bool has_colors,
+                  const std::vector<uint32_t>& unique_vertices,
+                  std::vector<uint8_t>* payload) const {
+    if (!has_colors) {
+      payload->push_back(kNoColor);
+      return;
+    }
+
+    std::unordered_map<uint32_t, uint8_t> palette_ids;
+    std::vector<uint32_t> palette;
+    for (const uint32_t i : unique_vertices) {
+      const uint32_t color = packedColor(mesh_block, i);
+      if (palette_ids.count(color)) continue;
+      if (palette.size() == kMaxPaletteSize) {
+        palette.clear();
+        break;
+      }
+      palette_ids.emplace(color, palette.size());
+      palette.push_back(color);
+    }
+
+    if (!palette.empty()) {
+      payload->push_back(kPalette);
+      writeUnsigned(palette.size(), payload);
+      for (const uint32_t color : palette) {
+        payload->push_back(static_cast<uint8_t>(color >> 16));
+        payload->push_back(static_cast<uint8_t>(color >> 8));
+        payload->push_back(static_cast<uint8_t>(color));
+      }
+      for (const uint32_t i : unique_vertices) {
+        payload->push_back(palette_ids[packedColor(mesh_block, i)]);
+      }
+    } else if (config_.lossy_colors) {
+      payload->push_back(kRgb565);
+      for (const uint32_t i : unique_vertices) {
+        const uint16_t color = (mesh_block.r[i] >> 3) << 11 |
+                               (mesh_block.g[i] >> 2) << 5 |
+                               mesh_block.b[i] >> 3;
+        payload->push_back(static_cast<uint8_t>(color >> 8));
+        payload->push_back(static_cast<uint8_t>(color));
+      }
+    } else {
+      payload->push_back(kRaw);
+      for (const uint32_t i : unique_vertices) {
+        payload->push_back(mesh_block.r[i]);
+        payload->push_back(mesh_block.g[i]);
+        payload->push_back(mesh_block.b[i]);
+      }
+    }
+  }
+
+  static bool unpackBlock(const uint8_t** payload, const uint8_t* end,
+                          const int64_t* previous_index, BlockBuffers* buffers,
+                          BlockView* block_view) {
+    for (int i = 0; i < 3; ++i) {
+      int64_t index_delta;
+      if (!readSigned(payload, end, &index_delta)) return false;
+      block_view->index[i] = previous_index[i] + index_delta;
+    }
+
+    // Every vertex and corner takes at least one byte, which bounds the
+    // sizes before anything is allocated for them
+    uint64_t num_vertices, num_unique;
+    if (!readUnsigned(payload, end, &num_vertices) ||
+        num_vertices > static_cast<uint64_t>(end - *payload) ||
+        !readUnsigned(payload, end, &num_unique) ||
+        num_unique > num_vertices) {
+      return false;
+    }
+    std::vector<uint32_t>& corner_vertices = buffers->corner_vertices;
+    corner_vertices.resize(num_vertices);
+    uint32_t next_unique = 0;
+    for (uint32_t& corner_vertex : corner_vertices) {
+      uint64_t corner_code;
+      if (!readUnsigned(payload, end, &corner_code)) return false;
+      if (corner_code == 0) {
+        if (next_unique == num_unique) return false;
+        corner_vertex = next_unique++;
+      } else {
+        if (corner_code > next_unique) return false;
+        corner_vertex = next_unique - corner_code;
+      }
+    }
+    if (next_unique != num_unique) return false;
+
+    buffers->x.resize(num_unique);
+    buffers->y.resize(num_unique);
+    buffers->z.resize(num_unique);
+    int64_t position[3] = {0, 0, 0};
+    for (uint64_t v = 0; v < num_unique; ++v) {
+      for (int d = 0; d < 3; ++d) {
+        int64_t position_delta;
+        if (!readSigned(payload, end, &position_delta)) return false;
+        position[d] += position_delta;
+        if (position[d] < 0 || position[d] > UINT16_MAX) return false;
+      }
+      buffers->x[v] = position[0];
+      buffers->y[v] = position[1];
+      buffers->z[v] = position[2];
+    }
+
+    bool has_colors;
+    if (!unpackColors(payload, end, num_unique, buffers, &has_colors)) {
+      return false;
+    }
+
+    uint64_t num_histories;
+    if (!readUnsigned(payload, end, &num_histories) ||
+        num_histories > static_cast<uint64_t>(end - *payload)) {
+      return false;
+    }
+    buffers->history_offsets.resize(num_histories + 1);
+    buffers->history_offsets[0] = 0u;
+    buffers->frames.clear();
+    for (uint64_t t = 0; t < num_histories; ++t) {
+      uint64_t history_size;
+      if (!readUnsigned(payload, end, &history_size) ||
+          history_size > static_cast<uint64_t>(end - *payload)) {
+        return false;
+      }
+      int64_t frame = 0;
+      for (uint64_t i = 0; i < history_size; ++i) {
+        int64_t frame_delta;
+        if (!readSigned(payload, end, &frame_delta)) return false;
+        frame += frame_delta;
+        buffers->frames.push_back(frame);
+      }
+      buffers->history_offsets[t + 1] = buffers->frames.size();
+    }
+
+    block_view->num_corners = num_vertices;
+    block_view->corner_vertices = corner_vertices.data();
+    block_view->num_unique = num_unique;
+    block_view->x = buffers->x.data();
+    block_view->y = buffers->y.data();
+    block_view->z = buffers->z.data();
+    block_view->r = has_colors ? buffers->r.data() : nullptr;
+    block_view->g = has_colors ? buffers->g.data() : nullptr;
+    block_view->b = has_colors ? buffers->b.data() : nullptr;
+    block_view->num_histories = num_histories;
+    block_view->history_offsets = buffers->history_offsets.data();
+    block_view->frames = buffers->frames.data();
+    return true;
+  }
+
+  static bool unpackColors(const uint8_t** payload, const uint8_t* end,
+                           uint64_t num_unique, BlockBuffers* buffers,
+                           bool* has_colors) {
+    if (*payload == end) return false;
+    const uint8_t color_mode = *(*payload)++;
+    *has_colors = color_mode != kNoColor;
+    if (!*has_colors) return true;
+
+    std::vector<uint8_t>& unique_r = buffers->r;
+    std::vector<uint8_t>& unique_g = buffers->g;
+    std::vector<uint8_t>& unique_b = buffers->b;
+    unique_r.resize(num_unique);
+    unique_g.resize(num_unique);
+    unique_b.resize(num_unique);
+    if (color_mode == kPalette) {
+      uint64_t palette_size;
+      if (!readUnsigned(payload, end, &palette_size) || palette_size == 0 ||
+          palette_size > kMaxPaletteSize ||
+          static_cast<uint64_t>(end - *payload) <
+              3 * palette_size + num_unique) {
+        return false;
+      }
+      const uint8_t* palette = *payload;
+      *payload += 3 * palette_size;
+      for (uint64_t v = 0; v < num_unique; ++v) {
+        const uint8_t palette_id = *(*payload)++;
+        if (palette_id >= palette_size) return false;
+        unique_r[v] = palette[3 * palette_id];
+        unique_g[v] = palette[3 * palette_id + 1];
+        unique_b[v] = palette[3 * palette_id + 2];
+      }
+    } else if (color_mode == kRaw) {
+      if (static_cast<uint64_t>(end - *payload) < 3 * num_unique) return false;
+      for (uint64_t v = 0; v < num_unique; ++v) {
+        unique_r[v] = *(*payload)++;
+        unique_g[v] = *(*payload)++;
+        unique_b[v] = *(*payload)++;
+      }
+    } else if (color_mode == kRgb565) {
+      if (static_cast<uint64_t>(end - *payload) < 2 * num_unique) return false;
+      for (uint64_t v = 0; v < num_unique; ++v) {
+        const uint16_t color = (*payload)[0] << 8 | (*payload)[1];
+        *payload += 2;
+        const uint8_t r = color >> 11;
+        const uint8_t g = (color >> 5) & 0x3f;
+        const uint8_t b = color & 0x1f;
+        unique_r[v] = r << 3 | r >> 2;
+        unique_g[v] = g << 2 | g >> 4;
+        unique_b[v] = b << 3 | b >> 2;
+      }
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  static inline uint32_t packedColor(const voxblox_msgs::MeshBlock& mesh_block,
+                                     size_t i) {
+    return static_cast<uint32_t>(mesh_block.r[i]) << 16 |
+           static_cast<uint32_t>(mesh_block.g[i]) << 8 | mesh_block.b[i];
+  }
+
+  static inline bool sameColor(const voxblox_msgs::MeshBlock& mesh_block,
+                               size_t i, size_t j) {
+    return packedColor(mesh_block, i) == packedColor(mesh_block, j);
+  }
+
+  static inline void writeUnsigned(uint64_t value,
+                                   std::vector<uint8_t>* payload) {
+    RansCoder::writeVarint(value, payload);
+  }
+  static inline void writeSigned(int64_t value,
+                                 std::vector<uint8_t>* payload) {
+    // Zigzag, so small negative deltas stay small
+    RansCoder::writeVarint((static_cast<uint64_t>(value) << 1) ^
+                               static_cast<uint64_t>(value >> 63),
+                           payload);
+  }
+  static inline bool readUnsigned(const uint8_t** payload, const uint8_t* end,
+                                  uint64_t* value) {
+    return RansCoder::readVarint(payload, end, value);
+  }
+  static inline bool readSigned(const uint8_t** payload, const uint8_t* end,
+                                int64_t* value) {
+    uint64_t zigzag;
+    if (!RansCoder::readVarint(payload, end, &zigzag)) return false;
+    *value =
+        static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+    return true;
+  }
+
+  Config config_;
+};
+
+}  // namespace utils
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_UTILS_MESH_PACK_CODEC_H_
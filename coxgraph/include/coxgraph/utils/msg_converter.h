@@ -5,15 +5,16 @@
 #include <cblox_msgs/MapLayer.h>
 #include <cblox_ros/submap_conversions.h>
 #include <coxgraph_msgs/BoundingBox.h>
-#include <coxgraph_msgs/ClientSubmap.h>
-#include <coxgraph_msgs/ClientSubmapSrvResponse.h>
+#include <coxgraph_msgs/ClientSubmapChunk.h>
 #include <coxgraph_msgs/MapFusion.h>
+#include <nav_msgs/Path.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <sensor_msgs/PointCloud.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/point_cloud_conversion.h>
 #include <voxblox_msgs/Layer.h>
 #include <voxblox_msgs/LayerWithTrajectory.h>
+#include <voxblox_msgs/MeshBlock.h>
 #include <voxblox_ros/conversions.h>
 #include <voxgraph_msgs/LoopClosure.h>
 
@@ -23,6 +24,7 @@
 #include <vector>
 
 #include "coxgraph/common.h"
+#include "coxgraph/utils/client_color.h"
 
 namespace coxgraph {
 namespace utils {
@@ -43,53 +45,75 @@ inline cblox_msgs::MapLayer tsdfMsgfromClientSubmap(
   return submap_tsdf_msg;
 }
 
-inline coxgraph_msgs::ClientSubmap msgFromCliSubmap(
-    const CliSm& submap, const std::string& frame_id) {
-  voxblox_msgs::Layer layer_msg;
-  voxblox::serializeLayerAsMsg<voxblox::TsdfVoxel>(
-      submap.getTsdfMap().getTsdfLayer(), false, &layer_msg);
-  voxblox_msgs::LayerWithTrajectory layer_with_trajectory_msg;
-  layer_with_trajectory_msg.layer = layer_msg;
-
-  LOG(INFO) << "debug: submap pose history size: "
-            << submap.getPoseHistory().size();
+// Fills the map header and trajectory of the first chunk of a submap
+inline void chunkHeaderFromCliSubmap(const CliSm& submap,
+                                     const std::string& frame_id,
+                                     coxgraph_msgs::ClientSubmapChunk* chunk) {
+  CHECK_NOTNULL(chunk);
   for (auto const& time_pose_kv : submap.getPoseHistory()) {
     geometry_msgs::PoseStamped pose_msg;
     pose_msg.header.stamp = time_pose_kv.first;
     tf::poseKindrToMsg(time_pose_kv.second.cast<double>(), &pose_msg.pose);
-    layer_with_trajectory_msg.trajectory.poses.emplace_back(pose_msg);
+    chunk->trajectory.poses.emplace_back(pose_msg);
   }
 
-  coxgraph_msgs::ClientSubmap cli_submap_msg;
-  cli_submap_msg.layer_with_traj = layer_with_trajectory_msg;
-  cli_submap_msg.map_header.id = submap.getID();
-  cli_submap_msg.map_header.start = submap.getStartTime();
-  cli_submap_msg.map_header.end = submap.getEndTime();
-  cli_submap_msg.map_header.header.stamp = ros::Time::now();
+  chunk->map_header.id = submap.getID();
+  chunk->map_header.start = submap.getStartTime();
+  chunk->map_header.end = submap.getEndTime();
+  chunk->map_header.header.stamp = ros::Time::now();
   tf::poseKindrToMsg(submap.getPose().cast<double>(),
-                     &cli_submap_msg.map_header.pose.map_pose);
-  cli_submap_msg.map_header.pose.frame_id = frame_id;
-  cli_submap_msg.mesh_pointclouds = *submap.mesh_pointcloud_;
-  return cli_submap_msg;
+                     &chunk->map_header.pose.map_pose);
+  chunk->map_header.pose.frame_id = frame_id;
+}
+
+// Serializes the TSDF blocks [begin, end) of block_indices, the message only
+// updates these blocks when deserialized
+inline void tsdfBlocksToMsg(const voxblox::Layer<voxblox::TsdfVoxel>& layer,
+                            const voxblox::BlockIndexList& block_indices,
+                            size_t begin, size_t end,
+                            voxblox_msgs::Layer* layer_msg) {
+  CHECK_NOTNULL(layer_msg);
+  CHECK_LE(end, block_indices.size());
+  layer_msg->voxel_size = layer.voxel_size();
+  layer_msg->voxels_per_side = layer.voxels_per_side();
+  layer_msg->layer_type = voxblox::voxel_types::kTsdf;
+  layer_msg->action = voxblox_msgs::Layer::ACTION_UPDATE;
+  layer_msg->blocks.clear();
+  layer_msg->blocks.reserve(end - begin);
+  for (size_t i = begin; i < end; ++i) {
+    // The indices may be listed before the layer changed, skip blocks that
+    // are gone since
+    const voxblox::BlockIndex& block_index = block_indices[i];
+    voxblox::Block<voxblox::TsdfVoxel>::ConstPtr block_ptr =
+        layer.getBlockPtrByIndex(block_index);
+    if (block_ptr == nullptr) continue;
+    layer_msg->blocks.emplace_back();
+    voxblox_msgs::Block& block_msg = layer_msg->blocks.back();
+    block_msg.x_index = block_index.x();
+    block_msg.y_index = block_index.y();
+    block_msg.z_index = block_index.z();
+    block_ptr->serializeToIntegers(&block_msg.data);
+  }
 }
 
 /**
- * @brief Generate Client Submap from Message
+ * @brief Generate an empty Client Submap from the first chunk of its transfer
  *
  * @param ser_sm_id
  * @param submap_config
- * @param submap_response
+ * @param chunk
  * @param frame_id
  * @return CliSm::Ptr
  */
-inline CliSm::Ptr cliSubmapFromMsg(
+inline CliSm::Ptr cliSubmapFromChunk(
     const SerSmId& ser_sm_id, const CliSmConfig& submap_config,
-    const coxgraph_msgs::ClientSubmap& submap_msg, std::string* frame_id) {
+    const coxgraph_msgs::ClientSubmapChunk& chunk, std::string* frame_id) {
+  CHECK(chunk.submap_begin);
   CliSm::Ptr submap_ptr(new CliSm(Transformation(), ser_sm_id, submap_config));
 
   // Naming copied from voxgraph
   for (const geometry_msgs::PoseStamped& pose_stamped :
-       submap_msg.layer_with_traj.trajectory.poses) {
+       chunk.trajectory.poses) {
     TransformationD T_submap_base_link;
     tf::poseMsgToKindr(pose_stamped.pose, &T_submap_base_link);
     submap_ptr->addPoseToHistory(
@@ -99,30 +123,32 @@ inline CliSm::Ptr cliSubmapFromMsg(
 
   if (submap_ptr->getPoseHistory().size()) {
     TransformationD submap_pose;
-    tf::poseMsgToKindr(submap_msg.map_header.pose.map_pose, &submap_pose);
+    tf::poseMsgToKindr(chunk.map_header.pose.map_pose, &submap_pose);
     submap_ptr->setPose(submap_pose.cast<voxblox::FloatingPoint>());
-    *frame_id = submap_msg.map_header.pose.frame_id;
-
-    // Deserialize the submap TSDF
-    if (!voxblox::deserializeMsgToLayer(
-            submap_msg.layer_with_traj.layer,
-            submap_ptr->getTsdfMapPtr()->getTsdfLayerPtr())) {
-      LOG(FATAL)
-          << "Received a submap msg with an invalid TSDF. Skipping submap.";
-    }
-    submap_ptr->finishSubmap();
-    *submap_ptr->mesh_pointcloud_ = submap_msg.mesh_pointclouds;
+    *frame_id = chunk.map_header.pose.frame_id;
   }
 
   return submap_ptr;
 }
 
-inline CliSm::Ptr cliSubmapFromMsg(
-    const SerSmId& ser_sm_id, const CliSmConfig& submap_config,
-    const coxgraph_msgs::ClientSubmapSrvResponse& submap_response,
-    std::string* frame_id) {
-  return cliSubmapFromMsg(ser_sm_id, submap_config, submap_response.submap,
-                          frame_id);
+// Deserializes the TSDF blocks of a chunk into its submap, and finishes the
+// submap with its last chunk. Submaps sent without trajectory stay empty.
+inline bool addChunkToCliSubmap(const coxgraph_msgs::ClientSubmapChunk& chunk,
+                                CliSm* submap_ptr) {
+  CHECK_NOTNULL(submap_ptr);
+  if (submap_ptr->getPoseHistory().empty()) return true;
+
+  if (chunk.layer.blocks.size() &&
+      !voxblox::deserializeMsgToLayer(
+          chunk.layer, submap_ptr->getTsdfMapPtr()->getTsdfLayerPtr())) {
+    LOG(ERROR) << "Received a submap chunk with an invalid TSDF.";
+    return false;
+  }
+  if (chunk.submap_end) {
+    submap_ptr->finishSubmap();
+    *submap_ptr->mesh_pointcloud_ = chunk.mesh_pointclouds;
+  }
+  return true;
 }
 
 inline voxgraph_msgs::LoopClosure fromMapFusionMsg(
@@ -146,24 +172,87 @@ inline coxgraph_msgs::BoundingBox msgFromBb(const BoundingBox& bounding_box) {
   return bb_msg;
 }
 
-inline uint64_t sizeOfMsg(const coxgraph_msgs::ClientSubmap& msg) {
-  uint64_t total_size = 0;
-  for (auto const& block : msg.layer_with_traj.layer.blocks) {
-    total_size += 3 * sizeof(block.x_index);
-    if (block.data.size())
-      total_size += block.data.size() * sizeof(block.data[0]);
+inline BoundingBox bbFromMsg(const coxgraph_msgs::BoundingBox& bb_msg) {
+  BoundingBox bounding_box;
+  bounding_box.min =
+      voxblox::Point(bb_msg.min[0], bb_msg.min[1], bb_msg.min[2]);
+  bounding_box.max =
+      voxblox::Point(bb_msg.max[0], bb_msg.max[1], bb_msg.max[2]);
+  return bounding_box;
+}
+
+// FNV-1a over the vertices, colors and observation history of a mesh block,
+// used to tell which blocks changed between two meshes of a submap
+inline uint64_t hashMeshBlock(const voxblox_msgs::MeshBlock& mesh_block) {
+  uint64_t hash = 14695981039346656037ull;
+  auto hash_bytes = [&hash](const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+  auto hash_vector = [&hash_bytes](const auto& values) {
+    const uint64_t size = values.size();
+    hash_bytes(&size, sizeof(size));
+    if (size) hash_bytes(values.data(), size * sizeof(values[0]));
+  };
+  hash_vector(mesh_block.x);
+  hash_vector(mesh_block.y);
+  hash_vector(mesh_block.z);
+  hash_vector(mesh_block.r);
+  hash_vector(mesh_block.g);
+  hash_vector(mesh_block.b);
+  for (auto const& observation : mesh_block.history) {
+    hash_vector(observation.history);
+  }
+  return hash;
+}
+
+// FNV-1a over the stamps and poses of a trajectory, used to tell whether a
+// submap mesh has to be republished for its trajectory alone
+inline uint64_t hashTrajectory(const nav_msgs::Path& trajectory) {
+  uint64_t hash = 14695981039346656037ull;
+  auto hash_bytes = [&hash](const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+  };
+  for (auto const& pose_msg : trajectory.poses) {
+    const geometry_msgs::Pose& pose = pose_msg.pose;
+    const double values[8] = {
+        pose_msg.header.stamp.toSec(), pose.position.x,    pose.position.y,
+        pose.position.z,               pose.orientation.x, pose.orientation.y,
+        pose.orientation.z,            pose.orientation.w};
+    hash_bytes(values, sizeof(values));
+  }
+  return hash;
+}
+
+// Content hash of a TSDF layer, independent of the block iteration order
+inline uint64_t hashTsdfLayer(const voxblox::Layer<voxblox::TsdfVoxel>& layer) {
+  voxblox::BlockIndexList block_indices;
+  layer.getAllAllocatedBlocks(&block_indices);
+  uint64_t layer_hash = block_indices.size();
+  std::vector<uint32_t> block_data;
+  for (const voxblox::BlockIndex& block_index : block_indices) {
+    layer.getBlockByIndex(block_index).serializeToIntegers(&block_data);
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 3; ++i) {
+      hash = (hash ^ static_cast<uint32_t>(block_index[i])) * 1099511628211ull;
+    }
+    for (const uint32_t value : block_data) {
+      hash = (hash ^ value) * 1099511628211ull;
+    }
+    // Finalize with splitmix64 before summing, so blocks do not cancel out
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    layer_hash += hash;
   }
-  total_size += sizeof(msg.layer_with_traj.layer.voxel_size);
-  total_size += sizeof(msg.layer_with_traj.layer.voxels_per_side);
-  total_size += sizeof(msg.layer_with_traj.layer.layer_type);
-  total_size += sizeof(msg.layer_with_traj.layer.action);
-  total_size += sizeof(msg.layer_with_traj.trajectory.header);
-  if (msg.layer_with_traj.trajectory.poses.size())
-    total_size += msg.layer_with_traj.trajectory.poses.size() *
-                  sizeof(msg.layer_with_traj.trajectory.poses[0]);
-  total_size += sizeof(msg.map_header);
-
-  return total_size;
+  return layer_hash;
 }
 
 inline CIdCSIdPair resolveSubmapFrame(std::string frame_id) {
@@ -174,29 +263,19 @@ inline CIdCSIdPair resolveSubmapFrame(std::string frame_id) {
   return std::make_pair(cid, csid);
 }
 
+// Color mode 0 keeps the mesh colors, 1 paints the mesh in the client color
+// and 2 tints the mesh colors with it
 inline Eigen::Vector3d getColor(Eigen::Vector3d ori_color, int color_mode,
                                 CliId cid) {
-  Eigen::Vector3d color;
-  if (color_mode == 0)
-    return ori_color;
-  else if (color_mode == 2) {
-    color = ori_color;
-    if (cid == 0) {
-      color[0] *= 1.0;
-      color[1] *= 0.5;
-      color[2] *= 0.5;
-    } else if (cid == 1) {
-      color[0] *= 0.5;
-      color[1] *= 1.0;
-      color[2] *= 0.5;
-    } else if (cid == 2) {
-      color[0] *= 0.5;
-      color[1] *= 0.5;
-      color[2] *= 1.0;
-    }
-    return color;
+  switch (color_mode) {
+    case 1:
+      return getClientColor(cid);
+    case 2:
+      return ori_color.cwiseProduct(
+          (getClientColor(cid).array() * 0.5 + 0.5).matrix());
+    default:
+      return ori_color;
   }
-  return ori_color;
 }
 
 inline std::shared_ptr<open3d::geometry::TriangleMesh> o3dMeshFromMsg(
@@ -235,27 +314,9 @@ inline std::shared_ptr<open3d::geometry::TriangleMesh> o3dMeshFromMsg(
   std::shared_ptr<open3d::geometry::TriangleMesh> o3d_mesh(
       new open3d::geometry::TriangleMesh(vertices, indices));
 
-  Eigen::Vector3d color;
   if (color_mode == 1) {
-    switch (cid) {
-      case 0:
-        color[0] = 1.0;
-        color[1] = 0;
-        color[2] = 0;
-        break;
-      case 1:
-        color[0] = 0;
-        color[1] = 1.0;
-        color[2] = 0;
-        break;
-      case 2:
-        color[0] = 0;
-        color[1] = 0;
-        color[2] = 1.0;
-        break;
-    }
-    for (size_t i = 0; i < o3d_mesh->vertices_.size(); i++)
-      o3d_mesh->vertex_colors_.emplace_back(color);
+    o3d_mesh->vertex_colors_.assign(o3d_mesh->vertices_.size(),
+                                    getClientColor(cid));
   } else {
     o3d_mesh->vertex_colors_ = colors;
   }
@@ -0,0 +1,107 @@
+#ifndef COXGRAPH_UTILS_PERSISTENT_ID_MAP_H_
+#define COXGRAPH_UTILS_PERSISTENT_ID_MAP_H_
+
+#include <glog/logging.h>
+
+#include <array>
+#include <bitset>
+#include <memory>
+#include <vector>
+
+namespace coxgraph {
+namespace utils {
+
+/**
+ * @brief Map from dense non-negative ids to values, stored in fixed size
+ * chunks that copies share. Copying the map copies one pointer per chunk, and
+ * a write copies only the chunk it touches, unless no other copy holds it.
+ * This makes copy-on-write snapshots cheap: publishing a snapshot after
+ * changing k entries costs O(n / kChunkSize + k * kChunkSize) instead of
+ * O(n).
+ *
+ * A copy may be read from any thread while another copy is written. A
+ * single copy has to be written by one thread at a time, and not be read
+ * meanwhile.
+ */
+template <typename T, size_t kChunkSize = 64>
+class PersistentIdMap {
+ public:
+  PersistentIdMap() : size_(0) {}
+
+  inline size_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+
+  // nullptr if the id has no value
+  inline const T* find(int id) const {
+    if (id < 0) return nullptr;
+    const size_t chunk_i = id / kChunkSize;
+    if (chunk_i >= chunks_.size() || chunks_[chunk_i] == nullptr) {
+      return nullptr;
+    }
+    const Chunk& chunk = *chunks_[chunk_i];
+    const size_t slot = id % kChunkSize;
+    return chunk.used[slot] ? &chunk.values[slot] : nullptr;
+  }
+
+  inline bool contains(int id) const { return find(id) != nullptr; }
+
+  inline const T& at(int id) const {
+    const T* value = find(id);
+    CHECK(value != nullptr) << "Id " << id << " not in map";
+    return *value;
+  }
+
+  // Inserts the value or replaces the one of the id
+  void set(int id, const T& value) { *getMutable(id) = value; }
+
+  // Value of the id to change in place, default constructed if it had none
+  T* getMutable(int id) {
+    CHECK_GE(id, 0);
+    const size_t chunk_i = id / kChunkSize;
+    if (chunk_i >= chunks_.size()) chunks_.resize(chunk_i + 1);
+    std::shared_ptr<Chunk>& chunk = chunks_[chunk_i];
+    if (chunk == nullptr) {
+      chunk = std::make_shared<Chunk>();
+    } else if (chunk.use_count() > 1) {
+      // Held by other copies, which must not see the change. A count that
+      // drops meanwhile only causes an unneeded copy.
+      chunk = std::make_shared<Chunk>(*chunk);
+    }
+    const size_t slot = id % kChunkSize;
+    if (!chunk->used[slot]) {
+      chunk->used[slot] = true;
+      size_++;
+    }
+    return &chunk->values[slot];
+  }
+
+  // Calls visit(id, value) for all ids in ascending order
+  template <typename Visitor>
+  void forEach(Visitor visit) const {
+    for (size_t chunk_i = 0; chunk_i < chunks_.size(); ++chunk_i) {
+      if (chunks_[chunk_i] == nullptr) continue;
+      const Chunk& chunk = *chunks_[chunk_i];
+      for (size_t slot = 0; slot < kChunkSize; ++slot) {
+        if (chunk.used[slot]) {
+          visit(static_cast<int>(chunk_i * kChunkSize + slot),
+                chunk.values[slot]);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Chunk {
+    std::bitset<kChunkSize> used;
+    std::array<T, kChunkSize> values;
+  };
+
+  // Never changed through a pointer another copy holds, see getMutable()
+  std::vector<std::shared_ptr<Chunk>> chunks_;
+  size_t size_;
+};
+
+}  // namespace utils
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_UTILS_PERSISTENT_ID_MAP_H_
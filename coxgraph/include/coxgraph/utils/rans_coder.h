@@ -0,0 +1,190 @@
+#ifndef COXGRAPH_UTILS_RANS_CODER_H_
+#define COXGRAPH_UTILS_RANS_CODER_H_
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace coxgraph {
+namespace utils {
+
+/**
+ * @brief Static order-0 rANS entropy coder over bytes.
+ *
+ * The encoded stream starts with the symbol frequency table, followed by the
+ * 32-bit coder state and the renormalization bytes, see Duda, Asymmetric
+ * numeral systems, and the byte-wise variant of ryg_rans. The decoded size is
+ * not stored and has to be passed to decode().
+ */
+class RansCoder {
+ public:
+  static void encode(const uint8_t* data, size_t size,
+                     std::vector<uint8_t>* encoded) {
+    CHECK_NOTNULL(encoded);
+    encoded->clear();
+    if (size == 0) return;
+
+    std::array<uint32_t, kNumSymbols> freqs;
+    normalizeFrequencies(data, size, &freqs);
+    std::array<uint32_t, kNumSymbols> starts;
+    cumulativeFrequencies(freqs, &starts);
+
+    // Frequency table: number of used symbols, then (symbol, frequency)
+    uint32_t num_used_symbols = 0;
+    for (const uint32_t freq : freqs) num_used_symbols += freq > 0;
+    writeVarint(num_used_symbols, encoded);
+    for (uint32_t s = 0; s < kNumSymbols; ++s) {
+      if (freqs[s] == 0) continue;
+      encoded->push_back(static_cast<uint8_t>(s));
+      writeVarint(freqs[s], encoded);
+    }
+    const size_t table_size = encoded->size();
+
+    // rANS encodes back to front, collect the bytes reversed and flip them
+    std::vector<uint8_t> reversed;
+    reversed.reserve(size + 4);
+    uint32_t state = kStateLowerBound;
+    for (size_t i = size; i > 0; --i) {
+      const uint8_t symbol = data[i - 1];
+      const uint32_t freq = freqs[symbol];
+      const uint32_t state_max =
+          ((kStateLowerBound >> kProbBits) << 8) * freq;
+      while (state >= state_max) {
+        reversed.push_back(static_cast<uint8_t>(state & 0xff));
+        state >>= 8;
+      }
+      state = ((state / freq) << kProbBits) + (state % freq) + starts[symbol];
+    }
+    for (int i = 0; i < 4; ++i) {
+      reversed.push_back(static_cast<uint8_t>(state & 0xff));
+      state >>= 8;
+    }
+    encoded->resize(table_size + reversed.size());
+    std::reverse_copy(reversed.begin(), reversed.end(),
+                      encoded->begin() + table_size);
+  }
+
+  // Returns false if the stream is malformed
+  static bool decode(const uint8_t* encoded, size_t encoded_size,
+                     size_t decoded_size, uint8_t* decoded) {
+    if (decoded_size == 0) return true;
+    CHECK_NOTNULL(decoded);
+    const uint8_t* const end = encoded + encoded_size;
+
+    std::array<uint32_t, kNumSymbols> freqs;
+    freqs.fill(0);
+    uint64_t num_used_symbols;
+    if (!readVarint(&encoded, end, &num_used_symbols) ||
+        num_used_symbols == 0 || num_used_symbols > kNumSymbols) {
+      return false;
+    }
+    for (uint64_t i = 0; i < num_used_symbols; ++i) {
+      if (encoded == end) return false;
+      const uint8_t symbol = *encoded++;
+      uint64_t freq;
+      if (!readVarint(&encoded, end, &freq) || freq > kProbScale) return false;
+      freqs[symbol] = static_cast<uint32_t>(freq);
+    }
+    std::array<uint32_t, kNumSymbols> starts;
+    if (cumulativeFrequencies(freqs, &starts) != kProbScale) return false;
+    std::array<uint8_t, kProbScale> slot_to_symbol;
+    for (uint32_t s = 0; s < kNumSymbols; ++s) {
+      std::fill(slot_to_symbol.begin() + starts[s],
+                slot_to_symbol.begin() + starts[s] + freqs[s],
+                static_cast<uint8_t>(s));
+    }
+
+    if (end - encoded < 4) return false;
+    uint32_t state = 0;
+    for (int i = 0; i < 4; ++i) state = (state << 8) | *encoded++;
+    for (size_t i = 0; i < decoded_size; ++i) {
+      const uint32_t slot = state & (kProbScale - 1);
+      const uint8_t symbol = slot_to_symbol[slot];
+      decoded[i] = symbol;
+      state = freqs[symbol] * (state >> kProbBits) + slot - starts[symbol];
+      while (state < kStateLowerBound) {
+        if (encoded == end) return false;
+        state = (state << 8) | *encoded++;
+      }
+    }
+    return true;
+  }
+
+  static inline void writeVarint(uint64_t value, std::vector<uint8_t>* out) {
+    while (value >= 0x80) {
+      out->push_back(static_cast<uint8_t>(value | 0x80));
+      value >>= 7;
+    }
+    out->push_back(static_cast<uint8_t>(value));
+  }
+
+  static inline bool readVarint(const uint8_t** in, const uint8_t* end,
+                                uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (*in == end) return false;
+      const uint8_t byte = *(*in)++;
+      *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) return true;
+    }
+    return false;
+  }
+
+ private:
+  static constexpr uint32_t kNumSymbols = 256;
+  static constexpr uint32_t kProbBits = 12;
+  static constexpr uint32_t kProbScale = 1u << kProbBits;
+  static constexpr uint32_t kStateLowerBound = 1u << 23;
+
+  // Scales the byte histogram to sum up to kProbScale, keeping every symbol
+  // that occurs at a frequency of at least one
+  static void normalizeFrequencies(const uint8_t* data, size_t size,
+                                   std::array<uint32_t, kNumSymbols>* freqs) {
+    std::array<uint64_t, kNumSymbols> counts;
+    counts.fill(0);
+    for (size_t i = 0; i < size; ++i) counts[data[i]]++;
+
+    uint32_t sum = 0;
+    for (uint32_t s = 0; s < kNumSymbols; ++s) {
+      (*freqs)[s] =
+          counts[s] == 0
+              ? 0
+              : std::max<uint32_t>(1, counts[s] * kProbScale / size);
+      sum += (*freqs)[s];
+    }
+    // Rounding leaves the sum off by at most the number of symbols, settle
+    // the difference on the most frequent symbols. With at most 256 symbols
+    // of frequency one, some symbol is always above one while sum is too big.
+    while (sum != kProbScale) {
+      auto max_it = std::max_element(freqs->begin(), freqs->end());
+      if (sum < kProbScale) {
+        *max_it += kProbScale - sum;
+        sum = kProbScale;
+      } else {
+        const uint32_t excess = std::min(sum - kProbScale, *max_it - 1);
+        *max_it -= excess;
+        sum -= excess;
+      }
+    }
+  }
+
+  static uint32_t cumulativeFrequencies(
+      const std::array<uint32_t, kNumSymbols>& freqs,
+      std::array<uint32_t, kNumSymbols>* starts) {
+    uint32_t start = 0;
+    for (uint32_t s = 0; s < kNumSymbols; ++s) {
+      (*starts)[s] = start;
+      start += freqs[s];
+      if (start > kProbScale) return start;
+    }
+    return start;
+  }
+};
+
+}  // namespace utils
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_UTILS_RANS_CODER_H_
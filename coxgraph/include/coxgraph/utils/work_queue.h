@@ -0,0 +1,168 @@
+#ifndef COXGRAPH_UTILS_WORK_QUEUE_H_
+#define COXGRAPH_UTILS_WORK_QUEUE_H_
+
+#include <glog/logging.h>
+#include <ros/ros.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace coxgraph {
+namespace utils {
+
+/**
+ * @brief Bounded FIFO of tasks served by one worker thread, one stage of a
+ * pipeline. push() blocks while the queue is full, so a slow stage throttles
+ * the one feeding it instead of buffering without limit.
+ *
+ * The worker takes up to max_batch_size queued tasks at once, which lets a
+ * stage coalesce everything that arrived while it was busy. A stage that
+ * postpones work can schedule a wakeup, the handler is then called with an
+ * empty batch if no task arrives before.
+ */
+template <typename T>
+class WorkQueue {
+ public:
+  typedef std::function<void(std::vector<T>*)> Handler;
+
+  WorkQueue(size_t capacity, size_t max_batch_size, Handler handler)
+      : capacity_(capacity),
+        max_batch_size_(max_batch_size),
+        handler_(handler),
+        num_in_handler_(0),
+        has_wakeup_(false),
+        shutdown_(false),
+        num_processed_(0),
+        num_batches_(0),
+        busy_time_(0.0) {
+    CHECK_GT(capacity_, 0);
+    CHECK_GT(max_batch_size_, 0);
+    worker_ = std::thread(&WorkQueue::workerLoop, this);
+  }
+
+  // Queued tasks are still handled before the worker exits, a scheduled
+  // wakeup is dropped
+  ~WorkQueue() {
+    {
+      std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+      shutdown_ = true;
+    }
+    queue_cv_.notify_all();
+    worker_.join();
+  }
+
+  void push(T task) {
+    std::unique_lock<std::mutex> queue_lock(queue_mutex_);
+    queue_cv_.wait(queue_lock, [this]() { return tasks_.size() < capacity_; });
+    tasks_.emplace_back(std::move(task));
+    queue_lock.unlock();
+    queue_cv_.notify_all();
+  }
+
+  // Calls the handler with an empty batch after delay seconds, unless it's
+  // called for queued tasks before. An earlier wakeup is kept.
+  void scheduleWakeup(double delay) {
+    const std::chrono::steady_clock::time_point wakeup_time =
+        std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(std::max(delay, 0.0)));
+    {
+      std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+      if (has_wakeup_ && wakeup_time_ <= wakeup_time) return;
+      wakeup_time_ = wakeup_time;
+      has_wakeup_ = true;
+    }
+    queue_cv_.notify_all();
+  }
+
+  // Blocks until every pushed task is handled
+  void waitUntilIdle() {
+    std::unique_lock<std::mutex> queue_lock(queue_mutex_);
+    queue_cv_.wait(queue_lock, [this]() {
+      return tasks_.empty() && num_in_handler_ == 0;
+    });
+  }
+
+  size_t size() {
+    std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+    return tasks_.size();
+  }
+
+  // Handled tasks, batches with tasks and the wall time spent in the handler
+  void getStats(uint64_t* num_processed, uint64_t* num_batches,
+                double* busy_time) {
+    std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+    *num_processed = num_processed_;
+    *num_batches = num_batches_;
+    *busy_time = busy_time_;
+  }
+
+ private:
+  void workerLoop() {
+    std::vector<T> batch;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> queue_lock(queue_mutex_);
+        while (!shutdown_ && tasks_.empty()) {
+          if (!has_wakeup_) {
+            queue_cv_.wait(queue_lock);
+          } else if (queue_cv_.wait_until(queue_lock, wakeup_time_) ==
+                     std::cv_status::timeout) {
+            break;
+          }
+        }
+        if (shutdown_ && tasks_.empty()) return;
+        has_wakeup_ = false;
+        while (!tasks_.empty() && batch.size() < max_batch_size_) {
+          batch.emplace_back(std::move(tasks_.front()));
+          tasks_.pop_front();
+        }
+        num_in_handler_ = batch.size();
+      }
+      queue_cv_.notify_all();
+
+      const ros::WallTime start_time = ros::WallTime::now();
+      handler_(&batch);
+      const double handle_time = (ros::WallTime::now() - start_time).toSec();
+
+      {
+        std::lock_guard<std::mutex> queue_lock(queue_mutex_);
+        num_processed_ += batch.size();
+        if (!batch.empty()) num_batches_++;
+        busy_time_ += handle_time;
+        num_in_handler_ = 0;
+      }
+      queue_cv_.notify_all();
+      batch.clear();
+    }
+  }
+
+  const size_t capacity_;
+  const size_t max_batch_size_;
+  const Handler handler_;
+
+  std::deque<T> tasks_;
+  size_t num_in_handler_;
+  bool has_wakeup_;
+  std::chrono::steady_clock::time_point wakeup_time_;
+  bool shutdown_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::thread worker_;
+
+  uint64_t num_processed_;
+  uint64_t num_batches_;
+  double busy_time_;
+};
+
+}  // namespace utils
+}  // namespace coxgraph
+
+#endif  // COXGRAPH_UTILS_WORK_QUEUE_H_
@@ -5,8 +5,10 @@
 #include <voxblox_msgs/MultiMesh.h>
 #include <voxgraph/tools/tf_helper.h>
 
+#include <algorithm>
 #include <chrono>
 #include <string>
+#include <utility>
 
 #include "coxgraph/common.h"
 
@@ -36,73 +38,153 @@ void CoxgraphClient::advertiseClientTopics() {
 }
 
 void CoxgraphClient::advertiseClientServices() {
-  get_client_submap_srv_ = nh_private_.advertiseService(
-      "get_client_submap", &CoxgraphClient::getClientSubmapCallback, this);
-  get_all_client_submaps_srv_ = nh_private_.advertiseService(
-      "get_all_submaps", &CoxgraphClient::getAllClientSubmapsCallback, this);
+  get_submap_chunk_srv_ = nh_private_.advertiseService(
+      "get_submap_chunk", &CoxgraphClient::getSubmapChunkCallback, this);
   get_pose_history_srv_ = nh_private_.advertiseService(
       "get_pose_history", &CoxgraphClient::getPoseHistory, this);
 }
 
-// TODO(mikexyl): add locks here, if optimizing is running, wait
 // TODO(mikexyl): move these to map server
-bool CoxgraphClient::getClientSubmapCallback(
-    coxgraph_msgs::ClientSubmapSrv::Request& request,
-    coxgraph_msgs::ClientSubmapSrv::Response& response) {
-  CliSmId submap_id;
-  if (submap_collection_ptr_->lookupActiveSubmapByTime(request.timestamp,
-                                                       &submap_id)) {
-    const CliSm& submap = submap_collection_ptr_->getSubmap(submap_id);
-    Transformation T_submap_t;
-    if (submap.lookupPoseByTime(request.timestamp, &T_submap_t)) {
-      response.submap.map_header.id = submap_id;
-      tf::transformKindrToMsg(T_submap_t.cast<double>(), &response.transform);
-      if (!ser_sm_id_pose_map_.count(submap_id)) {
-        response.submap =
-            utils::msgFromCliSubmap(submap, frame_names_.output_odom_frame);
-        ser_sm_id_pose_map_.emplace(submap_id, submap.getPose());
-        LOG(INFO) << log_prefix_ << " Submap " << submap_id
-                  << " is successfully sent to server";
-      }
-      response.pub_time = ros::Time::now();
-      return true;
-    } else {
-      LOG(WARNING) << "Client " << client_id_ << ": Requested time "
-                   << request.timestamp << " has no corresponding robot pose!";
-      return false;
+bool CoxgraphClient::getSubmapChunkCallback(
+    coxgraph_msgs::SubmapChunkSrv::Request& request,      // NOLINT
+    coxgraph_msgs::SubmapChunkSrv::Response& response) {  // NOLINT
+  // Submaps are only locked while one chunk is served, the stream state is
+  // only read and written under the lock
+  std::lock_guard<std::timed_mutex> submap_proc_lock(submap_proc_mutex_);
+  if (request.seq == 0) {
+    if (!openSubmapStream(request)) return false;
+  } else if (request.transfer_id != submap_stream_.transfer_id ||
+             request.seq != submap_stream_.next_seq) {
+    LOG(WARNING) << log_prefix_ << "Requested chunk " << request.seq
+                 << " of transfer " << request.transfer_id
+                 << " is not the next chunk of the current transfer "
+                 << submap_stream_.transfer_id << ", aborting transfer";
+    return false;
+  }
+  fillNextSubmapChunk(&response.chunk);
+  return true;
+}
+
+bool CoxgraphClient::openSubmapStream(
+    const coxgraph_msgs::SubmapChunkSrv::Request& request) {
+  submap_stream_ = SubmapStream();
+  submap_stream_.transfer_id = request.transfer_id;
+  if (request.cached_submap_ids.size() != request.cached_versions.size()) {
+    LOG(WARNING) << log_prefix_ << "Malformed list of cached submaps";
+    return false;
+  }
+  for (size_t i = 0; i < request.cached_submap_ids.size(); ++i) {
+    submap_stream_.cached_versions.emplace(request.cached_submap_ids[i],
+                                           request.cached_versions[i]);
+  }
+
+  if (request.mode == coxgraph_msgs::SubmapChunkSrv::Request::ALL_SUBMAPS) {
+    LOG(INFO) << log_prefix_ << "Server is requesting all submaps";
+    for (auto const& submap_ptr : submap_collection_ptr_->getSubmapPtrs()) {
+      if (ser_sm_id_pose_map_.count(submap_ptr->getID())) continue;
+      submap_stream_.submaps.emplace_back(submap_ptr);
     }
-  } else {
+    return true;
+  }
+  submap_stream_.mode_by_time = true;
+
+  CliSmId submap_id;
+  if (!submap_collection_ptr_->lookupActiveSubmapByTime(request.timestamp,
+                                                        &submap_id)) {
     LOG(WARNING) << "Client " << client_id_
                  << ": No active submap containing requested time "
                  << request.timestamp << "!";
     return false;
   }
-  return false;
+  CliSm::ConstPtr submap_ptr =
+      submap_collection_ptr_->getSubmapConstPtr(submap_id);
+  if (!submap_ptr->lookupPoseByTime(request.timestamp,
+                                    &submap_stream_.T_submap_t)) {
+    LOG(WARNING) << "Client " << client_id_ << ": Requested time "
+                 << request.timestamp << " has no corresponding robot pose!";
+    return false;
+  }
+  submap_stream_.submaps.emplace_back(submap_ptr);
+  // The submap only counts as sent once its last chunk is served, a transfer
+  // that breaks off sends it in full again next time
+  submap_stream_.header_only = ser_sm_id_pose_map_.count(submap_id);
+  LOG_IF(INFO, !submap_stream_.header_only)
+      << log_prefix_ << " Submap " << submap_id << " is being sent to server";
+  return true;
 }
 
-bool CoxgraphClient::getAllClientSubmapsCallback(
-    coxgraph_msgs::SubmapsSrv::Request& request,      // NOLINT
-    coxgraph_msgs::SubmapsSrv::Response& response) {  // NOLINT
-  LOG(INFO) << log_prefix_
-            << "Server is requesting all submaps! pausing submap process";
-  uint8_t trials_ = 0;
-  while (!submap_proc_mutex_.try_lock_for(std::chrono::milliseconds(500))) {
-    LOG(INFO) << log_prefix_
-              << "current submap is still being processed, waiting";
-    trials_++;
-    CHECK_LT(trials_, 3) << " Tried 3 times, submap process is still running";
-  }
-  LOG(INFO) << log_prefix_ << "Submap process is paused, sending all submaps";
+void CoxgraphClient::fillNextSubmapChunk(
+    coxgraph_msgs::ClientSubmapChunk* chunk) {
+  CHECK_NOTNULL(chunk);
+  SubmapStream& stream = submap_stream_;
+  chunk->transfer_id = stream.transfer_id;
+  chunk->seq = stream.next_seq++;
+
+  if (stream.submap_index < stream.submaps.size()) {
+    const CliSm& submap = *stream.submaps[stream.submap_index];
+    const voxblox::Layer<voxblox::TsdfVoxel>& tsdf_layer =
+        submap.getTsdfMap().getTsdfLayer();
+    chunk->map_header.id = submap.getID();
+    if (!stream.submap_begun) {
+      chunk->submap_begin = true;
+      tf::transformKindrToMsg(stream.T_submap_t.cast<double>(),
+                              &chunk->transform);
+      if (!stream.header_only) {
+        utils::chunkHeaderFromCliSubmap(
+            submap, frame_names_.output_odom_frame, chunk);
+        chunk->version = getSubmapVersion(submap);
+        auto cached_it = stream.cached_versions.find(submap.getID());
+        chunk->cached = cached_it != stream.cached_versions.end() &&
+                        cached_it->second == chunk->version;
+        if (!chunk->cached) {
+          tsdf_layer.getAllAllocatedBlocks(&stream.block_indices);
+        }
+      }
+      stream.next_block = 0;
+      stream.submap_begun = true;
+    }
+
+    const size_t end_block =
+        std::min(stream.block_indices.size(),
+                 stream.next_block + submap_chunk_blocks_);
+    utils::tsdfBlocksToMsg(tsdf_layer, stream.block_indices, stream.next_block,
+                           end_block, &chunk->layer);
+    stream.next_block = end_block;
 
-  for (auto const& submap_ptr : submap_collection_ptr_->getSubmapPtrs()) {
-    if (ser_sm_id_pose_map_.count(submap_ptr->getID())) continue;
-    response.submaps.emplace_back(
-        utils::msgFromCliSubmap(*submap_ptr, frame_names_.output_odom_frame));
+    if (stream.next_block == stream.block_indices.size()) {
+      chunk->submap_end = true;
+      if (!stream.header_only && !chunk->cached) {
+        chunk->mesh_pointclouds = *submap.mesh_pointcloud_;
+      }
+      stream.block_indices.clear();
+      stream.submap_begun = false;
+      stream.submap_index++;
+    }
   }
 
-  submap_proc_mutex_.unlock();
+  chunk->transfer_end = stream.submap_index == stream.submaps.size();
+  if (chunk->transfer_end && stream.mode_by_time && !stream.header_only) {
+    const CliSm& submap = *stream.submaps.front();
+    ser_sm_id_pose_map_.emplace(submap.getID(), submap.getPose());
+  }
+  if (chunk->transfer_end) {
+    LOG(INFO) << log_prefix_ << "Sent " << stream.submaps.size()
+              << " submaps in " << stream.next_seq << " chunks";
+  }
+  chunk->pub_time = ros::Time::now();
+}
 
-  return true;
+uint64_t CoxgraphClient::getSubmapVersion(const CliSm& submap) {
+  auto version_it = submap_versions_.find(submap.getID());
+  if (version_it != submap_versions_.end() &&
+      version_it->second.first == submap.getEndTime()) {
+    return version_it->second.second;
+  }
+  const uint64_t version =
+      utils::hashTsdfLayer(submap.getTsdfMap().getTsdfLayer());
+  submap_versions_[submap.getID()] =
+      std::make_pair(submap.getEndTime(), version);
+  return version;
 }
 
 bool CoxgraphClient::submapCallback(
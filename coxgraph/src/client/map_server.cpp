@@ -1,10 +1,16 @@
 #include "coxgraph/client/map_server.h"
 
 #include <coxgraph_msgs/MeshWithTrajectory.h>
+#include <coxgraph_msgs/PackedMeshWithTrajectory.h>
+#include <voxblox/utils/timing.h>
 #include <voxblox_msgs/MultiMesh.h>
 
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace coxgraph {
 namespace client {
@@ -24,12 +30,26 @@ MapServer::Config MapServer::getConfigFromRosParam(
   nh_private.param<bool>("publish_mesh_with_trajectory",
                          config.publish_mesh_with_trajectory,
                          config.publish_mesh_with_trajectory);
+  nh_private.param<bool>("pack_submap_mesh", config.pack_submap_mesh,
+                         config.pack_submap_mesh);
+  nh_private.param<bool>("mesh_pack_lossy_colors",
+                         config.mesh_pack_lossy_colors,
+                         config.mesh_pack_lossy_colors);
+  nh_private.param<bool>("publish_mesh_deltas", config.publish_mesh_deltas,
+                         config.publish_mesh_deltas);
+  nh_private.param<int>("mesh_full_resend_every_n",
+                        config.mesh_full_resend_every_n,
+                        config.mesh_full_resend_every_n);
   return config;
 }
 
 void MapServer::subscribeTopics() {
   kf_pose_sub_ = nh_private_.subscribe("keyframe_pose", 10,
                                        &MapServer::kfPoseCallback, this);
+  if (config_.publish_mesh_with_trajectory) {
+    mesh_resync_sub_ = nh_private_.subscribe(
+        "mesh_resync_request", 10, &MapServer::meshResyncCallback, this);
+  }
 }
 
 void MapServer::advertiseTopics() {
@@ -48,7 +68,11 @@ void MapServer::advertiseTopics() {
     traversable_pub_ = nh_private_.advertise<pcl::PointCloud<pcl::PointXYZI> >(
         "traversable", 10, true);
 
-  if (config_.publish_mesh_with_trajectory)
+  if (config_.publish_mesh_with_trajectory && config_.pack_submap_mesh)
+    submap_mesh_pub_ =
+        nh_private_.advertise<coxgraph_msgs::PackedMeshWithTrajectory>(
+            "submap_mesh_packed", 10, true);
+  else if (config_.publish_mesh_with_trajectory)
     submap_mesh_pub_ = nh_private_.advertise<coxgraph_msgs::MeshWithTrajectory>(
         "submap_mesh_with_traj", 10, true);
   else
@@ -118,11 +142,38 @@ void MapServer::publishTraversable() {
 
 void MapServer::publishSubmapMesh(CliSmId csid, std::string /* world_frame */,
                                   const voxgraph::SubmapVisuals& submap_vis) {
-  CliSm::ConstPtr submap_ptr = submap_collection_ptr_->getSubmapConstPtr(csid);
+  std::lock_guard<std::mutex> submap_mesh_lock(submap_mesh_mutex_);
+  submap_vis_ = &submap_vis;
+  publishSubmapMeshLocked(csid, submap_vis);
+}
+
+void MapServer::meshResyncCallback(
+    const coxgraph_msgs::MeshResyncRequest& mesh_resync_msg) {
+  std::lock_guard<std::mutex> submap_mesh_lock(submap_mesh_mutex_);
+  const CliSmId csid = mesh_resync_msg.submap_id;
+  LOG(INFO) << "Mesh of submap " << csid << " requested in full";
+  // Without block hashes, the next mesh goes out in full. The sequence
+  // number keeps counting.
+  PublishedSubmapMesh& published = published_submap_meshes_[csid];
+  published.block_hashes.clear();
+  published.num_deltas = 0;
+  if (submap_vis_ == nullptr || !submap_collection_ptr_->exists(csid)) return;
+  publishSubmapMeshLocked(csid, *submap_vis_);
+}
+
+void MapServer::publishSubmapMeshLocked(
+    CliSmId csid, const voxgraph::SubmapVisuals& submap_vis) {
+  CliSm::Ptr submap_ptr = submap_collection_ptr_->getSubmapPtr(csid);
   CHECK(submap_ptr != nullptr);
+  // Taken before meshing, an update that lands in between is flagged again
+  // for the next publish
+  std::set<MeshBlockKey> updated_mesh_blocks;
+  const bool track_deltas =
+      config_.publish_mesh_with_trajectory && config_.publish_mesh_deltas;
+  if (track_deltas) getUpdatedMeshBlocks(submap_ptr, &updated_mesh_blocks);
+
   auto mesh_layer_ptr =
       std::make_shared<cblox::MeshLayer>(submap_collection_ptr_->block_size());
-
   submap_vis.generateSubmapMesh(submap_ptr, voxblox::Color(),
                                 mesh_layer_ptr.get());
 
@@ -133,22 +184,123 @@ void MapServer::publishSubmapMesh(CliSmId csid, std::string /* world_frame */,
   mesh_msg.header.frame_id = submap_frame;
   mesh_msg.name_space = submap_frame;
 
-  if (config_.publish_mesh_with_trajectory) {
-    coxgraph_msgs::MeshWithTrajectory mesh_with_traj_msg;
-    mesh_with_traj_msg.mesh = mesh_msg;
-    for (auto const& pose_kv : submap_ptr->getPoseHistory()) {
-      if (!kf_timestamp_set_.count(pose_kv.first)) continue;
-      geometry_msgs::PoseStamped pose_msg;
-      pose_msg.header.frame_id = submap_frame;
-      pose_msg.header.stamp = pose_kv.first;
-      tf::poseKindrToMsg(pose_kv.second.cast<double>(), &pose_msg.pose);
-      mesh_with_traj_msg.trajectory.poses.emplace_back(pose_msg);
+  if (!config_.publish_mesh_with_trajectory) {
+    submap_mesh_pub_.publish(mesh_msg);
+    return;
+  }
+
+  coxgraph_msgs::MeshWithTrajectory mesh_with_traj_msg;
+  for (auto const& pose_kv : submap_ptr->getPoseHistory()) {
+    if (!kf_timestamp_set_.count(pose_kv.first)) continue;
+    geometry_msgs::PoseStamped pose_msg;
+    pose_msg.header.frame_id = submap_frame;
+    pose_msg.header.stamp = pose_kv.first;
+    tf::poseKindrToMsg(pose_kv.second.cast<double>(), &pose_msg.pose);
+    mesh_with_traj_msg.trajectory.poses.emplace_back(pose_msg);
+  }
+
+  PublishedSubmapMesh& published = published_submap_meshes_[csid];
+  const bool send_delta = track_deltas && !published.block_hashes.empty() &&
+                          published.num_deltas + 1 <
+                              config_.mesh_full_resend_every_n;
+  if (track_deltas) {
+    removeUnchangedMeshBlocks(updated_mesh_blocks, send_delta, &published,
+                              &mesh_msg.mesh);
+    // A delta without blocks still carries a changed trajectory
+    const uint64_t trajectory_hash =
+        utils::hashTrajectory(mesh_with_traj_msg.trajectory);
+    if (send_delta && mesh_msg.mesh.mesh_blocks.empty() &&
+        trajectory_hash == published.trajectory_hash) {
+      return;
     }
+    published.trajectory_hash = trajectory_hash;
+  }
+  published.num_deltas = send_delta ? published.num_deltas + 1 : 0;
+  mesh_with_traj_msg.action =
+      send_delta ? coxgraph_msgs::MeshWithTrajectory::ACTION_UPDATE
+                 : coxgraph_msgs::MeshWithTrajectory::ACTION_RESET;
+  mesh_with_traj_msg.seq = ++published.seq;
+  mesh_with_traj_msg.mesh = std::move(mesh_msg);
 
-    submap_mesh_pub_.publish(mesh_with_traj_msg);
+  if (config_.pack_submap_mesh) {
+    coxgraph_msgs::PackedMeshWithTrajectory packed_mesh_msg;
+    voxblox::timing::Timer pack_timer("pack_submap_mesh");
+    mesh_pack_codec_.pack(mesh_with_traj_msg, &packed_mesh_msg);
+    pack_timer.Stop();
+    packed_mesh_msg.pub_time = ros::Time::now();
+    submap_mesh_pub_.publish(packed_mesh_msg);
   } else {
-    submap_mesh_pub_.publish(mesh_msg);
+    submap_mesh_pub_.publish(mesh_with_traj_msg);
+  }
+}
+
+void MapServer::getUpdatedMeshBlocks(
+    const CliSm::Ptr& submap_ptr, std::set<MeshBlockKey>* updated_mesh_blocks) {
+  CHECK_NOTNULL(updated_mesh_blocks);
+  // The mesh is generated in the submap frame with the TSDF block size, so
+  // mesh and TSDF blocks share their indices. Marching cubes reads one voxel
+  // into the next blocks in positive direction, so a mesh block also changes
+  // with the TSDF blocks after it.
+  voxblox::Layer<voxblox::TsdfVoxel>* tsdf_layer_ptr =
+      submap_ptr->getTsdfMapPtr()->getTsdfLayerPtr();
+  voxblox::BlockIndexList updated_blocks;
+  tsdf_layer_ptr->getAllUpdatedBlocks(voxblox::Update::kMesh, &updated_blocks);
+  for (const voxblox::BlockIndex& block_index : updated_blocks) {
+    for (int dx = 0; dx <= 1; ++dx) {
+      for (int dy = 0; dy <= 1; ++dy) {
+        for (int dz = 0; dz <= 1; ++dz) {
+          updated_mesh_blocks->emplace(block_index.x() - dx,
+                                       block_index.y() - dy,
+                                       block_index.z() - dz);
+        }
+      }
+    }
+    tsdf_layer_ptr->getBlockByIndex(block_index)
+        .updated()
+        .reset(voxblox::Update::kMesh);
+  }
+}
+
+void MapServer::removeUnchangedMeshBlocks(
+    const std::set<MeshBlockKey>& updated_mesh_blocks, bool send_delta,
+    PublishedSubmapMesh* published, voxblox_msgs::Mesh* mesh_msg) {
+  CHECK_NOTNULL(published);
+  CHECK_NOTNULL(mesh_msg);
+  // The submap mesh is regenerated from scratch. Blocks outside the updated
+  // TSDF blocks keep their published hash, the others are hashed once and
+  // compared by content, as a TSDF update often leaves the surface as it was.
+  std::map<MeshBlockKey, uint64_t> block_hashes;
+  std::vector<voxblox_msgs::MeshBlock> changed_blocks;
+  for (auto& mesh_block : mesh_msg->mesh_blocks) {
+    const MeshBlockKey block_key = std::make_tuple(
+        mesh_block.index[0], mesh_block.index[1], mesh_block.index[2]);
+    auto published_it = published->block_hashes.find(block_key);
+    if (send_delta && published_it != published->block_hashes.end() &&
+        !updated_mesh_blocks.count(block_key)) {
+      block_hashes.emplace(block_key, published_it->second);
+      continue;
+    }
+    const uint64_t block_hash = utils::hashMeshBlock(mesh_block);
+    block_hashes.emplace(block_key, block_hash);
+    if (!send_delta || published_it == published->block_hashes.end() ||
+        published_it->second != block_hash) {
+      changed_blocks.emplace_back(std::move(mesh_block));
+    }
+  }
+
+  if (send_delta) {
+    // Deleted blocks go out empty
+    for (auto const& published_kv : published->block_hashes) {
+      if (block_hashes.count(published_kv.first)) continue;
+      voxblox_msgs::MeshBlock deleted_block;
+      deleted_block.index[0] = std::get<0>(published_kv.first);
+      deleted_block.index[1] = std::get<1>(published_kv.first);
+      deleted_block.index[2] = std::get<2>(published_kv.first);
+      changed_blocks.emplace_back(std::move(deleted_block));
+    }
   }
+  mesh_msg->mesh_blocks.swap(changed_blocks);
+  published->block_hashes.swap(block_hashes);
 }
 
 }  // namespace client
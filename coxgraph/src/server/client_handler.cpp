@@ -1,10 +1,13 @@
 #include "coxgraph/server/client_handler.h"
 
+#include <coxgraph_msgs/MeshResyncRequest.h>
 #include <coxgraph_msgs/PoseHistorySrv.h>
-#include <coxgraph_msgs/SubmapsSrv.h>
 #include <coxgraph_msgs/TimeLine.h>
 
+#include <memory>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "coxgraph/utils/msg_converter.h"
@@ -41,15 +44,49 @@ void ClientHandler::subscribeToTopics() {
   submap_mesh_sub_ =
       nh_.subscribe(client_node_name_ + "/submap_mesh_with_traj", kSubQueueSize,
                     &ClientHandler::submapMeshCallback, this);
+  packed_submap_mesh_sub_ =
+      nh_.subscribe(client_node_name_ + "/submap_mesh_packed", kSubQueueSize,
+                    &ClientHandler::packedSubmapMeshCallback, this);
   sm_pose_updates_sub_ =
       nh_.subscribe(client_node_name_ + "/map_pose_updates", 10,
                     &ClientHandler::submapPoseUpdatesCallback, this);
 }
 
+void ClientHandler::packedSubmapMeshCallback(
+    const coxgraph_msgs::PackedMeshWithTrajectory& packed_mesh_msg) {
+  const uint32_t packed_mesh_size =
+      ros::serialization::serializationLength(packed_mesh_msg);
+  eval_data_pub_.publishBandwidth(client_node_name_ + "/submap_mesh_packed",
+                                  packed_mesh_size, packed_mesh_msg.pub_time,
+                                  ros::Time::now());
+  {
+    std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+    resource_usage_.mesh_bytes_received += packed_mesh_size;
+  }
+  CIdCSIdPair csid_pair =
+      utils::resolveSubmapFrame(packed_mesh_msg.header.frame_id);
+  CHECK_EQ(csid_pair.first, client_id_);
+  LOG(INFO) << log_prefix_ << " Received packed mesh of submap "
+            << csid_pair.second;
+  if (mesh_collection_ptr_->addPackedSubmapMesh(client_id_, csid_pair.second,
+                                                packed_mesh_msg)) {
+    requestMeshResync(csid_pair.second);
+  }
+}
+
+void ClientHandler::requestMeshResync(CliSmId csid) {
+  LOG(WARNING) << log_prefix_ << " Mesh of submap " << csid
+               << " is out of sync, requesting it in full";
+  coxgraph_msgs::MeshResyncRequest resync_msg;
+  resync_msg.header.stamp = ros::Time::now();
+  resync_msg.submap_id = csid;
+  mesh_resync_pub_.publish(resync_msg);
+}
+
 void ClientHandler::timeLineCallback(
     const coxgraph_msgs::TimeLine& time_line_msg) {
   updateTimeLine(time_line_msg.start, time_line_msg.end);
-  time_line_update_callback_();
+  time_line_update_callback_(client_id_, time_line_);
 }
 
 void ClientHandler::advertiseTopics() {
@@ -60,18 +97,16 @@ void ClientHandler::advertiseTopics() {
   sm_pose_tf_pub_ = nh_.advertise<coxgraph_msgs::MapTransform>(
       client_node_name_ + "/" + config_.client_map_pose_update_topic_suffix,
       config_.pub_queue_length, true);
+  mesh_resync_pub_ = nh_.advertise<coxgraph_msgs::MeshResyncRequest>(
+      client_node_name_ + "/mesh_resync_request", config_.pub_queue_length);
 }
 
 void ClientHandler::subscribeToServices() {
   LOG(INFO) << log_prefix_ << "Subscribed to service: "
-            << client_node_name_ + "/get_client_submap";
-  pub_client_submap_client_ = nh_.serviceClient<coxgraph_msgs::ClientSubmapSrv>(
-      client_node_name_ + "/get_client_submap");
-
-  LOG(INFO) << log_prefix_ << "Subscribed to service: "
-            << client_node_name_ + "/get_all_submaps";
-  get_all_submaps_client_ = nh_.serviceClient<coxgraph_msgs::SubmapsSrv>(
-      client_node_name_ + "/get_all_submaps");
+            << client_node_name_ + "/get_submap_chunk";
+  // Persistent, a transfer takes one call per chunk
+  get_submap_chunk_client_ = nh_.serviceClient<coxgraph_msgs::SubmapChunkSrv>(
+      client_node_name_ + "/get_submap_chunk", true);
 
   LOG(INFO) << log_prefix_ << "Subscribed to service: "
             << client_node_name_ + "/get_pose_history";
@@ -86,21 +121,213 @@ ClientHandler::ReqState ClientHandler::requestSubmapByTime(
 
   if (!time_line_.hasTime(timestamp)) return ReqState::FUTURE;
 
-  coxgraph_msgs::ClientSubmapSrv cli_submap_srv;
-  cli_submap_srv.request.timestamp = timestamp;
-  if (pub_client_submap_client_.call(cli_submap_srv)) {
-    eval_data_pub_.publishBandwidth(
-        client_node_name_ + "/client_submap",
-        utils::sizeOfMsg(cli_submap_srv.response.submap),
-        cli_submap_srv.response.pub_time, ros::Time::now());
-    *cli_sid = cli_submap_srv.response.submap.map_header.id;
-    *submap = utils::cliSubmapFromMsg(ser_sid, submap_config_,
-                                      cli_submap_srv.response, &map_frame_id_);
-    tf::transformMsgToKindr<voxblox::FloatingPoint>(
-        cli_submap_srv.response.transform, T_Sm_C_t);
-    return ReqState::SUCCESS;
+  SerSmId ser_sm_id = ser_sid;
+  std::vector<CliSmPack> submap_packs;
+  if (!pullSubmapStream(
+          coxgraph_msgs::SubmapChunkSrv::Request::SUBMAP_BY_TIME, timestamp,
+          &ser_sm_id,
+          [&submap_packs](const CliSmPack& submap_pack) {
+            submap_packs.emplace_back(submap_pack);
+          },
+          T_Sm_C_t) ||
+      submap_packs.size() != 1) {
+    return ReqState::FAILED;
+  }
+  *cli_sid = submap_packs.front().cli_sm_id;
+  *submap = submap_packs.front().submap_ptr;
+  return ReqState::SUCCESS;
+}
+
+std::future<ClientHandler::SubmapRequest>
+ClientHandler::requestSubmapByTimeAsync(const ros::Time& timestamp,
+                                        const SerSmId& ser_sid) {
+  auto request_promise = std::make_shared<std::promise<SubmapRequest>>();
+  std::future<SubmapRequest> request_future = request_promise->get_future();
+  if (!time_line_.hasTime(timestamp)) {
+    SubmapRequest request;
+    request.state = ReqState::FUTURE;
+    request_promise->set_value(request);
+    return request_future;
+  }
+
+  postIoTask([this, timestamp, ser_sid, request_promise]() {
+    SubmapRequest request;
+    request.state = requestSubmapByTime(timestamp, ser_sid, &request.cli_sid,
+                                        &request.submap, &request.T_Sm_C_t);
+    request_promise->set_value(request);
+  });
+  return request_future;
+}
+
+void ClientHandler::postIoTask(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> io_lock(io_mutex_);
+    io_tasks_.emplace_back(std::move(task));
+  }
+  io_cv_.notify_one();
+}
+
+void ClientHandler::ioLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> io_lock(io_mutex_);
+      io_cv_.wait(io_lock,
+                  [this]() { return io_shutdown_ || !io_tasks_.empty(); });
+      // Pending requests are still served, their futures are waited on
+      if (io_tasks_.empty()) return;
+      task = std::move(io_tasks_.front());
+      io_tasks_.pop_front();
+    }
+    task();
   }
-  return ReqState::FAILED;
+}
+
+bool ClientHandler::pullSubmapStream(
+    uint8_t mode, const ros::Time& timestamp, SerSmId* ser_sm_id,
+    const SubmapPackCallback& submap_pack_callback, Transformation* T_Sm_C_t) {
+  CHECK_NOTNULL(ser_sm_id);
+  const SerSmId start_ser_sm_id = *ser_sm_id;
+  const ros::WallTime start_time = ros::WallTime::now();
+  std::set<CliSmId> handed_over;
+  auto hand_over = [&handed_over,
+                    &submap_pack_callback](const CliSmPack& submap_pack) {
+    handed_over.emplace(submap_pack.cli_sm_id);
+    submap_pack_callback(submap_pack);
+  };
+  bool cache_missed = false;
+  bool success = pullSubmapStream(mode, timestamp, true, std::set<CliSmId>(),
+                                  ser_sm_id, hand_over, T_Sm_C_t,
+                                  &cache_missed);
+  if (!success && cache_missed) {
+    // A cached submap got evicted during the transfer, pull everything again.
+    // The submaps already handed over are skipped and keep their ids.
+    LOG(WARNING) << log_prefix_ << "Submap cache missed, retrying transfer";
+    *ser_sm_id = start_ser_sm_id + handed_over.size();
+    success = pullSubmapStream(mode, timestamp, false, handed_over, ser_sm_id,
+                               hand_over, T_Sm_C_t, &cache_missed);
+  }
+
+  std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+  resource_usage_.transfer_time += (ros::WallTime::now() - start_time).toSec();
+  resource_usage_.submaps_received += handed_over.size();
+  return success;
+}
+
+bool ClientHandler::pullSubmapStream(
+    uint8_t mode, const ros::Time& timestamp, bool use_cache,
+    const std::set<CliSmId>& skip_cli_sm_ids, SerSmId* ser_sm_id,
+    const SubmapPackCallback& submap_pack_callback, Transformation* T_Sm_C_t,
+    bool* cache_missed) {
+  coxgraph_msgs::SubmapChunkSrv chunk_srv;
+  chunk_srv.request.mode = mode;
+  chunk_srv.request.timestamp = timestamp;
+  chunk_srv.request.transfer_id = next_transfer_id_++;
+  if (use_cache && submap_cache_ptr_->enabled()) {
+    std::vector<CliSmId> cached_submap_ids;
+    submap_cache_ptr_->getVersions(client_id_, &cached_submap_ids,
+                                   &chunk_srv.request.cached_versions);
+    chunk_srv.request.cached_submap_ids.assign(cached_submap_ids.begin(),
+                                               cached_submap_ids.end());
+  }
+  // Only submaps of full transfers are cached, the ones requested by time
+  // are kept in the submap collection anyway
+  const bool fill_cache =
+      submap_cache_ptr_->enabled() &&
+      mode == coxgraph_msgs::SubmapChunkSrv::Request::ALL_SUBMAPS;
+
+  CliSm::Ptr submap_ptr;
+  bool skipping_submap = false;
+  coxgraph_msgs::ClientSubmapChunk::Ptr cache_msg;
+  for (uint32_t seq = 0;; ++seq) {
+    chunk_srv.request.seq = seq;
+    if (!callSubmapChunkService(&chunk_srv)) return false;
+    const coxgraph_msgs::ClientSubmapChunk& chunk = chunk_srv.response.chunk;
+    const bool in_submap = submap_ptr != nullptr || skipping_submap;
+    if (chunk.transfer_id != chunk_srv.request.transfer_id ||
+        chunk.seq != seq || (chunk.submap_begin && in_submap) ||
+        (!chunk.submap_begin && !in_submap && !chunk.transfer_end)) {
+      LOG(ERROR) << log_prefix_ << "Received chunk " << chunk.seq
+                 << " of transfer " << chunk.transfer_id
+                 << " out of order, aborting transfer";
+      return false;
+    }
+    const uint32_t chunk_size = ros::serialization::serializationLength(chunk);
+    eval_data_pub_.publishBandwidth(client_node_name_ + "/submap_chunk",
+                                    chunk_size, chunk.pub_time,
+                                    ros::Time::now());
+    {
+      std::lock_guard<std::mutex> resource_usage_lock(resource_usage_mutex_);
+      resource_usage_.submap_bytes_received += chunk_size;
+    }
+
+    if (chunk.submap_begin && skip_cli_sm_ids.count(chunk.map_header.id)) {
+      skipping_submap = true;
+    } else if (chunk.submap_begin) {
+      submap_ptr = utils::cliSubmapFromChunk((*ser_sm_id)++, submap_config_,
+                                             chunk, &map_frame_id_);
+      if (T_Sm_C_t != nullptr) {
+        tf::transformMsgToKindr<voxblox::FloatingPoint>(chunk.transform,
+                                                        T_Sm_C_t);
+      }
+      if (chunk.cached) {
+        // The header is current, the blocks come from the cache
+        coxgraph_msgs::ClientSubmapChunk::ConstPtr cached_msg =
+            submap_cache_ptr_->get(client_id_, chunk.map_header.id,
+                                   chunk.version);
+        if (cached_msg == nullptr) {
+          *cache_missed = true;
+          return false;
+        }
+        if (!utils::addChunkToCliSubmap(*cached_msg, submap_ptr.get())) {
+          return false;
+        }
+      } else if (fill_cache) {
+        cache_msg.reset(new coxgraph_msgs::ClientSubmapChunk());
+        cache_msg->map_header.id = chunk.map_header.id;
+        cache_msg->version = chunk.version;
+        cache_msg->submap_begin = true;
+        cache_msg->submap_end = true;
+        cache_msg->layer.voxel_size = chunk.layer.voxel_size;
+        cache_msg->layer.voxels_per_side = chunk.layer.voxels_per_side;
+        cache_msg->layer.layer_type = chunk.layer.layer_type;
+        cache_msg->layer.action = chunk.layer.action;
+      }
+    }
+    if (submap_ptr != nullptr) {
+      if (!chunk.cached &&
+          !utils::addChunkToCliSubmap(chunk, submap_ptr.get())) {
+        return false;
+      }
+      if (cache_msg != nullptr) {
+        cache_msg->layer.blocks.insert(cache_msg->layer.blocks.end(),
+                                       chunk.layer.blocks.begin(),
+                                       chunk.layer.blocks.end());
+      }
+      if (chunk.submap_end) {
+        if (cache_msg != nullptr) {
+          cache_msg->mesh_pointclouds = chunk.mesh_pointclouds;
+          submap_cache_ptr_->put(client_id_, cache_msg);
+          cache_msg.reset();
+        }
+        submap_pack_callback(
+            CliSmPack(submap_ptr, client_id_, chunk.map_header.id));
+        submap_ptr.reset();
+      }
+    }
+    if (chunk.submap_end) skipping_submap = false;
+    if (chunk.transfer_end) return submap_ptr == nullptr && !skipping_submap;
+  }
+}
+
+bool ClientHandler::callSubmapChunkService(
+    coxgraph_msgs::SubmapChunkSrv* chunk_srv) {
+  if (get_submap_chunk_client_.call(*chunk_srv)) return true;
+  if (get_submap_chunk_client_.isValid()) return false;
+  // The persistent connection dropped, reconnect once
+  get_submap_chunk_client_ = nh_.serviceClient<coxgraph_msgs::SubmapChunkSrv>(
+      client_node_name_ + "/get_submap_chunk", true);
+  return get_submap_chunk_client_.call(*chunk_srv);
 }
 
 void ClientHandler::submapPoseUpdatesCallback(
@@ -108,42 +335,31 @@ void ClientHandler::submapPoseUpdatesCallback(
   CHECK(submap_collection_ptr_ != nullptr);
   LOG(INFO) << log_prefix_ << "Received new pose for "
             << map_pose_updates_msg.submap_id.size() << " submaps.";
+  // Publish all poses of the message as one snapshot, so readers never see
+  // only part of an update
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      submap_collection_ptr_->getSnapshot();
+  SubmapCollection::SmPoseMap submap_poses;
   for (int i = 0; i < map_pose_updates_msg.submap_id.size(); i++) {
     SerSmId ser_sm_id;
-    CHECK(submap_collection_ptr_->getSerSmIdByCliSmId(
-        client_id_, map_pose_updates_msg.submap_id[i], &ser_sm_id));
-    CHECK(submap_collection_ptr_->exists(ser_sm_id))
-        << "CliSmId " << map_pose_updates_msg.submap_id[i]
-        << ", SerSmId: " << ser_sm_id;
-    geometry_msgs::Pose submap_pose_msg = map_pose_updates_msg.new_pose[i];
-    CliSm::Ptr submap_ptr = submap_collection_ptr_->getSubmapPtr(ser_sm_id);
+    CHECK(snapshot->getSerSmIdByCliSmId(
+        client_id_, map_pose_updates_msg.submap_id[i], &ser_sm_id))
+        << "CliSmId " << map_pose_updates_msg.submap_id[i];
     TransformationD submap_pose;
-    tf::poseMsgToKindr(submap_pose_msg, &submap_pose);
-    submap_ptr = submap_collection_ptr_->getSubmapPtr(ser_sm_id);
-    submap_ptr->setPose(submap_pose.cast<voxblox::FloatingPoint>());
-    submap_collection_ptr_->updateOriPose(
-        ser_sm_id, submap_pose.cast<voxblox::FloatingPoint>());
+    tf::poseMsgToKindr(map_pose_updates_msg.new_pose[i], &submap_pose);
+    submap_poses[ser_sm_id] = submap_pose.cast<voxblox::FloatingPoint>();
     LOG(INFO) << log_prefix_ << "Updating pose for submap cli id: "
               << map_pose_updates_msg.submap_id[i] << " ser id: " << ser_sm_id;
   }
+  submap_collection_ptr_->updateSubmapPoses(submap_poses, true);
 }
 
-bool ClientHandler::requestAllSubmaps(std::vector<CliSmPack>* submap_packs,
-                                      SerSmId* start_ser_sm_id) {
+bool ClientHandler::requestAllSubmaps(
+    const SubmapPackCallback& submap_pack_callback, SerSmId* start_ser_sm_id) {
   std::lock_guard<std::mutex> submap_request_lock(submap_request_mutex_);
-
-  CHECK(submap_packs != nullptr);
-  submap_packs->clear();
-  coxgraph_msgs::SubmapsSrv submap_srv;
-  if (get_all_submaps_client_.call(submap_srv)) {
-    for (auto const& submap_msg : submap_srv.response.submaps)
-      submap_packs->emplace_back(
-          utils::cliSubmapFromMsg((*start_ser_sm_id)++, submap_config_,
-                                  submap_msg, &map_frame_id_),
-          client_id_, submap_msg.map_header.id);
-    return true;
-  }
-  return false;
+  return pullSubmapStream(coxgraph_msgs::SubmapChunkSrv::Request::ALL_SUBMAPS,
+                          ros::Time(), start_ser_sm_id, submap_pack_callback,
+                          nullptr);
 }
 
 bool ClientHandler::requestPoseHistory(const std::string& file_path,
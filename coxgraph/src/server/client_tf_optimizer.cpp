@@ -1,5 +1,7 @@
 #include "coxgraph/server/client_tf_optimizer.h"
 
+#include <map>
+
 #include "coxgraph/common.h"
 
 namespace coxgraph {
@@ -18,18 +20,154 @@ void ClientTfOptimizer::addClient(const CliId& cid,
   config.T_I_node_initial = pose;
 
   pose_graph_.addClientNode(config);
+  client_poses_[cid] = pose;
+}
+
+void ClientTfOptimizer::removeClient(const CliId& cid) {
+  CHECK_NE(cid, 0) << "Client 0 is fixed and can't be removed";
+  for (auto it = relative_pose_averages_.begin();
+       it != relative_pose_averages_.end();) {
+    if (it->first.first == cid || it->first.second == cid) {
+      it = relative_pose_averages_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  pose_graph_.resetClientRelativePoseConstraint();
+  pose_graph_.removeClientNode(cid);
+  client_poses_.erase(cid);
+  fused_clients_.erase(cid);
 }
 
-void ClientTfOptimizer::addClientRelativePoseMeasurement(
+void ClientTfOptimizer::addClientRelativePoseMeasurements(
     const CliId& first_cid, const CliId& second_cid,
-    const Transformation& T_C1_C2) {
-  RelativePoseConstraint::Config config;
-  config.information_matrix = cli_rp_info_matrix_;
-  config.origin_client_id = first_cid;
-  config.destination_client_id = second_cid;
-  config.T_origin_destination = T_C1_C2;
-
-  pose_graph_.addClientRelativePoseConstraint(config);
+    const TransformationVector& T_C1_X, const TransformationVector& T_X_C2) {
+  CHECK_NE(first_cid, second_cid);
+  if (!hasClient(first_cid) || !hasClient(second_cid)) return;
+  if (first_cid < second_cid) {
+    relative_pose_averages_[CliIdPair(first_cid, second_cid)].addProducts(
+        T_C1_X, T_X_C2);
+  } else {
+    // (T_C1_X * T_X_C2)^-1 = T_X_C2^-1 * T_C1_X^-1
+    TransformationVector T_C2_X, T_X_C1;
+    T_C2_X.reserve(T_X_C2.size());
+    T_X_C1.reserve(T_C1_X.size());
+    for (auto const& T : T_X_C2) T_C2_X.emplace_back(T.inverse());
+    for (auto const& T : T_C1_X) T_X_C1.emplace_back(T.inverse());
+    relative_pose_averages_[CliIdPair(second_cid, first_cid)].addProducts(
+        T_C2_X, T_X_C1);
+  }
+}
+
+void ClientTfOptimizer::optimize() {
+  const ros::WallTime start_time = ros::WallTime::now();
+
+  // Chain the averaged client pairs along a maximum weight spanning tree
+  // from the fixed client 0 (Prim's algorithm)
+  std::map<CliId, Transformation> T_G_C;
+  T_G_C.emplace(0, client_poses_.at(0));
+  while (true) {
+    auto best_it = relative_pose_averages_.end();
+    for (auto it = relative_pose_averages_.begin();
+         it != relative_pose_averages_.end(); ++it) {
+      if (T_G_C.count(it->first.first) == T_G_C.count(it->first.second)) {
+        continue;
+      }
+      if (best_it == relative_pose_averages_.end() ||
+          it->second.getWeight() > best_it->second.getWeight()) {
+        best_it = it;
+      }
+    }
+    if (best_it == relative_pose_averages_.end()) break;
+
+    const CliId& first_cid = best_it->first.first;
+    const CliId& second_cid = best_it->first.second;
+    const Transformation T_C1_C2 = best_it->second.getAverage();
+    if (T_G_C.count(first_cid)) {
+      T_G_C.emplace(second_cid, T_G_C.at(first_cid) * T_C1_C2);
+    } else {
+      T_G_C.emplace(first_cid, T_G_C.at(second_cid) * T_C1_C2.inverse());
+    }
+  }
+  fused_clients_.clear();
+  for (auto const& cli_pose_kv : T_G_C) {
+    client_poses_[cli_pose_kv.first] = cli_pose_kv.second;
+    fused_clients_.emplace(cli_pose_kv.first);
+  }
+  publishClosedFormSummary((ros::WallTime::now() - start_time).toSec());
+
+  if (ceres_refinement_ && !relative_pose_averages_.empty()) {
+    refineWithCeres();
+  }
+}
+
+void ClientTfOptimizer::refineWithCeres() {
+  // One constraint per client pair, weighted by the number of submap pairs
+  // it averages. The |A| * |B| products of a submap pair share their errors,
+  // weighting by them would make the constraint far too confident.
+  pose_graph_.resetClientRelativePoseConstraint();
+  for (auto const& average_kv : relative_pose_averages_) {
+    RelativePoseConstraint::Config config;
+    config.information_matrix =
+        cli_rp_info_matrix_ * average_kv.second.getNumPairs();
+    config.origin_client_id = average_kv.first.first;
+    config.destination_client_id = average_kv.first.second;
+    config.T_origin_destination = average_kv.second.getAverage();
+    pose_graph_.addClientRelativePoseConstraint(config);
+  }
+  for (auto const& cli_pose_kv : client_poses_) {
+    pose_graph_.setClientNodePose(cli_pose_kv.first, cli_pose_kv.second);
+  }
+
+  pose_graph_.optimize();
+  for (auto const& cli_pose_kv : pose_graph_.getClientMapTf()) {
+    if (!fused_clients_.count(cli_pose_kv.first)) continue;
+    client_poses_[cli_pose_kv.first] = cli_pose_kv.second;
+  }
+  publishSolverSummary();
+}
+
+void ClientTfOptimizer::publishClosedFormSummary(double solve_time) {
+  if (solver_summary_pub_.getNumSubscribers() == 0) return;
+
+  // The spanning tree is exact for the averages it uses, there are no
+  // iterations and no remaining cost to report
+  coxgraph_msgs::SolverSummary summary_msg;
+  summary_msg.header.stamp = ros::Time::now();
+  summary_msg.solver = "closed_form";
+  summary_msg.num_threads = 1;
+  summary_msg.num_parameter_blocks = fused_clients_.size();
+  summary_msg.num_residual_blocks = relative_pose_averages_.size();
+  summary_msg.minimizer_time = solve_time;
+  summary_msg.total_time = solve_time;
+  summary_msg.termination_type = "CONVERGENCE";
+  solver_summary_pub_.publish(summary_msg);
+}
+
+void ClientTfOptimizer::publishSolverSummary() {
+  if (solver_summary_pub_.getNumSubscribers() == 0) return;
+
+  const ceres::Solver::Summary& summary = pose_graph_.getLastSolverSummary();
+  coxgraph_msgs::SolverSummary summary_msg;
+  summary_msg.header.stamp = ros::Time::now();
+  summary_msg.solver = "ceres";
+  summary_msg.linear_solver_type =
+      ceres::LinearSolverTypeToString(summary.linear_solver_type_used);
+  summary_msg.num_threads = summary.num_threads_used;
+  summary_msg.num_parameter_blocks = summary.num_parameter_blocks;
+  summary_msg.num_residual_blocks = summary.num_residual_blocks;
+  summary_msg.num_successful_steps = summary.num_successful_steps;
+  summary_msg.num_unsuccessful_steps = summary.num_unsuccessful_steps;
+  summary_msg.initial_cost = summary.initial_cost;
+  summary_msg.final_cost = summary.final_cost;
+  summary_msg.preprocessor_time = summary.preprocessor_time_in_seconds;
+  summary_msg.minimizer_time = summary.minimizer_time_in_seconds;
+  summary_msg.linear_solver_time = summary.linear_solver_time_in_seconds;
+  summary_msg.postprocessor_time = summary.postprocessor_time_in_seconds;
+  summary_msg.total_time = summary.total_time_in_seconds;
+  summary_msg.termination_type =
+      ceres::TerminationTypeToString(summary.termination_type);
+  solver_summary_pub_.publish(summary_msg);
 }
 
 }  // namespace server
@@ -1,6 +1,5 @@
 #include "coxgraph/server/coxgraph_server.h"
 
-#include <coxgraph_msgs/SubmapsSrv.h>
 #include <geometry_msgs/Quaternion.h>
 #include <tf/transform_datatypes.h>
 #include <visualization_msgs/Marker.h>
@@ -8,6 +7,9 @@
 #include <boost/filesystem.hpp>
 
 #include <chrono>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -23,16 +25,40 @@ CoxgraphServer::Config CoxgraphServer::getConfigFromRosParam(
     const ros::NodeHandle& nh_private) {
   CoxgraphServer::Config config;
 
+  nh_private.param<int>("max_client_number", config.max_client_number,
+                        config.max_client_number);
+  LOG_IF(FATAL,
+         !(config.max_client_number > 0 &&
+           config.max_client_number <= std::numeric_limits<CliId>::max()))
+      << "Invalid max client number, must > 0 and fit into a client id. "
+         "Given: "
+      << config.max_client_number;
   nh_private.param<int>("client_number", config.client_number,
                         config.client_number);
-  LOG_IF(FATAL,
-         !(config.client_number > 0 && config.client_number <= kMaxClientNum))
-      << "Invalid client number, must > 0, and only max 2 clients supported "
-         "now. Given: "
+  LOG_IF(FATAL, !(config.client_number > 0 &&
+                  config.client_number <= config.max_client_number))
+      << "Invalid client number, must > 0 and <= max_client_number. Given: "
       << config.client_number;
+  std::string client_leave_policy = "freeze";
+  nh_private.param<std::string>("client_leave_policy", client_leave_policy,
+                                client_leave_policy);
+  LOG_IF(FATAL, !parseClientLeavePolicy(client_leave_policy,
+                                        &config.client_leave_policy))
+      << "Invalid client leave policy, must be freeze or evict. Given: "
+      << client_leave_policy;
 
   nh_private.param<int>("map_fusion_queue_size", config.map_fusion_queue_size,
                         config.map_fusion_queue_size);
+  nh_private.param<int>("map_fusion_pipeline_queue_size",
+                        config.map_fusion_pipeline_queue_size,
+                        config.map_fusion_pipeline_queue_size);
+  LOG_IF(FATAL, config.map_fusion_pipeline_queue_size <= 0)
+      << "Invalid map fusion pipeline queue size, must > 0. Given: "
+      << config.map_fusion_pipeline_queue_size;
+  float optimization_interval = config.optimization_interval.toSec();
+  nh_private.param<float>("optimization_interval", optimization_interval,
+                          optimization_interval);
+  config.optimization_interval.fromSec(optimization_interval);
   float refuse_interval;
   nh_private.param<float>("refuse_interval", refuse_interval, refuse_interval);
   config.refuse_interval.fromSec(refuse_interval);
@@ -61,19 +87,139 @@ CoxgraphServer::Config CoxgraphServer::getConfigFromRosParam(
   return config;
 }
 
-void CoxgraphServer::initClientHandlers(const ros::NodeHandle& nh,
-                                        const ros::NodeHandle& nh_private) {
-  CHECK_LT(config_.fixed_map_client_id, kMaxClientNum);
+bool CoxgraphServer::parseClientLeavePolicy(const std::string& policy_str,
+                                            ClientLeavePolicy* policy) {
+  CHECK_NOTNULL(policy);
+  if (policy_str == "freeze") {
+    *policy = ClientLeavePolicy::FREEZE;
+  } else if (policy_str == "evict") {
+    *policy = ClientLeavePolicy::EVICT;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void CoxgraphServer::initClientHandlers() {
+  CHECK_LT(config_.fixed_map_client_id, config_.client_number);
   for (int i = 0; i < config_.client_number; i++) {
-    client_handlers_.emplace_back(new ClientHandler(
-        nh, nh_private, i, config_.map_frame_prefix, submap_config_,
-        submap_collection_ptr_, server_vis_->getMeshCollectionPtr(),
-        std::bind(&CoxgraphServer::timeLineUpdateCallback, this)));
+    CliId cid = i;
+    std::string message;
+    CHECK(registerClient(&cid, &message)) << message;
+  }
+}
+
+server::ClientHandler::Ptr CoxgraphServer::getClientHandler(
+    const CliId& cid) const {
+  const std::shared_ptr<const ClientMap> clients = getClients();
+  auto client_it = clients->find(cid);
+  if (client_it == clients->end()) return nullptr;
+  return client_it->second.handler;
+}
 
-    force_fuse_.emplace_back(true);
-    fused_time_line_.emplace_back(TimeLine());
+bool CoxgraphServer::registerClient(CliId* cid, std::string* message) {
+  CHECK_NOTNULL(cid);
+  CHECK_NOTNULL(message);
+  std::lock_guard<std::mutex> registration_lock(client_registration_mutex_);
+  const std::shared_ptr<const ClientMap> clients = getClients();
+  if (*cid < 0) {
+    *cid = clients->empty() ? 0 : clients->rbegin()->first + 1;
+  }
+  if (*cid >= config_.max_client_number) {
+    *message = "No client id left below max_client_number " +
+               std::to_string(config_.max_client_number);
+    return false;
   }
-  force_fuse_[config_.fixed_map_client_id] = false;
+  const std::string client_str = "Client " + std::to_string(*cid);
+
+  auto client_it = clients->find(*cid);
+  if (client_it != clients->end()) {
+    if (client_it->second.state == ClientState::ACTIVE) {
+      *message = client_str + " is registered already";
+      return true;
+    }
+    if (client_it->second.state == ClientState::EVICTED) {
+      *message = client_str + " was evicted, its id can't be used again";
+      return false;
+    }
+  }
+
+  // Everything the handler callbacks reach is set up before it's created. A
+  // frozen client rejoining is fused already and keeps its fusion state.
+  {
+    std::lock_guard<std::mutex> refuse_lock(refuse_mutex_);
+    if (client_it == clients->end()) {
+      fusion_states_[*cid].force_fuse = (*cid != config_.fixed_map_client_id);
+    }
+  }
+  tf_controller_->addClient(*cid);
+
+  std::shared_ptr<ClientMap> new_clients =
+      std::make_shared<ClientMap>(*clients);
+  Client& client = (*new_clients)[*cid];
+  client.state = ClientState::ACTIVE;
+  client.handler.reset(new ClientHandler(
+      nh_, nh_private_, *cid, config_.map_frame_prefix, submap_config_,
+      submap_collection_ptr_, server_vis_->getMeshCollectionPtr(),
+      submap_cache_ptr_,
+      std::bind(&CoxgraphServer::timeLineUpdateCallback, this,
+                std::placeholders::_1, std::placeholders::_2)));
+  std::atomic_store(&clients_, std::shared_ptr<const ClientMap>(new_clients));
+
+  *message = client_str + " registered";
+  LOG(INFO) << *message;
+  return true;
+}
+
+bool CoxgraphServer::deregisterClient(const CliId& cid,
+                                      ClientLeavePolicy policy,
+                                      std::string* message) {
+  CHECK_NOTNULL(message);
+  const std::string client_str = "Client " + std::to_string(cid);
+  if (cid == config_.fixed_map_client_id) {
+    *message = client_str + " holds the fixed map and can't leave";
+    return false;
+  }
+
+  ClientHandler::Ptr client_handler;
+  {
+    std::lock_guard<std::mutex> registration_lock(client_registration_mutex_);
+    const std::shared_ptr<const ClientMap> clients = getClients();
+    auto client_it = clients->find(cid);
+    if (client_it == clients->end() ||
+        client_it->second.state != ClientState::ACTIVE) {
+      *message = client_str + " is not registered";
+      return false;
+    }
+    std::shared_ptr<ClientMap> new_clients =
+        std::make_shared<ClientMap>(*clients);
+    Client& client = new_clients->at(cid);
+    client.state = policy == ClientLeavePolicy::FREEZE ? ClientState::FROZEN
+                                                       : ClientState::EVICTED;
+    client_handler = std::move(client.handler);
+    std::atomic_store(&clients_,
+                      std::shared_ptr<const ClientMap>(new_clients));
+  }
+
+  const size_t num_dropped = map_fusion_scheduler_->removeClient(cid);
+  publishMapFusionQueueStats();
+  if (policy == ClientLeavePolicy::EVICT) evictClient(cid);
+
+  *message = client_str + " left, its submaps are " +
+             (policy == ClientLeavePolicy::FREEZE ? "frozen" : "evicted") +
+             ", dropped " + std::to_string(num_dropped) +
+             " deferred map fusions";
+  LOG(INFO) << *message;
+  // The handler stops once the transfers it has queued are served
+  return true;
+}
+
+void CoxgraphServer::evictClient(const CliId& cid) {
+  tf_controller_->removeClient(cid);
+  server_vis_->getMeshCollectionPtr()->removeClientMeshes(cid);
+  submap_cache_ptr_->removeClient(cid);
+  std::lock_guard<std::mutex> refuse_lock(refuse_mutex_);
+  fusion_states_.erase(cid);
 }
 
 void CoxgraphServer::subscribeTopics() {
@@ -82,7 +228,14 @@ void CoxgraphServer::subscribeTopics() {
                     &CoxgraphServer::mapFusionMsgCallback, this);
 }
 
-void CoxgraphServer::advertiseTopics() {}
+void CoxgraphServer::advertiseTopics() {
+  map_fusion_queue_stats_pub_ =
+      nh_private_.advertise<coxgraph_msgs::MapFusionQueueStats>(
+          "map_fusion_queue_stats", config_.publisher_queue_length);
+  client_resource_usage_pub_ =
+      nh_private_.advertise<coxgraph_msgs::ClientResourceUsage>(
+          "client_resource_usage", config_.publisher_queue_length);
+}
 
 void CoxgraphServer::advertiseServices() {
   get_final_global_mesh_srv_ = nh_private_.advertiseService(
@@ -92,6 +245,10 @@ void CoxgraphServer::advertiseServices() {
       "get_pose_history", &CoxgraphServer::getPoseHistoryCallback, this);
   need_to_fuse_srv_ = nh_private_.advertiseService(
       "need_to_fuse", &CoxgraphServer::needToFuseCallback, this);
+  register_client_srv_ = nh_private_.advertiseService(
+      "register_client", &CoxgraphServer::registerClientCallback, this);
+  deregister_client_srv_ = nh_private_.advertiseService(
+      "deregister_client", &CoxgraphServer::deregisterClientCallback, this);
 }
 
 // TODO(mikexyl): move this to server_vis
@@ -101,39 +258,65 @@ bool CoxgraphServer::getFinalGlobalMeshCallback(
   LOG(INFO) << "Service called to get final global mesh, pausing map fusion "
                "process";
 
-  processMFFuture();
+  // Run what the current time lines already cover before the mesh is built,
+  // and let the fusions in flight reach the pose graph
+  const std::shared_ptr<const ClientMap> clients = getClients();
+  for (auto const& client_kv : *clients) {
+    if (client_kv.second.handler == nullptr) continue;
+    wakeMapFusions(client_kv.first, client_kv.second.handler->getTimeLine());
+  }
+  fetch_queue_->waitUntilIdle();
+  fuse_queue_->waitUntilIdle();
 
   std::string file_path = request.file_path;
   LOG_IF(INFO, file_path.empty())
       << "Mesh file path is not given, mesh will not be saved as file";
 
-  uint8_t trials_ = 0;
+  // Map fusions from other robots may have arrived meanwhile, the fuse stage
+  // holds the lock for at most one batch and its optimization
   while (!final_mesh_gen_mutex_.try_lock_for(std::chrono::milliseconds(500))) {
     LOG(INFO) << "current map fusion is still being processing, waiting";
-    trials_++;
-    CHECK_LT(trials_, 3)
-        << " Tried 3 times, map fusion process is still running";
   }
   LOG(INFO) << "Map fusion process is paused, generating final mesh";
 
-  // requesting submaps one by one to avoid bandwidth peak,
-  std::vector<CliSmPack> all_submaps;
+  // Only the overlays are changed from here, so the live collection and pose
+  // graph stay as map fusion left them
+  SubmapCollection::Ptr global_submap_collection_ptr =
+      submap_collection_ptr_->createOverlay();
+  PoseGraphInterface global_pg_interface(pose_graph_interface_,
+                                         global_submap_collection_ptr);
+
+  // requesting submaps one by one to avoid bandwidth peak, each one goes to
+  // the overlays as soon as it is complete
   SerSmId start_ser_sm_id = submap_collection_ptr_->getNextSubmapID();
-  for (auto const& ch : client_handlers_) {
-    if (!tf_controller_->ifClientFused(ch->getCliId())) continue;
-    std::vector<CliSmPack> submaps_in_client;
-    CHECK(ch->requestAllSubmaps(&submaps_in_client, &start_ser_sm_id));
-    all_submaps.insert(all_submaps.end(), submaps_in_client.begin(),
-                       submaps_in_client.end());
+  for (auto const& client_kv : *clients) {
+    const ClientHandler::Ptr& ch = client_kv.second.handler;
+    if (ch == nullptr || !tf_controller_->ifClientFused(ch->getCliId())) {
+      continue;
+    }
+    CHECK(ch->requestAllSubmaps(
+        [&global_submap_collection_ptr,
+         &global_pg_interface](const CliSmPack& submap_pack) {
+          global_submap_collection_ptr->addSubmap(
+              submap_pack.submap_ptr, submap_pack.cid, submap_pack.cli_sm_id);
+          global_pg_interface.addSubmap(submap_pack.submap_ptr->getID());
+        },
+        &start_ser_sm_id));
   }
+  // The overlay pose graph solves its own copy of the live Ceres problem,
+  // map fusion stays paused until it's solved. Meshing only reads the
+  // optimized poses from the overlay collection.
+  if (global_submap_collection_ptr->getSnapshot()->size() > 0) {
+    server_vis_->optimizeFinalGlobalGraph(&global_pg_interface);
+  }
+  final_mesh_gen_mutex_.unlock();
+  LOG(INFO) << "Map fusion process unpaused";
 
-  server_vis_->getFinalGlobalMesh(
-      submap_collection_ptr_, pose_graph_interface_, all_submaps,
-      tf_controller_->getGlobalMissionFrame(), file_path, true);
-
-  LOG(INFO) << "Global mesh generated, map fusion process unpaused";
+  server_vis_->getFinalGlobalMesh(global_submap_collection_ptr,
+                                  tf_controller_->getGlobalMissionFrame(),
+                                  file_path, true);
 
-  final_mesh_gen_mutex_.unlock();
+  LOG(INFO) << "Global mesh generated";
   std::string ok_str = "Global mesh saved to " + request.file_path;
   LOG(INFO) << ok_str;
   response.message = ok_str;
@@ -145,8 +328,10 @@ bool CoxgraphServer::getPoseHistoryCallback(
     coxgraph_msgs::FilePath::Response& response) {
   LOG(INFO) << "Generating pose history for all clients";
 
-  std::vector<PoseStampedVector> pose_histories(config_.client_number);
-  for (auto const& ch : client_handlers_) {
+  std::map<CliId, PoseStampedVector> pose_histories;
+  for (auto const& client_kv : *getClients()) {
+    const ClientHandler::Ptr& ch = client_kv.second.handler;
+    if (ch == nullptr) continue;
     if (!ch->requestPoseHistory(request.file_path,
                                 &pose_histories[ch->getCliId()])) {
       LOG(ERROR) << "Request pose history of Client " << ch->getCliId()
@@ -162,11 +347,18 @@ bool CoxgraphServer::getPoseHistoryCallback(
   if (!f.is_open()) LOG(ERROR) << "Failed to open file " << request.file_path;
   f << std::fixed;
 
-  for (int cid = 0; cid < pose_histories.size(); cid++) {
+  for (auto const& pose_history_kv : pose_histories) {
+    const boost::optional<tf::StampedTransform> T_G_Cli_tf =
+        tf_controller_->getTGCliOpt(pose_history_kv.first);
+    if (!T_G_Cli_tf) {
+      LOG(WARNING) << "Client " << static_cast<int>(pose_history_kv.first)
+                   << " left, its pose history is not saved";
+      continue;
+    }
     TransformationD T_G_Cli;
-    tf::transformTFToKindr(tf_controller_->getTGCliOpt(cid), &T_G_Cli);
+    tf::transformTFToKindr(*T_G_Cli_tf, &T_G_Cli);
 
-    for (auto const& pose : pose_histories[cid]) {
+    for (auto const& pose : pose_history_kv.second) {
       TransformationD T_Cli_C;
       tf::poseMsgToKindr(pose.pose, &T_Cli_C);
       TransformationD T_G_C = T_G_Cli * T_Cli_C;
@@ -189,9 +381,39 @@ bool CoxgraphServer::getPoseHistoryCallback(
 bool CoxgraphServer::needToFuseCallback(
     coxgraph_msgs::NeedToFuseSrv::Request& request,
     coxgraph_msgs::NeedToFuseSrv::Response& response) {
-  response.need_to_fuse = needRefuse(
-      request.cid_a, client_handlers_[request.cid_a]->getTimeLine().end,
-      request.cid_b, client_handlers_[request.cid_b]->getTimeLine().end);
+  const ClientHandler::Ptr client_handler_a =
+      getClientHandler(request.cid_a);
+  const ClientHandler::Ptr client_handler_b =
+      getClientHandler(request.cid_b);
+  response.need_to_fuse =
+      client_handler_a != nullptr && client_handler_b != nullptr &&
+      needRefuse(request.cid_a, client_handler_a->getTimeLine().end,
+                 request.cid_b, client_handler_b->getTimeLine().end);
+  return true;
+}
+
+bool CoxgraphServer::registerClientCallback(
+    coxgraph_msgs::RegisterClient::Request& request,
+    coxgraph_msgs::RegisterClient::Response& response) {
+  CliId cid = request.client_id;
+  response.success = registerClient(&cid, &response.message);
+  response.client_id = cid;
+  return true;
+}
+
+bool CoxgraphServer::deregisterClientCallback(
+    coxgraph_msgs::DeregisterClient::Request& request,
+    coxgraph_msgs::DeregisterClient::Response& response) {
+  ClientLeavePolicy policy = config_.client_leave_policy;
+  if (!request.policy.empty() &&
+      !parseClientLeavePolicy(request.policy, &policy)) {
+    response.success = false;
+    response.message = "Invalid client leave policy " + request.policy +
+                       ", must be freeze or evict";
+    return true;
+  }
+  response.success =
+      deregisterClient(request.client_id, policy, &response.message);
   return true;
 }
 
@@ -217,192 +439,417 @@ void CoxgraphServer::mapFusionMsgCallback(
 void CoxgraphServer::loopClosureCallback(
     const CliId& client_id,
     const voxgraph_msgs::LoopClosure& loop_closure_msg) {
-  if (config_.enable_client_loop_closure)
-    client_handlers_[client_id]->pubLoopClosureMsg(loop_closure_msg);
+  if (!config_.enable_client_loop_closure) return;
+  const ClientHandler::Ptr client_handler = getClientHandler(client_id);
+  if (client_handler != nullptr) {
+    client_handler->pubLoopClosureMsg(loop_closure_msg);
+  }
 }
 
-// TODO(mikexyl): logics here really messed up, clean it
-bool CoxgraphServer::mapFusionCallback(
-    const coxgraph_msgs::MapFusion& map_fusion_msg, bool future) {
-  std::lock_guard<std::timed_mutex> map_fusion_proc_lock(final_mesh_gen_mutex_);
-
+void CoxgraphServer::mapFusionCallback(
+    const coxgraph_msgs::MapFusion& map_fusion_msg) {
   CHECK_NE(map_fusion_msg.from_client_id, map_fusion_msg.to_client_id);
 
-  // TODO(mikexyl): make ifs cleaner
-  CliSm::Ptr submap_a, submap_b;
-  CliSmId cli_sm_id_a, cli_sm_id_b;
-  Transformation T_A_t1, T_B_t2;
   const CliId& cid_a = map_fusion_msg.from_client_id;
   const CliId& cid_b = map_fusion_msg.to_client_id;
   const ros::Time& t1 = map_fusion_msg.from_timestamp;
   const ros::Time& t2 = map_fusion_msg.to_timestamp;
-  TransformationD T_t1_t2;
-  tf::transformMsgToKindr(map_fusion_msg.transform, &T_t1_t2);
-
-  if (!needRefuse(cid_a, t1, cid_b, t2)) return true;
-  CHECK((!fused_time_line_[cid_a].hasTime(t1)) ||
-        (!fused_time_line_[cid_b].hasTime(t2)));
-
-  ReqState ok_a, ok_b;
-  bool has_time_a = client_handlers_[cid_a]->hasTime(t1);
-  bool has_time_b = client_handlers_[cid_b]->hasTime(t2);
-
-  if (has_time_a && has_time_b) {
-    // TODO(mikexyl): add a service to request submap id, publish submap only if
-    // submap id not requested before
-    ok_a = client_handlers_[cid_a]->requestSubmapByTime(
-        t1, submap_collection_ptr_->getNextSubmapID(), &cli_sm_id_a, &submap_a,
-        &T_A_t1);
-    ok_b = client_handlers_[cid_b]->requestSubmapByTime(
-        t2, submap_collection_ptr_->getNextSubmapID() + 1, &cli_sm_id_b,
-        &submap_b, &T_B_t2);
-
-    CHECK_NE(ok_a, ReqState::FUTURE);
-    CHECK_NE(ok_b, ReqState::FUTURE);
-
-    if (verbose_) {
-      LOG_IF(INFO, ok_a == ReqState::FAILED && verbose_)
-          << "Requesting submap from Client " << map_fusion_msg.from_client_id
-          << " failed!";
-
-      LOG_IF(INFO, ok_a == ReqState::FUTURE && verbose_)
-          << "Requested timestamp from Client " << map_fusion_msg.from_client_id
-          << " is ahead of client timeline, map fusion msg saved for later";
-      LOG_IF(INFO, ok_b == ReqState::FAILED && verbose_)
-          << "Requesting submap from Client " << map_fusion_msg.to_client_id
-          << " failed!";
-      LOG_IF(INFO, ok_b == ReqState::FUTURE && verbose_)
-          << "Requested timestamp from Client " << map_fusion_msg.to_client_id
-          << " is ahead of client timeline, map fusion msg saved for later";
-    }
+
+  const ClientHandler::Ptr client_handler_a = getClientHandler(cid_a);
+  const ClientHandler::Ptr client_handler_b = getClientHandler(cid_b);
+  if (client_handler_a == nullptr || client_handler_b == nullptr) {
+    LOG(WARNING) << "Dropped map fusion of Client " << static_cast<int>(cid_a)
+                 << " and Client " << static_cast<int>(cid_b)
+                 << ", not both are registered";
+    return;
+  }
+
+  if (!needRefuse(cid_a, t1, cid_b, t2)) return;
+
+  // The time lines are checked by the scheduler, under the same lock as its
+  // wakeups, so no update can slip in between the check and the deferral
+  if (deferMapFusion(map_fusion_msg)) return;
+
+  MapFusionJob job;
+  if (!startMapFusionJob(map_fusion_msg, &job)) return;
+  num_fusions_in_fetch_++;
+  const ros::WallTime push_start_time = ros::WallTime::now();
+  fetch_queue_->push(std::move(job));
+  const double push_wait_time =
+      (ros::WallTime::now() - push_start_time).toSec();
+  LOG_IF(INFO, verbose_ && push_wait_time > kPushWaitLogS)
+      << "Map fusion pipeline full, waited " << push_wait_time
+      << " s to queue map fusion";
+}
+
+bool CoxgraphServer::startMapFusionJob(
+    const coxgraph_msgs::MapFusion& map_fusion_msg, MapFusionJob* job) {
+  CHECK_NOTNULL(job);
+  const ClientHandler::Ptr client_handler_a =
+      getClientHandler(map_fusion_msg.from_client_id);
+  const ClientHandler::Ptr client_handler_b =
+      getClientHandler(map_fusion_msg.to_client_id);
+  if (client_handler_a == nullptr || client_handler_b == nullptr) return false;
+
+  // TODO(mikexyl): add a service to request submap id, publish submap only if
+  // submap id not requested before
+  // Both submaps are fetched in parallel, on the I/O threads of the clients,
+  // while earlier fusions are still being inserted and optimized
+  job->map_fusion_msg = map_fusion_msg;
+  job->start_time = ros::WallTime::now();
+  job->ser_sm_id_a = reserveSerSmId();
+  job->ser_sm_id_b = reserveSerSmId();
+  job->request_a = client_handler_a->requestSubmapByTimeAsync(
+      map_fusion_msg.from_timestamp, job->ser_sm_id_a);
+  job->request_b = client_handler_b->requestSubmapByTimeAsync(
+      map_fusion_msg.to_timestamp, job->ser_sm_id_b);
+  return true;
+}
+
+void CoxgraphServer::collectSubmapPairs(std::vector<MapFusionJob>* jobs) {
+  // Refetched fusions are appended to the batch, so it's walked by index
+  for (size_t job_i = 0; job_i < jobs->size(); job_i++) {
+    MapFusionJob& job = jobs->at(job_i);
+    SubmapPairFusion fusion;
+    fusion.map_fusion_msg = job.map_fusion_msg;
+    fusion.start_time = job.start_time;
+    fusion.ser_sm_id_a = job.ser_sm_id_a;
+    fusion.ser_sm_id_b = job.ser_sm_id_b;
+    fusion.request_a = job.request_a.get();
+    fusion.request_b = job.request_b.get();
+    const coxgraph_msgs::MapFusion& map_fusion_msg = fusion.map_fusion_msg;
+    const ReqState ok_a = fusion.request_a.state;
+    const ReqState ok_b = fusion.request_b.state;
+
+    LOG_IF(INFO, ok_a == ReqState::FAILED && verbose_)
+        << "Requesting submap from Client " << map_fusion_msg.from_client_id
+        << " failed!";
+    LOG_IF(INFO, ok_b == ReqState::FAILED && verbose_)
+        << "Requesting submap from Client " << map_fusion_msg.to_client_id
+        << " failed!";
     LOG_IF(INFO, ok_a == ReqState::SUCCESS && verbose_)
         << "Received submap from Client " << map_fusion_msg.from_client_id
         << " with layer memory "
-        << submap_a->getTsdfMapPtr()->getTsdfLayerPtr()->getMemorySize();
+        << fusion.request_a.submap->getTsdfMapPtr()
+               ->getTsdfLayerPtr()
+               ->getMemorySize();
     LOG_IF(INFO, ok_b == ReqState::SUCCESS && verbose_)
         << "Received submap from Client " << map_fusion_msg.to_client_id
         << " with layer memory "
-        << submap_b->getTsdfMapPtr()->getTsdfLayerPtr()->getMemorySize();
-
-    if (ok_a != ReqState::SUCCESS || ok_b != ReqState::SUCCESS) {
-      if (ok_a == ReqState::SUCCESS) {
-        addSubmap(submap_a, cid_a, cli_sm_id_a);
+        << fusion.request_b.submap->getTsdfMapPtr()
+               ->getTsdfLayerPtr()
+               ->getMemorySize();
+
+    // The client time line moved on between the check and the request. If
+    // the scheduler has seen the update already, no later one may come to
+    // wake the fusion, so it's fetched again right away.
+    MapFusionJob retry_job;
+    bool retry = false;
+    if ((ok_a == ReqState::FUTURE || ok_b == ReqState::FUTURE) &&
+        !deferMapFusion(map_fusion_msg)) {
+      if (job.num_retries < kMaxMapFusionRetries &&
+          startMapFusionJob(map_fusion_msg, &retry_job)) {
+        retry_job.start_time = job.start_time;
+        retry_job.num_retries = job.num_retries + 1;
+        retry = true;
+        num_fusions_in_fetch_++;
+      } else {
+        LOG(WARNING) << "Dropped map fusion of Client "
+                     << static_cast<int>(map_fusion_msg.from_client_id)
+                     << " and Client "
+                     << static_cast<int>(map_fusion_msg.to_client_id)
+                     << ", its submaps couldn't be fetched";
       }
-      if (ok_b == ReqState::SUCCESS) {
-        addSubmap(submap_b, cid_b, cli_sm_id_b);
-      }
-      return false;
     }
+    // Failed fusions are passed on too, the fuse stage only optimizes once
+    // nothing is left in the pipeline. The fusion leaves the fetch count
+    // before it's handed off, so the fuse stage never waits for itself.
+    num_fusions_in_fetch_--;
+    fuse_queue_->push(std::move(fusion));
+    if (retry) jobs->emplace_back(std::move(retry_job));
   }
+}
 
-  bool fused_any = false;
-  if (future) {
-    CHECK_EQ(ok_a, ReqState::SUCCESS);
-    CHECK_EQ(ok_b, ReqState::SUCCESS);
-    fused_any = fuseMap(cid_a, t1, cli_sm_id_a, submap_a, T_A_t1,  // NOLINT
-                        cid_b, t2, cli_sm_id_b, submap_b, T_B_t2,
-                        T_t1_t2.cast<voxblox::FloatingPoint>());
-  } else {
-    if (has_time_a && has_time_b) {
-      if ((ok_a == ReqState::SUCCESS && ok_b == ReqState::FUTURE) ||
-          (ok_b == ReqState::SUCCESS && ok_a == ReqState::FUTURE)) {
-        addToMFFuture(map_fusion_msg);
-      }
-      if (ok_a == ReqState::SUCCESS && ok_b == ReqState::SUCCESS) {
-        fused_any = fuseMap(cid_a, t1, cli_sm_id_a, submap_a, T_A_t1,  // NOLINT
-                            cid_b, t2, cli_sm_id_b, submap_b, T_B_t2,
-                            T_t1_t2.cast<voxblox::FloatingPoint>());
-      }
-    } else {
-      addToMFFuture(map_fusion_msg);
+void CoxgraphServer::fuseSubmapPairs(std::vector<SubmapPairFusion>* fusions) {
+  std::lock_guard<std::timed_mutex> map_fusion_proc_lock(final_mesh_gen_mutex_);
+
+  int num_fused = 0;
+  for (auto const& fusion : *fusions) {
+    const bool fused = fuseMap(fusion);
+    const SubmapCollection::Snapshot::ConstPtr snapshot =
+        submap_collection_ptr_->getSnapshot();
+    for (const SerSmId& ser_sm_id : {fusion.ser_sm_id_a, fusion.ser_sm_id_b}) {
+      if (!snapshot->exists(ser_sm_id)) releaseSerSmId(ser_sm_id);
     }
+    if (!fused) continue;
+    num_fused++;
+    if (unsolved_fusions_.empty()) unsolved_since_ = ros::WallTime::now();
+    unsolved_fusions_.push_back({fusion.map_fusion_msg.from_client_id,
+                                 fusion.map_fusion_msg.to_client_id,
+                                 fusion.start_time});
+  }
+  LOG_IF(INFO, !fusions->empty())
+      << "Fused " << num_fused << " of " << fusions->size() << " submap pairs";
+  if (unsolved_fusions_.empty()) return;
+
+  // Solve once the pipeline drained, so a single fusion is applied right
+  // away, or when the oldest unsolved fusion waited for the interval. A
+  // deferred solve wakes this stage at the latest when the interval expires,
+  // even if no further fusion arrives. The fetch stage hands fusions over
+  // one by one, so its own count is used instead of the batches it handles.
+  const size_t num_in_fetch = num_fusions_in_fetch_;
+  const size_t num_to_fuse = fuse_queue_->size();
+  const double unsolved_time = (ros::WallTime::now() - unsolved_since_).toSec();
+  if (num_in_fetch + num_to_fuse > 0 &&
+      unsolved_time < config_.optimization_interval.toSec()) {
+    LOG_IF(INFO, verbose_) << "Optimization deferred, " << num_in_fetch
+                           << " map fusions still fetching submaps and "
+                           << num_to_fuse << " queued for fusion";
+    fuse_queue_->scheduleWakeup(config_.optimization_interval.toSec() -
+                                unsolved_time);
+    return;
   }
 
-  if (fused_any) {
-    updateNeedRefuse(cid_a, t1, cid_b, t2);
-    return true;
+  updateSubmapRPConstraints();
+  const OptState opt_state =
+      optimizePoseGraph(config_.enable_registration_constraints);
+  LOG(INFO) << "Result of Last Optimization " << (opt_state == OptState::OK)
+            << ", solved " << unsolved_fusions_.size()
+            << " map fusions after " << unsolved_time << " s";
+
+  // A map fusion takes from its acceptance to this solve, accounted to both
+  // of its clients
+  const ros::WallTime solved_time = ros::WallTime::now();
+  for (auto const& unsolved_fusion : unsolved_fusions_) {
+    const double latency = (solved_time - unsolved_fusion.start_time).toSec();
+    for (const CliId& cid : {unsolved_fusion.cid_a, unsolved_fusion.cid_b}) {
+      const ClientHandler::Ptr client_handler = getClientHandler(cid);
+      if (client_handler != nullptr) client_handler->addFusionLatency(latency);
+    }
   }
-  return false;
+  unsolved_fusions_.clear();
+
+  uint64_t num_fetched, num_fetch_batches, num_inserted, num_optimizations;
+  double fetch_busy_time, fuse_busy_time;
+  fetch_queue_->getStats(&num_fetched, &num_fetch_batches, &fetch_busy_time);
+  fuse_queue_->getStats(&num_inserted, &num_optimizations, &fuse_busy_time);
+  // Pairs per busy second is the throughput each stage sustains in a burst
+  LOG_IF(INFO, verbose_) << "Map fusion pipeline: " << num_fetched
+                         << " pairs collected in " << fetch_busy_time
+                         << " s ("
+                         << (fetch_busy_time > 0.0
+                                 ? num_fetched / fetch_busy_time
+                                 : 0.0)
+                         << " pairs/s), " << num_inserted
+                         << " pairs fused in " << num_optimizations
+                         << " optimizations in " << fuse_busy_time << " s ("
+                         << (fuse_busy_time > 0.0
+                                 ? num_inserted / fuse_busy_time
+                                 : 0.0)
+                         << " pairs/s)";
 }
 
-void CoxgraphServer::addToMFFuture(
-    const coxgraph_msgs::MapFusion& map_fusion_msg) {
-  std::lock_guard<std::mutex> future_mf_queue_lock(future_mf_queue_mutex_);
-  if (map_fusion_msgs_future_.size() < config_.map_fusion_queue_size)
-    map_fusion_msgs_future_.push_back(
-        std::pair<coxgraph_msgs::MapFusion, int>(map_fusion_msg, 0));
-}
-
-void CoxgraphServer::processMFFuture() {
-  std::lock_guard<std::mutex> future_mf_queue_lock(future_mf_queue_mutex_);
-  bool processed_any = false;
-  for (auto it = map_fusion_msgs_future_.begin();
-       it != map_fusion_msgs_future_.end();) {
-    LOG(INFO) << "processing MF Future";
-    coxgraph_msgs::MapFusion map_fusion_msg = it->first;
-    CliId cid_a = map_fusion_msg.from_client_id;
-    CliId cid_b = map_fusion_msg.to_client_id;
-    ros::Time t1 = map_fusion_msg.from_timestamp;
-    ros::Time t2 = map_fusion_msg.to_timestamp;
-    if (client_handlers_[cid_a]->hasTime(t1) &&
-        client_handlers_[cid_b]->hasTime(t2)) {
-      if (mapFusionCallback(map_fusion_msg, true)) {
-        processed_any = true;
-        break;
-      }
-    }
+SerSmId CoxgraphServer::reserveSerSmId() {
+  std::lock_guard<std::mutex> ser_sm_id_lock(ser_sm_id_mutex_);
+  if (released_ser_sm_ids_.empty()) return next_ser_sm_id_++;
+  const SerSmId ser_sm_id = *released_ser_sm_ids_.begin();
+  released_ser_sm_ids_.erase(released_ser_sm_ids_.begin());
+  return ser_sm_id;
+}
 
-    if (it->second >= kMaxFutureUncatchedN) {
-      it = map_fusion_msgs_future_.erase(it);
-    } else {
-      it->second++;
-      ++it;
-    }
+void CoxgraphServer::releaseSerSmId(const SerSmId& ser_sm_id) {
+  std::lock_guard<std::mutex> ser_sm_id_lock(ser_sm_id_mutex_);
+  CHECK(released_ser_sm_ids_.emplace(ser_sm_id).second);
+}
+
+bool CoxgraphServer::deferMapFusion(
+    const coxgraph_msgs::MapFusion& map_fusion_msg) {
+  if (map_fusion_scheduler_->defer(map_fusion_msg) ==
+      MapFusionScheduler::DeferState::READY) {
+    return false;
   }
+  LOG_IF(INFO, verbose_)
+      << "Requested timestamps are ahead of client time lines, map fusion "
+         "deferred";
+  publishMapFusionQueueStats();
+  return true;
+}
 
-  if (processed_any) {
-    map_fusion_msgs_future_.clear();
+void CoxgraphServer::wakeMapFusions(const CliId& cid,
+                                    const TimeLine& time_line) {
+  std::vector<coxgraph_msgs::MapFusion> ready_map_fusion_msgs;
+  map_fusion_scheduler_->updateTimeLine(cid, time_line,
+                                        &ready_map_fusion_msgs);
+  if (ready_map_fusion_msgs.empty()) return;
+  for (auto const& map_fusion_msg : ready_map_fusion_msgs) {
+    LOG_IF(INFO, verbose_) << "Processing deferred map fusion of Client "
+                           << static_cast<int>(map_fusion_msg.from_client_id)
+                           << " and Client "
+                           << static_cast<int>(map_fusion_msg.to_client_id);
+    mapFusionCallback(map_fusion_msg);
   }
+  publishMapFusionQueueStats();
+}
+
+void CoxgraphServer::publishMapFusionQueueStats() {
+  if (map_fusion_queue_stats_pub_.getNumSubscribers() == 0) return;
+  coxgraph_msgs::MapFusionQueueStats stats_msg;
+  stats_msg.header.stamp = ros::Time::now();
+  map_fusion_scheduler_->getStats(&stats_msg);
+  stats_msg.wait_time.header = stats_msg.header;
+  map_fusion_queue_stats_pub_.publish(stats_msg);
 }
 
-void CoxgraphServer::futureMFProcCallback(const ros::TimerEvent& event) {
-  processMFFuture();
+void CoxgraphServer::publishClientResourceUsage(
+    const ros::TimerEvent& /*event*/) {
+  const ros::Time now = ros::Time::now();
+  int num_clients = 0;
+  uint32_t num_submaps = 0, num_fusions = 0;
+  uint64_t memory_bytes = 0;
+  double fusion_latency = 0.0;
+  for (auto const& client_kv : *getClients()) {
+    const ClientHandler::Ptr& client_handler = client_kv.second.handler;
+    if (client_handler == nullptr) continue;
+    const ClientHandler::ResourceUsage usage =
+        client_handler->getResourceUsage();
+    num_clients++;
+    num_submaps += usage.submaps_in_collection;
+    memory_bytes += usage.collection_memory_bytes;
+    num_fusions += usage.map_fusions_solved;
+    fusion_latency += usage.fusion_latency;
+    if (client_resource_usage_pub_.getNumSubscribers() == 0) continue;
+
+    coxgraph_msgs::ClientResourceUsage usage_msg;
+    usage_msg.header.stamp = now;
+    usage_msg.client_id = client_handler->getCliId();
+    usage_msg.submap_bytes_received = usage.submap_bytes_received;
+    usage_msg.mesh_bytes_received = usage.mesh_bytes_received;
+    usage_msg.submaps_received = usage.submaps_received;
+    usage_msg.transfer_time = usage.transfer_time;
+    usage_msg.submaps_in_collection = usage.submaps_in_collection;
+    usage_msg.collection_memory_bytes = usage.collection_memory_bytes;
+    usage_msg.map_fusions_solved = usage.map_fusions_solved;
+    usage_msg.mean_fusion_latency =
+        usage.map_fusions_solved > 0
+            ? usage.fusion_latency / usage.map_fusions_solved
+            : 0.0;
+    client_resource_usage_pub_.publish(usage_msg);
+  }
+
+  // How the server scales with the number of clients, a fusion is counted
+  // by both of its clients, which cancels out in the mean
+  LOG_IF_EVERY_N(INFO, verbose_, 10)
+      << "Serving " << num_clients << " clients: " << num_submaps
+      << " submaps with " << memory_bytes / (1024.0 * 1024.0)
+      << " MB of TSDF, mean map fusion latency "
+      << (num_fusions > 0 ? fusion_latency / num_fusions : 0.0) << " s";
 }
 
 bool CoxgraphServer::needRefuse(const CliId& cid_a, const ros::Time& t1,
                                 const CliId& cid_b, const ros::Time& t2) {
-  CHECK_EQ(force_fuse_[config_.fixed_map_client_id], false);
+  std::lock_guard<std::mutex> refuse_lock(refuse_mutex_);
+  auto fusion_state_a_it = fusion_states_.find(cid_a);
+  auto fusion_state_b_it = fusion_states_.find(cid_b);
+  if (fusion_state_a_it == fusion_states_.end() ||
+      fusion_state_b_it == fusion_states_.end()) {
+    return false;
+  }
+  const FusionState& fusion_state_a = fusion_state_a_it->second;
+  const FusionState& fusion_state_b = fusion_state_b_it->second;
   // TODO(mikexyl): update need fusion flag based on time since last fusion
   if ((cid_a != config_.fixed_map_client_id &&
-       (isTimeNeedRefuse(cid_a, t1) || force_fuse_[cid_a])) ||
+       (isTimeNeedRefuse(fusion_state_a, t1) || fusion_state_a.force_fuse)) ||
       (cid_b != config_.fixed_map_client_id &&
-       (isTimeNeedRefuse(cid_b, t2) || force_fuse_[cid_b])))
+       (isTimeNeedRefuse(fusion_state_b, t2) || fusion_state_b.force_fuse)))
     return true;
   return false;
 }
 
 bool CoxgraphServer::updateNeedRefuse(const CliId& cid_a, const ros::Time& t1,
                                       const CliId& cid_b, const ros::Time& t2) {
-  CHECK_EQ(force_fuse_[config_.fixed_map_client_id], false);
-  force_fuse_[cid_a] = false;
-  force_fuse_[cid_b] = false;
+  std::lock_guard<std::mutex> refuse_lock(refuse_mutex_);
+  auto fusion_state_a_it = fusion_states_.find(cid_a);
+  auto fusion_state_b_it = fusion_states_.find(cid_b);
   // TODO(mikexyl): logically timeline update here shouldn't return false,
   // investigate this
-  fused_time_line_[cid_a].update(t1);
-  fused_time_line_[cid_b].update(t2);
+  if (fusion_state_a_it != fusion_states_.end()) {
+    fusion_state_a_it->second.force_fuse = false;
+    fusion_state_a_it->second.fused_time_line.update(t1);
+  }
+  if (fusion_state_b_it != fusion_states_.end()) {
+    fusion_state_b_it->second.force_fuse = false;
+    fusion_state_b_it->second.fused_time_line.update(t2);
+  }
   return true;
 }
 
-bool CoxgraphServer::fuseMap(const CliId& cid_a, const ros::Time& t1,
-                             const CliSmId& cli_sm_id_a,
-                             const CliSm::Ptr& submap_a,
-                             const Transformation& T_A_t1, const CliId& cid_b,
-                             const ros::Time& t2, const CliSmId& cli_sm_id_b,
-                             const CliSm::Ptr& submap_b,
-                             const Transformation& T_B_t2,
-                             const Transformation& T_t1_t2) {
+bool CoxgraphServer::fuseMap(const SubmapPairFusion& fusion) {
   std::lock_guard<std::mutex> map_fuse_lock(map_fuse_mutex_);
 
+  const CliId& cid_a = fusion.map_fusion_msg.from_client_id;
+  const CliId& cid_b = fusion.map_fusion_msg.to_client_id;
+  const ros::Time& t1 = fusion.map_fusion_msg.from_timestamp;
+  const ros::Time& t2 = fusion.map_fusion_msg.to_timestamp;
+  const CliSmId& cli_sm_id_a = fusion.request_a.cli_sid;
+  const CliSmId& cli_sm_id_b = fusion.request_b.cli_sid;
+  const CliSm::Ptr& submap_a = fusion.request_a.submap;
+  const CliSm::Ptr& submap_b = fusion.request_b.submap;
+  const Transformation& T_A_t1 = fusion.request_a.T_Sm_C_t;
+  const Transformation& T_B_t2 = fusion.request_b.T_Sm_C_t;
+
+  // Pairs in flight when one of the clients got evicted are dropped, the
+  // ones of a frozen client are still fused
+  const std::shared_ptr<const ClientMap> clients = getClients();
+  auto is_evicted = [&clients](const CliId& cid) {
+    auto client_it = clients->find(cid);
+    return client_it == clients->end() ||
+           client_it->second.state == ClientState::EVICTED;
+  };
+  const bool evicted_a = is_evicted(cid_a);
+  const bool evicted_b = is_evicted(cid_b);
+  LOG_IF(INFO, evicted_a) << "Dropped submap pair of evicted Client "
+                          << static_cast<int>(cid_a);
+  LOG_IF(INFO, evicted_b) << "Dropped submap pair of evicted Client "
+                          << static_cast<int>(cid_b);
+
+  // Submaps sent before only come with a header and have to be in the
+  // collection already. A client that lost track of what the server has
+  // doesn't take the server down, the pair is dropped instead.
+  auto is_unknown = [this](const CliId& cid,
+                           const ClientHandler::SubmapRequest& request) {
+    SerSmId ser_sm_id;
+    return request.state == ReqState::SUCCESS &&
+           request.submap->getPoseHistory().empty() &&
+           !submap_collection_ptr_->getSerSmIdByCliSmId(cid, request.cli_sid,
+                                                        &ser_sm_id);
+  };
+  const bool unknown_a = is_unknown(cid_a, fusion.request_a);
+  const bool unknown_b = is_unknown(cid_b, fusion.request_b);
+  LOG_IF(WARNING, unknown_a || unknown_b)
+      << "Dropped submap pair, a submap sent as header only was never "
+         "received in full";
+
+  if (evicted_a || evicted_b || unknown_a || unknown_b ||
+      fusion.request_a.state != ReqState::SUCCESS ||
+      fusion.request_b.state != ReqState::SUCCESS) {
+    // Keep a newly received submap of a client still there, its client
+    // counts it as sent and later requests only get a header. Ones received
+    // before carry no pose history and are in the collection already.
+    if (!evicted_a && fusion.request_a.state == ReqState::SUCCESS &&
+        !submap_a->getPoseHistory().empty()) {
+      addSubmap(submap_a, cid_a, cli_sm_id_a);
+    }
+    if (!evicted_b && fusion.request_b.state == ReqState::SUCCESS &&
+        !submap_b->getPoseHistory().empty()) {
+      addSubmap(submap_b, cid_b, cli_sm_id_b);
+    }
+    return false;
+  }
+
+  TransformationD T_t1_t2_d;
+  tf::transformMsgToKindr(fusion.map_fusion_msg.transform, &T_t1_t2_d);
+  const Transformation T_t1_t2 = T_t1_t2_d.cast<voxblox::FloatingPoint>();
+
   LOG(INFO) << "Fusing: " << std::endl
             << "  Client: " << static_cast<int>(cid_a)
             << " -> Submap: " << static_cast<int>(cli_sm_id_a) << std::endl
@@ -412,21 +859,6 @@ bool CoxgraphServer::fuseMap(const CliId& cid_a, const ros::Time& t1,
   LOG_IF(INFO, verbose_) << " T_B_t2: " << std::endl << T_B_t2;
   LOG_IF(INFO, verbose_) << " T_t1_t2: " << std::endl << T_t1_t2;
 
-  bool prev_result = false;
-
-  if (optimization_async_handle_.valid() &&
-      optimization_async_handle_.wait_for(std::chrono::milliseconds(10)) !=
-          std::future_status::ready) {
-    LOG(INFO)
-        << "Previous pose graph optimization not yet complete. Waiting...";
-    optimization_async_handle_.wait();
-  }
-
-  prev_result = optimization_async_handle_.valid()
-                    ? (optimization_async_handle_.get() == OptState::OK)
-                    : true;
-  LOG(INFO) << "Result of Last Optimization" << prev_result;
-
   // TODO(mikexyl): add a duplicate check before adding
   SerSmId ser_sm_id_a, ser_sm_id_b;
   if (submap_a->getPoseHistory().empty()) {
@@ -445,13 +877,13 @@ bool CoxgraphServer::fuseMap(const CliId& cid_a, const ros::Time& t1,
     ser_sm_id_b = addSubmap(submap_b, cid_b, cli_sm_id_b);
   }
 
-  bool added_loop;
   if (config_.enable_map_fusion_constraints) {
     // TODO(mikexyl): transform T_t1_t2 based on cli map frame
     Transformation T_A_B = T_A_t1 * T_t1_t2 * T_B_t2.inverse();
-    added_loop = pose_graph_interface_.addLoopClosureMeasurement(
-        ser_sm_id_a, ser_sm_id_b, T_A_B, false);
-    if (!added_loop) return false;
+    if (!pose_graph_interface_.addLoopClosure(ser_sm_id_a, ser_sm_id_b,
+                                              T_A_B)) {
+      return false;
+    }
     geometry_msgs::Transform pose;
     tf::transformKindrToMsg(T_A_B.cast<double>(), &pose);
     double roll, pitch, yaw;
@@ -466,13 +898,8 @@ bool CoxgraphServer::fuseMap(const CliId& cid_a, const ros::Time& t1,
   pose_graph_interface_.addForceRegistrationConstraint(ser_sm_id_a,
                                                        ser_sm_id_b);
 
-  updateSubmapRPConstraints();
-
-  optimization_async_handle_ =
-      std::async(std::launch::async, &CoxgraphServer::optimizePoseGraph, this,
-                 this->config_.enable_registration_constraints);
-
-  return added_loop;
+  updateNeedRefuse(cid_a, t1, cid_b, t2);
+  return true;
 }
 
 void CoxgraphServer::updateSubmapRPConstraints() {
@@ -481,21 +908,25 @@ void CoxgraphServer::updateSubmapRPConstraints() {
         << "Don't turn on use_tf_submap_pose, somehow it doesn't work for now";
     // Update submap poses in collection by looking up tf. Do this here because
     // it's only needed when adding rp constraints.
-    for (int cid = 0; cid < submap_collection_ptr_->getClientNumber(); cid++) {
+    const SubmapCollection::Snapshot::ConstPtr snapshot =
+        submap_collection_ptr_->getSnapshot();
+    SubmapCollection::SmPoseMap submap_poses;
+    for (const CliId& cid : snapshot->getCliIds()) {
+      const ClientHandler::Ptr client_handler = getClientHandler(cid);
+      if (client_handler == nullptr) continue;
       std::vector<CliSmId> cli_sids;
-      if (!submap_collection_ptr_->getCliSmIdsByCliId(cid, &cli_sids)) continue;
+      if (!snapshot->getCliSmIdsByCliId(cid, &cli_sids)) continue;
       for (auto const& cli_sid : cli_sids) {
         Transformation T_Cli_Sm;
-        if (!client_handlers_[cid]->lookUpSubmapPoseFromTf(cli_sid,
-                                                           &T_Cli_Sm)) {
+        if (!client_handler->lookUpSubmapPoseFromTf(cli_sid, &T_Cli_Sm)) {
           continue;
         }
         SerSmId ser_sid;
-        CHECK(submap_collection_ptr_->getSerSmIdByCliSmId(cid, cli_sid,
-                                                          &ser_sid));
-        submap_collection_ptr_->setSubmapPose(ser_sid, T_Cli_Sm);
+        CHECK(snapshot->getSerSmIdByCliSmId(cid, cli_sid, &ser_sid));
+        submap_poses[ser_sid] = T_Cli_Sm;
       }
     }
+    submap_collection_ptr_->updateSubmapPoses(submap_poses, false);
   }
   pose_graph_interface_.updateSubmapRPConstraints();
 }
@@ -542,7 +973,7 @@ void CoxgraphServer::evaluateResiduals() {
   if (config_.enable_map_fusion_constraints) {
     LOG(INFO) << "Evaluating Residuals of Map Fusion Constraints";
     pose_graph_interface_.printResiduals(
-        PoseGraphInterface::ConstraintType::RelPose);
+        PoseGraphInterface::ConstraintType::LoopClosure);
   }
   if (submap_collection_ptr_->size() > 2) {
     LOG(INFO) << "Evaluating Residuals of Submap RelPose Constraints";
@@ -554,31 +985,50 @@ void CoxgraphServer::evaluateResiduals() {
 }
 
 void CoxgraphServer::updateCliMapRelativePose() {
-  std::lock_guard<std::mutex> pose_update_lock(
+  std::unique_lock<std::mutex> pose_update_lock(
       *(tf_controller_->getPoseUpdateMutex()));
   tf_controller_->resetCliMapRelativePoses();
   PoseMap pose_map = pose_graph_interface_.getPoseMap();
-  for (int i = 0; i < config_.client_number; i++) {
-    std::vector<SerSmId> ser_sm_ids_a;
-    if (!submap_collection_ptr_->getSerSmIdsByCliId(i, &ser_sm_ids_a)) continue;
-
-    for (int j = i + 1; j < config_.client_number; j++) {
-      std::vector<SerSmId> ser_sm_ids_b;
-      if (!submap_collection_ptr_->getSerSmIdsByCliId(j, &ser_sm_ids_b))
-        continue;
-
-      for (auto const& sm_id_a : ser_sm_ids_a) {
-        for (auto const& sm_id_b : ser_sm_ids_b) {
-          Transformation T_CA_SMA = submap_collection_ptr_->getOriPose(sm_id_a);
-          Transformation T_CB_SMB = submap_collection_ptr_->getOriPose(sm_id_b);
-          Transformation T_SMA_SMB =
-              pose_map[sm_id_a].inverse() * pose_map[sm_id_b];
-          Transformation T_CA_CB = T_CA_SMA * T_SMA_SMB * T_CB_SMB.inverse();
-          tf_controller_->addCliMapRelativePose(i, j, T_CA_CB);
-        }
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      submap_collection_ptr_->getSnapshot();
+
+  // Every submap of a client gives one estimate of the client map frame in
+  // the optimized frame, T_C_G = T_C_SM * T_G_SM^-1. The relative pose of two
+  // clients is averaged over all pairs of their estimates. Submaps of evicted
+  // clients don't place any client.
+  const std::shared_ptr<const ClientMap> clients = getClients();
+  std::vector<CliId> cids;
+  std::vector<TransformationVector> T_C_Gs;
+  for (const CliId& cid : snapshot->getCliIds()) {
+    auto client_it = clients->find(cid);
+    if (client_it == clients->end() ||
+        client_it->second.state == ClientState::EVICTED) {
+      continue;
+    }
+    std::vector<SerSmId> ser_sm_ids;
+    if (!snapshot->getSerSmIdsByCliId(cid, &ser_sm_ids)) continue;
+    cids.emplace_back(cid);
+    T_C_Gs.emplace_back();
+    T_C_Gs.back().reserve(ser_sm_ids.size());
+    for (auto const& ser_sm_id : ser_sm_ids) {
+      T_C_Gs.back().emplace_back(snapshot->getOriPose(ser_sm_id) *
+                                 pose_map[ser_sm_id].inverse());
+    }
+  }
+
+  for (size_t i = 0; i < cids.size(); i++) {
+    for (size_t j = i + 1; j < cids.size(); j++) {
+      TransformationVector T_G_CBs;
+      T_G_CBs.reserve(T_C_Gs[j].size());
+      for (auto const& T_CB_G : T_C_Gs[j]) {
+        T_G_CBs.emplace_back(T_CB_G.inverse());
       }
+      tf_controller_->addCliMapRelativePoses(cids[i], cids[j], T_C_Gs[i],
+                                             T_G_CBs);
     }
   }
+  pose_update_lock.unlock();
+  tf_controller_->requestCliMapPoseUpdate();
 }
 
 }  // namespace coxgraph
@@ -1,5 +1,7 @@
 #include "coxgraph/server/global_tf_controller.h"
 
+#include <cmath>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -16,66 +18,130 @@ GlobalTfController::Config GlobalTfController::getConfigFromRosParam(
 }
 
 void GlobalTfController::initCliMapPose() {
-  for (int i = 0; i < client_number_; i++) {
-    cli_mission_frames_.emplace_back(map_frame_prefix_ + "_" +
-                                     std::to_string(i));
-    client_tf_optimizer_.addClient(i, Transformation());
-    tf::Transform identity;
-    identity.setOrigin(tf::Vector3(0, 0, 0));
-    identity.setRotation(tf::Quaternion(0, 0, 0, 1));
-    T_G_CLI_opt_.emplace_back(tf::StampedTransform(identity, ros::Time::now(),
-                                                   global_mission_frame_,
-                                                   cli_mission_frames_[i]));
-  }
+  std::atomic_store(&tf_set_,
+                    std::shared_ptr<const TfSet>(std::make_shared<TfSet>()));
+
+  ros::TimerOptions tf_pub_timer_options(
+      ros::Duration(1 / kTfPubFreq),
+      boost::bind(&GlobalTfController::pubCliTfCallback, this, _1),
+      &tf_pub_queue_);
+  tf_pub_timer_ = nh_private_.createTimer(tf_pub_timer_options);
+}
+
+void GlobalTfController::addClient(const CliId& cid) {
+  std::lock_guard<std::mutex> pose_update_lock(pose_update_mutex);
+  if (client_tf_optimizer_.hasClient(cid)) return;
+  client_tf_optimizer_.addClient(cid, Transformation());
+
+  tf::Transform identity;
+  identity.setOrigin(tf::Vector3(0, 0, 0));
+  identity.setRotation(tf::Quaternion(0, 0, 0, 1));
+  std::shared_ptr<TfSet> tf_set =
+      std::make_shared<TfSet>(*std::atomic_load(&tf_set_));
+  tf_set->T_G_CLI_opt[cid] = tf::StampedTransform(
+      identity, ros::Time::now(), global_mission_frame_,
+      map_frame_prefix_ + "_" + std::to_string(cid));
+  tf_set->cli_tf_fused[cid] = (cid == 0);
+  std::atomic_store(&tf_set_, std::shared_ptr<const TfSet>(tf_set));
+}
 
-  cli_tf_fused_.resize(4, false);
-  cli_tf_fused_[0] = true;
+void GlobalTfController::removeClient(const CliId& cid) {
+  std::lock_guard<std::mutex> pose_update_lock(pose_update_mutex);
+  if (!client_tf_optimizer_.hasClient(cid)) return;
+  client_tf_optimizer_.removeClient(cid);
 
-  tf_pub_timer_ =
-      nh_private_.createTimer(ros::Duration(1 / kTfPubFreq),
-                              &GlobalTfController::pubCliTfCallback, this);
+  std::shared_ptr<TfSet> tf_set =
+      std::make_shared<TfSet>(*std::atomic_load(&tf_set_));
+  tf_set->T_G_CLI_opt.erase(cid);
+  tf_set->cli_tf_fused.erase(cid);
+  std::atomic_store(&tf_set_, std::shared_ptr<const TfSet>(tf_set));
 }
 
-// TODO(mikexyl): move pose update another thread
 void GlobalTfController::pubCliTfCallback(const ros::TimerEvent& event) {
+  recordTfJitter(event);
   if (!inControl()) return;
-  updateCliMapPose();
-  for (int i = 0; i < T_G_CLI_opt_.size(); i++) {
-    if (cli_tf_fused_[i]) tf_boardcaster_.sendTransform(T_G_CLI_opt_[i]);
+  const std::shared_ptr<const TfSet> tf_set = std::atomic_load(&tf_set_);
+  const ros::Time now = ros::Time::now();
+  for (auto const& T_G_CLI_kv : tf_set->T_G_CLI_opt) {
+    if (!tf_set->cli_tf_fused.at(T_G_CLI_kv.first)) continue;
+    tf::StampedTransform T_G_CLI = T_G_CLI_kv.second;
+    T_G_CLI.stamp_ = now;
+    tf_boardcaster_.sendTransform(T_G_CLI);
   }
 }
 
-void GlobalTfController::addCliMapRelativePose(const CliId& first_cid,
-                                               const CliId& second_cid,
-                                               const Transformation& T_C1_C2) {
-  client_tf_optimizer_.addClientRelativePoseMeasurement(first_cid, second_cid,
-                                                        T_C1_C2);
-  pose_updated_ = true;
+void GlobalTfController::recordTfJitter(const ros::TimerEvent& event) {
+  if (event.last_real.isZero()) return;
+  const double jitter =
+      std::abs((event.current_real - event.last_real).toSec() -
+               1.0 / kTfPubFreq);
+  const int bin = static_cast<int>(jitter / kJitterBinWidth);
+  jitter_counts_[bin < kJitterNumBins ? bin : kJitterNumBins]++;
+  if (jitter > max_jitter_) max_jitter_ = jitter;
+
+  // Publish the histogram about once per second
+  if (++num_tf_pubs_ % static_cast<uint64_t>(kTfPubFreq) != 0 ||
+      jitter_pub_.getNumSubscribers() == 0) {
+    return;
+  }
+  coxgraph_msgs::Histogram jitter_msg;
+  jitter_msg.header.stamp = event.current_real;
+  jitter_msg.bin_width = kJitterBinWidth;
+  jitter_msg.counts = jitter_counts_;
+  jitter_msg.max = max_jitter_;
+  jitter_pub_.publish(jitter_msg);
 }
 
-void GlobalTfController::updateCliMapPose() {
-  if (pose_updated_) {
-    std::lock_guard<std::mutex> pose_update_lock(pose_update_mutex);
-    computeOptCliMapPose();
-    PoseMap new_cli_map_poses = client_tf_optimizer_.getClientMapTfs();
-    CHECK(new_cli_map_poses[0] == Transformation());
-    for (auto const& cli_map_pose_kv : new_cli_map_poses) {
-      cli_tf_fused_[cli_map_pose_kv.first] = true;
-      tf::Transform pose;
-      tf::transformKindrToTF(cli_map_pose_kv.second.cast<double>(), &pose);
-      T_G_CLI_opt_[cli_map_pose_kv.first] = tf::StampedTransform(
-          pose, ros::Time::now(), T_G_CLI_opt_[cli_map_pose_kv.first].frame_id_,
-          T_G_CLI_opt_[cli_map_pose_kv.first].child_frame_id_);
-      LOG_IF(INFO, verbose_)
-          << "Updated pose for Client" << cli_map_pose_kv.first << " with pose"
-          << cli_map_pose_kv.second;
-    }
-    pose_updated_ = false;
-  } else {
-    for (auto& T_G_CLI : T_G_CLI_opt_) {
-      T_G_CLI.stamp_ = ros::Time::now();
+void GlobalTfController::addCliMapRelativePoses(
+    const CliId& first_cid, const CliId& second_cid,
+    const TransformationVector& T_C1_G, const TransformationVector& T_G_C2) {
+  client_tf_optimizer_.addClientRelativePoseMeasurements(first_cid, second_cid,
+                                                         T_C1_G, T_G_C2);
+}
+
+void GlobalTfController::requestCliMapPoseUpdate() {
+  {
+    std::lock_guard<std::mutex> solve_lock(solve_mutex_);
+    solve_requested_ = true;
+  }
+  solve_cv_.notify_one();
+}
+
+void GlobalTfController::solveLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> solve_lock(solve_mutex_);
+      solve_cv_.wait(solve_lock,
+                     [this] { return solve_requested_ || solve_shutdown_; });
+      if (solve_shutdown_) return;
+      solve_requested_ = false;
     }
+    std::lock_guard<std::mutex> pose_update_lock(pose_update_mutex);
+    updateCliMapPose();
+  }
+}
+
+void GlobalTfController::updateCliMapPose() {
+  computeOptCliMapPose();
+  PoseMap new_cli_map_poses = client_tf_optimizer_.getClientMapTfs();
+  CHECK(new_cli_map_poses[0] == Transformation());
+
+  std::shared_ptr<TfSet> tf_set =
+      std::make_shared<TfSet>(*std::atomic_load(&tf_set_));
+  for (auto const& cli_map_pose_kv : new_cli_map_poses) {
+    auto T_G_CLI_it = tf_set->T_G_CLI_opt.find(cli_map_pose_kv.first);
+    if (T_G_CLI_it == tf_set->T_G_CLI_opt.end()) continue;
+    tf_set->cli_tf_fused[cli_map_pose_kv.first] = true;
+    tf::Transform pose;
+    tf::transformKindrToTF(cli_map_pose_kv.second.cast<double>(), &pose);
+    tf::StampedTransform& T_G_CLI = T_G_CLI_it->second;
+    T_G_CLI = tf::StampedTransform(pose, ros::Time::now(), T_G_CLI.frame_id_,
+                                   T_G_CLI.child_frame_id_);
+    LOG_IF(INFO, verbose_)
+        << "Updated pose for Client" << cli_map_pose_kv.first << " with pose"
+        << cli_map_pose_kv.second;
   }
+  std::atomic_store(&tf_set_, std::shared_ptr<const TfSet>(tf_set));
 }
 
 void GlobalTfController::computeOptCliMapPose() {
@@ -0,0 +1,222 @@
+#include "coxgraph/server/map_fusion_scheduler.h"
+
+#include <algorithm>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace coxgraph {
+namespace server {
+
+MapFusionScheduler::MapFusionScheduler(const Config& config)
+    : config_(config),
+      next_seq_(0),
+      num_deferred_(0),
+      num_duplicates_(0),
+      num_evicted_(0),
+      num_dispatched_(0),
+      wait_time_counts_(kWaitTimeNumBins + 1, 0),
+      max_wait_time_(0.0) {}
+
+MapFusionScheduler::Config MapFusionScheduler::getConfigFromRosParam(
+    const ros::NodeHandle& nh_private) {
+  MapFusionScheduler::Config config;
+  nh_private.param<int>("map_fusion_queue_size", config.max_queue_size,
+                        config.max_queue_size);
+  std::string priority = "newest_first";
+  nh_private.param<std::string>("map_fusion_priority", priority, priority);
+  if (priority == "newest_first") {
+    config.priority = Priority::NEWEST_FIRST;
+  } else if (priority == "oldest_first") {
+    config.priority = Priority::OLDEST_FIRST;
+  } else {
+    LOG(FATAL) << "Invalid map fusion priority, must be newest_first or "
+                  "oldest_first. Given: "
+               << priority;
+  }
+  return config;
+}
+
+MapFusionScheduler::DeferState MapFusionScheduler::defer(
+    const coxgraph_msgs::MapFusion& map_fusion_msg) {
+  const CliId cid_a = map_fusion_msg.from_client_id;
+  const CliId cid_b = map_fusion_msg.to_client_id;
+  CHECK_NE(cid_a, cid_b);
+  CHECK_GE(cid_a, 0);
+  CHECK_GE(cid_b, 0);
+
+  std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+  const bool covered_a = isCovered(cid_a, map_fusion_msg.from_timestamp);
+  const bool covered_b = isCovered(cid_b, map_fusion_msg.to_timestamp);
+  if (covered_a && covered_b) return DeferState::READY;
+
+  const FusionKey key = getKey(map_fusion_msg);
+  if (seqs_by_key_.count(key)) {
+    num_duplicates_++;
+    return DeferState::DUPLICATE;
+  }
+
+  const uint64_t seq = next_seq_++;
+  Entry& entry = entries_[seq];
+  entry.map_fusion_msg = map_fusion_msg;
+  entry.key = key;
+  entry.deferred_time = ros::WallTime::now();
+  // Only the timestamps still ahead of the time lines wait
+  entry.wait_it_a = covered_a
+                        ? wait_indices_[cid_a].end()
+                        : addWait(cid_a, map_fusion_msg.from_timestamp, seq);
+  entry.wait_it_b = covered_b
+                        ? wait_indices_[cid_b].end()
+                        : addWait(cid_b, map_fusion_msg.to_timestamp, seq);
+  seqs_by_key_.emplace(key, seq);
+  num_deferred_++;
+
+  const size_t max_queue_size = std::max(config_.max_queue_size, 0);
+  while (entries_.size() > max_queue_size) {
+    auto lowest_it = entries_.begin();
+    for (auto it = std::next(lowest_it); it != entries_.end(); ++it) {
+      if (hasPriority(lowest_it->first, it->first)) lowest_it = it;
+    }
+    const coxgraph_msgs::MapFusion& evicted = lowest_it->second.map_fusion_msg;
+    LOG(WARNING) << "Map fusion queue full, evicted fusion of Client "
+                 << static_cast<int>(evicted.from_client_id) << " at "
+                 << evicted.from_timestamp << " and Client "
+                 << static_cast<int>(evicted.to_client_id) << " at "
+                 << evicted.to_timestamp;
+    erase(lowest_it->first);
+    num_evicted_++;
+  }
+  return DeferState::DEFERRED;
+}
+
+void MapFusionScheduler::updateTimeLine(
+    const CliId& cid, const TimeLine& time_line,
+    std::vector<coxgraph_msgs::MapFusion>* ready) {
+  CHECK_NOTNULL(ready);
+  ready->clear();
+
+  std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+  time_lines_[cid] = time_line;
+  if (time_line.end.isZero()) return;
+  auto wait_index_it = wait_indices_.find(cid);
+  if (wait_index_it == wait_indices_.end()) return;
+  WaitIndex& wait_index = wait_index_it->second;
+  std::vector<uint64_t> ready_seqs;
+  auto wait_it = wait_index.lower_bound(time_line.start);
+  auto wait_end_it = wait_index.upper_bound(time_line.end);
+  while (wait_it != wait_end_it) {
+    const uint64_t seq = wait_it->second;
+    Entry& entry = entries_.at(seq);
+    if (entry.wait_it_a == wait_it) {
+      entry.wait_it_a = wait_index.end();
+    } else {
+      CHECK(entry.wait_it_b == wait_it);
+      entry.wait_it_b = wait_index.end();
+    }
+    wait_it = wait_index.erase(wait_it);
+
+    const CliId cid_a = entry.map_fusion_msg.from_client_id;
+    const CliId cid_b = entry.map_fusion_msg.to_client_id;
+    if (entry.wait_it_a == wait_indices_[cid_a].end() &&
+        entry.wait_it_b == wait_indices_[cid_b].end()) {
+      ready_seqs.emplace_back(seq);
+    }
+  }
+
+  std::sort(ready_seqs.begin(), ready_seqs.end(),
+            [this](uint64_t seq_a, uint64_t seq_b) {
+              return hasPriority(seq_a, seq_b);
+            });
+  const ros::WallTime now = ros::WallTime::now();
+  for (uint64_t seq : ready_seqs) {
+    const Entry& entry = entries_.at(seq);
+    ready->emplace_back(entry.map_fusion_msg);
+    recordWaitTime((now - entry.deferred_time).toSec());
+    num_dispatched_++;
+    erase(seq);
+  }
+}
+
+size_t MapFusionScheduler::removeClient(const CliId& cid) {
+  std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+  std::vector<uint64_t> removed_seqs;
+  for (auto const& entry_kv : entries_) {
+    const FusionKey& key = entry_kv.second.key;
+    if (std::get<0>(key) == cid || std::get<2>(key) == cid) {
+      removed_seqs.emplace_back(entry_kv.first);
+    }
+  }
+  for (uint64_t seq : removed_seqs) erase(seq);
+  num_evicted_ += removed_seqs.size();
+  wait_indices_.erase(cid);
+  time_lines_.erase(cid);
+  return removed_seqs.size();
+}
+
+size_t MapFusionScheduler::size() {
+  std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+  return entries_.size();
+}
+
+void MapFusionScheduler::getStats(coxgraph_msgs::MapFusionQueueStats* stats) {
+  CHECK_NOTNULL(stats);
+  std::lock_guard<std::mutex> scheduler_lock(scheduler_mutex_);
+  stats->queue_depth = entries_.size();
+  stats->num_deferred = num_deferred_;
+  stats->num_duplicates = num_duplicates_;
+  stats->num_evicted = num_evicted_;
+  stats->num_dispatched = num_dispatched_;
+  stats->wait_time.bin_width = kWaitTimeBinWidth;
+  stats->wait_time.counts = wait_time_counts_;
+  stats->wait_time.max = max_wait_time_;
+}
+
+bool MapFusionScheduler::isCovered(const CliId& cid, const ros::Time& time) {
+  auto time_line_it = time_lines_.find(cid);
+  return time_line_it != time_lines_.end() &&
+         time_line_it->second.hasTime(time);
+}
+
+bool MapFusionScheduler::hasPriority(uint64_t seq_a, uint64_t seq_b) const {
+  if (config_.priority == Priority::NEWEST_FIRST) {
+    const coxgraph_msgs::MapFusion& msg_a = entries_.at(seq_a).map_fusion_msg;
+    const coxgraph_msgs::MapFusion& msg_b = entries_.at(seq_b).map_fusion_msg;
+    const ros::Time latest_a =
+        std::max(msg_a.from_timestamp, msg_a.to_timestamp);
+    const ros::Time latest_b =
+        std::max(msg_b.from_timestamp, msg_b.to_timestamp);
+    if (latest_a != latest_b) return latest_a > latest_b;
+    return seq_a > seq_b;
+  }
+  return seq_a < seq_b;
+}
+
+MapFusionScheduler::WaitIndex::iterator MapFusionScheduler::addWait(
+    const CliId& cid, const ros::Time& time, uint64_t seq) {
+  return wait_indices_[cid].emplace(time, seq);
+}
+
+void MapFusionScheduler::erase(uint64_t seq) {
+  auto entry_it = entries_.find(seq);
+  CHECK(entry_it != entries_.end());
+  const Entry& entry = entry_it->second;
+  WaitIndex& wait_index_a = wait_indices_[std::get<0>(entry.key)];
+  WaitIndex& wait_index_b = wait_indices_[std::get<2>(entry.key)];
+  if (entry.wait_it_a != wait_index_a.end()) {
+    wait_index_a.erase(entry.wait_it_a);
+  }
+  if (entry.wait_it_b != wait_index_b.end()) {
+    wait_index_b.erase(entry.wait_it_b);
+  }
+  seqs_by_key_.erase(entry.key);
+  entries_.erase(entry_it);
+}
+
+void MapFusionScheduler::recordWaitTime(double wait_time) {
+  const int bin = static_cast<int>(wait_time / kWaitTimeBinWidth);
+  wait_time_counts_[bin < kWaitTimeNumBins ? bin : kWaitTimeNumBins]++;
+  if (wait_time > max_wait_time_) max_wait_time_ = wait_time;
+}
+
+}  // namespace server
+}  // namespace coxgraph
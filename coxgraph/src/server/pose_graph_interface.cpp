@@ -1,107 +1,388 @@
 #include "coxgraph/server/pose_graph_interface.h"
 
-#include <vector>
+#include <voxgraph/backend/constraint/cost_functions/relative_pose_cost_function.h>
 
-#include <voxgraph/backend/constraint/relative_pose_constraint.h>
+#include <cmath>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
 namespace coxgraph {
 namespace server {
 
+PoseGraphInterface::Config PoseGraphInterface::getConfigFromRosParam(
+    const ros::NodeHandle& nh_private) {
+  Config config;
+  const ros::NodeHandle nh_registration(nh_private, "submap_registration");
+  nh_registration.param<float>("sampling_ratio",
+                               config.registration_sampling_ratio,
+                               config.registration_sampling_ratio);
+  nh_registration.param<float>("grid_band", config.registration_grid_band,
+                               config.registration_grid_band);
+  nh_registration.param<float>("min_voxel_weight",
+                               config.registration_min_voxel_weight,
+                               config.registration_min_voxel_weight);
+  nh_registration.param<double>("weight", config.registration_weight,
+                                config.registration_weight);
+  nh_registration.param<float>("crop_margin", config.registration_crop_margin,
+                               config.registration_crop_margin);
+  const ros::NodeHandle nh_rp(nh_private, "submap_relative_pose");
+  nh_rp.param<float>("translation_tolerance", config.rp_translation_tolerance,
+                     config.rp_translation_tolerance);
+  nh_rp.param<float>("rotation_tolerance", config.rp_rotation_tolerance,
+                     config.rp_rotation_tolerance);
+  CHECK_GT(config.registration_sampling_ratio, 0.0f);
+  CHECK_GT(config.registration_grid_band, 0.0f);
+  return config;
+}
+
 void PoseGraphInterface::addSubmap(SerSmId submap_id) {
+  // Configure the submap node
+  voxgraph::SubmapNode::Config node_config = node_templates_.submap;
+  node_config.submap_id = submap_id;
+  // Current pose, submaps keep the one they were added with
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      cox_submap_collection_ptr_->getSnapshot();
+  CHECK(snapshot->exists(submap_id));
+  node_config.T_I_node_initial = snapshot->getPose(submap_id);
+  // The first submap added fixes the gauge, whichever id it got
+  node_config.set_constant = !has_constant_node_;
+  has_constant_node_ = true;
+
+  // The voxgraph pose graph only checks loop closure candidates
   if (robocentric_) {
     voxgraph::PoseGraphInterface::addSubmap(submap_id);
   } else {
     // non-robocentric
-    // Configure the submap node and add it to the pose graph
-    voxgraph::SubmapNode::Config node_config = node_templates_.submap;
-    node_config.submap_id = submap_id;
-    CHECK(submap_collection_ptr_->getSubmapPose(submap_id,
-                                                &node_config.T_I_node_initial));
-    if (submap_id == 0) {
-      ROS_INFO("Setting pose of submap 0 to constant");
-      node_config.set_constant = true;
-    } else {
-      node_config.set_constant = false;
-    }
+    ROS_INFO_COND(node_config.set_constant,
+                  "Setting pose of submap %d to constant",
+                  static_cast<int>(submap_id));
     pose_graph_.addSubmapNode(node_config);
-    ROS_INFO_STREAM_COND(verbose_,
-                         "Added node to graph for submap: " << submap_id);
   }
+  submap_pose_graph_.addSubmapNode(node_config);
+  ROS_INFO_STREAM_COND(verbose_,
+                       "Added node to graph for submap: " << submap_id);
+}
+
+bool PoseGraphInterface::addLoopClosure(const SerSmId& first_submap_id,
+                                        const SerSmId& second_submap_id,
+                                        const Transformation& T_S1_S2) {
+  if (!addLoopClosureMeasurement(first_submap_id, second_submap_id, T_S1_S2,
+                                 false)) {
+    return false;
+  }
+  // A newer measurement of the pair replaces the previous one
+  const InformationMatrix sqrt_information = getSqrtInformation(
+      measurement_templates_.loop_closure.information_matrix);
+  submap_pose_graph_.setConstraint(
+      ConstraintType::LoopClosure,
+      std::make_pair(first_submap_id, second_submap_id),
+      voxgraph::RelativePoseCostFunction::Create(T_S1_S2, sqrt_information));
+  has_new_loop_closures_ = true;
+  return true;
 }
 
 void PoseGraphInterface::optimize(bool enable_registration) {
-  pose_graph_.optimize(true);
+  const ros::WallTime start_time = ros::WallTime::now();
 
-  // update registration constrains after loop closure optimized. Submaps
-  // overlapping can only be determined after their relative poses computed by
-  // loop closure optimization
-  if (enable_registration) updateRegistrationConstraints();
+  // The loop closure solve only places the submaps so that their overlaps
+  // can be determined. Without new loop closures the poses of the previous
+  // solution do.
+  if (enable_registration) {
+    if (has_new_loop_closures_) {
+      submap_pose_graph_.setRegistrationEnabled(false);
+      submap_pose_graph_.optimize();
+      submap_pose_graph_.setRegistrationEnabled(true);
+    }
+    updateRegistrationConstraints();
+  }
+  has_new_loop_closures_ = false;
 
-  // Optimize the pose graph with all constraints enabled
-  pose_graph_.optimize();
+  // Optimize the pose graph with all constraints enabled, starting from the
+  // poses of the previous solution
+  const ros::WallTime solve_start_time = ros::WallTime::now();
+  submap_pose_graph_.optimize();
+  const ros::WallTime end_time = ros::WallTime::now();
+
+  LOG(INFO) << "Optimized pose graph of "
+            << cox_submap_collection_ptr_->size() << " submaps in "
+            << (end_time - start_time).toSec() << " s, final solve with "
+            << submap_pose_graph_.getNumConstraints(
+                   ConstraintType::Registration)
+            << " registration constraints took "
+            << (end_time - solve_start_time).toSec() << " s";
 
   // Publish debug visuals
-  if (pose_graph_pub_.getNumSubscribers() > 0) {
-    LOG(INFO) << "publish pose graph: " << pose_graph_.getSubmapPoses().size();
-    pose_graph_vis_.publishPoseGraph(pose_graph_, visualization_odom_frame_,
-                                     "optimized", pose_graph_pub_);
-  }
+  if (pose_graph_pub_.getNumSubscribers() > 0) publishPoseGraph();
 }
 
 void PoseGraphInterface::updateSubmapRPConstraints() {
-  resetSubmapRelativePoseConstrains();
-  for (int cid = 0; cid < cox_submap_collection_ptr_->getClientNumber();
-       cid++) {
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      cox_submap_collection_ptr_->getSnapshot();
+  std::map<SerSmIdPair, Transformation> submap_rp_constraints;
+  for (const CliId& cid : snapshot->getCliIds()) {
     std::vector<SerSmId> cli_ser_sm_ids;
-    if (!cox_submap_collection_ptr_->getSerSmIdsByCliId(cid, &cli_ser_sm_ids))
-      continue;
-    for (int i = 0; i < cli_ser_sm_ids.size() - 1; i++) {
+    if (!snapshot->getSerSmIdsByCliId(cid, &cli_ser_sm_ids)) continue;
+    for (int i = 0; i + 1 < cli_ser_sm_ids.size(); i++) {
       int j = i + 1;
       SerSmId sid_i = cli_ser_sm_ids.at(i);
       SerSmId sid_j = cli_ser_sm_ids.at(j);
 
-      Transformation T_M_SMi =
-          cox_submap_collection_ptr_->getSubmapPtr(sid_i)->getPose();
-      Transformation T_M_SMj =
-          cox_submap_collection_ptr_->getSubmapPtr(sid_j)->getPose();
+      Transformation T_M_SMi = snapshot->getPose(sid_i);
+      Transformation T_M_SMj = snapshot->getPose(sid_j);
       Transformation T_SMi_SMj = T_M_SMi.inverse() * T_M_SMj;
-      addSubmapRelativePoseConstraint(sid_i, sid_j, T_SMi_SMj);
+      submap_rp_constraints.emplace(std::make_pair(sid_i, sid_j), T_SMi_SMj);
     }
   }
+
+  // Constraints whose submaps aren't consecutive any more
+  for (auto constraint_it = submap_rp_constraints_.begin();
+       constraint_it != submap_rp_constraints_.end();) {
+    if (submap_rp_constraints.count(constraint_it->first)) {
+      ++constraint_it;
+      continue;
+    }
+    submap_pose_graph_.removeConstraint(ConstraintType::SubmapRelPose,
+                                        constraint_it->first);
+    constraint_it = submap_rp_constraints_.erase(constraint_it);
+  }
+
+  // New constraints, and the ones whose measurement moved
+  size_t num_changed = 0;
+  for (auto const& constraint_kv : submap_rp_constraints) {
+    auto constraint_it = submap_rp_constraints_.find(constraint_kv.first);
+    if (constraint_it != submap_rp_constraints_.end()) {
+      const Transformation T_old_new =
+          constraint_it->second.inverse() * constraint_kv.second;
+      if (T_old_new.getPosition().norm() <= config_.rp_translation_tolerance &&
+          T_old_new.getRotation().getDisparityAngle(
+              Transformation::Rotation()) <= config_.rp_rotation_tolerance) {
+        continue;
+      }
+    }
+    addSubmapRelativePoseConstraint(constraint_kv.first.first,
+                                    constraint_kv.first.second,
+                                    constraint_kv.second);
+    num_changed++;
+  }
+  LOG_IF(INFO, verbose_) << "Added or replaced " << num_changed << " of "
+                         << submap_rp_constraints_.size()
+                         << " submap relative pose constraints";
+}
+
+void PoseGraphInterface::updateSubmapCollectionPoses() {
+  const PoseMap pose_map = getPoseMap();
+  cox_submap_collection_ptr_->updateSubmapPoses(
+      SubmapCollection::SmPoseMap(pose_map.begin(), pose_map.end()), false);
 }
 
 void PoseGraphInterface::addSubmapRelativePoseConstraint(
     const SerSmId& first_submap_id, const SerSmId& second_submap_id,
     const Transformation& T_S1_S2) {
-  RelativePoseConstraint::Config submap_rp_config;
-  submap_rp_config.information_matrix = sm_rp_info_matrix_;
-  submap_rp_config.origin_submap_id = first_submap_id;
-  submap_rp_config.destination_submap_id = second_submap_id;
-  submap_rp_config.T_origin_destination = T_S1_S2;
-
-  // Add the constraint to the pose graph
+  // Replaces the constraint of the pair if there is one
   // TODO(mikexyl): since these should be called every time submap pose updated,
   // don't log it
-  pose_graph_.addSubmapRelativePoseConstraint(submap_rp_config);
+  const SerSmIdPair submap_pair(first_submap_id, second_submap_id);
+  submap_pose_graph_.setConstraint(
+      ConstraintType::SubmapRelPose, submap_pair,
+      voxgraph::RelativePoseCostFunction::Create(
+          T_S1_S2, getSqrtInformation(sm_rp_info_matrix_)));
+  submap_rp_constraints_[submap_pair] = T_S1_S2;
+}
+
+void PoseGraphInterface::updateRegistrationConstraints() {
+  const ros::WallTime start_time = ros::WallTime::now();
+  const PoseMap submap_poses = submap_pose_graph_.getSubmapPoses();
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      cox_submap_collection_ptr_->getSnapshot();
+  std::vector<SerSmId> ser_sm_ids;
+  std::vector<CliSm::ConstPtr> submap_ptrs;
+  ser_sm_ids.reserve(submap_poses.size());
+  submap_ptrs.reserve(submap_poses.size());
+  for (auto const& submap_pose_kv : submap_poses) {
+    if (!snapshot->exists(submap_pose_kv.first)) continue;
+    ser_sm_ids.emplace_back(submap_pose_kv.first);
+    submap_ptrs.emplace_back(
+        snapshot->getSubmapConstPtr(submap_pose_kv.first));
+  }
+
+  for (size_t i = 0; i < ser_sm_ids.size(); i++) {
+    registration_aabb_tree_.update(
+        ser_sm_ids[i], SubmapCollection::getMovedSurfaceAabb(
+                           *submap_ptrs[i], submap_poses.at(ser_sm_ids[i])));
+  }
+
+  std::vector<SubmapAabbTree::SerSmIdPair> overlapping_pairs;
+  registration_aabb_tree_.getOverlappingPairs(&overlapping_pairs);
+  std::set<SerSmIdPair> registration_pairs(overlapping_pairs.begin(),
+                                           overlapping_pairs.end());
+  registration_pairs.insert(forced_registration_pairs_.begin(),
+                            forced_registration_pairs_.end());
+
+  // Constraints of pairs that stopped overlapping
+  size_t num_removed = 0;
+  for (const SerSmIdPair& submap_pair :
+       submap_pose_graph_.getConstraintPairs(ConstraintType::Registration)) {
+    if (registration_pairs.count(submap_pair)) continue;
+    submap_pose_graph_.removeConstraint(ConstraintType::Registration,
+                                        submap_pair);
+    registration_crops_.erase(submap_pair);
+    num_removed++;
+  }
+  // Pairs that started overlapping, and the ones whose samples were cropped
+  // at a relative pose that moved them by more than the crop margin since.
+  // The others keep their constraints.
+  size_t num_added = 0, num_recropped = 0;
+  for (const SerSmIdPair& submap_pair : registration_pairs) {
+    auto crop_it = registration_crops_.find(submap_pair);
+    if (crop_it != registration_crops_.end()) {
+      const Transformation T_B_A =
+          submap_poses.at(submap_pair.second).inverse() *
+          submap_poses.at(submap_pair.first);
+      const Transformation T_old_new = crop_it->second.T_B_A.inverse() * T_B_A;
+      // Bounds how far the relative pose moved any kept sample
+      const float max_sample_motion =
+          T_old_new.getPosition().norm() +
+          T_old_new.getRotation().getDisparityAngle(
+              Transformation::Rotation()) *
+              crop_it->second.radius;
+      if (max_sample_motion <= config_.registration_crop_margin) continue;
+      num_recropped++;
+    }
+    if (addRegistrationConstraint(submap_pair, submap_poses)) num_added++;
+  }
+
+  size_t num_grids, num_grid_bytes;
+  grid_cache_.getStats(&num_grids, &num_grid_bytes);
+  LOG_IF(INFO, verbose_) << "Found " << overlapping_pairs.size()
+                         << " overlapping pairs of "
+                         << registration_aabb_tree_.size()
+                         << " submaps, added " << num_added << " ("
+                         << num_recropped << " recropped) and removed "
+                         << num_removed << " registration constraints in "
+                         << (ros::WallTime::now() - start_time).toSec()
+                         << " s, " << num_grids << " dense grids use "
+                         << num_grid_bytes / 1024 << " kB";
 }
 
 void PoseGraphInterface::addForceRegistrationConstraint(
     const SerSmId& first_submap_id, const SerSmId& second_submap_id) {
-  RegistrationConstraint::Config constraint_config =
-      measurement_templates_.registration;
-  constraint_config.first_submap_id = first_submap_id;
-  constraint_config.second_submap_id = second_submap_id;
-
-  // Add pointers to both submaps
-  constraint_config.first_submap_ptr =
-      submap_collection_ptr_->getSubmapConstPtr(first_submap_id);
-  constraint_config.second_submap_ptr =
-      submap_collection_ptr_->getSubmapConstPtr(second_submap_id);
-  CHECK_NOTNULL(constraint_config.first_submap_ptr);
-  CHECK_NOTNULL(constraint_config.second_submap_ptr);
-
-  // Add the constraint to the pose graph
-  pose_graph_.addForceRegistrationConstraint(constraint_config);
+  const SerSmIdPair submap_pair(first_submap_id, second_submap_id);
+  forced_registration_pairs_.insert(submap_pair);
+  if (!submap_pose_graph_.hasConstraint(ConstraintType::Registration,
+                                        submap_pair)) {
+    addRegistrationConstraint(submap_pair,
+                              submap_pose_graph_.getSubmapPoses());
+  }
+}
+
+bool PoseGraphInterface::addRegistrationConstraint(
+    const SerSmIdPair& submap_pair, const PoseMap& submap_poses) {
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      cox_submap_collection_ptr_->getSnapshot();
+  const CliSm::ConstPtr reading_submap_ptr =
+      snapshot->getSubmapConstPtr(submap_pair.first);
+  const CliSm::ConstPtr reference_submap_ptr =
+      snapshot->getSubmapConstPtr(submap_pair.second);
+  CHECK_NOTNULL(reading_submap_ptr);
+  CHECK_NOTNULL(reference_submap_ptr);
+
+  const std::shared_ptr<const RegistrationSamples> reading_samples =
+      getRegistrationSamples(*reading_submap_ptr);
+  if (reading_samples->empty()) return false;
+  const DenseTsdfGrid::ConstPtr reference_grid =
+      grid_cache_.get(*reference_submap_ptr);
+  if (reference_grid->empty()) return false;
+
+  // Only the samples near the reference grid are evaluated
+  RegistrationCrop crop;
+  crop.T_B_A = submap_poses.at(submap_pair.second).inverse() *
+               submap_poses.at(submap_pair.first);
+  auto cropped_samples = std::make_shared<RegistrationSamples>();
+  crop.radius = RegistrationCostFunction::cropSamples(
+      *reading_samples, crop.T_B_A, *reference_grid,
+      config_.registration_crop_margin, cropped_samples.get());
+  if (cropped_samples->empty()) {
+    // Submaps whose samples left the reference grid box
+    if (submap_pose_graph_.removeConstraint(ConstraintType::Registration,
+                                            submap_pair)) {
+      registration_crops_.erase(submap_pair);
+    }
+    return false;
+  }
+
+  submap_pose_graph_.setConstraint(
+      ConstraintType::Registration, submap_pair,
+      new RegistrationCostFunction(cropped_samples, reference_grid,
+                                   std::sqrt(config_.registration_weight)));
+  registration_crops_[submap_pair] = crop;
+  return true;
+}
+
+std::shared_ptr<const RegistrationSamples>
+PoseGraphInterface::getRegistrationSamples(const CliSm& submap) {
+  std::shared_ptr<const RegistrationSamples>& samples =
+      registration_samples_[submap.getID()];
+  if (samples == nullptr) {
+    auto new_samples = std::make_shared<RegistrationSamples>();
+    RegistrationCostFunction::getSamples(
+        submap.getTsdfMapPtr()->getTsdfLayer(),
+        config_.registration_grid_band / 2.0f,
+        config_.registration_min_voxel_weight,
+        config_.registration_sampling_ratio, new_samples.get());
+    samples = new_samples;
+  }
+  return samples;
+}
+
+InformationMatrix PoseGraphInterface::getSqrtInformation(
+    const InformationMatrix& information_matrix) {
+  // Same as the voxgraph constraints, L of the Cholesky decomposition LL^T
+  Eigen::LLT<InformationMatrix> information_llt(information_matrix);
+  CHECK(information_llt.info() != Eigen::NumericalIssue)
+      << "The square root of the information matrix could not be computed, "
+      << "make sure it is symmetric and positive definite: "
+      << information_matrix;
+  return information_llt.matrixL();
+}
+
+void PoseGraphInterface::publishPoseGraph() {
+  const PoseMap submap_poses = submap_pose_graph_.getSubmapPoses();
+  visualization_msgs::Marker marker;
+  marker.header.frame_id = visualization_odom_frame_;
+  marker.header.stamp = ros::Time::now();
+  marker.ns = "optimized";
+  marker.type = visualization_msgs::Marker::LINE_LIST;
+  marker.action = visualization_msgs::Marker::ADD;
+  marker.pose.orientation.w = 1.0;
+  marker.scale.x = 0.05;
+  marker.color.a = 1.0;
+
+  // Loop closures red, submap relative poses green, registration blue
+  for (int type_i = 0; type_i < 3; type_i++) {
+    const ConstraintType type = static_cast<ConstraintType>(type_i);
+    std_msgs::ColorRGBA color;
+    color.r = type == ConstraintType::LoopClosure;
+    color.g = type == ConstraintType::SubmapRelPose;
+    color.b = type == ConstraintType::Registration;
+    color.a = 1.0;
+    for (const SerSmIdPair& submap_pair :
+         submap_pose_graph_.getConstraintPairs(type)) {
+      for (const SerSmId& submap_id : {submap_pair.first, submap_pair.second}) {
+        const Transformation::Position& position =
+            submap_poses.at(submap_id).getPosition();
+        geometry_msgs::Point point;
+        point.x = position.x();
+        point.y = position.y();
+        point.z = position.z();
+        marker.points.emplace_back(point);
+        marker.colors.emplace_back(color);
+      }
+    }
+  }
+  LOG(INFO) << "publish pose graph: " << submap_poses.size();
+  pose_graph_pub_.publish(marker);
 }
 
 }  // namespace server
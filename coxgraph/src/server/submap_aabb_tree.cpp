@@ -0,0 +1,271 @@
+#include "coxgraph/server/submap_aabb_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+namespace coxgraph {
+namespace server {
+
+void SubmapAabbTree::update(const SerSmId& ser_sm_id,
+                            const BoundingBox& aabb) {
+  if (isEmpty(aabb)) {
+    remove(ser_sm_id);
+    return;
+  }
+
+  auto leaf_it = leaves_.find(ser_sm_id);
+  if (leaf_it != leaves_.end()) {
+    Node& node = nodes_[leaf_it->second];
+    node.aabb = aabb;
+    // Still inside the enlarged box, the tree stays as it is
+    if (contains(node.fat_aabb, aabb)) return;
+    removeLeaf(leaf_it->second);
+  } else {
+    const int leaf = allocateNode();
+    nodes_[leaf].ser_sm_id = ser_sm_id;
+    nodes_[leaf].aabb = aabb;
+    leaf_it = leaves_.emplace(ser_sm_id, leaf).first;
+  }
+
+  const int leaf = leaf_it->second;
+  nodes_[leaf].fat_aabb.min = aabb.min.array() - margin_;
+  nodes_[leaf].fat_aabb.max = aabb.max.array() + margin_;
+  insertLeaf(leaf);
+}
+
+void SubmapAabbTree::remove(const SerSmId& ser_sm_id) {
+  auto leaf_it = leaves_.find(ser_sm_id);
+  if (leaf_it == leaves_.end()) return;
+  removeLeaf(leaf_it->second);
+  freeNode(leaf_it->second);
+  leaves_.erase(leaf_it);
+}
+
+std::vector<SerSmId> SubmapAabbTree::getIds() const {
+  std::vector<SerSmId> ser_sm_ids;
+  ser_sm_ids.reserve(leaves_.size());
+  for (auto const& leaf_kv : leaves_) ser_sm_ids.emplace_back(leaf_kv.first);
+  std::sort(ser_sm_ids.begin(), ser_sm_ids.end());
+  return ser_sm_ids;
+}
+
+bool SubmapAabbTree::getAabb(const SerSmId& ser_sm_id,
+                             BoundingBox* aabb) const {
+  CHECK_NOTNULL(aabb);
+  auto leaf_it = leaves_.find(ser_sm_id);
+  if (leaf_it == leaves_.end()) return false;
+  *aabb = nodes_[leaf_it->second].aabb;
+  return true;
+}
+
+void SubmapAabbTree::query(const BoundingBox& aabb,
+                           std::vector<SerSmId>* ser_sm_ids) const {
+  CHECK_NOTNULL(ser_sm_ids);
+  ser_sm_ids->clear();
+  std::vector<int> leaves;
+  queryLeaves(aabb, &leaves);
+  for (int leaf : leaves) ser_sm_ids->emplace_back(nodes_[leaf].ser_sm_id);
+  std::sort(ser_sm_ids->begin(), ser_sm_ids->end());
+}
+
+void SubmapAabbTree::getOverlappingPairs(
+    std::vector<SerSmIdPair>* pairs) const {
+  CHECK_NOTNULL(pairs);
+  pairs->clear();
+  std::vector<int> leaves;
+  for (auto const& leaf_kv : leaves_) {
+    const Node& node = nodes_[leaf_kv.second];
+    queryLeaves(node.aabb, &leaves);
+    // Every pair is found from both of its submaps, keep it once
+    for (int leaf : leaves) {
+      if (node.ser_sm_id < nodes_[leaf].ser_sm_id) {
+        pairs->emplace_back(node.ser_sm_id, nodes_[leaf].ser_sm_id);
+      }
+    }
+  }
+  std::sort(pairs->begin(), pairs->end());
+}
+
+int SubmapAabbTree::allocateNode() {
+  int node;
+  if (free_nodes_.empty()) {
+    node = nodes_.size();
+    nodes_.emplace_back();
+  } else {
+    node = free_nodes_.back();
+    free_nodes_.pop_back();
+  }
+  nodes_[node].parent = kNullNode;
+  nodes_[node].left = kNullNode;
+  nodes_[node].right = kNullNode;
+  nodes_[node].height = 0;
+  return node;
+}
+
+void SubmapAabbTree::freeNode(int node) {
+  nodes_[node].height = -1;
+  free_nodes_.emplace_back(node);
+}
+
+void SubmapAabbTree::insertLeaf(int leaf) {
+  nodes_[leaf].parent = kNullNode;
+  if (root_ == kNullNode) {
+    root_ = leaf;
+    return;
+  }
+
+  // Descend to the sibling whose box grows least by adding the leaf, counting
+  // the growth inherited by all ancestors
+  const BoundingBox leaf_aabb = nodes_[leaf].fat_aabb;
+  int sibling = root_;
+  while (!nodes_[sibling].isLeaf()) {
+    const Node& node = nodes_[sibling];
+    const float area = surfaceArea(node.fat_aabb);
+    const float merged_area = surfaceArea(merge(node.fat_aabb, leaf_aabb));
+    // Cost of a new parent of this node and the leaf
+    const float cost = 2.0f * merged_area;
+    // Growth of the ancestors if descending further
+    const float inherited_cost = 2.0f * (merged_area - area);
+
+    auto descend_cost = [&](int child) {
+      const BoundingBox& child_aabb = nodes_[child].fat_aabb;
+      float child_cost = surfaceArea(merge(child_aabb, leaf_aabb));
+      if (!nodes_[child].isLeaf()) child_cost -= surfaceArea(child_aabb);
+      return child_cost + inherited_cost;
+    };
+    const float left_cost = descend_cost(node.left);
+    const float right_cost = descend_cost(node.right);
+
+    if (cost < left_cost && cost < right_cost) break;
+    sibling = left_cost < right_cost ? node.left : node.right;
+  }
+
+  const int old_parent = nodes_[sibling].parent;
+  const int new_parent = allocateNode();
+  nodes_[new_parent].parent = old_parent;
+  nodes_[new_parent].fat_aabb = merge(leaf_aabb, nodes_[sibling].fat_aabb);
+  nodes_[new_parent].height = nodes_[sibling].height + 1;
+  nodes_[new_parent].left = sibling;
+  nodes_[new_parent].right = leaf;
+  nodes_[sibling].parent = new_parent;
+  nodes_[leaf].parent = new_parent;
+
+  if (old_parent == kNullNode) {
+    root_ = new_parent;
+  } else if (nodes_[old_parent].left == sibling) {
+    nodes_[old_parent].left = new_parent;
+  } else {
+    nodes_[old_parent].right = new_parent;
+  }
+
+  refitAncestors(leaf);
+}
+
+void SubmapAabbTree::removeLeaf(int leaf) {
+  if (leaf == root_) {
+    root_ = kNullNode;
+    return;
+  }
+
+  // The sibling takes the place of the parent
+  const int parent = nodes_[leaf].parent;
+  const int grand_parent = nodes_[parent].parent;
+  const int sibling =
+      nodes_[parent].left == leaf ? nodes_[parent].right : nodes_[parent].left;
+
+  nodes_[sibling].parent = grand_parent;
+  if (grand_parent == kNullNode) {
+    root_ = sibling;
+  } else if (nodes_[grand_parent].left == parent) {
+    nodes_[grand_parent].left = sibling;
+  } else {
+    nodes_[grand_parent].right = sibling;
+  }
+  freeNode(parent);
+  nodes_[leaf].parent = kNullNode;
+
+  refitAncestors(sibling);
+}
+
+void SubmapAabbTree::refitAncestors(int node) {
+  int index = nodes_[node].parent;
+  while (index != kNullNode) {
+    index = balance(index);
+    Node& ancestor = nodes_[index];
+    const Node& left = nodes_[ancestor.left];
+    const Node& right = nodes_[ancestor.right];
+    ancestor.height = 1 + std::max(left.height, right.height);
+    ancestor.fat_aabb = merge(left.fat_aabb, right.fat_aabb);
+    index = ancestor.parent;
+  }
+}
+
+int SubmapAabbTree::balance(int a) {
+  if (nodes_[a].isLeaf() || nodes_[a].height < 2) return a;
+
+  const int b = nodes_[a].left;
+  const int c = nodes_[a].right;
+  const int height_diff = nodes_[c].height - nodes_[b].height;
+  if (std::abs(height_diff) <= 1) return a;
+
+  // Rotates the higher child up to the position of a, with a keeping the
+  // lower child and the lower grandchild
+  auto rotate_up = [this, a](int up, int other) {
+    const int f = nodes_[up].left;
+    const int g = nodes_[up].right;
+
+    nodes_[up].left = a;
+    nodes_[up].parent = nodes_[a].parent;
+    nodes_[a].parent = up;
+    if (nodes_[up].parent == kNullNode) {
+      root_ = up;
+    } else if (nodes_[nodes_[up].parent].left == a) {
+      nodes_[nodes_[up].parent].left = up;
+    } else {
+      nodes_[nodes_[up].parent].right = up;
+    }
+
+    int keep = f, move = g;
+    if (nodes_[f].height <= nodes_[g].height) std::swap(keep, move);
+    nodes_[up].right = keep;
+    if (nodes_[a].left == up) {
+      nodes_[a].left = move;
+    } else {
+      nodes_[a].right = move;
+    }
+    nodes_[move].parent = a;
+
+    nodes_[a].fat_aabb = merge(nodes_[other].fat_aabb, nodes_[move].fat_aabb);
+    nodes_[a].height =
+        1 + std::max(nodes_[other].height, nodes_[move].height);
+    nodes_[up].fat_aabb = merge(nodes_[a].fat_aabb, nodes_[keep].fat_aabb);
+    nodes_[up].height = 1 + std::max(nodes_[a].height, nodes_[keep].height);
+    return up;
+  };
+
+  return height_diff > 1 ? rotate_up(c, b) : rotate_up(b, c);
+}
+
+void SubmapAabbTree::queryLeaves(const BoundingBox& aabb,
+                                 std::vector<int>* leaves) const {
+  leaves->clear();
+  if (root_ == kNullNode) return;
+  std::vector<int> stack{root_};
+  while (!stack.empty()) {
+    const int index = stack.back();
+    stack.pop_back();
+    const Node& node = nodes_[index];
+    if (!overlaps(node.fat_aabb, aabb)) continue;
+    if (node.isLeaf()) {
+      if (overlaps(node.aabb, aabb)) leaves->emplace_back(index);
+    } else {
+      stack.emplace_back(node.left);
+      stack.emplace_back(node.right);
+    }
+  }
+}
+
+}  // namespace server
+}  // namespace coxgraph
@@ -0,0 +1,223 @@
+#include "coxgraph/server/submap_cache.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace coxgraph {
+namespace server {
+
+SubmapCache::SubmapCache(const Config& config)
+    : config_(config),
+      max_memory_size_(static_cast<size_t>(std::max(config.max_memory_mb, 0))
+                       << 20),
+      memory_size_(0) {
+  if (!config_.spill_directory.empty()) {
+    boost::filesystem::create_directories(config_.spill_directory);
+    removeSpillFiles();
+  }
+}
+
+SubmapCache::~SubmapCache() {
+  if (!config_.spill_directory.empty()) removeSpillFiles();
+}
+
+SubmapCache::Config SubmapCache::getConfigFromRosParam(
+    const ros::NodeHandle& nh_private) {
+  SubmapCache::Config config;
+  nh_private.param<int>("submap_cache/max_memory_mb", config.max_memory_mb,
+                        config.max_memory_mb);
+  nh_private.param<std::string>("submap_cache/spill_directory",
+                                config.spill_directory,
+                                config.spill_directory);
+  return config;
+}
+
+void SubmapCache::getVersions(const CliId& cid,
+                              std::vector<CliSmId>* cli_sm_ids,
+                              std::vector<uint64_t>* versions) {
+  CHECK(cli_sm_ids != nullptr);
+  CHECK(versions != nullptr);
+  cli_sm_ids->clear();
+  versions->clear();
+  std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+  for (auto const& entry_kv : entries_) {
+    if (entry_kv.first.first != cid) continue;
+    cli_sm_ids->emplace_back(entry_kv.first.second);
+    versions->emplace_back(entry_kv.second.version);
+  }
+}
+
+void SubmapCache::put(
+    const CliId& cid,
+    const coxgraph_msgs::ClientSubmapChunk::ConstPtr& submap_msg) {
+  CHECK(submap_msg != nullptr);
+  if (!enabled()) return;
+  const CIdCSIdPair key(cid, submap_msg->map_header.id);
+  std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+
+  auto entry_it = entries_.find(key);
+  if (entry_it != entries_.end()) {
+    if (entry_it->second.submap_msg != nullptr) {
+      memory_size_ -= entry_it->second.size;
+      lru_.erase(entry_it->second.lru_it);
+    } else {
+      removeSpillFile(key);
+    }
+    entries_.erase(entry_it);
+  }
+
+  Entry entry;
+  entry.version = submap_msg->version;
+  entry.size = ros::serialization::serializationLength(*submap_msg);
+  entry.submap_msg = submap_msg;
+  lru_.push_front(key);
+  entry.lru_it = lru_.begin();
+  entries_.emplace(key, entry);
+  memory_size_ += entry.size;
+  evict();
+}
+
+void SubmapCache::removeClient(const CliId& cid) {
+  std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+  for (auto entry_it = entries_.begin(); entry_it != entries_.end();) {
+    if (entry_it->first.first != cid) {
+      ++entry_it;
+      continue;
+    }
+    if (entry_it->second.submap_msg != nullptr) {
+      memory_size_ -= entry_it->second.size;
+      lru_.erase(entry_it->second.lru_it);
+    } else {
+      removeSpillFile(entry_it->first);
+    }
+    entry_it = entries_.erase(entry_it);
+  }
+}
+
+coxgraph_msgs::ClientSubmapChunk::ConstPtr SubmapCache::get(
+    const CliId& cid, const CliSmId& cli_sm_id, uint64_t version) {
+  const CIdCSIdPair key(cid, cli_sm_id);
+  std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+  auto entry_it = entries_.find(key);
+  if (entry_it == entries_.end() || entry_it->second.version != version) {
+    return nullptr;
+  }
+
+  Entry& entry = entry_it->second;
+  if (entry.submap_msg == nullptr) {
+    entry.submap_msg = load(key);
+    // Back in memory, evict() writes the file again if needed
+    removeSpillFile(key);
+    if (entry.submap_msg == nullptr) {
+      entries_.erase(entry_it);
+      return nullptr;
+    }
+    memory_size_ += entry.size;
+  } else {
+    lru_.erase(entry.lru_it);
+  }
+  lru_.push_front(key);
+  entry.lru_it = lru_.begin();
+
+  // Hold on to the submap, evict() may spill or drop it again
+  coxgraph_msgs::ClientSubmapChunk::ConstPtr submap_msg = entry.submap_msg;
+  evict();
+  return submap_msg;
+}
+
+void SubmapCache::evict() {
+  while (memory_size_ > max_memory_size_ && !lru_.empty()) {
+    const CIdCSIdPair key = lru_.back();
+    lru_.pop_back();
+    auto entry_it = entries_.find(key);
+    CHECK(entry_it != entries_.end());
+    memory_size_ -= entry_it->second.size;
+    if (config_.spill_directory.empty()) {
+      entries_.erase(entry_it);
+    } else if (spill(key, entry_it->second)) {
+      entry_it->second.submap_msg.reset();
+    } else {
+      removeSpillFile(key);
+      entries_.erase(entry_it);
+    }
+  }
+}
+
+std::string SubmapCache::spillPath(const CIdCSIdPair& key) const {
+  return (boost::filesystem::path(config_.spill_directory) /
+          ("submap_" + std::to_string(static_cast<int>(key.first)) + "_" +
+           std::to_string(key.second) + ".bin"))
+      .string();
+}
+
+bool SubmapCache::spill(const CIdCSIdPair& key, const Entry& entry) const {
+  std::vector<uint8_t> buffer(entry.size);
+  ros::serialization::OStream stream(buffer.data(), buffer.size());
+  ros::serialization::serialize(stream, *entry.submap_msg);
+
+  std::ofstream file(spillPath(key), std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+  if (!file.good()) {
+    LOG(WARNING) << "Failed to spill submap " << key.second << " of client "
+                 << static_cast<int>(key.first) << " to " << spillPath(key);
+    return false;
+  }
+  return true;
+}
+
+void SubmapCache::removeSpillFile(const CIdCSIdPair& key) const {
+  boost::system::error_code error;
+  boost::filesystem::remove(spillPath(key), error);
+}
+
+void SubmapCache::removeSpillFiles() const {
+  boost::system::error_code error;
+  boost::filesystem::directory_iterator dir_it(config_.spill_directory, error);
+  if (error) return;
+  size_t num_removed = 0;
+  for (; dir_it != boost::filesystem::directory_iterator();
+       dir_it.increment(error)) {
+    if (error) break;
+    const std::string file_name = dir_it->path().filename().string();
+    if (file_name.compare(0, 7, "submap_") != 0 ||
+        dir_it->path().extension() != ".bin") {
+      continue;
+    }
+    boost::system::error_code remove_error;
+    if (boost::filesystem::remove(dir_it->path(), remove_error)) {
+      num_removed++;
+    }
+  }
+  LOG_IF(INFO, num_removed > 0) << "Removed " << num_removed
+                                << " spilled submaps from "
+                                << config_.spill_directory;
+}
+
+coxgraph_msgs::ClientSubmapChunk::ConstPtr SubmapCache::load(
+    const CIdCSIdPair& key) const {
+  std::ifstream file(spillPath(key), std::ios::binary | std::ios::ate);
+  if (!file.is_open()) return nullptr;
+  std::vector<uint8_t> buffer(static_cast<size_t>(file.tellg()));
+  file.seekg(0);
+  file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+  if (!file.good()) return nullptr;
+
+  coxgraph_msgs::ClientSubmapChunk::Ptr submap_msg(
+      new coxgraph_msgs::ClientSubmapChunk());
+  ros::serialization::IStream stream(buffer.data(), buffer.size());
+  try {
+    ros::serialization::deserialize(stream, *submap_msg);
+  } catch (const ros::serialization::StreamOverrunException& e) {
+    LOG(WARNING) << "Spilled submap " << key.second << " of client "
+                 << static_cast<int>(key.first) << " is corrupted";
+    return nullptr;
+  }
+  return submap_msg;
+}
+
+}  // namespace server
+}  // namespace coxgraph
@@ -2,23 +2,119 @@
 
 #include <voxblox/integrator/merge_integration.h>
 
+#include <limits>
 #include <vector>
 
 namespace coxgraph {
 namespace server {
 
+const SubmapAabbTree& SubmapCollection::Snapshot::getAabbTree() const {
+  std::lock_guard<std::mutex> aabb_tree_lock(aabb_tree_mutex_);
+  if (aabb_tree_ == nullptr) {
+    aabb_tree_.reset(new SubmapAabbTree());
+    entries_.forEach([this](int ser_sm_id, const Entry& entry) {
+      aabb_tree_->update(ser_sm_id, entry.aabb);
+    });
+  }
+  return *aabb_tree_;
+}
+
+SubmapCollection::Ptr SubmapCollection::createOverlay() {
+  std::lock_guard<std::mutex> snapshot_write_lock(snapshot_write_mutex_);
+  return Ptr(new SubmapCollection(*this));
+}
+
 Transformation SubmapCollection::addSubmap(const CliSm::Ptr& submap_ptr,
                                            const CliId& cid,
                                            const CliSmId& cli_sm_id) {
+  std::lock_guard<std::mutex> snapshot_write_lock(snapshot_write_mutex_);
+  std::shared_ptr<Snapshot> snapshot = copySnapshot();
+  addSubmapToSnapshot(submap_ptr, cid, cli_sm_id, snapshot.get());
+  publishSnapshot(snapshot);
+  return Transformation();
+}
+
+void SubmapCollection::addSubmaps(const std::vector<CliSmPack>& submap_packs) {
+  if (submap_packs.empty()) return;
+  std::lock_guard<std::mutex> snapshot_write_lock(snapshot_write_mutex_);
+  std::shared_ptr<Snapshot> snapshot = copySnapshot();
+  for (auto const& submap_pack : submap_packs) {
+    addSubmapToSnapshot(submap_pack.submap_ptr, submap_pack.cid,
+                        submap_pack.cli_sm_id, snapshot.get());
+  }
+  publishSnapshot(snapshot);
+}
+
+void SubmapCollection::addSubmapToSnapshot(const CliSm::Ptr& submap_ptr,
+                                           const CliId& cid,
+                                           const CliSmId& cli_sm_id,
+                                           Snapshot* snapshot) {
   CHECK(submap_ptr != nullptr);
+  CHECK_GE(cid, 0);
   voxgraph::VoxgraphSubmapCollection::addSubmap(submap_ptr);
-  sm_cli_id_map_.emplace(submap_ptr->getID(), CIdCSIdPair(cid, cli_sm_id));
-  if (!cli_ser_sm_id_map_.count(submap_ptr->getID())) {
-    cli_ser_sm_id_map_.emplace(cid, std::vector<SerSmId>());
+
+  const SerSmId ser_sm_id = submap_ptr->getID();
+  if (snapshot->exists(ser_sm_id)) return;
+  Snapshot::Entry* entry = snapshot->entries_.getMutable(ser_sm_id);
+  entry->cid = cid;
+  entry->cli_sm_id = cli_sm_id;
+  entry->ori_pose = submap_ptr->getPose();
+  entry->pose = submap_ptr->getPose();
+  entry->aabb = submap_ptr->getOdomFrameSurfaceAabb();
+  entry->submap_ptr = submap_ptr;
+  if (!snapshot->cli_sm_ser_sm_id_maps_[cid].contains(cli_sm_id)) {
+    snapshot->cli_sm_ser_sm_id_maps_[cid].set(cli_sm_id, ser_sm_id);
   }
-  cli_ser_sm_id_map_[cid].emplace_back(submap_ptr->getID());
-  sm_id_ori_pose_map_.emplace(submap_ptr->getID(), submap_ptr->getPose());
-  return Transformation();
+}
+
+void SubmapCollection::updateSubmapPoses(const SmPoseMap& submap_poses,
+                                         bool update_ori_poses) {
+  if (submap_poses.empty()) return;
+  std::lock_guard<std::mutex> snapshot_write_lock(snapshot_write_mutex_);
+  std::shared_ptr<Snapshot> snapshot = copySnapshot();
+  for (auto const& ser_sm_id_pose_kv : submap_poses) {
+    const SerSmId& ser_sm_id = ser_sm_id_pose_kv.first;
+    CHECK(snapshot->exists(ser_sm_id)) << "SerSmId: " << ser_sm_id;
+    Snapshot::Entry* entry = snapshot->entries_.getMutable(ser_sm_id);
+    entry->pose = ser_sm_id_pose_kv.second;
+    entry->aabb =
+        getMovedSurfaceAabb(*entry->submap_ptr, ser_sm_id_pose_kv.second);
+    if (update_ori_poses) entry->ori_pose = ser_sm_id_pose_kv.second;
+  }
+  publishSnapshot(snapshot);
+}
+
+voxgraph::VoxgraphSubmapCollection::Ptr SubmapCollection::createPosedCopy()
+    const {
+  const Snapshot::ConstPtr snapshot = getSnapshot();
+  voxgraph::VoxgraphSubmapCollection::Ptr posed_copy(
+      new voxgraph::VoxgraphSubmapCollection(cox_submap_config_));
+  for (auto const& submap_ptr : snapshot->getSubmapConstPtrs()) {
+    CliSm::Ptr submap_copy = std::make_shared<CliSm>(*submap_ptr);
+    submap_copy->setPose(snapshot->getPose(submap_ptr->getID()));
+    posed_copy->addSubmap(submap_copy);
+  }
+  return posed_copy;
+}
+
+BoundingBox SubmapCollection::getMovedSurfaceAabb(
+    const CliSm& submap, const Transformation& T_O_S) {
+  const BoundingBox aabb = submap.getOdomFrameSurfaceAabb();
+  if (SubmapAabbTree::isEmpty(aabb)) return aabb;
+  const Transformation T_new_old = T_O_S * submap.getPose().inverse();
+  typedef std::numeric_limits<voxblox::FloatingPoint> Limits;
+  BoundingBox moved_aabb;
+  moved_aabb.min.setConstant(Limits::max());
+  moved_aabb.max.setConstant(Limits::lowest());
+  for (int corner = 0; corner < 8; corner++) {
+    const voxblox::Point corner_old((corner & 1) ? aabb.max.x() : aabb.min.x(),
+                                    (corner & 2) ? aabb.max.y() : aabb.min.y(),
+                                    (corner & 4) ? aabb.max.z() : aabb.min.z());
+    const voxblox::Point corner_new = T_new_old * corner_old;
+    moved_aabb.min = moved_aabb.min.cwiseMin(corner_new);
+    moved_aabb.max = moved_aabb.max.cwiseMax(corner_new);
+  }
+  return moved_aabb;
 }
 
 Transformation SubmapCollection::mergeToCliMap(const CliSm::Ptr& submap_ptr) {
@@ -17,45 +17,38 @@
 
 namespace coxgraph {
 namespace server {
-void ServerVisualizer::getFinalGlobalMesh(
-    const SubmapCollection::Ptr& submap_collection_ptr,
-    const PoseGraphInterface& pose_graph_interface,
-    const std::vector<CliSmPack>& other_submaps,
-    const std::string& mission_frame, const ros::Publisher& publisher,
-    const std::string& file_path, bool save_to_file) {
-  LOG(INFO) << "Generating final mesh";
-
-  SubmapCollection::Ptr global_submap_collection_ptr(
-      new SubmapCollection(*submap_collection_ptr));
-  PoseGraphInterface global_pg_interface(pose_graph_interface,
-                                         global_submap_collection_ptr);
-
-  for (auto const& submap_pack : other_submaps) {
-    global_submap_collection_ptr->addSubmap(
-        submap_pack.submap_ptr, submap_pack.cid, submap_pack.cli_sm_id);
-    global_pg_interface.addSubmap(submap_pack.submap_ptr->getID());
-  }
-  if (global_submap_collection_ptr->getSubmapConstPtrs().empty()) return;
+void ServerVisualizer::optimizeFinalGlobalGraph(
+    PoseGraphInterface* global_pg_interface) {
+  CHECK_NOTNULL(global_pg_interface);
+  LOG(INFO) << "Optimizing final pose graph";
 
-  global_pg_interface.updateSubmapRPConstraints();
+  global_pg_interface->updateSubmapRPConstraints();
 
   auto opt_async =
       std::async(std::launch::async, &PoseGraphInterface::optimize,
-                 &global_pg_interface, config_.registration_enable);
+                 global_pg_interface, config_.registration_enable);
 
   while (opt_async.wait_for(std::chrono::milliseconds(100)) !=
          std::future_status::ready) {
     LOG_EVERY_N(INFO, 10) << "Global optimzation is still running...";
   }
-  global_pg_interface.printResiduals(
-      PoseGraphInterface::ConstraintType::RelPose);
-  global_pg_interface.printResiduals(
+  global_pg_interface->printResiduals(
+      PoseGraphInterface::ConstraintType::LoopClosure);
+  global_pg_interface->printResiduals(
       PoseGraphInterface::ConstraintType::SubmapRelPose);
-  LOG(INFO) << "Optimization finished, generating global mesh...";
+  LOG(INFO) << "Optimization finished";
 
-  global_pg_interface.updateSubmapCollectionPoses();
+  global_pg_interface->updateSubmapCollectionPoses();
+}
 
-  auto pose_map = global_pg_interface.getPoseMap();
+void ServerVisualizer::getFinalGlobalMesh(
+    const SubmapCollection::Ptr& global_submap_collection_ptr,
+    const std::string& mission_frame, const ros::Publisher& publisher,
+    const std::string& file_path, bool save_to_file) {
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      global_submap_collection_ptr->getSnapshot();
+  if (snapshot->size() == 0) return;
+  LOG(INFO) << "Generating final mesh";
 
   boost::filesystem::path mesh_p_o3d_client_color(file_path);
   boost::filesystem::path mesh_p_o3d_raw(file_path);
@@ -68,15 +61,14 @@ void ServerVisualizer::getFinalGlobalMesh(
     // Combine mesh
     std::shared_ptr<open3d::geometry::TriangleMesh> combined_mesh(
         new open3d::geometry::TriangleMesh());
-    for (auto const& submap :
-         global_submap_collection_ptr->getSubmapConstPtrs()) {
+    for (auto const& submap : snapshot->getSubmapConstPtrs()) {
       auto submap_mesh = utils::o3dMeshFromMsg(
           *submap->mesh_pointcloud_, config_.o3d_color_mode,
-          global_submap_collection_ptr->getCliIdPairBySsid(submap->getID())
-              .first);
+          snapshot->getCliIdPairBySsid(submap->getID()).first);
       if (submap_mesh == nullptr) continue;
-      submap_mesh->Transform(
-          pose_map[submap->getID()].cast<double>().getTransformationMatrix());
+      submap_mesh->Transform(snapshot->getPose(submap->getID())
+                                 .cast<double>()
+                                 .getTransformationMatrix());
       *combined_mesh += *submap_mesh;
       combined_mesh->MergeCloseVertices(0.06);
       combined_mesh->RemoveDuplicatedVertices();
@@ -87,8 +79,7 @@ void ServerVisualizer::getFinalGlobalMesh(
 
     o3d_vis_->ClearGeometries();
     if (config_.o3d_vis_traj) {
-      for (int cid = 0; cid < global_submap_collection_ptr->getClientNumber();
-           cid++) {
+      for (const CliId& cid : global_submap_collection_ptr->getCliIds()) {
         std::shared_ptr<open3d::geometry::LineSet> traj_line_set(
             new open3d::geometry::LineSet());
         auto traj = global_submap_collection_ptr->getPoseHistory(cid);
@@ -96,7 +87,7 @@ void ServerVisualizer::getFinalGlobalMesh(
           auto const& pose = traj[i];
           traj_line_set->points_.emplace_back(
               pose.pose.position.x, pose.pose.position.y, pose.pose.position.y);
-          traj_line_set->colors_.emplace_back(client_colors_[cid]);
+          traj_line_set->colors_.emplace_back(utils::getClientColor(cid));
           traj_line_set->lines_.emplace_back(i, i + 1);
         }
         traj_line_set->lines_.erase(traj_line_set->lines_.end() - 1);
@@ -118,15 +109,17 @@ void ServerVisualizer::getFinalGlobalMesh(
                                     *combined_mesh);
   }
 
-  if (config_.publish_combined_mesh)
+  if (config_.publish_combined_mesh) {
+    // The voxgraph mesher reads the poses off the submaps, which are shared
+    // with the live collection and must keep their poses there
     submap_vis_.saveAndPubCombinedMesh(
-        *global_submap_collection_ptr, mission_frame, publisher,
-        save_to_file ? mesh_p_voxblox.string() : "");
+        *global_submap_collection_ptr->createPosedCopy(), mission_frame,
+        publisher, save_to_file ? mesh_p_voxblox.string() : "");
+  }
 
   std::map<SerSmId, CIdCSIdPair> sm_cli_ids;
-  for (auto const& submap : global_submap_collection_ptr->getSubmapPtrs()) {
-    auto csid_pair =
-        global_submap_collection_ptr->getCliIdPairBySsid(submap->getID());
+  for (auto const& submap : snapshot->getSubmapConstPtrs()) {
+    auto csid_pair = snapshot->getCliIdPairBySsid(submap->getID());
     sm_cli_ids.emplace(submap->getID(),
                        std::make_pair(csid_pair.first, csid_pair.second));
   }
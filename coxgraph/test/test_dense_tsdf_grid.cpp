@@ -0,0 +1,293 @@
+#include <gtest/gtest.h>
+#include <voxblox/interpolator/interpolator.h>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "coxgraph/server/backend/dense_tsdf_grid.h"
+#include "coxgraph/server/backend/registration_cost_function.h"
+
+namespace coxgraph {
+namespace server {
+
+class DenseTsdfGridTest : public ::testing::Test {
+ protected:
+  static constexpr float kVoxelSize = 0.1f;
+  static constexpr int kVoxelsPerSide = 16;
+  static constexpr float kTruncationDistance = 0.3f;
+  static constexpr float kRadius = 1.0f;
+
+  DenseTsdfGridTest()
+      : tsdf_layer_(kVoxelSize, kVoxelsPerSide), center_(0.13f, -0.07f, 0.21f) {
+    // TSDF of a sphere, observed up to the truncation distance
+    const float half_size = kRadius + 2.0f * kTruncationDistance;
+    for (float x = -half_size; x <= half_size; x += kVoxelSize) {
+      for (float y = -half_size; y <= half_size; y += kVoxelSize) {
+        for (float z = -half_size; z <= half_size; z += kVoxelSize) {
+          tsdf_layer_.allocateBlockPtrByCoordinates(center_ +
+                                                    voxblox::Point(x, y, z));
+        }
+      }
+    }
+    voxblox::BlockIndexList block_indices;
+    tsdf_layer_.getAllAllocatedBlocks(&block_indices);
+    for (const voxblox::BlockIndex& block_index : block_indices) {
+      voxblox::Block<voxblox::TsdfVoxel>::Ptr block =
+          tsdf_layer_.getBlockPtrByIndex(block_index);
+      for (size_t i = 0; i < block->num_voxels(); ++i) {
+        voxblox::TsdfVoxel& voxel = block->getVoxelByLinearIndex(i);
+        const float distance =
+            (block->computeCoordinatesFromLinearIndex(i) - center_).norm() -
+            kRadius;
+        if (std::abs(distance) <= kTruncationDistance) {
+          voxel.distance = distance;
+          voxel.weight = 1.0f;
+        }
+      }
+    }
+  }
+
+  // Random points at most max_distance from the sphere surface
+  std::vector<Eigen::Vector3f> getPointsNearSurface(int num_points,
+                                                    float max_distance) {
+    std::mt19937 generator(0);
+    std::normal_distribution<float> normal(0.0f, 1.0f);
+    std::uniform_real_distribution<float> offset(-max_distance, max_distance);
+    std::vector<Eigen::Vector3f> points;
+    for (int i = 0; i < num_points; ++i) {
+      const Eigen::Vector3f direction =
+          Eigen::Vector3f(normal(generator), normal(generator),
+                          normal(generator))
+              .normalized();
+      points.push_back(center_ + direction * (kRadius + offset(generator)));
+    }
+    return points;
+  }
+
+  DenseTsdfGrid::TsdfLayer tsdf_layer_;
+  const Eigen::Vector3f center_;
+};
+
+TEST_F(DenseTsdfGridTest, MatchesInterpolator) {
+  const DenseTsdfGrid grid(tsdf_layer_, kTruncationDistance, 0.0f);
+  ASSERT_FALSE(grid.empty());
+  const voxblox::Interpolator<voxblox::TsdfVoxel> interpolator(&tsdf_layer_);
+
+  // All 8 voxels around these points are within the truncation distance
+  int num_compared = 0;
+  for (const Eigen::Vector3f& point :
+       getPointsNearSurface(10000, kVoxelSize)) {
+    float distance, interpolator_distance;
+    Eigen::Vector3f gradient;
+    ASSERT_TRUE(grid.getDistanceAndGradient(point, &distance, &gradient));
+    ASSERT_TRUE(
+        interpolator.getDistance(point, &interpolator_distance, true));
+    EXPECT_NEAR(distance, interpolator_distance, 1e-5f);
+    // Close to the surface the TSDF is the distance to a sphere
+    EXPECT_NEAR(gradient.dot((point - center_).normalized()), 1.0f, 0.1f);
+
+    // The gradient is the one of the trilinear interpolation, which has kinks
+    // where the point crosses into the next 8 voxels
+    const float kStep = 1e-3f;
+    for (int axis = 0; axis < 3; ++axis) {
+      const float grid_coordinate = point(axis) / kVoxelSize - 0.5f;
+      if (std::floor(grid_coordinate - kStep / kVoxelSize) !=
+          std::floor(grid_coordinate + kStep / kVoxelSize)) {
+        continue;
+      }
+      float distance_minus, distance_plus;
+      const Eigen::Vector3f step = Eigen::Vector3f::Unit(axis) * kStep;
+      ASSERT_TRUE(grid.getDistanceAndGradient(point - step, &distance_minus,
+                                              nullptr));
+      ASSERT_TRUE(grid.getDistanceAndGradient(point + step, &distance_plus,
+                                              nullptr));
+      EXPECT_NEAR(gradient(axis), (distance_plus - distance_minus) / kStep / 2,
+                  0.01f);
+    }
+    num_compared++;
+  }
+  EXPECT_EQ(num_compared, 10000);
+
+  // Far from the surface is outside the band
+  float distance;
+  EXPECT_FALSE(
+      grid.getDistanceAndGradient(center_, &distance, nullptr));
+  EXPECT_FALSE(grid.getDistanceAndGradient(
+      center_ + Eigen::Vector3f(10.0f, 0.0f, 0.0f), &distance, nullptr));
+}
+
+TEST_F(DenseTsdfGridTest, CostFunctionJacobians) {
+  auto samples = std::make_shared<RegistrationSamples>();
+  RegistrationCostFunction::getSamples(tsdf_layer_, 2.0f * kVoxelSize, 0.0f,
+                                       0.3f, samples.get());
+  ASSERT_GT(samples->size(), 100u);
+  RegistrationCostFunction cost_function(
+      samples,
+      std::make_shared<const DenseTsdfGrid>(tsdf_layer_, kTruncationDistance,
+                                            0.0f),
+      2.0);
+
+  // Both submaps see the same sphere, so the residuals vanish at the true
+  // relative pose
+  double T_W_A[4] = {1.0, 2.0, 0.5, 0.3};
+  double T_W_B[4] = {1.0, 2.0, 0.5, 0.3};
+  const double* parameters[2] = {T_W_A, T_W_B};
+  const size_t num_residuals = samples->size();
+  std::vector<double> residuals(num_residuals);
+  ASSERT_TRUE(cost_function.Evaluate(parameters, residuals.data(), nullptr));
+  for (double residual : residuals) EXPECT_NEAR(residual, 0.0, 1e-4);
+
+  // Jacobians against central differences, away from the true pose
+  T_W_A[0] += 0.03;
+  T_W_A[3] += 0.02;
+  T_W_B[2] -= 0.04;
+  std::vector<double> jacobian_a(num_residuals * 4),
+      jacobian_b(num_residuals * 4);
+  double* jacobians[2] = {jacobian_a.data(), jacobian_b.data()};
+  ASSERT_TRUE(
+      cost_function.Evaluate(parameters, residuals.data(), jacobians));
+  const double kStep = 1e-4;
+  std::vector<double> residuals_minus(num_residuals),
+      residuals_plus(num_residuals);
+  size_t num_mismatches = 0;
+  for (int block_i = 0; block_i < 2; ++block_i) {
+    double* pose = block_i == 0 ? T_W_A : T_W_B;
+    for (int param_i = 0; param_i < 4; ++param_i) {
+      const double value = pose[param_i];
+      pose[param_i] = value - kStep;
+      cost_function.Evaluate(parameters, residuals_minus.data(), nullptr);
+      pose[param_i] = value + kStep;
+      cost_function.Evaluate(parameters, residuals_plus.data(), nullptr);
+      pose[param_i] = value;
+      for (size_t i = 0; i < num_residuals; ++i) {
+        const double numeric =
+            (residuals_plus[i] - residuals_minus[i]) / (2.0 * kStep);
+        // Steps across voxel boundaries, where the trilinear interpolation
+        // has a kink, or out of the band don't match
+        if (std::abs(jacobians[block_i][i * 4 + param_i] - numeric) > 1e-2) {
+          num_mismatches++;
+        }
+      }
+    }
+  }
+  EXPECT_LT(num_mismatches, num_residuals * 8 / 50);
+}
+
+// A reading submap half off the reference one only evaluates the samples
+// that can land in the reference grid
+TEST_F(DenseTsdfGridTest, CroppedSamples) {
+  auto samples = std::make_shared<RegistrationSamples>();
+  RegistrationCostFunction::getSamples(tsdf_layer_, 2.0f * kVoxelSize, 0.0f,
+                                       1.0f, samples.get());
+  const DenseTsdfGrid::ConstPtr grid = std::make_shared<const DenseTsdfGrid>(
+      tsdf_layer_, kTruncationDistance, 0.0f);
+  const Transformation T_B_A(Transformation::Rotation(),
+                             Transformation::Position(1.5f, 0.0f, 0.0f));
+  auto cropped_samples = std::make_shared<RegistrationSamples>();
+  const float radius = RegistrationCostFunction::cropSamples(
+      *samples, T_B_A, *grid, 0.5f, cropped_samples.get());
+  ASSERT_FALSE(cropped_samples->empty());
+  EXPECT_LT(cropped_samples->size(), samples->size() * 3 / 4);
+  EXPECT_LE(radius, (center_.norm() + kRadius + 2.0f * kVoxelSize) * 1.01f);
+
+  // Same cost at the cropping pose and up to the margin away from it
+  const RegistrationCostFunction cost_function(samples, grid, 1.0);
+  const RegistrationCostFunction cropped_cost_function(cropped_samples, grid,
+                                                       1.0);
+  std::vector<double> residuals(samples->size()),
+      cropped_residuals(cropped_samples->size());
+  const int kNumEvaluations = 100;
+  std::chrono::duration<double> time(0.0), cropped_time(0.0);
+  for (int evaluation_i = 0; evaluation_i < kNumEvaluations; ++evaluation_i) {
+    const double offset = 0.4 * evaluation_i / kNumEvaluations;
+    double T_W_A[4] = {1.5 + offset, offset, -offset, 0.0};
+    double T_W_B[4] = {0.0, 0.0, 0.0, 0.0};
+    const double* parameters[2] = {T_W_A, T_W_B};
+
+    auto start = std::chrono::steady_clock::now();
+    cost_function.Evaluate(parameters, residuals.data(), nullptr);
+    time += std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    cropped_cost_function.Evaluate(parameters, cropped_residuals.data(),
+                                   nullptr);
+    cropped_time += std::chrono::steady_clock::now() - start;
+
+    double cost = 0.0, cropped_cost = 0.0;
+    for (double residual : residuals) cost += residual * residual;
+    for (double residual : cropped_residuals) {
+      cropped_cost += residual * residual;
+    }
+    ASSERT_NEAR(cost, cropped_cost, 1e-9 * (1.0 + cost));
+  }
+
+  EXPECT_LT(cropped_time.count(), time.count());
+  std::cout << "Cropping kept " << cropped_samples->size() << " of "
+            << samples->size() << " samples, evaluation "
+            << cropped_time.count() / kNumEvaluations * 1e6 << " us instead of "
+            << time.count() / kNumEvaluations * 1e6 << " us" << std::endl;
+}
+
+// Per evaluation cost and memory of the dense grid against the hashed block
+// layer and voxblox's interpolator, which the registration cost of voxgraph
+// looks distances and gradients up with
+TEST_F(DenseTsdfGridTest, LookupSpeedAndMemory) {
+  const auto build_start = std::chrono::steady_clock::now();
+  const DenseTsdfGrid grid(tsdf_layer_, kTruncationDistance, 0.0f);
+  const std::chrono::duration<double> build_time =
+      std::chrono::steady_clock::now() - build_start;
+  const voxblox::Interpolator<voxblox::TsdfVoxel> interpolator(&tsdf_layer_);
+  const std::vector<Eigen::Vector3f> points =
+      getPointsNearSurface(100000, kVoxelSize);
+
+  float grid_sum = 0.0f;
+  auto start = std::chrono::steady_clock::now();
+  for (const Eigen::Vector3f& point : points) {
+    float distance;
+    Eigen::Vector3f gradient;
+    if (grid.getDistanceAndGradient(point, &distance, &gradient)) {
+      grid_sum += distance + gradient.x();
+    }
+  }
+  const std::chrono::duration<double> grid_time =
+      std::chrono::steady_clock::now() - start;
+
+  float interpolator_sum = 0.0f;
+  start = std::chrono::steady_clock::now();
+  for (const Eigen::Vector3f& point : points) {
+    float distance;
+    voxblox::Point gradient;
+    if (interpolator.getDistance(point, &distance, true) &&
+        interpolator.getGradient(point, &gradient, true)) {
+      interpolator_sum += distance + gradient.x();
+    }
+  }
+  const std::chrono::duration<double> interpolator_time =
+      std::chrono::steady_clock::now() - start;
+
+  // Both looked up the same points
+  EXPECT_NEAR(grid_sum, interpolator_sum, 0.02f * points.size());
+  EXPECT_LT(grid_time.count(), interpolator_time.count());
+  EXPECT_LT(grid.getMemorySize(), tsdf_layer_.getMemorySize());
+  std::cout << "Distance and gradient lookup: dense grid "
+            << grid_time.count() / points.size() * 1e9
+            << " ns, interpolator "
+            << interpolator_time.count() / points.size() * 1e9 << " ns"
+            << std::endl;
+  std::cout << "Memory: dense grid " << grid.getMemorySize() / 1024
+            << " kB for " << grid.getNumBandVoxels()
+            << " band voxels, built in " << build_time.count() * 1e3
+            << " ms, TSDF layer " << tsdf_layer_.getMemorySize() / 1024
+            << " kB" << std::endl;
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,201 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "coxgraph/server/map_fusion_scheduler.h"
+
+namespace coxgraph {
+namespace server {
+
+class MapFusionSchedulerTest : public ::testing::Test {
+ protected:
+  typedef std::tuple<int, double, int, double> FusionKey;
+
+  static coxgraph_msgs::MapFusion makeFusion(int cid_a, double t_a, int cid_b,
+                                             double t_b) {
+    coxgraph_msgs::MapFusion map_fusion_msg;
+    map_fusion_msg.from_client_id = cid_a;
+    map_fusion_msg.from_timestamp = ros::Time(t_a);
+    map_fusion_msg.to_client_id = cid_b;
+    map_fusion_msg.to_timestamp = ros::Time(t_b);
+    return map_fusion_msg;
+  }
+
+  static TimeLine makeTimeLine(double start, double end) {
+    TimeLine time_line;
+    time_line.start = ros::Time(start);
+    time_line.end = ros::Time(end);
+    return time_line;
+  }
+
+  static FusionKey getKey(const coxgraph_msgs::MapFusion& map_fusion_msg) {
+    return std::make_tuple(map_fusion_msg.from_client_id,
+                           map_fusion_msg.from_timestamp.toSec(),
+                           map_fusion_msg.to_client_id,
+                           map_fusion_msg.to_timestamp.toSec());
+  }
+
+  static MapFusionScheduler::Config makeConfig(
+      int max_queue_size, MapFusionScheduler::Priority priority) {
+    MapFusionScheduler::Config config;
+    config.max_queue_size = max_queue_size;
+    config.priority = priority;
+    return config;
+  }
+};
+
+TEST_F(MapFusionSchedulerTest, DuplicatesAreKeptOnce) {
+  MapFusionScheduler scheduler(
+      makeConfig(10, MapFusionScheduler::Priority::NEWEST_FIRST));
+  EXPECT_EQ(scheduler.defer(makeFusion(0, 1.0, 1, 2.0)),
+            MapFusionScheduler::DeferState::DEFERRED);
+  EXPECT_EQ(scheduler.defer(makeFusion(0, 1.0, 1, 2.0)),
+            MapFusionScheduler::DeferState::DUPLICATE);
+  // Other timestamp or other direction is another fusion
+  EXPECT_EQ(scheduler.defer(makeFusion(0, 1.0, 1, 3.0)),
+            MapFusionScheduler::DeferState::DEFERRED);
+  EXPECT_EQ(scheduler.defer(makeFusion(1, 2.0, 0, 1.0)),
+            MapFusionScheduler::DeferState::DEFERRED);
+  EXPECT_EQ(scheduler.size(), 3u);
+
+  coxgraph_msgs::MapFusionQueueStats stats;
+  scheduler.getStats(&stats);
+  EXPECT_EQ(stats.num_deferred, 3u);
+  EXPECT_EQ(stats.num_duplicates, 1u);
+}
+
+TEST_F(MapFusionSchedulerTest, ReadyOnlyOnceBothClientsCoverIt) {
+  MapFusionScheduler scheduler(
+      makeConfig(10, MapFusionScheduler::Priority::NEWEST_FIRST));
+  scheduler.defer(makeFusion(0, 1.0, 1, 2.0));
+  std::vector<coxgraph_msgs::MapFusion> ready;
+  scheduler.updateTimeLine(0, makeTimeLine(0.0, 5.0), &ready);
+  EXPECT_TRUE(ready.empty());
+  scheduler.updateTimeLine(1, makeTimeLine(0.0, 1.5), &ready);
+  EXPECT_TRUE(ready.empty());
+  scheduler.updateTimeLine(1, makeTimeLine(0.0, 2.5), &ready);
+  ASSERT_EQ(ready.size(), 1u);
+  EXPECT_EQ(getKey(ready.front()), getKey(makeFusion(0, 1.0, 1, 2.0)));
+  EXPECT_EQ(scheduler.size(), 0u);
+}
+
+TEST_F(MapFusionSchedulerTest, CoveredFusionsAreNotQueued) {
+  MapFusionScheduler scheduler(
+      makeConfig(10, MapFusionScheduler::Priority::NEWEST_FIRST));
+  std::vector<coxgraph_msgs::MapFusion> ready;
+  scheduler.updateTimeLine(0, makeTimeLine(0.0, 5.0), &ready);
+  scheduler.updateTimeLine(1, makeTimeLine(0.0, 5.0), &ready);
+  // Already covered, no further time line update is needed to run it
+  EXPECT_EQ(scheduler.defer(makeFusion(0, 1.0, 1, 2.0)),
+            MapFusionScheduler::DeferState::READY);
+  EXPECT_EQ(scheduler.size(), 0u);
+
+  // Only the timestamp ahead of client 1 waits
+  EXPECT_EQ(scheduler.defer(makeFusion(0, 1.0, 1, 6.0)),
+            MapFusionScheduler::DeferState::DEFERRED);
+  scheduler.updateTimeLine(1, makeTimeLine(0.0, 7.0), &ready);
+  ASSERT_EQ(ready.size(), 1u);
+  EXPECT_EQ(getKey(ready.front()), getKey(makeFusion(0, 1.0, 1, 6.0)));
+}
+
+TEST_F(MapFusionSchedulerTest, PriorityOrder) {
+  const std::vector<coxgraph_msgs::MapFusion> fusions = {
+      makeFusion(0, 3.0, 1, 1.0), makeFusion(0, 1.0, 1, 2.0),
+      makeFusion(0, 4.0, 1, 4.0), makeFusion(0, 2.0, 1, 1.0)};
+  for (auto priority : {MapFusionScheduler::Priority::NEWEST_FIRST,
+                        MapFusionScheduler::Priority::OLDEST_FIRST}) {
+    MapFusionScheduler scheduler(makeConfig(10, priority));
+    for (auto const& map_fusion_msg : fusions) scheduler.defer(map_fusion_msg);
+    std::vector<coxgraph_msgs::MapFusion> ready;
+    scheduler.updateTimeLine(0, makeTimeLine(0.0, 10.0), &ready);
+    ASSERT_TRUE(ready.empty());
+    scheduler.updateTimeLine(1, makeTimeLine(0.0, 10.0), &ready);
+    ASSERT_EQ(ready.size(), fusions.size());
+
+    std::vector<FusionKey> expected;
+    if (priority == MapFusionScheduler::Priority::NEWEST_FIRST) {
+      // By the later of the two timestamps, newest first
+      expected = {getKey(fusions[2]), getKey(fusions[0]), getKey(fusions[3]),
+                  getKey(fusions[1])};
+    } else {
+      // By arrival
+      for (auto const& map_fusion_msg : fusions) {
+        expected.emplace_back(getKey(map_fusion_msg));
+      }
+    }
+    for (size_t i = 0; i < ready.size(); ++i) {
+      EXPECT_EQ(getKey(ready[i]), expected[i]) << "at " << i;
+    }
+  }
+}
+
+TEST_F(MapFusionSchedulerTest, EvictsLowestPriorityWithoutLosingOthers) {
+  constexpr int kMaxQueueSize = 5;
+  constexpr int kNumFusions = 20;
+  for (auto priority : {MapFusionScheduler::Priority::NEWEST_FIRST,
+                        MapFusionScheduler::Priority::OLDEST_FIRST}) {
+    MapFusionScheduler scheduler(makeConfig(kMaxQueueSize, priority));
+    // Arrival order differs from timestamp order
+    std::vector<coxgraph_msgs::MapFusion> fusions;
+    for (int i = 0; i < kNumFusions; ++i) {
+      const double t = (i * 7) % kNumFusions + 1.0;
+      fusions.emplace_back(makeFusion(0, t, 1, t));
+      scheduler.defer(fusions.back());
+      EXPECT_LE(scheduler.size(), static_cast<size_t>(kMaxQueueSize));
+    }
+
+    coxgraph_msgs::MapFusionQueueStats stats;
+    scheduler.getStats(&stats);
+    EXPECT_EQ(stats.num_evicted, kNumFusions - kMaxQueueSize);
+
+    // The fusions that win every comparison are the ones still queued
+    std::set<FusionKey> expected;
+    if (priority == MapFusionScheduler::Priority::NEWEST_FIRST) {
+      std::sort(fusions.begin(), fusions.end(),
+                [](const coxgraph_msgs::MapFusion& a,
+                   const coxgraph_msgs::MapFusion& b) {
+                  return a.from_timestamp > b.from_timestamp;
+                });
+    }
+    for (int i = 0; i < kMaxQueueSize; ++i) {
+      expected.emplace(getKey(fusions[i]));
+    }
+
+    std::vector<coxgraph_msgs::MapFusion> ready;
+    scheduler.updateTimeLine(0, makeTimeLine(0.0, 100.0), &ready);
+    scheduler.updateTimeLine(1, makeTimeLine(0.0, 100.0), &ready);
+    std::set<FusionKey> dispatched;
+    for (auto const& map_fusion_msg : ready) {
+      dispatched.emplace(getKey(map_fusion_msg));
+    }
+    EXPECT_EQ(dispatched, expected);
+    EXPECT_EQ(scheduler.size(), 0u);
+  }
+}
+
+TEST_F(MapFusionSchedulerTest, RemoveClientDropsItsFusions) {
+  MapFusionScheduler scheduler(
+      makeConfig(10, MapFusionScheduler::Priority::NEWEST_FIRST));
+  scheduler.defer(makeFusion(0, 1.0, 1, 1.0));
+  scheduler.defer(makeFusion(0, 1.0, 2, 1.0));
+  scheduler.defer(makeFusion(2, 2.0, 1, 2.0));
+  EXPECT_EQ(scheduler.removeClient(2), 2u);
+
+  std::vector<coxgraph_msgs::MapFusion> ready;
+  scheduler.updateTimeLine(0, makeTimeLine(0.0, 10.0), &ready);
+  scheduler.updateTimeLine(1, makeTimeLine(0.0, 10.0), &ready);
+  ASSERT_EQ(ready.size(), 1u);
+  EXPECT_EQ(getKey(ready.front()), getKey(makeFusion(0, 1.0, 1, 1.0)));
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
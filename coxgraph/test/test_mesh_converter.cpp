@@ -0,0 +1,286 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "coxgraph/map_comm/mesh_converter.h"
+
+namespace voxblox {
+
+class MeshConverterTest : public ::testing::Test {
+ protected:
+  static constexpr int kNumBlocks = 1000;
+  static constexpr int kTrianglesPerBlock = 200;
+  static constexpr int kNumFrames = 200;
+  static constexpr int kNumTimingRuns = 3;
+
+  // Frame clouds as returned by getNextPointcloud, one per trajectory pose
+  struct Result {
+    pcl::PointCloud<pcl::PointXYZRGB> recovered_pointcloud;
+    std::vector<Pointcloud> frame_points;
+    std::vector<Colors> frame_colors;
+  };
+
+  void SetUp() override {
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> coordinate_dist(
+        0, std::numeric_limits<uint16_t>::max() / 2);
+    std::uniform_int_distribution<int> color_dist(0, 255);
+    std::uniform_int_distribution<int> frame_dist(0, kNumFrames - 1);
+    std::uniform_int_distribution<int> length_dist(0, 10);
+
+    mesh_.block_edge_length = 1.6;
+    mesh_.mesh_blocks.resize(kNumBlocks);
+    for (int block_i = 0; block_i < kNumBlocks; ++block_i) {
+      voxblox_msgs::MeshBlock& mesh_block = mesh_.mesh_blocks[block_i];
+      mesh_block.index[0] = block_i % 20;
+      mesh_block.index[1] = (block_i / 20) % 10;
+      mesh_block.index[2] = block_i / 200;
+      for (int i = 0; i < 3 * kTrianglesPerBlock; ++i) {
+        mesh_block.x.push_back(coordinate_dist(gen));
+        mesh_block.y.push_back(coordinate_dist(gen));
+        mesh_block.z.push_back(coordinate_dist(gen));
+        mesh_block.r.push_back(color_dist(gen));
+        mesh_block.g.push_back(color_dist(gen));
+        mesh_block.b.push_back(color_dist(gen));
+      }
+      mesh_block.history.resize(kTrianglesPerBlock);
+      for (auto& history : mesh_block.history) {
+        const int first = frame_dist(gen);
+        history.history = {static_cast<uint32_t>(first),
+                           static_cast<uint32_t>(std::min(
+                               first + length_dist(gen), kNumFrames - 1))};
+      }
+    }
+
+    const ros::Time start_time(100.0);
+    for (int frame_i = 0; frame_i < kNumFrames; ++frame_i) {
+      geometry_msgs::PoseStamped pose;
+      pose.header.stamp = start_time + ros::Duration(frame_i * 0.05);
+      pose.pose.orientation.w = 1.0;
+      mesh_.trajectory.poses.emplace_back(pose);
+    }
+  }
+
+  // Returns the fastest of kNumTimingRuns conversions in ms
+  double convert(int num_threads, Result* result) const {
+    MeshConverter::Config config;
+    config.num_threads = num_threads;
+    MeshConverter mesh_converter(config);
+    double min_time_ms = std::numeric_limits<double>::max();
+    for (int run = 0; run < kNumTimingRuns; ++run) {
+      mesh_converter.clear();
+      mesh_converter.setMesh(mesh_);
+      const auto start = std::chrono::steady_clock::now();
+      EXPECT_TRUE(
+          mesh_converter.convertToPointCloud(&result->recovered_pointcloud));
+      const std::chrono::duration<double, std::milli> time =
+          std::chrono::steady_clock::now() - start;
+      min_time_ms = std::min(min_time_ms, time.count());
+    }
+
+    result->frame_points.clear();
+    result->frame_colors.clear();
+    int frame_i = 0;
+    Transformation T_G_C;
+    PointcloudPtr points(new Pointcloud());
+    ColorsPtr colors(new Colors());
+    while (mesh_converter.getNextPointcloud(&frame_i, &T_G_C, &points,
+                                            &colors)) {
+      result->frame_points.emplace_back(*points);
+      result->frame_colors.emplace_back(*colors);
+    }
+    return min_time_ms;
+  }
+
+  // Samples a single triangle, as interpolateTriangle did before the
+  // sampling moved into TriangleSampler
+  static void sampleTriangle(const TriangleSampler& sampler,
+                             const Pointcloud& triangle, const Colors& colors,
+                             Pointcloud* interp_pts, Colors* interp_colors) {
+    float x[3], y[3], z[3];
+    uint8_t r[3], g[3], b[3];
+    for (int v = 0; v < 3; ++v) {
+      x[v] = triangle[v].x();
+      y[v] = triangle[v].y();
+      z[v] = triangle[v].z();
+      r[v] = colors[v].r;
+      g[v] = colors[v].g;
+      b[v] = colors[v].b;
+    }
+    const TriangleSampler::TriangleBatch batch{x, y, z, r, g, b, 1u};
+    size_t num_samples;
+    sampler.countSamples(batch, &num_samples);
+    interp_pts->resize(num_samples);
+    interp_colors->resize(num_samples);
+    sampler.sample(batch, interp_pts->data(), interp_colors->data());
+  }
+
+  // Copy of the serial decoding loop of convertToPointCloud before the blocks
+  // were decoded in parallel, kept as the reference for the decoder
+  double decodeBaseline(Result* result) const {
+    const auto start = std::chrono::steady_clock::now();
+    const TriangleSampler triangle_sampler(
+        MeshConverter::getSamplerConfig(MeshConverter::Config()));
+    result->recovered_pointcloud.clear();
+    std::map<uint32_t, std::pair<Pointcloud, Colors>> pointcloud;
+    Pointcloud triangle;
+    Colors colors;
+    for (auto const& mesh_block : mesh_.mesh_blocks) {
+      if (mesh_block.history.empty()) continue;
+      const BlockIndex index(mesh_block.index[0], mesh_block.index[1],
+                             mesh_block.index[2]);
+      for (size_t i = 0; i < mesh_block.x.size(); ++i) {
+        constexpr float point_conv_factor =
+            2.0f / std::numeric_limits<uint16_t>::max();
+        const float mesh_x =
+            (static_cast<float>(mesh_block.x[i]) * point_conv_factor +
+             static_cast<float>(index[0])) *
+            mesh_.block_edge_length;
+        const float mesh_y =
+            (static_cast<float>(mesh_block.y[i]) * point_conv_factor +
+             static_cast<float>(index[1])) *
+            mesh_.block_edge_length;
+        const float mesh_z =
+            (static_cast<float>(mesh_block.z[i]) * point_conv_factor +
+             static_cast<float>(index[2])) *
+            mesh_.block_edge_length;
+        auto const& history = mesh_block.history[i / 3];
+
+        triangle.emplace_back(mesh_x, mesh_y, mesh_z);
+        colors.emplace_back(mesh_block.r[i], mesh_block.g[i], mesh_block.b[i]);
+        pcl::PointXYZRGB recovered_point;
+        recovered_point.x = mesh_x;
+        recovered_point.y = mesh_y;
+        recovered_point.z = mesh_z;
+        recovered_point.r = mesh_block.r[i];
+        recovered_point.g = mesh_block.g[i];
+        recovered_point.b = mesh_block.b[i];
+        result->recovered_pointcloud.push_back(recovered_point);
+        if (triangle.size() == 3) {
+          Pointcloud interp_pts;
+          Colors interp_colors;
+          sampleTriangle(triangle_sampler, triangle, colors, &interp_pts,
+                         &interp_colors);
+          for (size_t h = 0; h < history.history.size(); h += 2) {
+            for (uint32_t j = history.history[h]; j <= history.history[h + 1];
+                 j++) {
+              auto& stamp_pointcloud = pointcloud[j];
+              stamp_pointcloud.first.insert(stamp_pointcloud.first.end(),
+                                            triangle.begin(), triangle.end());
+              stamp_pointcloud.first.insert(stamp_pointcloud.first.end(),
+                                            interp_pts.begin(),
+                                            interp_pts.end());
+              stamp_pointcloud.second.insert(stamp_pointcloud.second.end(),
+                                             colors.begin(), colors.end());
+              stamp_pointcloud.second.insert(stamp_pointcloud.second.end(),
+                                             interp_colors.begin(),
+                                             interp_colors.end());
+            }
+          }
+          triangle.clear();
+          colors.clear();
+        }
+      }
+    }
+    const std::chrono::duration<double, std::milli> time =
+        std::chrono::steady_clock::now() - start;
+
+    // The trajectory poses are the identity, one per frame
+    result->frame_points.assign(kNumFrames, Pointcloud());
+    result->frame_colors.assign(kNumFrames, Colors());
+    for (auto& stamp_pointcloud : pointcloud) {
+      result->frame_points[stamp_pointcloud.first].swap(
+          stamp_pointcloud.second.first);
+      result->frame_colors[stamp_pointcloud.first].swap(
+          stamp_pointcloud.second.second);
+    }
+    return time.count();
+  }
+
+  static void expectSameResult(const Result& expected, const Result& actual) {
+    ASSERT_EQ(expected.recovered_pointcloud.size(),
+              actual.recovered_pointcloud.size());
+    for (size_t i = 0; i < expected.recovered_pointcloud.size(); ++i) {
+      const pcl::PointXYZRGB& a = expected.recovered_pointcloud[i];
+      const pcl::PointXYZRGB& b = actual.recovered_pointcloud[i];
+      ASSERT_EQ(a.x, b.x);
+      ASSERT_EQ(a.y, b.y);
+      ASSERT_EQ(a.z, b.z);
+      ASSERT_EQ(a.r, b.r);
+      ASSERT_EQ(a.g, b.g);
+      ASSERT_EQ(a.b, b.b);
+    }
+
+    ASSERT_EQ(expected.frame_points.size(), actual.frame_points.size());
+    for (size_t frame_i = 0; frame_i < expected.frame_points.size();
+         ++frame_i) {
+      const Pointcloud& a = expected.frame_points[frame_i];
+      const Pointcloud& b = actual.frame_points[frame_i];
+      ASSERT_EQ(a.size(), b.size()) << "in frame " << frame_i;
+      for (size_t i = 0; i < a.size(); ++i) ASSERT_EQ(a[i], b[i]);
+      const Colors& colors_a = expected.frame_colors[frame_i];
+      const Colors& colors_b = actual.frame_colors[frame_i];
+      ASSERT_EQ(colors_a.size(), colors_b.size());
+      for (size_t i = 0; i < colors_a.size(); ++i) {
+        ASSERT_EQ(colors_a[i].r, colors_b[i].r);
+        ASSERT_EQ(colors_a[i].g, colors_b[i].g);
+        ASSERT_EQ(colors_a[i].b, colors_b[i].b);
+      }
+    }
+  }
+
+  voxblox_msgs::Mesh mesh_;
+};
+
+TEST_F(MeshConverterTest, DecodeMatchesBaseline) {
+  Result baseline;
+  const double baseline_ms = decodeBaseline(&baseline);
+  ASSERT_EQ(baseline.recovered_pointcloud.size(),
+            static_cast<size_t>(3 * kNumBlocks * kTrianglesPerBlock));
+  size_t num_frame_points = 0u;
+  for (const Pointcloud& points : baseline.frame_points) {
+    num_frame_points += points.size();
+  }
+  EXPECT_GT(num_frame_points, 0u);
+
+  const int num_threads =
+      std::max(2, static_cast<int>(std::thread::hardware_concurrency()));
+  std::cout << "convertToPointCloud, " << kNumBlocks << " blocks of "
+            << kTrianglesPerBlock << " triangles: " << baseline_ms
+            << " ms for the serial baseline";
+  for (int threads : {1, num_threads}) {
+    Result result;
+    const double time_ms = convert(threads, &result);
+    expectSameResult(baseline, result);
+    std::cout << ", " << time_ms << " ms with " << threads << " threads";
+  }
+  std::cout << std::endl;
+}
+
+TEST_F(MeshConverterTest, RejectsPartialTriangles) {
+  voxblox_msgs::MeshBlock& mesh_block = mesh_.mesh_blocks.front();
+  mesh_block.x.pop_back();
+  mesh_block.y.pop_back();
+  mesh_block.z.pop_back();
+  mesh_block.r.pop_back();
+  mesh_block.g.pop_back();
+  mesh_block.b.pop_back();
+  Result result;
+  EXPECT_DEATH(convert(1, &result), "num_vertices % 3");
+}
+
+}  // namespace voxblox
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,283 @@
+#include <gtest/gtest.h>
+#include <ros/serialization.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "coxgraph/utils/mesh_pack_codec.h"
+
+namespace coxgraph {
+namespace utils {
+
+class MeshPackCodecTest : public ::testing::Test {
+ protected:
+  static constexpr int kNumBlocks = 300;
+  // Vertices per side of the grid surface in every block
+  static constexpr int kGridSize = 8;
+
+  // Every block holds a slightly noisy grid surface as a triangle soup, like
+  // the voxblox mesher outputs it, with a short observation history per
+  // triangle. Even blocks have smoothly varying colors that fit a palette,
+  // odd blocks too many colors for one.
+  void SetUp() override {
+    std::mt19937 gen(0);
+    std::uniform_int_distribution<int> noise_dist(0, 50);
+    std::uniform_int_distribution<int> frame_dist(0, 500);
+    std::uniform_int_distribution<int> length_dist(0, 20);
+    std::uniform_int_distribution<int> color_dist(0, 255);
+
+    auto& mesh_blocks = mesh_with_traj_.mesh.mesh.mesh_blocks;
+    mesh_blocks.resize(kNumBlocks);
+    for (int block_i = 0; block_i < kNumBlocks; ++block_i) {
+      voxblox_msgs::MeshBlock& mesh_block = mesh_blocks[block_i];
+      mesh_block.index[0] = block_i % 7;
+      mesh_block.index[1] = (block_i / 7) % 7 - 3;
+      mesh_block.index[2] = block_i / 49;
+
+      std::vector<std::array<uint16_t, 3>> grid;
+      for (int i = 0; i < kGridSize; ++i) {
+        for (int j = 0; j < kGridSize; ++j) {
+          grid.push_back({{static_cast<uint16_t>(i * 4000 + noise_dist(gen)),
+                           static_cast<uint16_t>(j * 4000),
+                           static_cast<uint16_t>(20000 + noise_dist(gen))}});
+        }
+      }
+      for (int i = 0; i + 1 < kGridSize; ++i) {
+        for (int j = 0; j + 1 < kGridSize; ++j) {
+          const int corners[6] = {i * kGridSize + j,
+                                  (i + 1) * kGridSize + j,
+                                  i * kGridSize + j + 1,
+                                  (i + 1) * kGridSize + j,
+                                  (i + 1) * kGridSize + j + 1,
+                                  i * kGridSize + j + 1};
+          for (int corner : corners) {
+            mesh_block.x.push_back(grid[corner][0]);
+            mesh_block.y.push_back(grid[corner][1]);
+            mesh_block.z.push_back(grid[corner][2]);
+            mesh_block.r.push_back(static_cast<uint8_t>(corner * 3));
+            mesh_block.g.push_back(static_cast<uint8_t>(corner * 3 / 2));
+            mesh_block.b.push_back(static_cast<uint8_t>(
+                block_i % 2 ? color_dist(gen) : block_i));
+          }
+          for (int triangle_i = 0; triangle_i < 2; ++triangle_i) {
+            voxblox_msgs::ObsHistory history;
+            const uint32_t first = frame_dist(gen);
+            history.history = {first, first + length_dist(gen)};
+            mesh_block.history.push_back(history);
+          }
+        }
+      }
+    }
+  }
+
+  static void expectSameBlocks(const coxgraph_msgs::MeshWithTrajectory& a,
+                               const coxgraph_msgs::MeshWithTrajectory& b,
+                               bool compare_colors) {
+    const auto& blocks_a = a.mesh.mesh.mesh_blocks;
+    const auto& blocks_b = b.mesh.mesh.mesh_blocks;
+    ASSERT_EQ(blocks_a.size(), blocks_b.size());
+    for (size_t block_i = 0; block_i < blocks_a.size(); ++block_i) {
+      const voxblox_msgs::MeshBlock& block_a = blocks_a[block_i];
+      const voxblox_msgs::MeshBlock& block_b = blocks_b[block_i];
+      EXPECT_EQ(block_a.index, block_b.index);
+      EXPECT_EQ(block_a.x, block_b.x);
+      EXPECT_EQ(block_a.y, block_b.y);
+      EXPECT_EQ(block_a.z, block_b.z);
+      if (compare_colors) {
+        EXPECT_EQ(block_a.r, block_b.r);
+        EXPECT_EQ(block_a.g, block_b.g);
+        EXPECT_EQ(block_a.b, block_b.b);
+      } else {
+        EXPECT_EQ(block_a.r.size(), block_b.r.size());
+      }
+      ASSERT_EQ(block_a.history.size(), block_b.history.size());
+      for (size_t i = 0; i < block_a.history.size(); ++i) {
+        EXPECT_EQ(block_a.history[i].history, block_b.history[i].history);
+      }
+    }
+  }
+
+  // Returns the fastest of kNumTimingRuns calls of fn in ms
+  template <typename Function>
+  static double timeMs(const Function& fn) {
+    double min_time_ms = std::numeric_limits<double>::max();
+    for (int run = 0; run < kNumTimingRuns; ++run) {
+      const auto start = std::chrono::steady_clock::now();
+      fn();
+      const std::chrono::duration<double, std::milli> time =
+          std::chrono::steady_clock::now() - start;
+      min_time_ms = std::min(min_time_ms, time.count());
+    }
+    return min_time_ms;
+  }
+
+  static constexpr int kNumTimingRuns = 5;
+
+  coxgraph_msgs::MeshWithTrajectory mesh_with_traj_;
+};
+
+TEST_F(MeshPackCodecTest, LosslessRoundTrip) {
+  for (bool entropy_coding : {false, true}) {
+    MeshPackCodec::Config config;
+    config.entropy_coding = entropy_coding;
+    coxgraph_msgs::PackedMeshWithTrajectory packed;
+    MeshPackCodec(config).pack(mesh_with_traj_, &packed);
+    EXPECT_EQ(packed.codec,
+              entropy_coding
+                  ? coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RANS
+                  : coxgraph_msgs::PackedMeshWithTrajectory::CODEC_RAW);
+
+    coxgraph_msgs::MeshWithTrajectory unpacked;
+    ASSERT_TRUE(MeshPackCodec::unpack(packed, &unpacked));
+    expectSameBlocks(mesh_with_traj_, unpacked, true);
+  }
+}
+
+TEST_F(MeshPackCodecTest, LossyColorsKeepGeometry) {
+  MeshPackCodec::Config config;
+  config.lossy_colors = true;
+  coxgraph_msgs::PackedMeshWithTrajectory packed;
+  MeshPackCodec(config).pack(mesh_with_traj_, &packed);
+
+  coxgraph_msgs::MeshWithTrajectory unpacked;
+  ASSERT_TRUE(MeshPackCodec::unpack(packed, &unpacked));
+  expectSameBlocks(mesh_with_traj_, unpacked, false);
+}
+
+TEST_F(MeshPackCodecTest, RejectsTruncatedPayloads) {
+  MeshPackCodec::Config config;
+  config.entropy_coding = false;
+  coxgraph_msgs::PackedMeshWithTrajectory packed;
+  MeshPackCodec(config).pack(mesh_with_traj_, &packed);
+
+  const size_t size = packed.data.size();
+  const size_t step = size / 200 + 1;
+  for (size_t truncated_size = 0; truncated_size < size;
+       truncated_size += step) {
+    coxgraph_msgs::PackedMeshWithTrajectory truncated = packed;
+    truncated.data.resize(truncated_size);
+    coxgraph_msgs::MeshWithTrajectory unpacked;
+    EXPECT_FALSE(MeshPackCodec::unpack(truncated, &unpacked))
+        << "truncated to " << truncated_size << " of " << size << " bytes";
+  }
+}
+
+TEST_F(MeshPackCodecTest, CompressionRatio) {
+  const uint32_t soup_size =
+      ros::serialization::serializationLength(mesh_with_traj_);
+  std::cout << "MeshWithTrajectory, " << kNumBlocks << " blocks: " << soup_size
+            << " bytes" << std::endl;
+  for (bool lossy_colors : {false, true}) {
+    MeshPackCodec::Config config;
+    config.lossy_colors = lossy_colors;
+    coxgraph_msgs::PackedMeshWithTrajectory packed;
+    MeshPackCodec(config).pack(mesh_with_traj_, &packed);
+    const uint32_t packed_size =
+        ros::serialization::serializationLength(packed);
+    EXPECT_LT(packed_size, soup_size);
+    std::cout << "PackedMeshWithTrajectory"
+              << (lossy_colors ? " with lossy colors: " : ": ")
+              << packed_size << " bytes, " << packed.raw_size
+              << " bytes before rANS, ratio "
+              << static_cast<double>(soup_size) / packed_size << std::endl;
+  }
+}
+
+TEST_F(MeshPackCodecTest, BlockViewsMatchUnpack) {
+  coxgraph_msgs::PackedMeshWithTrajectory packed;
+  MeshPackCodec().pack(mesh_with_traj_, &packed);
+
+  coxgraph_msgs::MeshWithTrajectory expanded;
+  auto& mesh_blocks = expanded.mesh.mesh.mesh_blocks;
+  size_t num_corners = 0u, num_unique = 0u;
+  ASSERT_TRUE(MeshPackCodec::forEachBlock(
+      packed, [&](const MeshPackCodec::BlockView& block_view) {
+        num_corners += block_view.num_corners;
+        num_unique += block_view.num_unique;
+        mesh_blocks.emplace_back();
+        block_view.expand(&mesh_blocks.back());
+      }));
+  EXPECT_EQ(num_corners, static_cast<size_t>(kNumBlocks * 6 *
+                                              (kGridSize - 1) *
+                                              (kGridSize - 1)));
+  // Corners of even blocks share their vertices, those of odd blocks differ
+  // in color
+  EXPECT_LT(num_unique, num_corners);
+  expectSameBlocks(mesh_with_traj_, expanded, true);
+}
+
+TEST_F(MeshPackCodecTest, ColorlessBlocksStayColorless) {
+  for (auto& mesh_block : mesh_with_traj_.mesh.mesh.mesh_blocks) {
+    mesh_block.r.clear();
+    mesh_block.g.clear();
+    mesh_block.b.clear();
+  }
+  coxgraph_msgs::PackedMeshWithTrajectory packed;
+  MeshPackCodec().pack(mesh_with_traj_, &packed);
+  coxgraph_msgs::MeshWithTrajectory unpacked;
+  ASSERT_TRUE(MeshPackCodec::unpack(packed, &unpacked));
+  expectSameBlocks(mesh_with_traj_, unpacked, true);
+}
+
+TEST_F(MeshPackCodecTest, MismatchedColorsAreFatal) {
+  mesh_with_traj_.mesh.mesh.mesh_blocks.back().g.pop_back();
+  coxgraph_msgs::PackedMeshWithTrajectory packed;
+  EXPECT_DEATH(MeshPackCodec().pack(mesh_with_traj_, &packed),
+               "mesh_block.g.size");
+}
+
+TEST_F(MeshPackCodecTest, EncodeDecodeLatency) {
+  std::cout << "MeshWithTrajectory, " << kNumBlocks << " blocks, best of "
+            << kNumTimingRuns << " runs:" << std::endl;
+  // The unpacked format costs at least a copy of the blocks on receipt
+  coxgraph_msgs::MeshWithTrajectory copied;
+  const double copy_ms = timeMs([&]() { copied = mesh_with_traj_; });
+  std::cout << "  copy of the unpacked message: " << copy_ms << " ms"
+            << std::endl;
+
+  for (bool entropy_coding : {false, true}) {
+    MeshPackCodec::Config config;
+    config.entropy_coding = entropy_coding;
+    const MeshPackCodec mesh_pack_codec(config);
+    coxgraph_msgs::PackedMeshWithTrajectory packed;
+    const double pack_ms =
+        timeMs([&]() { mesh_pack_codec.pack(mesh_with_traj_, &packed); });
+
+    coxgraph_msgs::MeshWithTrajectory unpacked;
+    const double unpack_ms =
+        timeMs([&]() { MeshPackCodec::unpack(packed, &unpacked); });
+
+    // Into blocks that already hold a mesh, as the mesh collection does
+    // for a mesh update
+    std::vector<voxblox_msgs::MeshBlock> stored_blocks(kNumBlocks);
+    size_t block_i = 0u;
+    const double view_ms = timeMs([&]() {
+      block_i = 0u;
+      MeshPackCodec::forEachBlock(
+          packed, [&](const MeshPackCodec::BlockView& block_view) {
+            block_view.expand(&stored_blocks[block_i++]);
+          });
+    });
+    EXPECT_EQ(block_i, static_cast<size_t>(kNumBlocks));
+
+    std::cout << (entropy_coding ? "  rANS" : "  raw") << ": pack "
+              << pack_ms << " ms, unpack " << unpack_ms
+              << " ms, block views " << view_ms << " ms" << std::endl;
+  }
+}
+
+}  // namespace utils
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  ::testing::FLAGS_gtest_death_test_style = "threadsafe";
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "coxgraph/map_comm/mesh_tsdf_integrator.h"
+
+namespace voxblox {
+
+class MeshTsdfIntegratorTest : public ::testing::Test {
+ protected:
+  static constexpr FloatingPoint kVoxelSize = 0.05;
+  static constexpr size_t kVoxelsPerSide = 8u;
+
+  // Closed unit cube, every face seen from far out along its outward normal.
+  // The winding doesn't matter, normals are oriented towards the viewpoints.
+  void SetUp() override {
+    for (int axis = 0; axis < 3; ++axis) {
+      const int u = (axis + 1) % 3;
+      const int v = (axis + 2) % 3;
+      for (int side = 0; side < 2; ++side) {
+        Point corners[4];
+        for (int k = 0; k < 4; ++k) {
+          corners[k] = Point::Zero();
+          corners[k][axis] = side;
+          corners[k][u] = (k == 1 || k == 2) ? 1.0 : 0.0;
+          corners[k][v] = k >= 2 ? 1.0 : 0.0;
+        }
+        const int quad[2][3] = {{0, 1, 2}, {0, 2, 3}};
+        Point viewpoint = kCenter;
+        viewpoint[axis] = side ? 10.0 : -10.0;
+        for (auto const& triangle : quad) {
+          for (int corner : triangle) {
+            triangles_.vertices.emplace_back(corners[corner]);
+            triangles_.colors.emplace_back(255, 0, 0);
+          }
+          triangles_.viewpoints.emplace_back(viewpoint);
+          triangles_.num_observations.push_back(1u);
+        }
+      }
+    }
+  }
+
+  static FloatingPoint cubeSignedDistance(const Point& point) {
+    const Point q = (point - kCenter).cwiseAbs() - Point::Constant(0.5);
+    return q.cwiseMax(0.0).norm() + std::min(q.maxCoeff(), 0.0f);
+  }
+
+  struct Result {
+    size_t num_voxels = 0u;
+    size_t num_wrong_signs = 0u;
+    double error_sum = 0.0;
+    double max_error = 0.0;
+  };
+
+  static void integrate(const MeshTsdfIntegrator::Triangles& triangles,
+                        Layer<TsdfVoxel>* layer) {
+    MeshTsdfIntegrator::Config config;
+    config.truncation_distance = 0.3;
+    const MeshTsdfIntegrator mesh_tsdf_integrator(config);
+    mesh_tsdf_integrator.integrateTriangles(triangles, layer);
+  }
+
+  // Compares every observed voxel to the exact distance to the cube
+  static Result integrateCube(const MeshTsdfIntegrator::Triangles& triangles) {
+    Layer<TsdfVoxel> layer(kVoxelSize, kVoxelsPerSide);
+    integrate(triangles, &layer);
+
+    Result result;
+    BlockIndexList block_indices;
+    layer.getAllAllocatedBlocks(&block_indices);
+    for (const BlockIndex& block_index : block_indices) {
+      Block<TsdfVoxel>& block = layer.getBlockByIndex(block_index);
+      for (size_t linear_index = 0; linear_index < block.num_voxels();
+           ++linear_index) {
+        const TsdfVoxel& voxel = block.getVoxelByLinearIndex(linear_index);
+        if (voxel.weight <= 0.0) continue;
+        ++result.num_voxels;
+        const FloatingPoint distance = cubeSignedDistance(
+            block.computeCoordinatesFromLinearIndex(linear_index));
+        // Voxels on the surface may take either sign
+        if ((distance > kEpsilon && voxel.distance < 0.0) ||
+            (distance < -kEpsilon && voxel.distance > 0.0)) {
+          ++result.num_wrong_signs;
+        }
+        const double error = std::fabs(distance - voxel.distance);
+        result.error_sum += error;
+        result.max_error = std::max(result.max_error, error);
+        EXPECT_EQ(voxel.color.a, 255u);
+      }
+    }
+    return result;
+  }
+
+  static const Point kCenter;
+  MeshTsdfIntegrator::Triangles triangles_;
+};
+
+const Point MeshTsdfIntegratorTest::kCenter(0.5, 0.5, 0.5);
+
+TEST_F(MeshTsdfIntegratorTest, ClosedCubeSigns) {
+  const auto start = std::chrono::steady_clock::now();
+  const Result result = integrateCube(triangles_);
+  const std::chrono::duration<double, std::milli> time =
+      std::chrono::steady_clock::now() - start;
+
+  ASSERT_GT(result.num_voxels, 0u);
+  EXPECT_EQ(result.num_wrong_signs, 0u);
+  EXPECT_LT(result.max_error, 1e-4);
+  std::cout << "integrateTriangles, 12 triangles: " << result.num_voxels
+            << " voxels in " << time.count() << " ms, mean error "
+            << result.error_sum / result.num_voxels << " m, max error "
+            << result.max_error << " m" << std::endl;
+}
+
+TEST_F(MeshTsdfIntegratorTest, JitteredCornersAreWelded) {
+  // The copies of a cube corner scatter around a multiple of the weld
+  // resolution of 1e-4, so they fall into different weld cells
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<FloatingPoint> jitter_dist(-2e-5, 2e-5);
+  MeshTsdfIntegrator::Triangles jittered = triangles_;
+  for (Point& vertex : jittered.vertices) {
+    vertex += Point(jitter_dist(gen), jitter_dist(gen), jitter_dist(gen));
+  }
+
+  const Result result = integrateCube(jittered);
+  ASSERT_GT(result.num_voxels, 0u);
+  EXPECT_EQ(result.num_wrong_signs, 0u);
+  EXPECT_LT(result.max_error, 1e-4);
+}
+
+TEST_F(MeshTsdfIntegratorTest, JitteredSpikeIsWelded) {
+  // Thin tetrahedron, the normals of the faces meeting at its apex are almost
+  // opposite. Voxels above the apex get the wrong sign from the normal of a
+  // single face, unless all copies of the apex and its edges are welded.
+  const Point corners[4] = {Point(0.0, 0.0, 0.0), Point(0.4, 0.0, 0.0),
+                            Point(0.0, 0.4, 0.0), Point(0.1, 0.1, 2.0)};
+  const int faces[4][3] = {{0, 1, 2}, {0, 1, 3}, {1, 2, 3}, {2, 0, 3}};
+  const Point centroid =
+      (corners[0] + corners[1] + corners[2] + corners[3]) / 4.0;
+  std::mt19937 gen(0);
+  std::uniform_real_distribution<FloatingPoint> jitter_dist(-2e-5, 2e-5);
+  MeshTsdfIntegrator::Triangles spike;
+  Point face_normals[4];
+  for (int f = 0; f < 4; ++f) {
+    const Point& a = corners[faces[f][0]];
+    Point normal =
+        (corners[faces[f][1]] - a).cross(corners[faces[f][2]] - a).normalized();
+    if (normal.dot(a - centroid) < 0.0) normal = -normal;
+    face_normals[f] = normal;
+    for (int corner : faces[f]) {
+      spike.vertices.emplace_back(
+          corners[corner] +
+          Point(jitter_dist(gen), jitter_dist(gen), jitter_dist(gen)));
+      spike.colors.emplace_back(255, 0, 0);
+    }
+    spike.viewpoints.emplace_back(centroid + 10.0 * normal);
+    spike.num_observations.push_back(1u);
+  }
+
+  Layer<TsdfVoxel> layer(kVoxelSize, kVoxelsPerSide);
+  integrate(spike, &layer);
+
+  BlockIndexList block_indices;
+  layer.getAllAllocatedBlocks(&block_indices);
+  size_t num_voxels = 0u, num_wrong_signs = 0u;
+  for (const BlockIndex& block_index : block_indices) {
+    Block<TsdfVoxel>& block = layer.getBlockByIndex(block_index);
+    for (size_t linear_index = 0; linear_index < block.num_voxels();
+         ++linear_index) {
+      const TsdfVoxel& voxel = block.getVoxelByLinearIndex(linear_index);
+      if (voxel.weight <= 0.0 || std::fabs(voxel.distance) < 1e-3) continue;
+      ++num_voxels;
+      const Point center =
+          block.computeCoordinatesFromLinearIndex(linear_index);
+      bool inside = true;
+      for (int f = 0; f < 4; ++f) {
+        inside &= face_normals[f].dot(center - corners[faces[f][0]]) < 0.0;
+      }
+      if (inside != (voxel.distance < 0.0)) ++num_wrong_signs;
+    }
+  }
+  ASSERT_GT(num_voxels, 0u);
+  EXPECT_EQ(num_wrong_signs, 0u);
+}
+
+}  // namespace voxblox
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
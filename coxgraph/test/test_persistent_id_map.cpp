@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "coxgraph/utils/persistent_id_map.h"
+
+namespace coxgraph {
+namespace utils {
+
+TEST(PersistentIdMapTest, CopiesDontSeeWrites) {
+  PersistentIdMap<int, 4> map;
+  for (int id = 0; id < 10; ++id) map.set(id, id);
+  EXPECT_EQ(map.size(), 10u);
+
+  const PersistentIdMap<int, 4> copy = map;
+  map.set(1, 100);
+  *map.getMutable(9) = 900;
+  map.set(20, 2000);
+  EXPECT_EQ(map.at(1), 100);
+  EXPECT_EQ(map.at(9), 900);
+  EXPECT_EQ(map.at(20), 2000);
+  EXPECT_EQ(map.size(), 11u);
+  EXPECT_EQ(copy.at(1), 1);
+  EXPECT_EQ(copy.at(9), 9);
+  EXPECT_FALSE(copy.contains(20));
+  EXPECT_EQ(copy.size(), 10u);
+
+  // Misses don't insert anything
+  EXPECT_EQ(map.find(-1), nullptr);
+  EXPECT_EQ(map.find(15), nullptr);
+  EXPECT_EQ(map.find(100), nullptr);
+  EXPECT_EQ(map.size(), 11u);
+
+  std::vector<int> ids;
+  map.forEach([&ids](int id, const int&) { ids.push_back(id); });
+  EXPECT_EQ(ids, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 20}));
+}
+
+// What a snapshot publish costs: copy the map, then change a few entries, as
+// for the poses of one client's new submaps. The unordered map is what the
+// snapshots copied before.
+TEST(PersistentIdMapTest, CopyAndWriteCost) {
+  struct Entry {
+    float pose[7];
+    float aabb[6];
+    int ids[2];
+  };
+  const int kNumWrites = 8;
+  const int kNumPublishes = 200;
+  for (int num_ids : {1000, 4000, 16000}) {
+    PersistentIdMap<Entry> persistent_map;
+    std::unordered_map<int, Entry> unordered_map;
+    for (int id = 0; id < num_ids; ++id) {
+      persistent_map.set(id, Entry());
+      unordered_map.emplace(id, Entry());
+    }
+
+    std::vector<PersistentIdMap<Entry>> persistent_copies;
+    persistent_copies.reserve(kNumPublishes);
+    auto start = std::chrono::steady_clock::now();
+    for (int publish_i = 0; publish_i < kNumPublishes; ++publish_i) {
+      persistent_copies.push_back(persistent_copies.empty()
+                                      ? persistent_map
+                                      : persistent_copies.back());
+      for (int write_i = 0; write_i < kNumWrites; ++write_i) {
+        persistent_copies.back()
+            .getMutable((publish_i * 37 + write_i) % num_ids)
+            ->pose[0] = publish_i;
+      }
+    }
+    const std::chrono::duration<double> persistent_time =
+        std::chrono::steady_clock::now() - start;
+
+    std::vector<std::unordered_map<int, Entry>> unordered_copies;
+    unordered_copies.reserve(kNumPublishes);
+    start = std::chrono::steady_clock::now();
+    for (int publish_i = 0; publish_i < kNumPublishes; ++publish_i) {
+      unordered_copies.push_back(unordered_copies.empty()
+                                     ? unordered_map
+                                     : unordered_copies.back());
+      for (int write_i = 0; write_i < kNumWrites; ++write_i) {
+        unordered_copies.back()[(publish_i * 37 + write_i) % num_ids]
+            .pose[0] = publish_i;
+      }
+    }
+    const std::chrono::duration<double> unordered_time =
+        std::chrono::steady_clock::now() - start;
+
+    // Every copy keeps the writes of its own and earlier publishes only
+    for (int publish_i = 0; publish_i < kNumPublishes; ++publish_i) {
+      ASSERT_EQ(persistent_copies[publish_i]
+                    .at((publish_i * 37) % num_ids)
+                    .pose[0],
+                unordered_copies[publish_i]
+                    .at((publish_i * 37) % num_ids)
+                    .pose[0]);
+    }
+    EXPECT_EQ(persistent_copies.front().at(37).pose[0], 0.0f);
+
+    EXPECT_LT(persistent_time.count(), unordered_time.count());
+    std::cout << num_ids << " ids, copy and " << kNumWrites
+              << " writes per publish: chunked "
+              << persistent_time.count() / kNumPublishes * 1e6
+              << " us, unordered map "
+              << unordered_time.count() / kNumPublishes * 1e6 << " us"
+              << std::endl;
+  }
+}
+
+}  // namespace utils
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
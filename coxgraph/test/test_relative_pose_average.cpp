@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <random>
+
+#include "coxgraph/server/backend/relative_pose_average.h"
+
+namespace coxgraph {
+namespace server {
+
+// In float precision, as the poses are
+const double kTolerance = 1e-4;
+
+class RelativePoseAverageTest : public ::testing::Test {
+ protected:
+  RelativePoseAverageTest() : gen_(0) {}
+
+  // Gravity aligned if tilted is false, otherwise a random rotation
+  Transformation randomPose(bool tilted) {
+    std::uniform_real_distribution<double> position_dist(-20.0, 20.0);
+    std::uniform_real_distribution<double> angle_dist(-M_PI, M_PI);
+    Eigen::Quaterniond q(
+        Eigen::AngleAxisd(angle_dist(gen_), Eigen::Vector3d::UnitZ()));
+    if (tilted) {
+      q = q * Eigen::AngleAxisd(angle_dist(gen_), Eigen::Vector3d::UnitX()) *
+          Eigen::AngleAxisd(angle_dist(gen_), Eigen::Vector3d::UnitY());
+    }
+    const Eigen::Vector3d position(position_dist(gen_), position_dist(gen_),
+                                   position_dist(gen_));
+    return Transformation(
+        Transformation::Rotation(q.cast<voxblox::FloatingPoint>()),
+        position.cast<voxblox::FloatingPoint>());
+  }
+
+  TransformationVector randomPoses(int num_poses, bool tilted) {
+    TransformationVector poses;
+    for (int i = 0; i < num_poses; ++i) poses.emplace_back(randomPose(tilted));
+    return poses;
+  }
+
+  static double getYaw(const Transformation& T) {
+    const Eigen::Matrix3d R = T.getRotationMatrix().cast<double>();
+    return std::atan2(R(1, 0), R(0, 0));
+  }
+
+  // Adds every product with add(), as the pairwise loop did
+  static void addBruteForce(const TransformationVector& T_A_X,
+                            const TransformationVector& T_X_B,
+                            RelativePoseAverage* average) {
+    for (auto const& T_a : T_A_X) {
+      for (auto const& T_b : T_X_B) average->add(T_a * T_b);
+    }
+  }
+
+  std::mt19937 gen_;
+};
+
+TEST_F(RelativePoseAverageTest, ProductsMatchPairwiseAverage) {
+  RelativePoseAverage factorized, brute_force;
+  // Several submap pairs of different sizes, as a client pair collects them
+  for (int pair_i = 0; pair_i < 20; ++pair_i) {
+    std::uniform_int_distribution<int> size_dist(1, 30);
+    const TransformationVector T_A_X = randomPoses(size_dist(gen_), false);
+    const TransformationVector T_X_B = randomPoses(size_dist(gen_), false);
+    factorized.addProducts(T_A_X, T_X_B);
+    addBruteForce(T_A_X, T_X_B, &brute_force);
+  }
+
+  EXPECT_DOUBLE_EQ(factorized.getWeight(), brute_force.getWeight());
+  EXPECT_EQ(factorized.getNumPairs(), 20);
+  const Transformation T_factorized = factorized.getAverage();
+  const Transformation T_brute_force = brute_force.getAverage();
+  EXPECT_LT((T_factorized.getPosition() - T_brute_force.getPosition()).norm(),
+            kTolerance);
+  EXPECT_NEAR(std::remainder(getYaw(T_factorized) - getYaw(T_brute_force),
+                             2.0 * M_PI),
+              0.0, kTolerance);
+}
+
+TEST_F(RelativePoseAverageTest, TiltedTranslationsMatchPairwiseAverage) {
+  // The translation sum is exact for any rotation, unlike the yaw sum
+  const TransformationVector T_A_X = randomPoses(17, true);
+  const TransformationVector T_X_B = randomPoses(23, true);
+  RelativePoseAverage factorized, brute_force;
+  factorized.addProducts(T_A_X, T_X_B);
+  addBruteForce(T_A_X, T_X_B, &brute_force);
+
+  EXPECT_LT((factorized.getAverage().getPosition() -
+             brute_force.getAverage().getPosition())
+                .norm(),
+            kTolerance);
+}
+
+TEST_F(RelativePoseAverageTest, EmptyInputsAreIgnored) {
+  RelativePoseAverage average;
+  average.addProducts(randomPoses(3, false), TransformationVector());
+  average.addProducts(TransformationVector(), randomPoses(3, false));
+  EXPECT_TRUE(average.empty());
+  EXPECT_EQ(average.getNumPairs(), 0);
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
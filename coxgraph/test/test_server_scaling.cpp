@@ -0,0 +1,232 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "coxgraph/server/map_fusion_scheduler.h"
+#include "coxgraph/utils/work_queue.h"
+
+namespace coxgraph {
+namespace server {
+
+typedef std::chrono::steady_clock Clock;
+
+// Costs of the stand-in clients and server stages
+const double kStepMs = 50.0;
+const int kNumSteps = 20;
+const double kFetchMs = 5.0;
+const double kInsertMs = 1.0;
+const double kSolveMsPerSubmap = 0.02;
+const double kIntervalMs = 200.0;
+const size_t kPipelineQueueSize = 4;
+
+/**
+ * Stand-in clients drive the server side of map fusion: the scheduler, the
+ * collect stage and the fuse stage, with the queue sizes the server uses.
+ * Every step each client extends its time line by one second and reports a
+ * loop closure with another client, half a second ahead of what that client
+ * covers, so every fusion is deferred once. Fetches are serialized per
+ * client, as on its I/O thread, and a solve grows with the pose graph.
+ */
+class ServerScalingTest : public ::testing::Test {
+ protected:
+  struct Result {
+    int num_fusions = 0;
+    int num_solves = 0;
+    double mean_latency = 0.0;
+    double max_latency = 0.0;
+    size_t max_pairs_in_flight = 0u;
+    size_t max_deferred = 0u;
+  };
+
+  struct Job {
+    Clock::time_point start_time;
+    std::future<bool> request_a;
+    std::future<bool> request_b;
+  };
+
+  static void sleepMs(double ms) {
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+  }
+
+  static coxgraph_msgs::MapFusion makeFusion(int cid_a, double t_a, int cid_b,
+                                             double t_b) {
+    coxgraph_msgs::MapFusion map_fusion_msg;
+    map_fusion_msg.from_client_id = cid_a;
+    map_fusion_msg.from_timestamp = ros::Time(t_a);
+    map_fusion_msg.to_client_id = cid_b;
+    map_fusion_msg.to_timestamp = ros::Time(t_b);
+    return map_fusion_msg;
+  }
+
+  static Result run(int num_clients) {
+    std::vector<std::unique_ptr<std::mutex>> io_mutexes;
+    for (int i = 0; i < num_clients; ++i) {
+      io_mutexes.emplace_back(new std::mutex());
+    }
+    auto fetch = [&io_mutexes](int cid) {
+      std::lock_guard<std::mutex> io_lock(*io_mutexes[cid]);
+      sleepMs(kFetchMs);
+      return true;
+    };
+
+    Result result;
+    std::atomic<size_t> num_in_flight(0);
+    std::atomic<int> num_in_fetch(0);
+    // Only touched by the fuse stage, until it's drained
+    int num_fused = 0, num_solved = 0, num_submaps = 0;
+    std::vector<Clock::time_point> unsolved_start_times;
+    std::vector<double> latencies;
+    std::mutex solved_mutex;
+    std::condition_variable solved_cv;
+
+    std::unique_ptr<utils::WorkQueue<Clock::time_point>> fuse_queue;
+    fuse_queue.reset(new utils::WorkQueue<Clock::time_point>(
+        kPipelineQueueSize, kPipelineQueueSize,
+        [&](std::vector<Clock::time_point>* batch) {
+          for (auto const& start_time : *batch) {
+            sleepMs(kInsertMs);
+            num_in_flight--;
+            num_submaps += 2;
+            unsolved_start_times.push_back(start_time);
+          }
+          num_fused += batch->size();
+          if (unsolved_start_times.empty()) return;
+          const std::chrono::duration<double, std::milli> unsolved_time =
+              Clock::now() - unsolved_start_times.front();
+          if ((num_in_fetch > 0 || fuse_queue->size() > 0) &&
+              unsolved_time.count() < kIntervalMs) {
+            fuse_queue->scheduleWakeup((kIntervalMs - unsolved_time.count()) /
+                                       1000.0);
+            return;
+          }
+          sleepMs(kSolveMsPerSubmap * num_submaps);
+          result.num_solves++;
+          const Clock::time_point solved_time = Clock::now();
+          for (auto const& start_time : unsolved_start_times) {
+            latencies.push_back(
+                std::chrono::duration<double>(solved_time - start_time)
+                    .count());
+          }
+          unsolved_start_times.clear();
+          {
+            std::lock_guard<std::mutex> solved_lock(solved_mutex);
+            num_solved = num_fused;
+          }
+          solved_cv.notify_all();
+        }));
+    utils::WorkQueue<Job> fetch_queue(
+        kPipelineQueueSize, kPipelineQueueSize, [&](std::vector<Job>* jobs) {
+          for (Job& job : *jobs) {
+            job.request_a.get();
+            job.request_b.get();
+            num_in_fetch--;
+            fuse_queue->push(job.start_time);
+          }
+        });
+
+    auto start_fusion = [&](const coxgraph_msgs::MapFusion& map_fusion_msg) {
+      Job job;
+      job.start_time = Clock::now();
+      job.request_a = std::async(std::launch::async, fetch,
+                                 map_fusion_msg.from_client_id);
+      job.request_b =
+          std::async(std::launch::async, fetch, map_fusion_msg.to_client_id);
+      num_in_fetch++;
+      result.max_pairs_in_flight =
+          std::max(result.max_pairs_in_flight, ++num_in_flight);
+      fetch_queue.push(std::move(job));
+    };
+
+    MapFusionScheduler::Config config;
+    config.max_queue_size = 2 * num_clients;
+    MapFusionScheduler scheduler(config);
+    for (int step = 1; step <= kNumSteps; ++step) {
+      const Clock::time_point step_end =
+          Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                             std::chrono::duration<double, std::milli>(
+                                 kStepMs));
+      for (int cid = 0; cid < num_clients; ++cid) {
+        TimeLine time_line;
+        time_line.start = ros::Time(0.5);
+        time_line.end = ros::Time(step);
+        std::vector<coxgraph_msgs::MapFusion> ready;
+        scheduler.updateTimeLine(cid, time_line, &ready);
+        for (auto const& map_fusion_msg : ready) start_fusion(map_fusion_msg);
+      }
+      for (int cid = 0; cid < num_clients; ++cid) {
+        const int other_cid =
+            (cid + 1 + step % (num_clients - 1)) % num_clients;
+        const coxgraph_msgs::MapFusion map_fusion_msg =
+            makeFusion(cid, step - 0.5, other_cid, step + 0.5);
+        if (scheduler.defer(map_fusion_msg) ==
+            MapFusionScheduler::DeferState::READY) {
+          start_fusion(map_fusion_msg);
+        }
+        result.num_fusions++;
+      }
+      result.max_deferred = std::max(result.max_deferred, scheduler.size());
+      std::this_thread::sleep_until(step_end);
+    }
+    // The last reports are covered once the time lines move on
+    for (int cid = 0; cid < num_clients; ++cid) {
+      TimeLine time_line;
+      time_line.start = ros::Time(0.5);
+      time_line.end = ros::Time(kNumSteps + 1);
+      std::vector<coxgraph_msgs::MapFusion> ready;
+      scheduler.updateTimeLine(cid, time_line, &ready);
+      for (auto const& map_fusion_msg : ready) start_fusion(map_fusion_msg);
+    }
+
+    {
+      std::unique_lock<std::mutex> solved_lock(solved_mutex);
+      solved_cv.wait(solved_lock,
+                     [&]() { return num_solved == result.num_fusions; });
+    }
+    fetch_queue.waitUntilIdle();
+    fuse_queue->waitUntilIdle();
+
+    for (double latency : latencies) {
+      result.mean_latency += latency / latencies.size();
+      result.max_latency = std::max(result.max_latency, latency);
+    }
+    EXPECT_EQ(latencies.size(), static_cast<size_t>(result.num_fusions));
+    return result;
+  }
+};
+
+TEST_F(ServerScalingTest, FourToThirtyTwoClients) {
+  for (int num_clients : {4, 8, 16, 32}) {
+    const Result result = run(num_clients);
+    EXPECT_EQ(result.num_fusions, num_clients * kNumSteps);
+    EXPECT_LT(result.num_solves, result.num_fusions);
+    // Intake blocks on a full fetch queue, so whatever the number of
+    // clients, only the queued and the handled batches of both stages plus
+    // the one being pushed hold submaps
+    EXPECT_LE(result.max_pairs_in_flight, 4 * kPipelineQueueSize + 1);
+    EXPECT_LE(result.max_deferred, static_cast<size_t>(2 * num_clients));
+    std::cout << num_clients << " clients: " << result.num_fusions
+              << " map fusions in " << result.num_solves
+              << " optimizations, latency mean " << result.mean_latency
+              << " s max " << result.max_latency << " s, at most "
+              << result.max_pairs_in_flight << " submap pairs in flight and "
+              << result.max_deferred << " fusions deferred" << std::endl;
+  }
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,164 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "coxgraph/server/submap_aabb_tree.h"
+
+namespace coxgraph {
+namespace server {
+
+class SubmapAabbTreeTest : public ::testing::Test {
+ protected:
+  typedef std::map<SerSmId, BoundingBox> BoxMap;
+
+  SubmapAabbTreeTest() : gen_(0) {}
+
+  // Submap sized box at a random position in a cube of the given extent
+  BoundingBox randomBox(float extent) {
+    std::uniform_real_distribution<float> position_dist(0.0f, extent);
+    std::uniform_real_distribution<float> size_dist(5.0f, 20.0f);
+    BoundingBox aabb;
+    aabb.min = voxblox::Point(position_dist(gen_), position_dist(gen_),
+                              position_dist(gen_));
+    aabb.max = aabb.min + voxblox::Point(size_dist(gen_), size_dist(gen_),
+                                         size_dist(gen_));
+    return aabb;
+  }
+
+  // Shifts the box by up to max_shift along every axis
+  BoundingBox shiftedBox(const BoundingBox& aabb, float max_shift) {
+    std::uniform_real_distribution<float> shift_dist(-max_shift, max_shift);
+    const voxblox::Point shift(shift_dist(gen_), shift_dist(gen_),
+                               shift_dist(gen_));
+    BoundingBox shifted;
+    shifted.min = aabb.min + shift;
+    shifted.max = aabb.max + shift;
+    return shifted;
+  }
+
+  // Boxes is any container of (id, box) pairs in ascending id order
+  template <typename Boxes>
+  static void getBruteForcePairs(
+      const Boxes& boxes, std::vector<SubmapAabbTree::SerSmIdPair>* pairs) {
+    pairs->clear();
+    for (auto it_a = boxes.begin(); it_a != boxes.end(); ++it_a) {
+      for (auto it_b = std::next(it_a); it_b != boxes.end(); ++it_b) {
+        if (SubmapAabbTree::overlaps(it_a->second, it_b->second)) {
+          pairs->emplace_back(it_a->first, it_b->first);
+        }
+      }
+    }
+  }
+
+  static void getBruteForceQuery(const BoxMap& boxes, const BoundingBox& aabb,
+                                 std::vector<SerSmId>* ser_sm_ids) {
+    ser_sm_ids->clear();
+    for (auto const& box_kv : boxes) {
+      if (SubmapAabbTree::overlaps(box_kv.second, aabb)) {
+        ser_sm_ids->emplace_back(box_kv.first);
+      }
+    }
+  }
+
+  std::mt19937 gen_;
+};
+
+TEST_F(SubmapAabbTreeTest, RandomUpdatesMatchBruteForce) {
+  constexpr int kNumOperations = 20000;
+  constexpr int kNumIds = 300;
+  constexpr float kExtent = 200.0f;
+
+  SubmapAabbTree aabb_tree;
+  BoxMap boxes;
+  std::uniform_int_distribution<int> id_dist(0, kNumIds - 1);
+  std::uniform_int_distribution<int> operation_dist(0, 9);
+  std::vector<SubmapAabbTree::SerSmIdPair> tree_pairs, brute_force_pairs;
+  std::vector<SerSmId> tree_ids, brute_force_ids;
+
+  for (int operation_i = 0; operation_i < kNumOperations; ++operation_i) {
+    const SerSmId ser_sm_id = id_dist(gen_);
+    const int operation = operation_dist(gen_);
+    auto box_it = boxes.find(ser_sm_id);
+    if (operation == 0) {
+      aabb_tree.remove(ser_sm_id);
+      boxes.erase(ser_sm_id);
+    } else if (operation < 7 && box_it != boxes.end()) {
+      // Pose corrections, mostly within the margin of the leaf
+      const BoundingBox aabb = shiftedBox(box_it->second, 1.0f);
+      aabb_tree.update(ser_sm_id, aabb);
+      box_it->second = aabb;
+    } else {
+      const BoundingBox aabb = randomBox(kExtent);
+      aabb_tree.update(ser_sm_id, aabb);
+      boxes[ser_sm_id] = aabb;
+    }
+
+    if (operation_i % 100 != 0) continue;
+    ASSERT_EQ(aabb_tree.size(), boxes.size());
+    aabb_tree.getOverlappingPairs(&tree_pairs);
+    getBruteForcePairs(boxes, &brute_force_pairs);
+    ASSERT_EQ(tree_pairs, brute_force_pairs);
+
+    const BoundingBox region = randomBox(kExtent);
+    aabb_tree.query(region, &tree_ids);
+    getBruteForceQuery(boxes, region, &brute_force_ids);
+    ASSERT_EQ(tree_ids, brute_force_ids);
+  }
+}
+
+TEST_F(SubmapAabbTreeTest, EmptyBoxesAreRemoved) {
+  SubmapAabbTree aabb_tree;
+  aabb_tree.update(0, randomBox(100.0f));
+  ASSERT_TRUE(aabb_tree.exists(0));
+  aabb_tree.update(0, BoundingBox());
+  EXPECT_FALSE(aabb_tree.exists(0));
+  EXPECT_EQ(aabb_tree.size(), 0u);
+}
+
+TEST_F(SubmapAabbTreeTest, OverlappingPairsTiming) {
+  constexpr int kNumSubmaps = 5000;
+  constexpr float kExtent = 1000.0f;
+
+  SubmapAabbTree aabb_tree;
+  BoxMap boxes;
+  for (int ser_sm_id = 0; ser_sm_id < kNumSubmaps; ++ser_sm_id) {
+    boxes[ser_sm_id] = randomBox(kExtent);
+    aabb_tree.update(ser_sm_id, boxes[ser_sm_id]);
+  }
+
+  typedef std::chrono::duration<double, std::milli> Milliseconds;
+  std::vector<SubmapAabbTree::SerSmIdPair> tree_pairs, brute_force_pairs;
+  auto start = std::chrono::steady_clock::now();
+  aabb_tree.getOverlappingPairs(&tree_pairs);
+  const Milliseconds tree_time = std::chrono::steady_clock::now() - start;
+
+  // Flat array for the baseline, as a plain loop over submaps would use
+  const std::vector<std::pair<SerSmId, BoundingBox>> box_array(boxes.begin(),
+                                                               boxes.end());
+  start = std::chrono::steady_clock::now();
+  getBruteForcePairs(box_array, &brute_force_pairs);
+  const Milliseconds brute_force_time =
+      std::chrono::steady_clock::now() - start;
+
+  EXPECT_EQ(tree_pairs, brute_force_pairs);
+  std::cout << "getOverlappingPairs, " << kNumSubmaps << " submaps and "
+            << tree_pairs.size() << " pairs: " << tree_time.count()
+            << " ms with the tree, " << brute_force_time.count()
+            << " ms testing all pairs" << std::endl;
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,150 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "coxgraph/server/submap_collection.h"
+
+namespace coxgraph {
+namespace server {
+
+class SubmapCollectionTest : public ::testing::Test {
+ protected:
+  SubmapCollectionTest()
+      : submap_collection_ptr_(
+            std::make_shared<SubmapCollection>(CliSmConfig())) {}
+
+  static Transformation makePose(float x) {
+    return Transformation(Transformation::Rotation(),
+                          Transformation::Position(x, 0.0, 0.0));
+  }
+
+  // Client submap ids of each client count from 0, server ids from ser_sid
+  void addClientSubmaps(const CliId& cid, int num_submaps, SerSmId ser_sid) {
+    for (CliSmId cli_sm_id = 0; cli_sm_id < num_submaps; ++cli_sm_id) {
+      CliSm::Ptr submap_ptr(
+          new CliSm(makePose(cli_sm_id), ser_sid++, CliSmConfig()));
+      submap_collection_ptr_->addSubmap(submap_ptr, cid, cli_sm_id);
+    }
+  }
+
+  // Same lookups as ClientHandler::submapPoseUpdatesCallback, every submap
+  // of the client moves to x
+  void updateClientPoses(const CliId& cid, int num_submaps, float x) {
+    const SubmapCollection::Snapshot::ConstPtr snapshot =
+        submap_collection_ptr_->getSnapshot();
+    SubmapCollection::SmPoseMap submap_poses;
+    for (CliSmId cli_sm_id = 0; cli_sm_id < num_submaps; ++cli_sm_id) {
+      SerSmId ser_sm_id;
+      CHECK(snapshot->getSerSmIdByCliSmId(cid, cli_sm_id, &ser_sm_id));
+      submap_poses[ser_sm_id] = makePose(x);
+    }
+    submap_collection_ptr_->updateSubmapPoses(submap_poses, true);
+  }
+
+  SubmapCollection::Ptr submap_collection_ptr_;
+};
+
+TEST_F(SubmapCollectionTest, IdIndexMatchesAddedSubmaps) {
+  addClientSubmaps(0, 5, 0);
+  addClientSubmaps(2, 3, 5);
+  const SubmapCollection::Snapshot::ConstPtr snapshot =
+      submap_collection_ptr_->getSnapshot();
+  EXPECT_EQ(snapshot->getCliIds(), std::vector<CliId>({0, 2}));
+
+  SerSmId ser_sm_id;
+  ASSERT_TRUE(snapshot->getSerSmIdByCliSmId(2, 1, &ser_sm_id));
+  EXPECT_EQ(ser_sm_id, 6);
+  EXPECT_EQ(snapshot->getCliIdPairBySsid(6), CIdCSIdPair(2, 1));
+  std::vector<CliSmId> cli_sids;
+  ASSERT_TRUE(snapshot->getCliSmIdsByCliId(0, &cli_sids));
+  EXPECT_EQ(cli_sids, std::vector<CliSmId>({0, 1, 2, 3, 4}));
+  std::vector<SerSmId> ser_sids;
+  ASSERT_TRUE(snapshot->getSerSmIdsByCliId(2, &ser_sids));
+  EXPECT_EQ(ser_sids, std::vector<SerSmId>({5, 6, 7}));
+
+  // Misses don't insert anything
+  EXPECT_FALSE(snapshot->getSerSmIdByCliSmId(2, 3, &ser_sm_id));
+  EXPECT_FALSE(snapshot->getSerSmIdByCliSmId(1, 0, &ser_sm_id));
+  EXPECT_FALSE(snapshot->getCliSmIdsByCliId(1, &cli_sids));
+  EXPECT_FALSE(snapshot->exists(8));
+  EXPECT_EQ(submap_collection_ptr_->getSnapshot()->getCliIds(),
+            std::vector<CliId>({0, 2}));
+}
+
+TEST_F(SubmapCollectionTest, PoseUpdatesWithConcurrentReaders) {
+  const int kNumUpdates = 200;
+  const int kNumReaders = 2;
+  for (int num_submaps : {1000, 4000}) {
+    submap_collection_ptr_ = std::make_shared<SubmapCollection>(CliSmConfig());
+    addClientSubmaps(0, num_submaps, 0);
+    updateClientPoses(0, num_submaps, 0.0);
+
+    // Readers look up every submap by its client id, a snapshot must hold
+    // the poses of exactly one update
+    std::atomic<bool> done(false);
+    std::atomic<int> num_started(0);
+    std::atomic<uint64_t> num_lookups(0), num_torn_snapshots(0);
+    std::vector<std::thread> readers;
+    for (int reader_i = 0; reader_i < kNumReaders; ++reader_i) {
+      readers.emplace_back([&]() {
+        num_started++;
+        while (!done) {
+          const SubmapCollection::Snapshot::ConstPtr snapshot =
+              submap_collection_ptr_->getSnapshot();
+          SerSmId ser_sm_id;
+          CHECK(snapshot->getSerSmIdByCliSmId(0, 0, &ser_sm_id));
+          const float x = snapshot->getPose(ser_sm_id).getPosition().x();
+          bool torn = false;
+          for (CliSmId cli_sm_id = 0; cli_sm_id < num_submaps; ++cli_sm_id) {
+            CHECK(snapshot->getSerSmIdByCliSmId(0, cli_sm_id, &ser_sm_id));
+            torn |= snapshot->getPose(ser_sm_id).getPosition().x() != x;
+          }
+          num_lookups += num_submaps;
+          if (torn) num_torn_snapshots++;
+        }
+      });
+    }
+
+    while (num_started < kNumReaders) std::this_thread::yield();
+    const auto start = std::chrono::steady_clock::now();
+    for (int update_i = 1; update_i <= kNumUpdates; ++update_i) {
+      updateClientPoses(0, num_submaps, update_i);
+      // Lets the readers in on a single core
+      std::this_thread::yield();
+    }
+    const std::chrono::duration<double> update_time =
+        std::chrono::steady_clock::now() - start;
+    done = true;
+    for (std::thread& reader : readers) reader.join();
+    const std::chrono::duration<double> total_time =
+        std::chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(num_torn_snapshots, 0u);
+    const SubmapCollection::Snapshot::ConstPtr snapshot =
+        submap_collection_ptr_->getSnapshot();
+    for (SerSmId ser_sm_id = 0; ser_sm_id < num_submaps; ++ser_sm_id) {
+      ASSERT_EQ(snapshot->getPose(ser_sm_id).getPosition().x(), kNumUpdates);
+      ASSERT_EQ(snapshot->getOriPose(ser_sm_id).getPosition().x(),
+                kNumUpdates);
+    }
+    std::cout << num_submaps << " submaps, " << kNumUpdates
+              << " full pose updates with " << kNumReaders << " readers: "
+              << kNumUpdates * num_submaps / update_time.count()
+              << " submap poses/s written, "
+              << num_lookups / total_time.count() << " lookups/s read"
+              << std::endl;
+  }
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
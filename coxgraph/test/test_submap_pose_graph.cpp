@@ -0,0 +1,238 @@
+#include <gtest/gtest.h>
+#include <voxgraph/backend/constraint/cost_functions/relative_pose_cost_function.h>
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <utility>
+
+#include "coxgraph/server/backend/dense_tsdf_grid.h"
+#include "coxgraph/server/backend/registration_cost_function.h"
+#include "coxgraph/server/backend/submap_pose_graph.h"
+
+namespace coxgraph {
+namespace server {
+
+class SubmapPoseGraphTest : public ::testing::Test {
+ protected:
+  using ConstraintType = SubmapPoseGraph::ConstraintType;
+
+  SubmapPoseGraphTest() : generator_(0), noise_(0.0f, 0.01f) {}
+
+  // Submaps on a circle, so that the last ones come back to the first
+  static Transformation getTruePose(int submap_id) {
+    const float angle = submap_id * 0.05f;
+    return Transformation(
+        Transformation::Rotation(Eigen::Quaternionf(Eigen::AngleAxisf(
+            angle + static_cast<float>(M_PI) / 2, Eigen::Vector3f::UnitZ()))),
+        Transformation::Position(20.0f * std::cos(angle),
+                                 20.0f * std::sin(angle), 0.0f));
+  }
+
+  // Initial poses drift, measurements are noisy
+  void addSubmap(SubmapPoseGraph* pose_graph, SerSmId submap_id) {
+    voxgraph::SubmapNode::Config node_config;
+    node_config.submap_id = submap_id;
+    node_config.set_constant = submap_id == 0;
+    node_config.T_I_node_initial =
+        getTruePose(submap_id) *
+        Transformation(Transformation::Rotation(),
+                       Transformation::Position(0.01f * submap_id, 0.0f,
+                                                0.0f));
+    pose_graph->addSubmapNode(node_config);
+  }
+
+  void addRelativePose(SubmapPoseGraph* pose_graph, ConstraintType type,
+                       SerSmId first_submap_id, SerSmId second_submap_id) {
+    const Transformation T_S1_S2 =
+        getTruePose(first_submap_id).inverse() *
+        getTruePose(second_submap_id) *
+        Transformation(Transformation::Rotation(),
+                       Transformation::Position(noise_(generator_),
+                                                noise_(generator_),
+                                                noise_(generator_)));
+    pose_graph->setConstraint(
+        type, std::make_pair(first_submap_id, second_submap_id),
+        voxgraph::RelativePoseCostFunction::Create(
+            T_S1_S2, InformationMatrix::Identity() * 10.0));
+  }
+
+  // A chain of relative poses, with a loop closure every 20 submaps
+  void addSubmapWithConstraints(SubmapPoseGraph* pose_graph,
+                                SerSmId submap_id) {
+    addSubmap(pose_graph, submap_id);
+    if (submap_id == 0) return;
+    addRelativePose(pose_graph, ConstraintType::SubmapRelPose, submap_id - 1,
+                    submap_id);
+    if (submap_id % 20 == 0) {
+      addRelativePose(pose_graph, ConstraintType::LoopClosure, 0, submap_id);
+    }
+  }
+
+  std::mt19937 generator_;
+  std::normal_distribution<float> noise_;
+};
+
+TEST_F(SubmapPoseGraphTest, ChangesOnlyTouchTheirConstraints) {
+  SubmapPoseGraph pose_graph{PoseGraph::Config()};
+  for (SerSmId submap_id = 0; submap_id < 60; ++submap_id) {
+    addSubmapWithConstraints(&pose_graph, submap_id);
+  }
+  EXPECT_EQ(pose_graph.getNumConstraints(ConstraintType::SubmapRelPose), 59u);
+  EXPECT_EQ(pose_graph.getNumConstraints(ConstraintType::LoopClosure), 2u);
+  pose_graph.optimize();
+  for (auto const& pose_kv : pose_graph.getSubmapPoses()) {
+    EXPECT_LT((pose_kv.second.getPosition() -
+               getTruePose(pose_kv.first).getPosition())
+                  .norm(),
+              0.2f)
+        << "Submap " << pose_kv.first;
+  }
+
+  // Replacing and removing keep one constraint per type and pair
+  addRelativePose(&pose_graph, ConstraintType::SubmapRelPose, 0, 1);
+  EXPECT_EQ(pose_graph.getNumConstraints(ConstraintType::SubmapRelPose), 59u);
+  EXPECT_TRUE(pose_graph.removeConstraint(ConstraintType::LoopClosure,
+                                          std::make_pair(0, 20)));
+  EXPECT_FALSE(pose_graph.removeConstraint(ConstraintType::LoopClosure,
+                                           std::make_pair(0, 20)));
+  EXPECT_EQ(pose_graph.getNumConstraints(ConstraintType::LoopClosure), 1u);
+  EXPECT_EQ(pose_graph.evaluateResiduals(ConstraintType::LoopClosure).size(),
+            4u);
+
+  // A copy solves on its own problem
+  SubmapPoseGraph copy(pose_graph);
+  addSubmapWithConstraints(&copy, 60);
+  copy.optimize();
+  EXPECT_FALSE(pose_graph.hasSubmapNode(60));
+  EXPECT_EQ(copy.getSubmapPoses().size(), 61u);
+  EXPECT_EQ(pose_graph.evaluateResiduals(ConstraintType::SubmapRelPose).size(),
+            59u * 4u);
+}
+
+// Latency of the optimization after each new submap against the number of
+// submaps, with the problem kept alive and with it rebuilt for every solve as
+// before. A copy rebuilds the problem from all nodes and constraints.
+TEST_F(SubmapPoseGraphTest, OptimizationLatency) {
+  const int kNumNewSubmaps = 10;
+  for (int num_submaps : {100, 400, 1600}) {
+    SubmapPoseGraph pose_graph{PoseGraph::Config()};
+    for (SerSmId submap_id = 0; submap_id < num_submaps; ++submap_id) {
+      addSubmapWithConstraints(&pose_graph, submap_id);
+    }
+    pose_graph.optimize();
+
+    std::chrono::duration<double> persistent_time(0.0), rebuild_time(0.0);
+    for (int new_i = 0; new_i < kNumNewSubmaps; ++new_i) {
+      addSubmapWithConstraints(&pose_graph, num_submaps + new_i);
+
+      auto start = std::chrono::steady_clock::now();
+      SubmapPoseGraph rebuilt_pose_graph(pose_graph);
+      rebuilt_pose_graph.optimize();
+      rebuild_time += std::chrono::steady_clock::now() - start;
+
+      start = std::chrono::steady_clock::now();
+      pose_graph.optimize();
+      persistent_time += std::chrono::steady_clock::now() - start;
+    }
+
+    EXPECT_LT(persistent_time.count(), rebuild_time.count());
+    std::cout << num_submaps << " submaps, optimization after a new submap: "
+              << "persistent problem "
+              << persistent_time.count() / kNumNewSubmaps * 1e3
+              << " ms, rebuilt problem "
+              << rebuild_time.count() / kNumNewSubmaps * 1e3 << " ms"
+              << std::endl;
+  }
+}
+
+// Solve time of a graph of registration constraints with one thread and with
+// all cores. All submaps observe the same sphere, so they share one grid and
+// one sample set.
+TEST_F(SubmapPoseGraphTest, RegistrationSolveThreads) {
+  const float kVoxelSize = 0.1f, kTruncationDistance = 0.3f, kRadius = 1.0f;
+  DenseTsdfGrid::TsdfLayer tsdf_layer(kVoxelSize, 16);
+  const float half_size = kRadius + 2.0f * kTruncationDistance;
+  for (float x = -half_size; x <= half_size; x += kVoxelSize) {
+    for (float y = -half_size; y <= half_size; y += kVoxelSize) {
+      for (float z = -half_size; z <= half_size; z += kVoxelSize) {
+        tsdf_layer.allocateBlockPtrByCoordinates(voxblox::Point(x, y, z));
+      }
+    }
+  }
+  voxblox::BlockIndexList block_indices;
+  tsdf_layer.getAllAllocatedBlocks(&block_indices);
+  for (const voxblox::BlockIndex& block_index : block_indices) {
+    voxblox::Block<voxblox::TsdfVoxel>::Ptr block =
+        tsdf_layer.getBlockPtrByIndex(block_index);
+    for (size_t i = 0; i < block->num_voxels(); ++i) {
+      voxblox::TsdfVoxel& voxel = block->getVoxelByLinearIndex(i);
+      const float distance =
+          block->computeCoordinatesFromLinearIndex(i).norm() - kRadius;
+      if (std::abs(distance) <= kTruncationDistance) {
+        voxel.distance = distance;
+        voxel.weight = 1.0f;
+      }
+    }
+  }
+  const DenseTsdfGrid::ConstPtr grid = std::make_shared<const DenseTsdfGrid>(
+      tsdf_layer, kTruncationDistance, 0.0f);
+  auto samples = std::make_shared<RegistrationSamples>();
+  RegistrationCostFunction::getSamples(tsdf_layer, kTruncationDistance, 0.0f,
+                                       1.0f, samples.get());
+
+  const int num_cores =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  const int kNumSolves = 3;
+  for (int num_pairs : {8, 32, 128}) {
+    std::chrono::duration<double> times[2] = {
+        std::chrono::duration<double>(0.0), std::chrono::duration<double>(0.0)};
+    for (int threads_i = 0; threads_i < 2; ++threads_i) {
+      PoseGraph::Config config;
+      config.num_threads = threads_i == 0 ? 1 : num_cores;
+      config.max_num_iterations = 10;
+      for (int solve_i = 0; solve_i < kNumSolves; ++solve_i) {
+        SubmapPoseGraph pose_graph(config);
+        for (SerSmId submap_id = 0; submap_id <= num_pairs; ++submap_id) {
+          voxgraph::SubmapNode::Config node_config;
+          node_config.submap_id = submap_id;
+          node_config.set_constant = submap_id == 0;
+          node_config.T_I_node_initial = Transformation(
+              Transformation::Rotation(),
+              Transformation::Position(noise_(generator_) * 5.0f,
+                                       noise_(generator_) * 5.0f,
+                                       noise_(generator_) * 5.0f));
+          pose_graph.addSubmapNode(node_config);
+          if (submap_id == 0) continue;
+          pose_graph.setConstraint(
+              ConstraintType::Registration,
+              std::make_pair(submap_id - 1, submap_id),
+              new RegistrationCostFunction(samples, grid, 1.0));
+        }
+        const auto start = std::chrono::steady_clock::now();
+        pose_graph.optimize();
+        times[threads_i] += std::chrono::steady_clock::now() - start;
+      }
+    }
+
+    if (num_cores > 1 && num_pairs == 128) {
+      EXPECT_LT(times[1].count(), times[0].count());
+    }
+    std::cout << num_pairs << " registration constraints, "
+              << samples->size() << " samples each, solve: 1 thread "
+              << times[0].count() / kNumSolves * 1e3 << " ms, " << num_cores
+              << " threads " << times[1].count() / kNumSolves * 1e3 << " ms"
+              << std::endl;
+  }
+}
+
+}  // namespace server
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
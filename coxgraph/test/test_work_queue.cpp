@@ -0,0 +1,226 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "coxgraph/utils/work_queue.h"
+
+namespace coxgraph {
+namespace utils {
+
+class WorkQueueTest : public ::testing::Test {
+ protected:
+  // Blocks the handler until released
+  class Gate {
+   public:
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this]() { return open_; });
+    }
+    void open() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        open_ = true;
+      }
+      cv_.notify_all();
+    }
+
+   private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool open_ = false;
+  };
+
+  static void sleepMs(double ms) {
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+  }
+};
+
+TEST_F(WorkQueueTest, HandlesTasksInOrder) {
+  std::vector<int> handled;
+  {
+    WorkQueue<int> queue(4, 3, [&handled](std::vector<int>* batch) {
+      EXPECT_LE(batch->size(), 3u);
+      handled.insert(handled.end(), batch->begin(), batch->end());
+    });
+    for (int i = 0; i < 100; ++i) queue.push(i);
+    queue.waitUntilIdle();
+  }
+  ASSERT_EQ(handled.size(), 100u);
+  for (int i = 0; i < 100; ++i) EXPECT_EQ(handled[i], i);
+}
+
+TEST_F(WorkQueueTest, FullQueueBlocksPush) {
+  Gate gate;
+  WorkQueue<int> queue(2, 1, [&gate](std::vector<int>*) { gate.wait(); });
+  // One task in the handler, two queued
+  for (int i = 0; i < 3; ++i) queue.push(i);
+  std::atomic<bool> pushed(false);
+  std::thread pusher([&queue, &pushed]() {
+    queue.push(3);
+    pushed = true;
+  });
+  sleepMs(50.0);
+  EXPECT_FALSE(pushed);
+  gate.open();
+  pusher.join();
+  EXPECT_TRUE(pushed);
+  queue.waitUntilIdle();
+}
+
+TEST_F(WorkQueueTest, BatchesWhatArrivedMeanwhile) {
+  Gate gate;
+  std::vector<size_t> batch_sizes;
+  WorkQueue<int> queue(10, 10,
+                       [&gate, &batch_sizes](std::vector<int>* batch) {
+                         gate.wait();
+                         batch_sizes.push_back(batch->size());
+                       });
+  queue.push(0);
+  while (queue.size() > 0) sleepMs(1.0);
+  for (int i = 1; i <= 5; ++i) queue.push(i);
+  gate.open();
+  queue.waitUntilIdle();
+  ASSERT_EQ(batch_sizes.size(), 2u);
+  EXPECT_EQ(batch_sizes[0], 1u);
+  EXPECT_EQ(batch_sizes[1], 5u);
+
+  uint64_t num_processed, num_batches;
+  double busy_time;
+  queue.getStats(&num_processed, &num_batches, &busy_time);
+  EXPECT_EQ(num_processed, 6u);
+  EXPECT_EQ(num_batches, 2u);
+}
+
+TEST_F(WorkQueueTest, WakeupCallsEmptyBatch) {
+  std::promise<size_t> woken;
+  WorkQueue<int> queue(1, 1, [&woken](std::vector<int>* batch) {
+    woken.set_value(batch->size());
+  });
+  queue.scheduleWakeup(0.02);
+  std::future<size_t> batch_size = woken.get_future();
+  ASSERT_EQ(batch_size.wait_for(std::chrono::seconds(5)),
+            std::future_status::ready);
+  EXPECT_EQ(batch_size.get(), 0u);
+}
+
+// Burst of map fusions between neighbouring robots, with the stages of the
+// server pipeline: submaps are fetched on the I/O thread of each client, the
+// collect stage waits for both, the fuse stage inserts what arrived and only
+// optimizes once nothing is left to fetch. The old server handled one fusion
+// at a time: fetch both submaps, insert, then optimize. As on the server, a
+// deferred solve still runs once the oldest unsolved fusion waited for the
+// optimization interval.
+TEST_F(WorkQueueTest, MapFusionBurstThroughput) {
+  const double kFetchMs = 20.0;
+  const double kInsertMs = 2.0;
+  const double kSolveMs = 40.0;
+  const double kIntervalMs = 200.0;
+  const int kFusionsPerRobot = 8;
+
+  for (int num_robots : {3, 4, 6}) {
+    const int num_fusions = num_robots * kFusionsPerRobot;
+    // One transfer at a time per client
+    std::vector<std::unique_ptr<std::mutex>> io_mutexes;
+    for (int i = 0; i < num_robots; ++i) {
+      io_mutexes.emplace_back(new std::mutex());
+    }
+    auto fetch = [&io_mutexes, kFetchMs](int cid) {
+      std::lock_guard<std::mutex> io_lock(*io_mutexes[cid]);
+      sleepMs(kFetchMs);
+      return true;
+    };
+
+    const auto serial_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_fusions; ++i) {
+      fetch(i % num_robots);
+      fetch((i + 1) % num_robots);
+      sleepMs(kInsertMs + kSolveMs);
+    }
+    const std::chrono::duration<double> serial_time =
+        std::chrono::steady_clock::now() - serial_start;
+
+    struct Job {
+      std::future<bool> request_a;
+      std::future<bool> request_b;
+    };
+    std::atomic<int> num_in_fetch(0);
+    int num_fused = 0, num_solved = 0, num_solves = 0;
+    std::chrono::steady_clock::time_point unsolved_since;
+    std::mutex solved_mutex;
+    std::condition_variable solved_cv;
+    std::unique_ptr<WorkQueue<int>> fuse_queue;
+    fuse_queue.reset(new WorkQueue<int>(4, 100, [&](std::vector<int>* batch) {
+      for (size_t i = 0; i < batch->size(); ++i) sleepMs(kInsertMs);
+      if (num_fused == num_solved) {
+        unsolved_since = std::chrono::steady_clock::now();
+      }
+      num_fused += batch->size();
+      if (num_fused == num_solved) return;
+      const std::chrono::duration<double, std::milli> unsolved_time =
+          std::chrono::steady_clock::now() - unsolved_since;
+      if ((num_in_fetch > 0 || fuse_queue->size() > 0) &&
+          unsolved_time.count() < kIntervalMs) {
+        return;
+      }
+      sleepMs(kSolveMs);
+      num_solves++;
+      {
+        std::lock_guard<std::mutex> solved_lock(solved_mutex);
+        num_solved = num_fused;
+      }
+      solved_cv.notify_all();
+    }));
+    WorkQueue<Job> fetch_queue(4, 4, [&](std::vector<Job>* jobs) {
+      for (Job& job : *jobs) {
+        job.request_a.get();
+        job.request_b.get();
+        num_in_fetch--;
+        fuse_queue->push(0);
+      }
+    });
+
+    const auto pipeline_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_fusions; ++i) {
+      Job job;
+      job.request_a = std::async(std::launch::async, fetch, i % num_robots);
+      job.request_b =
+          std::async(std::launch::async, fetch, (i + 1) % num_robots);
+      num_in_fetch++;
+      fetch_queue.push(std::move(job));
+    }
+    {
+      std::unique_lock<std::mutex> solved_lock(solved_mutex);
+      solved_cv.wait(solved_lock,
+                     [&]() { return num_solved == num_fusions; });
+    }
+    const std::chrono::duration<double> pipeline_time =
+        std::chrono::steady_clock::now() - pipeline_start;
+    fetch_queue.waitUntilIdle();
+    fuse_queue->waitUntilIdle();
+
+    EXPECT_LT(pipeline_time.count(), serial_time.count());
+    EXPECT_LT(num_solves, num_fusions);
+    std::cout << num_robots << " robots, burst of " << num_fusions
+              << " map fusions: one at a time "
+              << num_fusions / serial_time.count() << " fusions/s, pipelined "
+              << num_fusions / pipeline_time.count() << " fusions/s with "
+              << num_solves << " optimizations" << std::endl;
+  }
+}
+
+}  // namespace utils
+}  // namespace coxgraph
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}